@@ -35,7 +35,10 @@ void set_control_parameter(const char* parameter_name, const char* val, ControlI
     else if (strcmp("position_dimension", parameter_name) == 0) sscanf(val, "%d", &control_input->position_dimension);
     else if (strcmp("start_frame", parameter_name) == 0) sscanf(val, "%d", &control_input->starting_frame);
     else if (strcmp("n_frames", parameter_name) == 0) sscanf(val, "%d", &control_input->n_frames);
+    else if (strcmp("prefetch_frames", parameter_name) == 0) sscanf(val, "%d", &control_input->prefetch_frames);
+    else if (strcmp("frame_index_flag", parameter_name) == 0) sscanf(val, "%d", &control_input->frame_index_flag);
     else if (strcmp("nonbonded_cutoff", parameter_name) == 0) sscanf(val, "%lf", &control_input->pair_nonbonded_cutoff);
+    else if (strcmp("verlet_skin", parameter_name) == 0) sscanf(val, "%lf", &control_input->verlet_skin);
     else if (strcmp("pair_nonbonded_basis_set_resolution", parameter_name) == 0) sscanf(val, "%lf", &control_input->pair_nonbonded_fm_binwidth);
     else if (strcmp("pair_bond_basis_set_resolution", parameter_name) == 0) sscanf(val, "%lf", &control_input->pair_bond_fm_binwidth);
     else if (strcmp("angle_basis_set_resolution", parameter_name) == 0) sscanf(val, "%lf", &control_input->angle_fm_binwidth);
@@ -46,6 +49,7 @@ void set_control_parameter(const char* parameter_name, const char* val, ControlI
     else if (strcmp("dihedral_bspline_basis_order", parameter_name) == 0) sscanf(val, "%d", &control_input->dihedral_bspline_k);
     else if (strcmp("basis_type", parameter_name) == 0) sscanf(val, "%d", &control_input->basis_set_type);
     else if (strcmp("matrix_type", parameter_name) == 0) sscanf(val, "%d", &control_input->matrix_type);
+    else if (strcmp("dense_frame_stacking_flag", parameter_name) == 0) sscanf(val, "%d", &control_input->dense_frame_stacking_flag);
     else if (strcmp("pair_nonbonded_output_binwidth", parameter_name) == 0) sscanf(val, "%lf", &control_input->pair_nonbonded_output_binwidth);
     else if (strcmp("pair_bond_output_binwidth", parameter_name) == 0) sscanf(val, "%lf", &control_input->pair_bond_output_binwidth);
     else if (strcmp("angle_output_binwidth", parameter_name) == 0) sscanf(val, "%lf", &control_input->angle_output_binwidth);
@@ -55,6 +59,7 @@ void set_control_parameter(const char* parameter_name, const char* val, ControlI
     else if (strcmp("rcond", parameter_name) == 0) sscanf(val, "%lf", &control_input->rcond);
 	else if (strcmp("sparse_safety_factor", parameter_name) == 0) sscanf(val, "%lf", &control_input->sparse_safety_factor);
 	else if (strcmp("num_sparse_threads", parameter_name) == 0) sscanf(val, "%d", &control_input->num_sparse_threads);
+	else if (strcmp("num_frame_threads", parameter_name) == 0) sscanf(val, "%d", &control_input->num_frame_threads);
     else if (strcmp("max_pair_bonds_per_site", parameter_name) == 0) sscanf(val, "%d", &control_input->max_pair_bonds_per_site);
     else if (strcmp("max_angles_per_site", parameter_name) == 0) sscanf(val, "%d", &control_input->max_angles_per_site);
     else if (strcmp("max_dihedrals_per_site", parameter_name) == 0) sscanf(val, "%d", &control_input->max_dihedrals_per_site);
@@ -74,6 +79,7 @@ void set_control_parameter(const char* parameter_name, const char* val, ControlI
 	else if (strcmp("density_bspline_basis_order", parameter_name) == 0) sscanf(val, "%d", &control_input->density_bspline_k);
 	else if (strcmp("density_interactions_flag", parameter_name) == 0) sscanf(val, "%d", &control_input->density_flag);
 	else if (strcmp("density_weights_flag", parameter_name) == 0) sscanf(val, "%d", &control_input->density_weights_flag);
+	else if (strcmp("density_weight_table_tolerance", parameter_name) == 0) sscanf(val, "%lf", &control_input->density_weight_table_tolerance);
     else if (strcmp("output_residual_flag", parameter_name) == 0) sscanf(val, "%d", &control_input->output_residual);
     else if (strcmp("bayesian_mscg_flag", parameter_name) == 0) sscanf(val, "%d", &control_input->bayesian_flag);
     else if (strcmp("bayesian_max_iterations", parameter_name) == 0) sscanf(val, "%d", &control_input->bayesian_max_iter);
@@ -130,7 +136,10 @@ ControlInputs::ControlInputs(void)
     random_num_seed = 1;
     starting_frame = 1;
     n_frames = 10;
+    prefetch_frames = 0;
+    frame_index_flag = 0;
     pair_nonbonded_cutoff = 1.0;
+    verlet_skin = 0.0;
     pair_nonbonded_fm_binwidth = 0.05;
     pair_bond_fm_binwidth = 0.05;
     angle_fm_binwidth = 1.0;
@@ -141,6 +150,7 @@ ControlInputs::ControlInputs(void)
     dihedral_bspline_k = 4;
     basis_set_type = 0;
     matrix_type = 0;
+    dense_frame_stacking_flag = 0;
     pair_nonbonded_output_binwidth = 0.05;
     pair_bond_output_binwidth = 0.05;
     angle_output_binwidth = 1.0;
@@ -150,6 +160,7 @@ ControlInputs::ControlInputs(void)
     rcond = -1.0;
 	sparse_safety_factor = 0.20;
     num_sparse_threads = 1;
+    num_frame_threads = 1;
     max_pair_bonds_per_site = 4;
     max_angles_per_site = 12;
     max_dihedrals_per_site = 36;
@@ -169,6 +180,7 @@ ControlInputs::ControlInputs(void)
 	density_bspline_k = 4;
 	density_flag = 0;
 	density_weights_flag = 0;
+	density_weight_table_tolerance = 0.0;
     output_residual = 0;
     bayesian_flag = 0;
     bayesian_max_iter = 1;
@@ -16,6 +16,8 @@ typedef struct ControlInputs {
 	// Data settings
     int starting_frame;
     int n_frames;
+    int prefetch_frames;					// Number of frames read ahead by a background thread (0 to read frames in turn)
+    int frame_index_flag;					// 1 to seek to start_frame using a frame index kept next to a LAMMPS trajectory; 0 otherwise
     int frames_per_traj_block;
     int volume_weighting_flag;
     
@@ -44,6 +46,7 @@ typedef struct ControlInputs {
 	int density_excluded_style;				// 0 no exclusions; 2 exclude 1-2 bonded; 3 exclude 1-2 and 1-3 bonded; 4 exclude 1-2, 1-3 and 1-4 bonded interactions
     double gamma;
     double pair_nonbonded_cutoff;
+    double verlet_skin;						// 0 to search cell lists every frame; otherwise the skin of reusable nonbonded pair lists
 	double density_cutoff_distance;
     int max_pair_bonds_per_site;
     int max_angles_per_site;
@@ -80,6 +83,7 @@ typedef struct ControlInputs {
 	double density_output_binwidth;
 	int density_flag;
 	int density_weights_flag;
+	double density_weight_table_tolerance;	// 0 to evaluate density weight functions analytically; otherwise the error allowed in their tables
 
 	// Rangefinder only output specifications
 	int output_pair_nonbonded_parameter_distribution;
@@ -95,6 +99,7 @@ typedef struct ControlInputs {
 
     // Matrix specifications
     int matrix_type;
+    int dense_frame_stacking_flag;          // 1 to keep block_size frames in each dense (matrix_type 0) block; 0 for one frame per block
     int itnlim;
     int iterative_calculation_flag;
     double tikhonov_regularization_param;
@@ -102,6 +107,7 @@ typedef struct ControlInputs {
     double rcond;
 	double sparse_safety_factor; 
 	int num_sparse_threads;
+	int num_frame_threads;
 	
 	ControlInputs(void);
 	~ControlInputs(void);
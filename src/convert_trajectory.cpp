@@ -0,0 +1,93 @@
+//
+//  convert_trajectory.cpp
+//
+//  This driver converts a trajectory into a binary trajectory (.cgb) that the
+//  other drivers can read with -b. It reads the frames that newfm would read
+//  with the same control.in; only the number of sites is taken from top.in.
+//
+//  Copyright (c) 2016 The Voth Group at The University of Chicago. All rights reserved.
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+#include "control_input.h"
+#include "misc.h"
+#include "trajectory_input.h"
+
+int read_number_of_sites(void);
+
+int main(int argc, char* argv[])
+{
+    double start_cputime = clock();
+    FrameSource frame_source;
+
+    // The binary trajectory to write, and optionally -single to write positions
+    // and forces as floats, follow the usual trajectory arguments.
+    int n_args = argc;
+    int precision = sizeof(double);
+    if (n_args > 1 && strcmp(argv[n_args - 1], "-single") == 0) {
+        precision = sizeof(float);
+        n_args--;
+    }
+    if (n_args < 5 || strcmp(argv[n_args - 2], "-o") != 0) {
+        printf("Usage: %s [-f file.trr OR -f file.xtc -f1 file1.xtc OR -l file.lammpstrj] -o file.cgb [-single]\n", argv[0]);
+        exit(EXIT_SUCCESS);
+    }
+    const char* binary_filename = argv[n_args - 1];
+    n_args -= 2;
+
+    printf("Parsing command line arguments.\n");
+    parse_command_line_arguments(n_args, argv, &frame_source);
+    if (frame_source.trajectory_type == kBinaryTrajectory) {
+        printf("The trajectory is already a binary trajectory.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Reading high level control parameters.\n");
+    ControlInputs control_input;
+    copy_control_inputs_to_frd(&control_input, &frame_source);
+    // Frame weights and virials are read by the runs using the binary trajectory.
+    frame_source.use_statistical_reweighting = 0;
+    frame_source.pressure_constraint_flag = 0;
+
+    // Site types are read into this array if dynamic_types or dynamic_state_sampling is set.
+    printf("Reading number of sites from topology file.\n");
+    int n_cg_sites = read_number_of_sites();
+    std::vector<int> cg_site_types(n_cg_sites, 0);
+
+    printf("Finding first frame...\n");
+    frame_source.get_first_frame(&frame_source, n_cg_sites, &cg_site_types[0]);
+    frame_source.move_to_start_frame(&frame_source);
+
+    printf("Writing binary trajectory.\n");
+    write_binary_trajectory(&frame_source, binary_filename, precision);
+    frame_source.cleanup(&frame_source);
+
+    double end_cputime = clock();
+    double elapsed_cputime = ((double)(end_cputime - start_cputime)) / CLOCKS_PER_SEC;
+    printf("%f seconds used.\n", elapsed_cputime);
+    return 0;
+}
+
+// Read the number of CG sites from the first line of top.in.
+
+int read_number_of_sites(void)
+{
+    int line = 0;
+    int n_cg_sites = 0;
+    char parameter_name[50];
+    std::string buff;
+    std::ifstream top_in;
+    check_and_open_in_stream(top_in, "top.in");
+    check_and_read_next_line(top_in, buff, line);
+    sscanf(buff.c_str(), "%s%d", parameter_name, &n_cg_sites);
+    if (strcmp(parameter_name, "cgsites") != 0 || n_cg_sites <= 0) {
+        printf("Expected the number of sites (cgsites) on the first line of top.in.\n");
+        exit(EXIT_FAILURE);
+    }
+    return n_cg_sites;
+}
@@ -17,10 +17,23 @@
 #include "trajectory_input.h"
 #include "splines.h"
 
+// Number of force-matched interactions of one type queued before their bases are evaluated together.
+const int BASIS_BATCH_SIZE = 64;
+// Number of bonded interactions whose geometry is computed together.
+const int BONDED_GEOMETRY_BATCH_SIZE = 64;
+
 //--------------------------------------------------------------------
 // Prototypes for internal implementation-specific functions
 //--------------------------------------------------------------------
 
+// Set up a list of interaction computers against the interaction classes in cg.
+
+void set_up_computer_list(CG_MODEL_DATA* const cg, std::list<InteractionClassComputer*> &icomp_list, ThreeBodyNonbondedClassComputer* const three_body_computer);
+
+// Compute one frame's matrix elements with a given list of interaction computers.
+
+void calculate_frame_fm_matrix_with_computers(CG_MODEL_DATA* const cg, std::list<InteractionClassComputer*> &icomp_list, ThreeBodyNonbondedClassComputer* const three_body_computer, MATRIX_DATA* const mat, FrameConfig* const frame_config, PairCellList &pair_cell_list, ThreeBCellList &three_body_cell_list, int trajectory_block_frame_index);
+
 // Utility functions for checking if a nonbonded interaction is excluded from the model due to bonding.
 
 bool check_excluded_list(const TopologyData* const topo_data, const int i, const int j);
@@ -30,21 +43,21 @@ bool check_density_excluded_list(const TopologyData* const topo_data, const int
 // differing by the way that potentially interacting particles are found in 
 // each frame and possibly found not to interact after.
 
-void order_pair_nonbonded_fm_matrix_element_calculation(InteractionClassComputer* const info, calc_pair_matrix_elements calc_matrix_elements, int* const cg_site_types, const int n_cg_types, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths);
-void order_bonded_fm_matrix_element_calculation(InteractionClassComputer* const info, int* const cg_site_types, const int n_cg_types, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths);
-void order_three_body_nonbonded_fm_matrix_element_calculation(InteractionClassComputer* const info, int* const cg_site_types, const int n_cg_types, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths);
-void density_fm_matrix_element_calculation(InteractionClassComputer* const iclass, calc_pair_matrix_elements calc_matrix_elements, int* const cg_site_types, const int n_cg_types, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths);
+void order_pair_nonbonded_fm_matrix_element_calculation(InteractionClassComputer* const info, calc_pair_matrix_elements calc_matrix_elements, const int type_k, const int type_l, const int n_cg_types, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths);
 
 // Helper functions for the above
 
 void process_completed_density(DensityClassComputer* const info, calc_pair_matrix_elements process_density, const int n_cg_types, int* const cg_site_types, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths);
-inline void decode_density_interaction_and_calculate(DensityClassComputer* info, unsigned long interaction_flags, calc_pair_matrix_elements calc_matrix_elements, int* const cg_site_types, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths);
 void process_normal_interaction_matrix_elements(InteractionClassComputer* const info, MATRIX_DATA* const mat, const int n_body, int* particle_ids, std::array<double, DIMENSION>* derivatives, const double param_value, const int virial_flag, const double param_deriv, const double distance);
+void queue_normal_interaction_matrix_elements(InteractionClassComputer* const info, MATRIX_DATA* const mat, const int n_body, int* particle_ids, std::array<double, DIMENSION>* derivatives, const double param_value, const int virial_flag, const double param_deriv, const double distance);
+void process_tabulated_interaction_matrix_elements(InteractionClassComputer* const info, MATRIX_DATA* const mat, const int n_body, int* particle_ids, std::array<double, DIMENSION>* derivatives, const double param_value, const int virial_flag);
+void process_matched_interaction_matrix_elements(InteractionClassComputer* const info, MATRIX_DATA* const mat, const int first_nonzero_basis_index, const int n_body, const int* particle_ids, std::array<double, DIMENSION>* derivatives, const double param_value, const int virial_flag);
 void process_density_matrix_elements(InteractionClassComputer* const info, MATRIX_DATA* const mat, const int n_body, int* particle_ids, std::array<double, DIMENSION>* derivatives, const double density_value, const int virial_flag, const double density_derivative, const double distance);
 
 // Functions for calculating individual 3-component matrix elements.
 
 void calc_isotropic_two_body_fm_matrix_elements(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
+void process_one_param_interaction(InteractionClassComputer* const info, MATRIX_DATA* const mat, const int n_body, int* particle_ids, std::array<double, DIMENSION>* derivatives, double param_value);
 void calc_angular_three_body_fm_matrix_elements(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
 void calc_dihedral_four_body_fm_matrix_elements(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
 void calc_density_fm_matrix_elements(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
@@ -54,6 +67,8 @@ double calc_gaussian_density_derivative(DensityClassComputer* const icomp, Densi
 double calc_switching_density_derivative(DensityClassComputer* const icomp, DensityClassSpec* const ispec, const double distance);
 double calc_lucy_density_derivative(DensityClassComputer* const icomp, DensityClassSpec* const ispec, const double distance);
 double calc_re_density_derivative(DensityClassComputer* const icomp, DensityClassSpec* const ispec, const double distance);
+double calc_tabulated_density_weight(DensityClassComputer* const icomp, DensityClassSpec* const ispec, const double distance2);
+double calc_tabulated_density_derivative(DensityClassComputer* const icomp, DensityClassSpec* const ispec, const double distance);
 void do_nothing(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
 void accumulate_matching_order_parameter_forces(InteractionClassComputer* const info, const int first_nonzero_basis_index, double extra_derivative_value, std::vector<double> &basis_fn_vals, const int n_body, const int* particle_ids, std::array<double, DIMENSION>* const &derivatives, MATRIX_DATA * const mat);
 
@@ -65,23 +80,70 @@ void accumulate_matching_order_parameter_forces(InteractionClassComputer* const
 
 void set_up_force_computers(CG_MODEL_DATA* const cg)
 {    
+    set_up_computer_list(cg, cg->icomp_list, &cg->three_body_nonbonded_computer);
+
+    // The type lookup tables are shared by all computers of a class, including thread copies.
+    std::list<InteractionClassSpec*>::iterator iclass_iterator;
+    for (iclass_iterator = cg->iclass_list.begin(); iclass_iterator != cg->iclass_list.end(); iclass_iterator++) {
+        (*iclass_iterator)->set_up_type_lookup();
+    }
+    cg->three_body_nonbonded_interactions.set_up_type_lookup();
+    cg->three_body_nonbonded_interactions.set_up_center_cutoffs();
+}
+
+void set_up_computer_list(CG_MODEL_DATA* const cg, std::list<InteractionClassComputer*> &icomp_list, ThreeBodyNonbondedClassComputer* const three_body_computer)
+{
     int curr_iclass_col_index = 0;
 
     // Set up normal case interaction classes.
     std::list<InteractionClassSpec*>::iterator iclass_iterator;
 	std::list<InteractionClassComputer*>::iterator icomp_iterator;
-	for(icomp_iterator=cg->icomp_list.begin(), iclass_iterator=cg->iclass_list.begin(); icomp_iterator != cg->icomp_list.end(); icomp_iterator++, iclass_iterator++) {
+	for(icomp_iterator=icomp_list.begin(), iclass_iterator=cg->iclass_list.begin(); icomp_iterator != icomp_list.end(); icomp_iterator++, iclass_iterator++) {
         (*icomp_iterator)->set_up_computer( (*iclass_iterator), &curr_iclass_col_index);
     }
 
     // Set up three body nonbonded interaction classes.
-    cg->three_body_nonbonded_computer.special_set_up_computer(&cg->three_body_nonbonded_interactions, &curr_iclass_col_index);
+    three_body_computer->special_set_up_computer(&cg->three_body_nonbonded_interactions, &curr_iclass_col_index);
+    
+    // Nonbonded pair classes may keep their neighbors across frames.
+    for(icomp_iterator=icomp_list.begin(); icomp_iterator != icomp_list.end(); icomp_iterator++) {
+        if ((*icomp_iterator)->ispec->class_type == kPairNonbonded || (*icomp_iterator)->ispec->class_type == kDensity) {
+            (*icomp_iterator)->verlet_list.skin = cg->verlet_skin;
+        }
+    }
+}
+
+// Build a thread's own copies of the computers in cg. They are listed in the same
+// order as cg->icomp_list so that they are matched with the same interaction classes.
+
+ThreadLocalComputers::ThreadLocalComputers(CG_MODEL_DATA* const cg)
+{
+	icomp_list.push_back(&pair_nonbonded_computer);
+	icomp_list.push_back(&pair_bonded_computer);
+	icomp_list.push_back(&angular_computer);
+	icomp_list.push_back(&dihedral_computer);
+	icomp_list.push_back(&density_computer);
+	
+	set_up_computer_list(cg, icomp_list, &three_body_nonbonded_computer);
+}
+
+ThreadLocalComputers::~ThreadLocalComputers()
+{
+	std::list<InteractionClassComputer*>::iterator icomp_iterator;
+	for(icomp_iterator=icomp_list.begin(); icomp_iterator != icomp_list.end(); icomp_iterator++) {
+		if ( (*icomp_iterator)->fm_s_comp != NULL ) delete (*icomp_iterator)->fm_s_comp;
+		if ( (*icomp_iterator)->table_s_comp != NULL ) delete (*icomp_iterator)->table_s_comp;
+	}
+	if (three_body_nonbonded_computer.fm_s_comp != NULL) delete three_body_nonbonded_computer.fm_s_comp;
+	if (three_body_nonbonded_computer.table_s_comp != NULL) delete three_body_nonbonded_computer.table_s_comp;
 }
 
 void InteractionClassComputer::set_up_computer(InteractionClassSpec* const ispec_pt, int *curr_iclass_col_index) 
 {
     // Store the pointer to the spec.
     ispec = ispec_pt;
+    bonded_list.clear();
+    verlet_list.clear();
 
 	// Set up spline computation for matching and tabulation
     // as needed.
@@ -101,6 +163,7 @@ void InteractionClassComputer::set_up_computer(InteractionClassSpec* const ispec
     *curr_iclass_col_index += ispec->interaction_column_indices[ispec->n_to_force_match];
 
 	process_interaction_matrix_elements = process_normal_interaction_matrix_elements;
+	pending_interactions = std::vector<PendingBasisInteractions>(ispec->get_n_defined());
     // Define the interaction class's geometric definition.
     cutoff2 = ispec->cutoff * ispec->cutoff;
     class_set_up_computer();
@@ -109,23 +172,27 @@ void InteractionClassComputer::set_up_computer(InteractionClassSpec* const ispec
 void PairNonbondedClassComputer::class_set_up_computer(void) 
 {
 	calculate_fm_matrix_elements = calc_isotropic_two_body_fm_matrix_elements;
+	process_interaction_matrix_elements = queue_normal_interaction_matrix_elements;
 }
 
 void PairBondedClassComputer::class_set_up_computer(void) 
 {
     calculate_fm_matrix_elements = calc_isotropic_two_body_fm_matrix_elements;
+	process_interaction_matrix_elements = queue_normal_interaction_matrix_elements;
 }
 
 void AngularClassComputer::class_set_up_computer(void) 
 {
     if (ispec->class_subtype == 1) calculate_fm_matrix_elements = calc_isotropic_two_body_fm_matrix_elements;
     else calculate_fm_matrix_elements = calc_angular_three_body_fm_matrix_elements;
+	process_interaction_matrix_elements = queue_normal_interaction_matrix_elements;
 }
 
 void DihedralClassComputer::class_set_up_computer(void) 
 {
     if (ispec->class_subtype == 1) calculate_fm_matrix_elements = calc_isotropic_two_body_fm_matrix_elements;
     else calculate_fm_matrix_elements = calc_dihedral_four_body_fm_matrix_elements;
+	process_interaction_matrix_elements = queue_normal_interaction_matrix_elements;
 }
 
 void DensityClassComputer::class_set_up_computer(void) 
@@ -136,19 +203,19 @@ void DensityClassComputer::class_set_up_computer(void)
 	if(iclass->class_subtype == 0) return;
 	if(iclass->class_subtype == 1) {
 		printf("Will calculate density using shifted-force Gaussian weight functions.\n");
-		calculate_density_values = calc_gaussian_density_values;
+		calculate_density_weight = calc_gaussian_density_weight;
 		calculate_density_derivative = calc_gaussian_density_derivative;
 	} else if(iclass->class_subtype == 2) {
 		printf("Will calculate density using shifted-force switching (tanh) weight functions.\n");
-		calculate_density_values = calc_switching_density_values;
+		calculate_density_weight = calc_switching_density_weight;
 		calculate_density_derivative = calc_switching_density_derivative;
 	} else if(iclass->class_subtype == 3) {
 		printf("Will calculate density using Lucy-style weight functions.\n");
-		calculate_density_values = calc_lucy_density_values;
+		calculate_density_weight = calc_lucy_density_weight;
 		calculate_density_derivative = calc_lucy_density_derivative;
 	}  else if(iclass->class_subtype == 4) {
 		printf("Will calculate density using Relative Entropy-style weight functions.\n");
-		calculate_density_values = calc_re_density_values;
+		calculate_density_weight = calc_re_density_weight;
 		calculate_density_derivative = calc_re_density_derivative;
 	}
 	calculate_fm_matrix_elements = calc_density_fm_matrix_elements;
@@ -174,11 +241,11 @@ void DensityClassComputer::class_set_up_computer(void)
 			denomenator[ii] = 2.0 * iclass->density_sigma[ii] * iclass->density_sigma[ii];
 			u_cutoff[ii] = - exp( - cutoff2 / denomenator[ii] );
 			f_cutoff[ii] = - 2.0 * iclass->cutoff * u_cutoff[ii] / denomenator[ii];
-			printf("%d: density_sigma %lf, cutoff %lf, u_cutoff %lf, f_cutoff %lf, denom %lf\n", i, iclass->density_sigma[i], iclass->cutoff, u_cutoff[i], f_cutoff[i], denomenator[i]); fflush(stdout);
+			printf("%d: density_sigma %lf, cutoff %lf, u_cutoff %lf, f_cutoff %lf, denom %lf\n", ii, iclass->density_sigma[ii], iclass->cutoff, u_cutoff[ii], f_cutoff[ii], denomenator[ii]); fflush(stdout);
 		}
 	} else if (iclass->class_subtype == 2) {
 		for(int ii = 0; ii < iclass->get_n_defined(); ii++) {
-			if (iclass->density_sigma[i] < VERYSMALL_F) {
+			if (iclass->density_sigma[ii] < VERYSMALL_F) {
 				printf("Density sigma parameter (%lf) is too small!\n", iclass->density_sigma[ii]);
 				exit(EXIT_FAILURE);
 			}
@@ -213,6 +280,109 @@ void DensityClassComputer::class_set_up_computer(void)
 		fflush(stdout);
 		exit(EXIT_FAILURE);
 	}
+	
+	// Replace the transcendental weight functions by tables if requested.
+	weight_tables.clear();
+	weight_table_max_error = 0.0;
+	if (iclass->weight_table_tolerance > 0.0) {
+		if (iclass->class_subtype == 1 || iclass->class_subtype == 2) {
+			set_up_weight_tables(iclass->weight_table_tolerance);
+		} else {
+			printf("Lucy-style and Relative Entropy-style weight functions are polynomials and will not be tabulated.\n");
+		}
+	}
+}
+
+// Evaluate the weight function parts and the derivative tabulated for the current interaction.
+
+void sample_analytic_density_weight_functions(DensityClassComputer* const icomp, DensityClassSpec* const ispec, const double distance, double* const vals)
+{
+	icomp->curr_weight = 0.0;
+	vals[1] = (*icomp->calculate_density_weight)(icomp, ispec, distance * distance);
+	icomp->curr_weight = 1.0;
+	vals[0] = (*icomp->calculate_density_weight)(icomp, ispec, distance * distance) - vals[1];
+	vals[2] = (*icomp->calculate_density_derivative)(icomp, ispec, distance);
+}
+
+// Tabulate the weight function and its derivative of each defined interaction for cubic Hermite interpolation.
+// The node spacing is halved until the largest error found a quarter, half and three quarters of the way
+// between nodes, relative to the largest magnitude of each function at the nodes, is within the tolerance.
+// Slopes at the nodes are found by central differences (one-sided at zero distance).
+
+void DensityClassComputer::set_up_weight_tables(const double tolerance)
+{
+	DensityClassSpec* iclass = static_cast<DensityClassSpec*>(ispec);
+	const int n_functions = 3;
+	const double check_fractions[3] = {0.25, 0.5, 0.75};
+	double step = 1.0e-5 * iclass->cutoff;
+	int max_n_intervals = 0;
+	
+	weight_tables.resize(iclass->get_n_defined());
+	for (int ii = 0; ii < iclass->get_n_defined(); ii++) {
+		CubicHermiteTable& table = weight_tables[ii];
+		table.n_functions = n_functions;
+		index_among_defined_intrxns = ii;
+		double table_error = 0.0;
+		for (table.n_intervals = 64; ; table.n_intervals *= 2) {
+			double spacing = iclass->cutoff / (double)(table.n_intervals);
+			double scale[n_functions] = {0.0, 0.0, 0.0};
+			double vals[n_functions], vals_up[n_functions], vals_down[n_functions];
+			table.inv_spacing = 1.0 / spacing;
+			table.nodes.resize((table.n_intervals + 1) * n_functions * 2);
+			
+			for (int node = 0; node <= table.n_intervals; node++) {
+				double distance = spacing * (double)node;
+				sample_analytic_density_weight_functions(this, iclass, distance, vals);
+				if (node == 0) {
+					sample_analytic_density_weight_functions(this, iclass, step, vals_up);
+					sample_analytic_density_weight_functions(this, iclass, 2.0 * step, vals_down);
+				} else {
+					sample_analytic_density_weight_functions(this, iclass, distance + step, vals_up);
+					sample_analytic_density_weight_functions(this, iclass, distance - step, vals_down);
+				}
+				for (int f = 0; f < n_functions; f++) {
+					double slope;
+					if (node == 0) slope = (4.0 * vals_up[f] - 3.0 * vals[f] - vals_down[f]) / (2.0 * step);
+					else slope = (vals_up[f] - vals_down[f]) / (2.0 * step);
+					table.nodes[(node * n_functions + f) * 2] = vals[f];
+					table.nodes[(node * n_functions + f) * 2 + 1] = slope * spacing;
+					if (fabs(vals[f]) > scale[f]) scale[f] = fabs(vals[f]);
+				}
+			}
+			
+			table_error = 0.0;
+			for (int interval = 0; interval < table.n_intervals; interval++) {
+				for (int n = 0; n < 3; n++) {
+					double distance = spacing * ((double)interval + check_fractions[n]);
+					sample_analytic_density_weight_functions(this, iclass, distance, vals);
+					for (int f = 0; f < n_functions; f++) {
+						if (scale[f] == 0.0) continue;
+						double error = fabs(table.eval(distance, f) - vals[f]) / scale[f];
+						if (error > table_error) table_error = error;
+					}
+				}
+			}
+			if (table_error <= tolerance || table.n_intervals >= MAX_DENSITY_WEIGHT_TABLE_INTERVALS) break;
+		}
+		if (table_error > tolerance) {
+			printf("Warning: density weight table %d only reaches a relative error of %le with %d intervals.\n", ii, table_error, table.n_intervals);
+		}
+		if (table_error > weight_table_max_error) weight_table_max_error = table_error;
+		if (table.n_intervals > max_n_intervals) max_n_intervals = table.n_intervals;
+	}
+	printf("Will calculate density weight functions from tables of up to %d intervals with largest relative error %le.\n", max_n_intervals, weight_table_max_error);
+	
+	calculate_density_weight = calc_tabulated_density_weight;
+	calculate_density_derivative = calc_tabulated_density_derivative;
+}
+
+// Record the accuracy of the density weight tables in a solution file if they are used.
+
+void write_density_weight_table_info(CG_MODEL_DATA* const cg, FILE* const solution_file)
+{
+	if (cg->density_computer.weight_tables.empty()) return;
+	fprintf(solution_file, "density_weight_table_tolerance:%le; density_weight_table_max_error:%le;\n",
+			cg->density_interactions.weight_table_tolerance, cg->density_computer.weight_table_max_error);
 }
 
 void DensityClassComputer::reset_density_array(void) 
@@ -252,13 +422,27 @@ void ThreeBodyNonbondedClassComputer::special_set_up_computer(InteractionClassSp
         *curr_iclass_col_index += ispec->interaction_column_indices[ispec->n_to_force_match];
     }
     fm_s_comp = new BSplineAndDerivComputer(ispec);
+    if (ispec->class_subtype > 0) {
+        fm_basis_fn_vals = std::vector<double>(fm_s_comp->get_n_coef());
+        fm_basis_deriv_vals = std::vector<double>(fm_s_comp->get_n_coef());
+    }
 }
 
 //--------------------------------------------------------------------
 // Main routine calling all other matrix element calculation routines
 //--------------------------------------------------------------------
 
-void calculate_frame_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, FrameConfig* const frame_config, PairCellList pair_cell_list, ThreeBCellList three_body_cell_list, int trajectory_block_frame_index)
+void calculate_frame_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, FrameConfig* const frame_config, PairCellList &pair_cell_list, ThreeBCellList &three_body_cell_list, int trajectory_block_frame_index)
+{
+    calculate_frame_fm_matrix_with_computers(cg, cg->icomp_list, &cg->three_body_nonbonded_computer, mat, frame_config, pair_cell_list, three_body_cell_list, trajectory_block_frame_index);
+}
+
+void calculate_frame_fm_matrix(CG_MODEL_DATA* const cg, ThreadLocalComputers* const computers, MATRIX_DATA* const mat, FrameConfig* const frame_config, PairCellList &pair_cell_list, ThreeBCellList &three_body_cell_list, int trajectory_block_frame_index)
+{
+    calculate_frame_fm_matrix_with_computers(cg, computers->icomp_list, &computers->three_body_nonbonded_computer, mat, frame_config, pair_cell_list, three_body_cell_list, trajectory_block_frame_index);
+}
+
+void calculate_frame_fm_matrix_with_computers(CG_MODEL_DATA* const cg, std::list<InteractionClassComputer*> &icomp_list, ThreeBodyNonbondedClassComputer* const three_body_computer, MATRIX_DATA* const mat, FrameConfig* const frame_config, PairCellList &pair_cell_list, ThreeBCellList &three_body_cell_list, int trajectory_block_frame_index)
 {
     // Each frame is a set of contiguous rows in the FM matrix; get the starting row for this frame.
     int current_frame_starting_row = trajectory_block_frame_index * cg->n_cg_sites; //shift row number after each frame within one block
@@ -272,18 +456,31 @@ void calculate_frame_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat,
     }
     
     // Set up a cell list and initialize the calculation temps for pair 
-    // nonbonded matrix element computations.
-    pair_cell_list.populateList(frame_config->current_n_sites, frame_config->x);
+    // nonbonded matrix element computations. Computers with a Verlet skin
+    // only read the pair cell list when their Verlet list is rebuilt, so if
+    // every pair and density computer has one, it is populated there instead.
+    // Others (e.g. those used for range finding) walk it every frame.
+    bool pair_cell_list_walked = false;
+    std::list<InteractionClassComputer*>::iterator icomp_iterator;
+    for(icomp_iterator=icomp_list.begin(); icomp_iterator != icomp_list.end(); icomp_iterator++) {
+        if (((*icomp_iterator)->ispec->class_type == kPairNonbonded || (*icomp_iterator)->ispec->class_type == kDensity) && (*icomp_iterator)->verlet_list.skin <= 0.0) {
+            pair_cell_list_walked = true;
+        }
+    }
+    if (pair_cell_list_walked) {
+        pair_cell_list.populateList(frame_config->current_n_sites, frame_config->x, cg->topo_data.cg_site_types);
+    } else {
+        pair_cell_list.populated = false;
+    }
     if (cg->three_body_nonbonded_interactions.class_subtype > 0) {
-        three_body_cell_list.populateList(frame_config->current_n_sites, frame_config->x);
+        three_body_cell_list.populateList(frame_config->current_n_sites, frame_config->x, cg->topo_data.cg_site_types);
     }
     
     // Calculate matrix elements by looking through interaction (cell and topology) lists to find active (and non-excluded) interactions.
-    std::list<InteractionClassComputer*>::iterator icomp_iterator;
-	for(icomp_iterator=cg->icomp_list.begin(); icomp_iterator != cg->icomp_list.end(); icomp_iterator++) {
+	for(icomp_iterator=icomp_list.begin(); icomp_iterator != icomp_list.end(); icomp_iterator++) {
         (*icomp_iterator)->calculate_interactions(mat, trajectory_block_frame_index, current_frame_starting_row, cg->n_cg_types, cg->topo_data, pair_cell_list, frame_config->x, frame_config->simulation_box_half_lengths);
     }
-    cg->three_body_nonbonded_computer.calculate_3B_interactions(mat, trajectory_block_frame_index, current_frame_starting_row, cg->n_cg_types, cg->topo_data, three_body_cell_list, frame_config->x, frame_config->simulation_box_half_lengths);
+    three_body_computer->calculate_3B_interactions(mat, trajectory_block_frame_index, current_frame_starting_row, cg->n_cg_types, cg->topo_data, three_body_cell_list, frame_config->x, frame_config->simulation_box_half_lengths);
 }
 
 //--------------------------------------------------------------------
@@ -293,7 +490,7 @@ void calculate_frame_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat,
 
 // Find all neighbors of all particles and call nonbonded matrix element computations for any pairs that interact. 
 
-void PairNonbondedClassComputer::calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
+void PairNonbondedClassComputer::calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
 {
     if (ispec->n_defined == 0) return;
     trajectory_block_frame_index = traj_block_frame_index;
@@ -301,100 +498,257 @@ void PairNonbondedClassComputer::calculate_interactions(MATRIX_DATA* const mat,
     walk_neighbor_list(mat, calculate_fm_matrix_elements, n_cg_types, topo_data, pair_cell_list, x, simulation_box_half_lengths);
 }
 
-inline void InteractionClassComputer::walk_neighbor_list(MATRIX_DATA* const mat, calc_pair_matrix_elements calc_matrix_elements, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
+// Squared minimum image distance from position_k to position_l, computed exactly as in the geometry routines.
+
+inline double calc_min_image_squared_distance(const std::array<double, DIMENSION> &position_k, const std::array<double, DIMENSION> &position_l, const real* simulation_box_half_lengths)
+{
+    double rr2 = 0.0;
+    for (int i = 0; i < DIMENSION; i++) {
+        double displacement = position_l[i] - position_k[i];
+        if (displacement > simulation_box_half_lengths[i]) displacement -= 2.0 * simulation_box_half_lengths[i];
+        else if (displacement < -simulation_box_half_lengths[i]) displacement += 2.0 * simulation_box_half_lengths[i];
+        rr2 += displacement * displacement;
+    }
+    return rr2;
+}
+
+// Pairs are visited cell by cell through the contiguous cell ranges of the cell list. Pairs beyond
+// the class cutoff are rejected from the cell list's copy of the positions, using the same distance
+// test as the matrix element kernels, before any per-site data is looked up.
+
+inline void InteractionClassComputer::walk_neighbor_list(MATRIX_DATA* const mat, calc_pair_matrix_elements calc_matrix_elements, const int n_cg_types, const TopologyData& topo_data, PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
 {
     if (ispec->n_defined == 0) return;
+    if (verlet_list.skin > 0.0) {
+        update_verlet_list(pair_cell_list, topo_data, topo_data.exclusion_list, x, simulation_box_half_lengths);
+        // Exclusions were applied when the list was built.
+        for (int p = 0; p < verlet_list.size(); p++) {
+            k = verlet_list.site_k[p];
+            l = verlet_list.site_l[p];
+            if (calc_min_image_squared_distance(x[k], x[l], simulation_box_half_lengths) > cutoff2) continue;
+            order_pair_nonbonded_fm_matrix_element_calculation(this, calc_matrix_elements, topo_data.cg_site_types[k], topo_data.cg_site_types[l], n_cg_types, mat, x, simulation_box_half_lengths);
+        }
+        flush_all_pending_interactions(mat);
+        return;
+    }
     int stencil_size = pair_cell_list.get_stencil_size();
     for (int kk = 0; kk < pair_cell_list.size; kk++) {
-        k = pair_cell_list.head[kk];
-        while (k >= 0) {
-            l = pair_cell_list.list[k];
-            while (l >= 0) {
-                if (check_excluded_list(&topo_data, k, l) == false) {
-                    order_pair_nonbonded_fm_matrix_element_calculation(this, calc_matrix_elements, topo_data.cg_site_types, n_cg_types, mat, x, simulation_box_half_lengths);
-                }
-                l = pair_cell_list.list[l];
+        for (int a = pair_cell_list.cell_start[kk]; a < pair_cell_list.cell_start[kk + 1]; a++) {
+            k = pair_cell_list.cell_sites[a];
+            for (int b = a + 1; b < pair_cell_list.cell_start[kk + 1]; b++) {
+                visit_cell_pair(mat, calc_matrix_elements, n_cg_types, topo_data, pair_cell_list, a, b, x, simulation_box_half_lengths);
             }
             //do the above the 2nd time for neiboring cells
             for (int nei = 0; nei < stencil_size; nei++) {
                 int ll = pair_cell_list.stencil[stencil_size * kk + nei];
-                l = pair_cell_list.head[ll];
-                while (l >= 0) {
-                    if (check_excluded_list(&topo_data, k, l) == false) {
-                        order_pair_nonbonded_fm_matrix_element_calculation(this, calc_matrix_elements, topo_data.cg_site_types, n_cg_types, mat, x, simulation_box_half_lengths);
-                    }
-                    l = pair_cell_list.list[l];
+                for (int b = pair_cell_list.cell_start[ll]; b < pair_cell_list.cell_start[ll + 1]; b++) {
+                    visit_cell_pair(mat, calc_matrix_elements, n_cg_types, topo_data, pair_cell_list, a, b, x, simulation_box_half_lengths);
                 }
             }
-            k = pair_cell_list.list[k];
         }
     }
+    flush_all_pending_interactions(mat);
 }
 
-inline void DensityClassComputer::walk_density_neighbor_list(MATRIX_DATA* const mat, calc_pair_matrix_elements calc_matrix_elements, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
+inline void InteractionClassComputer::visit_cell_pair(MATRIX_DATA* const mat, calc_pair_matrix_elements calc_matrix_elements, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, const int a, const int b, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths)
+{
+    if (calc_min_image_squared_distance(pair_cell_list.sorted_x[a], pair_cell_list.sorted_x[b], simulation_box_half_lengths) > cutoff2) return;
+    
+    l = pair_cell_list.cell_sites[b];
+    if (check_excluded_list(&topo_data, k, l) == false) {
+        order_pair_nonbonded_fm_matrix_element_calculation(this, calc_matrix_elements, pair_cell_list.sorted_types[a], pair_cell_list.sorted_types[b], n_cg_types, mat, x, simulation_box_half_lengths);
+    }
+}
+
+// Rebuild the Verlet list from the cell list if any site has moved too far since it was last built.
+// Pairs are kept if they are not excluded and lie within the computer's cutoff plus the skin.
+// The cell list must be sized for the cutoff plus the skin; it is populated here the first time
+// a list is rebuilt in a frame.
+
+void InteractionClassComputer::update_verlet_list(PairCellList& pair_cell_list, const TopologyData& topo_data, const TopoList* const exclusion_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths)
+{
+    int n_sites = topo_data.n_cg_sites;
+    if (verlet_list.is_current(n_sites, x, simulation_box_half_lengths)) return;
+    
+    if (!pair_cell_list.populated) pair_cell_list.populateList(n_sites, x, topo_data.cg_site_types);
+    double list_cutoff = sqrt(cutoff2) + verlet_list.skin;
+    double list_cutoff2 = list_cutoff * list_cutoff;
+    verlet_list.site_k.clear();
+    verlet_list.site_l.clear();
+    
+    int stencil_size = pair_cell_list.get_stencil_size();
+    for (int kk = 0; kk < pair_cell_list.size; kk++) {
+        for (int a = pair_cell_list.cell_start[kk]; a < pair_cell_list.cell_start[kk + 1]; a++) {
+            int site_k = pair_cell_list.cell_sites[a];
+            for (int nei = -1; nei < stencil_size; nei++) {
+                int ll = (nei < 0) ? kk : pair_cell_list.stencil[stencil_size * kk + nei];
+                int first = (nei < 0) ? a + 1 : pair_cell_list.cell_start[ll];
+                for (int b = first; b < pair_cell_list.cell_start[ll + 1]; b++) {
+                    if (calc_min_image_squared_distance(pair_cell_list.sorted_x[a], pair_cell_list.sorted_x[b], simulation_box_half_lengths) > list_cutoff2) continue;
+                    int site_l = pair_cell_list.cell_sites[b];
+                    if (exclusion_list->is_sorted_partner(site_k, site_l)) continue;
+                    verlet_list.site_k.push_back(site_k);
+                    verlet_list.site_l.push_back(site_l);
+                }
+            }
+        }
+    }
+    
+    verlet_list.reference_x.assign(x, x + n_sites);
+    for (int i = 0; i < DIMENSION; i++) {
+        verlet_list.reference_box_half_lengths[i] = simulation_box_half_lengths[i];
+    }
+    verlet_list.built = true;
+}
+
+inline void DensityClassComputer::walk_density_neighbor_list(const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
 {
     if (ispec->n_defined == 0) return;
+    if (verlet_list.skin > 0.0) {
+        // The list is brought up to date once per frame by calculate_interactions; exclusions were applied when it was built.
+        for (int p = 0; p < verlet_list.size(); p++) {
+            k = verlet_list.site_k[p];
+            l = verlet_list.site_l[p];
+            accumulate_pair_densities(n_cg_types, topo_data, x, simulation_box_half_lengths);
+        }
+        return;
+    }
     int stencil_size = pair_cell_list.get_stencil_size();
     for (int kk = 0; kk < pair_cell_list.size; kk++) {
-        k = pair_cell_list.head[kk];
-        while (k >= 0) {
-            l = pair_cell_list.list[k];
-            while (l >= 0) {
+        for (int a = pair_cell_list.cell_start[kk]; a < pair_cell_list.cell_start[kk + 1]; a++) {
+            k = pair_cell_list.cell_sites[a];
+            for (int b = a + 1; b < pair_cell_list.cell_start[kk + 1]; b++) {
+                l = pair_cell_list.cell_sites[b];
                 if (check_density_excluded_list(&topo_data, k, l) == false) {
-                    density_fm_matrix_element_calculation(this, calc_matrix_elements, topo_data.cg_site_types, n_cg_types, mat, x, simulation_box_half_lengths);
+                    accumulate_pair_densities(n_cg_types, topo_data, x, simulation_box_half_lengths);
                 }
-                l = pair_cell_list.list[l];
             }
             //do the above the 2nd time for neiboring cells
             for (int nei = 0; nei < stencil_size; nei++) {
                 int ll = pair_cell_list.stencil[stencil_size * kk + nei];
-                l = pair_cell_list.head[ll];
-                while (l >= 0) {
+                for (int b = pair_cell_list.cell_start[ll]; b < pair_cell_list.cell_start[ll + 1]; b++) {
+                    l = pair_cell_list.cell_sites[b];
                     if (check_density_excluded_list(&topo_data, k, l) == false) {
-                        density_fm_matrix_element_calculation(this, calc_matrix_elements, topo_data.cg_site_types, n_cg_types, mat, x, simulation_box_half_lengths);
+                        accumulate_pair_densities(n_cg_types, topo_data, x, simulation_box_half_lengths);
                     }
-                    l = pair_cell_list.list[l];
                 }
             }
-            k = pair_cell_list.list[k];
         }
     }
 }
 
+// Add the weight functions of the pair k, l to the densities at both of its sites, first in the order k, l and then l, k,
+// each time for the active interactions of that order of site types. When force matching, the pair's geometry and the
+// weighted weight function derivative of each of these interactions are also cached, in the same order.
+
+inline void DensityClassComputer::accumulate_pair_densities(const int n_cg_types, const TopologyData& topo_data, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths)
+{
+    DensityClassSpec* dspec = static_cast<DensityClassSpec*>(ispec);
+    int particle_ids[2] = {k, l};
+    double distance2;
+    std::array<double, DIMENSION> derivatives[1];
+    if (!conditionally_calc_squared_distance_and_derivatives(particle_ids, x, simulation_box_half_lengths, cutoff2, distance2, derivatives)) return;
+    
+    bool cache_pair = (calculate_density_derivative != NULL);
+    double distance = sqrt(distance2);
+    int pair = pair_cache.n_pairs();
+    if (cache_pair) {
+        for (int i = 0; i < DIMENSION; i++) {
+            derivatives[0][i] = 0.5 * derivatives[0][i] / distance;
+        }
+        pair_cache.site_k.push_back(k);
+        pair_cache.site_l.push_back(l);
+        pair_cache.distance.push_back(distance);
+        pair_cache.derivatives.push_back(derivatives[0]);
+    }
+    
+    for (int order = 0; order < 2; order++) {
+        int site_1 = particle_ids[order];
+        int type_pair = (topo_data.cg_site_types[site_1] - 1) * n_cg_types + (topo_data.cg_site_types[particle_ids[1 - order]] - 1);
+        for (int n = dspec->pair_interaction_starts[type_pair]; n < dspec->pair_interaction_starts[type_pair + 1]; n++) {
+            index_among_defined_intrxns = dspec->pair_interaction_indices[n];
+            curr_weight = dspec->pair_interaction_weights[n];
+            if (distance2 < cutoff2) {
+                density_values[index_among_defined_intrxns * dspec->n_cg_sites + site_1] += (*calculate_density_weight)(this, dspec, distance2);
+            }
+            if (cache_pair) {
+                pair_cache.entry_pair.push_back(pair);
+                pair_cache.entry_reversed.push_back(char(order));
+                pair_cache.entry_index_among_defined.push_back(index_among_defined_intrxns);
+                pair_cache.entry_density_derivative.push_back((*calculate_density_derivative)(this, dspec, distance) * curr_weight);
+            }
+        }
+    }
+}
+
+// Calculate the matrix elements of every cached interaction from its cached geometry and the completed densities.
+
+void DensityClassComputer::stream_cached_matrix_elements(MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths)
+{
+    for (int n = 0; n < pair_cache.n_entries(); n++) {
+        int pair = pair_cache.entry_pair[n];
+        index_among_defined_intrxns = pair_cache.entry_index_among_defined[n];
+        curr_distance = pair_cache.distance[pair];
+        curr_density_derivative = pair_cache.entry_density_derivative[n];
+        if (pair_cache.entry_reversed[n] == 0) {
+            k = pair_cache.site_k[pair];
+            l = pair_cache.site_l[pair];
+            curr_derivatives[0] = pair_cache.derivatives[pair];
+        } else {
+            k = pair_cache.site_l[pair];
+            l = pair_cache.site_k[pair];
+            for (int i = 0; i < DIMENSION; i++) {
+                curr_derivatives[0][i] = -pair_cache.derivatives[pair][i];
+            }
+        }
+        (*calculate_fm_matrix_elements)(this, x, simulation_box_half_lengths, mat);
+    }
+}
+
 // Calculate matrix elements for all bonded interactions by looping over the approriate topology lists. 
 
-void PairBondedClassComputer::calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
+void PairBondedClassComputer::calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
 {
     if (ispec->n_defined == 0) return;
     trajectory_block_frame_index = traj_block_frame_index;
     current_frame_starting_row = curr_frame_starting_row;
-    for (k = 0; k < int(topo_data.n_cg_sites); k++) {
-        for (unsigned kk = 0; kk < topo_data.bond_list->partner_numbers_[k]; kk++) {
-            l = topo_data.bond_list->partners_[k][kk];
-            if (k < l) order_bonded_fm_matrix_element_calculation(this, topo_data.cg_site_types, n_cg_types, mat, x, simulation_box_half_lengths);
+    if (!bonded_list.is_current(topo_data.cg_site_types, topo_data.n_cg_sites)) {
+        bonded_list.clear();
+        for (k = 0; k < int(topo_data.n_cg_sites); k++) {
+            for (unsigned kk = 0; kk < topo_data.bond_list->partner_numbers_[k]; kk++) {
+                l = topo_data.bond_list->partners_[k][kk];
+                if (k < l) add_to_bonded_list(topo_data.cg_site_types, n_cg_types);
+            }
         }
+        finish_bonded_list(topo_data.cg_site_types, topo_data.n_cg_sites);
     }
+    walk_bonded_list(mat, x, simulation_box_half_lengths);
 }
 
-void AngularClassComputer::calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
+void AngularClassComputer::calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
 {
     if (ispec->n_defined == 0) return;
     trajectory_block_frame_index = traj_block_frame_index;
     current_frame_starting_row = curr_frame_starting_row;
-    for (k = 0; k < int(topo_data.n_cg_sites); k++) {
-        for (unsigned kk = 0; kk < topo_data.angle_list->partner_numbers_[k]; kk++) {
-        	// Grab partners from angle list (organization of angle_list described in topology files).
-        	// j is the "center" index while l and k are the "ends" of the angle.
-        	// To avoid double counting, the interaction is only counted if the ends are
-        	// ordered such that k < l.
-            l = topo_data.angle_list->partners_[k][2 * kk + 1];
-            j = topo_data.angle_list->partners_[k][2 * kk];
-            if (k < l) order_bonded_fm_matrix_element_calculation(this, topo_data.cg_site_types, n_cg_types, mat, x, simulation_box_half_lengths);
+    if (!bonded_list.is_current(topo_data.cg_site_types, topo_data.n_cg_sites)) {
+        bonded_list.clear();
+        for (k = 0; k < int(topo_data.n_cg_sites); k++) {
+            for (unsigned kk = 0; kk < topo_data.angle_list->partner_numbers_[k]; kk++) {
+                // Grab partners from angle list (organization of angle_list described in topology files).
+                // j is the "center" index while l and k are the "ends" of the angle.
+                // To avoid double counting, the interaction is only counted if the ends are
+                // ordered such that k < l.
+                l = topo_data.angle_list->partners_[k][2 * kk + 1];
+                j = topo_data.angle_list->partners_[k][2 * kk];
+                if (k < l) add_to_bonded_list(topo_data.cg_site_types, n_cg_types);
+            }
         }
+        finish_bonded_list(topo_data.cg_site_types, topo_data.n_cg_sites);
     }
+    walk_bonded_list(mat, x, simulation_box_half_lengths);
 }
 
-void DihedralClassComputer::calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
+void DihedralClassComputer::calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
 {
     if (ispec->n_defined == 0) return;
     
@@ -405,26 +759,184 @@ void DihedralClassComputer::calculate_interactions(MATRIX_DATA* const mat, int t
 
     trajectory_block_frame_index = traj_block_frame_index;
     current_frame_starting_row = curr_frame_starting_row;
-    for (k = 0; k < int(topo_data.n_cg_sites); k++) {
-        for (unsigned kk = 0; kk < topo_data.dihedral_list->partner_numbers_[k]; kk++) {
-        	// Grab partners from dihedral list (organization of dihedral_list described in topology files).
-        	// i and j are the indices for the "central bond" index while l and k are the "ends" of the dihedral.
-        	// To avoid double counting, the interaction is only counted if the ends are
-        	// ordered such that k < l.
-            l = topo_data.dihedral_list->partners_[k][3 * kk + 2];
-            i = topo_data.dihedral_list->partners_[k][3 * kk];
-            j = topo_data.dihedral_list->partners_[k][3 * kk + 1];
-            if (k < l) order_bonded_fm_matrix_element_calculation(this, topo_data.cg_site_types, n_cg_types, mat, x, simulation_box_half_lengths);
+    if (!bonded_list.is_current(topo_data.cg_site_types, topo_data.n_cg_sites)) {
+        bonded_list.clear();
+        for (k = 0; k < int(topo_data.n_cg_sites); k++) {
+            for (unsigned kk = 0; kk < topo_data.dihedral_list->partner_numbers_[k]; kk++) {
+                // Grab partners from dihedral list (organization of dihedral_list described in topology files).
+                // i and j are the indices for the "central bond" index while l and k are the "ends" of the dihedral.
+                // To avoid double counting, the interaction is only counted if the ends are
+                // ordered such that k < l.
+                l = topo_data.dihedral_list->partners_[k][3 * kk + 2];
+                i = topo_data.dihedral_list->partners_[k][3 * kk];
+                j = topo_data.dihedral_list->partners_[k][3 * kk + 1];
+                if (k < l) add_to_bonded_list(topo_data.cg_site_types, n_cg_types);
+            }
+        }
+        finish_bonded_list(topo_data.cg_site_types, topo_data.n_cg_sites);
+    }
+    walk_bonded_list(mat, x, simulation_box_half_lengths);
+}
+
+// Helpers for compiling the topology lists of a bonded class into a flat list
+// once, so that each frame only does the geometry and basis evaluation.
+
+void InteractionClassComputer::add_to_bonded_list(int* const cg_site_types, const int n_cg_types)
+{
+    if (ispec->type_lookup.size() > 0) {
+        set_indices_from_lookup(ispec->type_lookup[calculate_type_lookup_index(cg_site_types, n_cg_types)]);
+    } else {
+        index_among_defined_intrxns = ispec->get_index_from_hash(calculate_hash_number(cg_site_types, n_cg_types));
+        set_indices();
+    }
+    bonded_list.site_k.push_back(k);
+    bonded_list.site_l.push_back(l);
+    bonded_list.site_i.push_back(i);
+    bonded_list.site_j.push_back(j);
+    bonded_list.index_among_defined.push_back(index_among_defined_intrxns);
+    bonded_list.index_among_matched.push_back(index_among_matched_interactions);
+    bonded_list.index_among_tabulated.push_back(index_among_tabulated_interactions);
+}
+
+// Sort the interactions by type (keeping topology order within each type) and
+// record the site types that the list is valid for.
+
+inline void reorder_bonded_list_column(std::vector<int> &column, const std::vector<int> &order)
+{
+    std::vector<int> sorted(order.size());
+    for (unsigned n = 0; n < order.size(); n++) sorted[n] = column[order[n]];
+    column.swap(sorted);
+}
+
+void InteractionClassComputer::finish_bonded_list(const int* const cg_site_types, const int n_cg_sites)
+{
+    // Counting sort on index_among_defined; undefined interactions (-1) go first.
+    int n_interactions = bonded_list.size();
+    std::vector<int> type_starts(ispec->get_n_defined() + 2, 0);
+    for (int n = 0; n < n_interactions; n++) type_starts[bonded_list.index_among_defined[n] + 2]++;
+    for (unsigned t = 1; t < type_starts.size(); t++) type_starts[t] += type_starts[t - 1];
+    std::vector<int> order(n_interactions);
+    for (int n = 0; n < n_interactions; n++) order[type_starts[bonded_list.index_among_defined[n] + 1]++] = n;
+    
+    reorder_bonded_list_column(bonded_list.site_k, order);
+    reorder_bonded_list_column(bonded_list.site_l, order);
+    reorder_bonded_list_column(bonded_list.site_i, order);
+    reorder_bonded_list_column(bonded_list.site_j, order);
+    reorder_bonded_list_column(bonded_list.index_among_defined, order);
+    reorder_bonded_list_column(bonded_list.index_among_matched, order);
+    reorder_bonded_list_column(bonded_list.index_among_tabulated, order);
+    
+    bonded_list.compiled_site_types.assign(cg_site_types, cg_site_types + n_cg_sites);
+    bonded_list.compiled = true;
+}
+
+// Calculate matrix elements for every interaction in the compiled bonded list.
+
+void InteractionClassComputer::walk_bonded_list(MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths)
+{
+    // The force matching kernels have batched geometry; others (e.g. range finding) go one at a time.
+    if (calculate_fm_matrix_elements == calc_isotropic_two_body_fm_matrix_elements) {
+        walk_bonded_list_in_batches(mat, 2, x, simulation_box_half_lengths);
+        return;
+    } else if (calculate_fm_matrix_elements == calc_angular_three_body_fm_matrix_elements) {
+        walk_bonded_list_in_batches(mat, 3, x, simulation_box_half_lengths);
+        return;
+    } else if (calculate_fm_matrix_elements == calc_dihedral_four_body_fm_matrix_elements) {
+        walk_bonded_list_in_batches(mat, 4, x, simulation_box_half_lengths);
+        return;
+    }
+    
+    int n_interactions = bonded_list.size();
+    for (int n = 0; n < n_interactions; n++) {
+        k = bonded_list.site_k[n];
+        l = bonded_list.site_l[n];
+        i = bonded_list.site_i[n];
+        j = bonded_list.site_j[n];
+        index_among_defined_intrxns = bonded_list.index_among_defined[n];
+        index_among_matched_interactions = bonded_list.index_among_matched[n];
+        index_among_tabulated_interactions = bonded_list.index_among_tabulated[n];
+        (*calculate_fm_matrix_elements)(this, x, simulation_box_half_lengths, mat);
+    }
+    flush_all_pending_interactions(mat);
+}
+
+// Calculate matrix elements for the compiled bonded list a block at a time: the geometry of
+// the whole block is computed together from the list's site arrays, then each interaction
+// is processed as in the single-interaction kernels.
+
+void InteractionClassComputer::walk_bonded_list_in_batches(MATRIX_DATA* const mat, const int n_body, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths)
+{
+    int n_interactions = bonded_list.size();
+    bonded_within_cutoff.resize(BONDED_GEOMETRY_BATCH_SIZE);
+    bonded_param_vals.resize(BONDED_GEOMETRY_BATCH_SIZE);
+    bonded_derivatives.resize(BONDED_GEOMETRY_BATCH_SIZE * (n_body - 1));
+    
+    for (int start = 0; start < n_interactions; start += BONDED_GEOMETRY_BATCH_SIZE) {
+        int n_block = (n_interactions - start < BONDED_GEOMETRY_BATCH_SIZE) ? n_interactions - start : BONDED_GEOMETRY_BATCH_SIZE;
+        std::array<double, DIMENSION>* derivatives = &bonded_derivatives[0];
+        switch (n_body) {
+            case 2:
+                conditionally_calc_distance_and_derivatives_batch(n_block, &bonded_list.site_k[start], &bonded_list.site_l[start], x, simulation_box_half_lengths, cutoff2, &bonded_within_cutoff[0], &bonded_param_vals[0], derivatives);
+                break;
+            case 3:
+                conditionally_calc_angle_and_derivatives_batch(n_block, &bonded_list.site_k[start], &bonded_list.site_l[start], &bonded_list.site_j[start], x, simulation_box_half_lengths, cutoff2, &bonded_within_cutoff[0], &bonded_param_vals[0], derivatives);
+                break;
+            case 4: default:
+                conditionally_calc_dihedral_and_derivatives_batch(n_block, &bonded_list.site_k[start], &bonded_list.site_l[start], &bonded_list.site_i[start], &bonded_list.site_j[start], x, simulation_box_half_lengths, &bonded_within_cutoff[0], &bonded_param_vals[0], derivatives);
+                break;
         }
+        
+        for (int e = 0; e < n_block; e++) {
+            if (!bonded_within_cutoff[e]) continue;
+            int n = start + e;
+            k = bonded_list.site_k[n];
+            l = bonded_list.site_l[n];
+            i = bonded_list.site_i[n];
+            j = bonded_list.site_j[n];
+            index_among_defined_intrxns = bonded_list.index_among_defined[n];
+            index_among_matched_interactions = bonded_list.index_among_matched[n];
+            index_among_tabulated_interactions = bonded_list.index_among_tabulated[n];
+            int particle_ids[4] = {k, l, (n_body == 4) ? i : j, j};
+            process_one_param_interaction(this, mat, n_body, particle_ids, &bonded_derivatives[e * (n_body - 1)], bonded_param_vals[e]);
+        }
+    }
+    flush_all_pending_interactions(mat);
+}
+
+// Evaluate the bases of the queued interactions of one type in a single batch and
+// accumulate their matrix elements in the order the interactions were queued.
+
+void InteractionClassComputer::flush_pending_interactions(MATRIX_DATA* const mat, const int index_among_defined)
+{
+    PendingBasisInteractions &pending = pending_interactions[index_among_defined];
+    int n_pending = pending.size();
+    if (n_pending == 0) return;
+    
+    index_among_defined_intrxns = index_among_defined;
+    set_indices();
+    int n_coef = fm_basis_fn_vals.size();
+    if ((int)(batch_first_nonzero_basis_indices.size()) < n_pending) batch_first_nonzero_basis_indices.resize(n_pending);
+    if ((int)(batch_basis_fn_vals.size()) < n_pending * n_coef) batch_basis_fn_vals.resize(n_pending * n_coef);
+    fm_s_comp->calculate_basis_fn_vals_batch(index_among_defined, n_pending, &pending.param_vals[0], &batch_first_nonzero_basis_indices[0], &batch_basis_fn_vals[0]);
+    
+    for (int n = 0; n < n_pending; n++) {
+        for (int m = 0; m < n_coef; m++) fm_basis_fn_vals[m] = batch_basis_fn_vals[n * n_coef + m];
+        process_matched_interaction_matrix_elements(this, mat, batch_first_nonzero_basis_indices[n], pending.n_body, &pending.particle_ids[n * pending.n_body], &pending.derivatives[n * (pending.n_body - 1)], pending.param_vals[n], pending.virial_flags[n]);
     }
+    pending.clear();
+}
+
+void InteractionClassComputer::flush_all_pending_interactions(MATRIX_DATA* const mat)
+{
+    for (unsigned t = 0; t < pending_interactions.size(); t++) flush_pending_interactions(mat, t);
 }
 
 // Calculate matrix elements for density non-bonded interactions.
-// First, find the density at each site by calculating weight functions between all pairs of neighbors for all particles and call weight function calculation
-// for each pair of density groups that interact. Exclusion lists are handled in the called subroutines.
-// Then, calculate the matrix elements by looking through the neighbor list (for all pairs of neighbors for all particles) to calculate matrix elements.
+// First, find the density at each site by calculating weight functions between all pairs of neighbors for all particles
+// for each pair of density groups that interact, caching the pairs and their interactions as they are found.
+// Then, calculate the matrix elements by streaming through the cached interactions.
 
-void DensityClassComputer::calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
+void DensityClassComputer::calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
 {
 	if (ispec->get_n_defined() == 0) return;
 	
@@ -435,14 +947,17 @@ void DensityClassComputer::calculate_interactions(MATRIX_DATA* const mat, int tr
 	trajectory_block_frame_index = traj_block_frame_index;
     current_frame_starting_row = curr_frame_starting_row;
     
+    if (verlet_list.skin > 0.0) update_verlet_list(pair_cell_list, topo_data, topo_data.density_exclusion_list, x, simulation_box_half_lengths);
+    
 	// First, pass through the neighbor list to compute the value of each density_group at every relavent CG site.
-	walk_density_neighbor_list(mat, calculate_density_values, n_cg_types, topo_data, pair_cell_list, x, simulation_box_half_lengths);
+	pair_cache.clear();
+	walk_density_neighbor_list(n_cg_types, topo_data, pair_cell_list, x, simulation_box_half_lengths);
 
 	// Do intermediate processing (if necessary).
 	process_completed_density(this, process_density, n_cg_types, topo_data.cg_site_types, mat, x, simulation_box_half_lengths);
 
 	// Finally, calculate the matrix elements by combining the density, density derivative, pair distance, and pair derivative.
-	walk_density_neighbor_list(mat, calculate_fm_matrix_elements, n_cg_types, topo_data, pair_cell_list, x, simulation_box_half_lengths);
+	stream_cached_matrix_elements(mat, x, simulation_box_half_lengths);
 }
   
 // Calculate matrix elements for three body non-bonded interactions.
@@ -459,67 +974,118 @@ void ThreeBodyNonbondedClassComputer::calculate_3B_interactions(MATRIX_DATA* con
 	}
 }
 
-inline void InteractionClassComputer::walk_3B_neighbor_list(MATRIX_DATA* const mat, const int n_cg_types, const TopologyData& topo_data, const ThreeBCellList& three_body_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
+// Triplets are enumerated center by center. Each center's neighbors are gathered once from its
+// cell and the cell stencil, keeping only sites within the largest cutoff for the center's type and
+// recording which end roles the exclusion lists allow. Every pair of later neighbors is then
+// checked against its own interaction cutoff before the matrix elements are calculated.
+// The pairs are visited in the same order as a direct walk over the cells.
+
+void ThreeBodyNonbondedClassComputer::walk_3B_neighbor_list(MATRIX_DATA* const mat, const int n_cg_types, const TopologyData& topo_data, const ThreeBCellList& three_body_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
 {
-	int stencil_size = three_body_cell_list.get_stencil_size();
     for (int kk = 0; kk < three_body_cell_list.size; kk++) {
-        j = three_body_cell_list.head[kk];
-        while (j >= 0) {
-            k = three_body_cell_list.head[kk];
-            while (k >= 0) {
-                if (j != k) {
-                    //three body
-                    l = three_body_cell_list.list[k];
-                    while (l >= 0) {
-                        if (l >= 0) {
-	                        if (l != j) {
-    	                       if ( (check_excluded_list(&topo_data, l, j) == false)  && (check_excluded_list(&topo_data, j, k) == false) ) {
-        	                       order_three_body_nonbonded_fm_matrix_element_calculation(this, topo_data.cg_site_types, n_cg_types, mat, x, simulation_box_half_lengths);
-            	               }
-            	        	}
-                        	l = three_body_cell_list.list[l];
-						}
-					}
-                    for (int nei_3 = 0; nei_3 < stencil_size; nei_3++) {
-                        int ll_3 = three_body_cell_list.stencil[stencil_size * kk + nei_3];
-                        l = three_body_cell_list.head[ll_3];
-                        while (l >= 0) {
-                            if ( (check_excluded_list(&topo_data, l, j) == false)  && (check_excluded_list(&topo_data, j, k) == false) ) {
-                                order_three_body_nonbonded_fm_matrix_element_calculation(this, topo_data.cg_site_types, n_cg_types, mat, x, simulation_box_half_lengths);
-                            }
-                            l = three_body_cell_list.list[l];
-                        }
-                    }
-                }
-                k = three_body_cell_list.list[k];
-            }
+        for (int c = three_body_cell_list.cell_start[kk]; c < three_body_cell_list.cell_start[kk + 1]; c++) {
+            j = three_body_cell_list.cell_sites[c];
+            build_center_neighbor_list(kk, c, topo_data, three_body_cell_list, simulation_box_half_lengths);
+            walk_center_neighbor_pairs(mat, n_cg_types, topo_data, x, simulation_box_half_lengths);
+        }
+    }
+}
+
+void ThreeBodyNonbondedClassComputer::build_center_neighbor_list(const int center_cell, const int center_slot, const TopologyData& topo_data, const ThreeBCellList& three_body_cell_list, const real* simulation_box_half_lengths)
+{
+    ThreeBodyNonbondedClassSpec* tb_spec = static_cast<ThreeBodyNonbondedClassSpec*>(ispec);
+    // Without per-type cutoffs (e.g. when range finding) every site in the neighboring cells is kept.
+    double max_cutoff2 = VERYLARGE * VERYLARGE;
+    if (tb_spec->center_type_cutoff2.size() > 0) max_cutoff2 = tb_spec->center_type_cutoff2[three_body_cell_list.sorted_types[center_slot] - 1];
+    const std::array<double, DIMENSION> &center_position = three_body_cell_list.sorted_x[center_slot];
+    
+    center_neighbors.clear();
+    center_neighbor_types.clear();
+    center_neighbor_rr2.clear();
+    center_neighbor_roles.clear();
+    
+    int stencil_size = three_body_cell_list.get_stencil_size();
+    for (int nei = -1; nei < stencil_size; nei++) {
+        int cell = (nei < 0) ? center_cell : three_body_cell_list.stencil[stencil_size * center_cell + nei];
+        for (int slot = three_body_cell_list.cell_start[cell]; slot < three_body_cell_list.cell_start[cell + 1]; slot++) {
+            int site = three_body_cell_list.cell_sites[slot];
+            if (site == j) continue;
+            double rr2 = calc_min_image_squared_distance(center_position, three_body_cell_list.sorted_x[slot], simulation_box_half_lengths);
+            if (rr2 > max_cutoff2) continue;
             
-            for (int nei = 0; nei < stencil_size; nei++) {
-                int ll = three_body_cell_list.stencil[stencil_size * kk + nei];
-                k = three_body_cell_list.head[ll];
-                while (k >= 0) {
-                    //three body
-                    l = three_body_cell_list.list[k];
-                    while (l >= 0) {
-                        if ( (check_excluded_list(&topo_data, l, j) == false)  && (check_excluded_list(&topo_data, j, k) == false) ) {
-                                order_three_body_nonbonded_fm_matrix_element_calculation(this, topo_data.cg_site_types, n_cg_types, mat, x, simulation_box_half_lengths);
-                        }
-                        l = three_body_cell_list.list[l];
-                    }
-                    for (int nei_3 = nei + 1; nei_3 < stencil_size; nei_3++) {
-                        int ll_3 = three_body_cell_list.stencil[stencil_size * kk + nei_3];
-                        l = three_body_cell_list.head[ll_3];
-                        while (l >= 0) {
-                            if ( (check_excluded_list(&topo_data, l, j) == false)  && (check_excluded_list(&topo_data, j, k) == false) ) {
-                                order_three_body_nonbonded_fm_matrix_element_calculation(this, topo_data.cg_site_types, n_cg_types, mat, x, simulation_box_half_lengths);
-                            }
-                            l = three_body_cell_list.list[l];
-                        }
-                    }
-                    k = three_body_cell_list.list[k];
-                }
+            char roles = 0;
+            if (check_excluded_list(&topo_data, j, site) == false) roles |= kThreeBodyEndK;
+            if (check_excluded_list(&topo_data, site, j) == false) roles |= kThreeBodyEndL;
+            if (roles == 0) continue;
+            
+            center_neighbors.push_back(site);
+            center_neighbor_types.push_back(three_body_cell_list.sorted_types[slot]);
+            center_neighbor_rr2.push_back(rr2);
+            center_neighbor_roles.push_back(roles);
+        }
+    }
+    
+    // A box that is decomposed along only some dimensions used to be a single cell, which lists the
+    // neighbors by increasing index. The kernels do not treat the end sites k and l symmetrically,
+    // so the neighbors are put back in that order to keep the orientation of each triplet.
+    if (three_body_cell_list.partially_decomposed) sort_center_neighbors_by_index();
+}
+
+// Insertion sort of the center's neighbors (and their types, distances, and roles) by site index.
+
+void ThreeBodyNonbondedClassComputer::sort_center_neighbors_by_index(void)
+{
+    int n_neighbors = center_neighbors.size();
+    for (int a = 1; a < n_neighbors; a++) {
+        int site = center_neighbors[a];
+        int type = center_neighbor_types[a];
+        double rr2 = center_neighbor_rr2[a];
+        char roles = center_neighbor_roles[a];
+        int b = a - 1;
+        while (b >= 0 && center_neighbors[b] > site) {
+            center_neighbors[b + 1] = center_neighbors[b];
+            center_neighbor_types[b + 1] = center_neighbor_types[b];
+            center_neighbor_rr2[b + 1] = center_neighbor_rr2[b];
+            center_neighbor_roles[b + 1] = center_neighbor_roles[b];
+            b--;
+        }
+        center_neighbors[b + 1] = site;
+        center_neighbor_types[b + 1] = type;
+        center_neighbor_rr2[b + 1] = rr2;
+        center_neighbor_roles[b + 1] = roles;
+    }
+}
+
+void ThreeBodyNonbondedClassComputer::walk_center_neighbor_pairs(MATRIX_DATA* const mat, const int n_cg_types, const TopologyData& topo_data, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths)
+{
+    ThreeBodyNonbondedClassSpec* tb_spec = static_cast<ThreeBodyNonbondedClassSpec*>(ispec);
+    bool check_cutoffs = (tb_spec->center_type_cutoff2.size() > 0);
+    int n_neighbors = center_neighbors.size();
+    int center_lookup_offset = (topo_data.cg_site_types[j] - 1) * n_cg_types;
+    
+    for (int a = 0; a < n_neighbors; a++) {
+        if ((center_neighbor_roles[a] & kThreeBodyEndK) == 0) continue;
+        k = center_neighbors[a];
+        for (int b = a + 1; b < n_neighbors; b++) {
+            if ((center_neighbor_roles[b] & kThreeBodyEndL) == 0) continue;
+            l = center_neighbors[b];
+            
+            if (tb_spec->type_lookup.size() > 0) {
+                set_indices_from_lookup(tb_spec->type_lookup[(center_lookup_offset + center_neighbor_types[a] - 1) * n_cg_types + center_neighbor_types[b] - 1]);
+                if (index_among_defined_intrxns == -1) continue; // if the index is -1, it is not present in the model and should be ignored.
+            } else {
+                index_among_defined_intrxns = tb_spec->get_index_from_hash(calculate_hash_number(topo_data.cg_site_types, n_cg_types));
+                if (index_among_defined_intrxns == -1) continue; // if the index is -1, it is not present in the model and should be ignored.
+                set_indices();
             }
-            j = three_body_cell_list.list[j];
+            if ((index_among_matched_interactions == 0) && (index_among_tabulated_interactions == 0)) continue; // if the index is zero, it is not present in the model and should be ignored.
+            
+            // Reject the triplet here if either end is beyond this interaction's cutoff, as the matrix element kernels would.
+            cutoff2 = tb_spec->three_body_nonbonded_cutoffs[index_among_defined_intrxns] * tb_spec->three_body_nonbonded_cutoffs[index_among_defined_intrxns];
+            if (check_cutoffs && (center_neighbor_rr2[a] > cutoff2 || center_neighbor_rr2[b] > cutoff2)) continue;
+            
+            stillinger_weber_angle_parameter = tb_spec->stillinger_weber_angle_parameters_by_type[index_among_defined_intrxns];
+            (*calculate_fm_matrix_elements)(this, x, simulation_box_half_lengths, mat);
         }
     }
 }
@@ -532,19 +1098,13 @@ inline void InteractionClassComputer::walk_3B_neighbor_list(MATRIX_DATA* const m
 inline bool check_excluded_list(const TopologyData* const topo_data, const int i, const int j)
 {
     // Check whether this non-bonded interaction is excluded from the model
-    for (unsigned k = 0; k < topo_data->exclusion_list->partner_numbers_[i]; k++) {
-        if (topo_data->exclusion_list->partners_[i][k] == unsigned(j)) return true;
-    }
-    return false;
+    return topo_data->exclusion_list->is_sorted_partner(unsigned(i), unsigned(j));
 }
 
 inline bool check_density_excluded_list(const TopologyData* const topo_data, const int i, const int j)
 {
-	// Check whetehr this non-bonded interaction is excluded from the model
-	for (unsigned k = 0; k < topo_data->density_exclusion_list->partner_numbers_[i]; k++) {
-        if (topo_data->density_exclusion_list->partners_[i][k] == unsigned(j)) return true;
-    }
-    return false;
+	// Check whether this non-bonded interaction is excluded from the model
+	return topo_data->density_exclusion_list->is_sorted_partner(unsigned(i), unsigned(j));
 }
 
 //--------------------------------------------------------------------
@@ -553,60 +1113,19 @@ inline bool check_density_excluded_list(const TopologyData* const topo_data, con
 // each frame and possibly found not to interact after.
 //--------------------------------------------------------------------
 
-void order_pair_nonbonded_fm_matrix_element_calculation(InteractionClassComputer* const info, calc_pair_matrix_elements calc_matrix_elements, int* const cg_site_types, const int n_cg_types, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths)
+void order_pair_nonbonded_fm_matrix_element_calculation(InteractionClassComputer* const info, calc_pair_matrix_elements calc_matrix_elements, const int type_k, const int type_l, const int n_cg_types, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths)
 {
     // Calculate the appropriate matrix elements.
-    info->index_among_defined_intrxns = info->ispec->get_index_from_hash(calc_two_body_interaction_hash(cg_site_types[info->k], cg_site_types[info->l], n_cg_types));
-    info->set_indices();
+    if (info->ispec->type_lookup.size() > 0) {
+        info->set_indices_from_lookup(info->ispec->type_lookup[(type_k - 1) * n_cg_types + type_l - 1]);
+    } else {
+        info->index_among_defined_intrxns = info->ispec->get_index_from_hash(calc_two_body_interaction_hash(type_k, type_l, n_cg_types));
+        info->set_indices();
+    }
 
     calc_matrix_elements(info, x, simulation_box_half_lengths, mat);
 }
 
-void order_bonded_fm_matrix_element_calculation(InteractionClassComputer* const info, int* const cg_site_types, const int n_cg_types, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths)
-{
-     // Calculate the appropriate matrix elements.    
-    info->index_among_defined_intrxns = info->ispec->get_index_from_hash(info->calculate_hash_number(cg_site_types, n_cg_types));
-    info->set_indices();
-
-    (*info->calculate_fm_matrix_elements)(info, x, simulation_box_half_lengths, mat);
-}
-
-void order_three_body_nonbonded_fm_matrix_element_calculation(InteractionClassComputer* const info, int* const cg_site_types, const int n_cg_types, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths)
-{
-    ThreeBodyNonbondedClassComputer* icomp = static_cast<ThreeBodyNonbondedClassComputer*>(info);
-    ThreeBodyNonbondedClassSpec* ispec = static_cast<ThreeBodyNonbondedClassSpec*>(icomp->ispec);
-    
-    // Calculate the appropriate matrix elements.
-    icomp->index_among_defined_intrxns = info->ispec->get_index_from_hash(icomp->calculate_hash_number(cg_site_types, n_cg_types));
-    if (icomp->index_among_defined_intrxns == -1) return; // if the index is -1, it is not present in the model and should be ignored.
-    
-    icomp->index_among_matched_interactions = ispec->defined_to_matched_intrxn_index_map[icomp->index_among_defined_intrxns];
-    icomp->index_among_tabulated_interactions = ispec->defined_to_tabulated_intrxn_index_map[icomp->index_among_defined_intrxns];
-    if ((icomp->index_among_matched_interactions == 0) && (icomp->index_among_tabulated_interactions == 0)) return; // if the index is zero, it is not present in the model and should be ignored.
-    
-    icomp->cutoff2 = ispec->three_body_nonbonded_cutoffs[icomp->index_among_defined_intrxns] * ispec->three_body_nonbonded_cutoffs[icomp->index_among_defined_intrxns];
-    icomp->stillinger_weber_angle_parameter = ispec->stillinger_weber_angle_parameters_by_type[icomp->index_among_defined_intrxns];
-    (*icomp->calculate_fm_matrix_elements)(icomp, x, simulation_box_half_lengths, mat); 
-}
-
-void density_fm_matrix_element_calculation(InteractionClassComputer* const info, calc_pair_matrix_elements calc_matrix_elements, int* const cg_site_types, const int n_cg_types, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths)
-{
-	DensityClassComputer* icomp = static_cast<DensityClassComputer*>(info);
-	DensityClassSpec* ispec = static_cast<DensityClassSpec*>(icomp->ispec);
-    
-	// Calculate the appropriate matrix elements.
-	// Get the bit flags for interactions encoded for this pair of types
-	unsigned long interaction_flags = ispec->site_to_density_group_intrxn_index_map[(cg_site_types[info->k] - 1) * n_cg_types + (cg_site_types[info->l] - 1)];
-	decode_density_interaction_and_calculate(icomp, interaction_flags, calc_matrix_elements, cg_site_types, mat, x, simulation_box_half_lengths);
-	
-	// Repeat this for the reversed pair of types.
-	swap_pair(info->k, info->l);
-	interaction_flags = ispec->site_to_density_group_intrxn_index_map[(cg_site_types[info->k] - 1) * n_cg_types + (cg_site_types[info->l] - 1)];
-	decode_density_interaction_and_calculate(icomp, interaction_flags, calc_matrix_elements, cg_site_types, mat, x, simulation_box_half_lengths);
-	//restore k and l
-	swap_pair(info->k, info->l);
-}
-
 //---------------------------------------------------------------------
 // Helper functions of functions in the above section.
 //---------------------------------------------------------------------
@@ -635,31 +1154,6 @@ void process_completed_density(DensityClassComputer* const info, calc_pair_matri
 	}
 }
 
-inline void decode_density_interaction_and_calculate(DensityClassComputer* info, unsigned long interaction_flags, calc_pair_matrix_elements calc_matrix_elements, int *const cg_site_types, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths)
-{
-	DensityClassSpec* ispec = static_cast<DensityClassSpec*>(info->ispec);
-	// Loop through to determine which bits are non-zero.
-	// For each non-zero bit, look-up the matched or tabulated interaction, and perform the requested calculation
-	for(int index_counter = 0; interaction_flags != 0; index_counter++) {
-		// This could easily be a while loop over interaction_flags with a manaully incremented counter.
-		if(interaction_flags % 2 == 1) {
-			// Look-up this index
-			info->index_among_defined_intrxns = index_counter;
-			info->set_indices();			
-			std::vector<int>types = ispec->get_interaction_types(info->index_among_defined_intrxns);
-			int group_type_index = (types[1] - 1) * ispec->n_cg_types + (cg_site_types[info->k] - 1);
-			info->curr_weight = ispec->density_weights[group_type_index];
-			
-			// Check that info->k is part of DG2
-			if(ispec->density_groups[group_type_index] == true) {
-				(*calc_matrix_elements)(info, x, simulation_box_half_lengths, mat);
-			}
-		}
-		// Shift to the right and repeat the operation
-		interaction_flags = interaction_flags >> 1;
-	}
-}
-
 void accumulate_matching_order_parameter_forces(InteractionClassComputer* const info, const int first_nonzero_basis_index, double extra_derivative_value, std::vector<double> &basis_fn_vals, const int n_body, const int* particle_ids, std::array<double, DIMENSION>* const &derivatives, MATRIX_DATA * const mat) 
 {
 	for (unsigned k = 0; k < basis_fn_vals.size(); k++) {
@@ -675,59 +1169,86 @@ void accumulate_matching_order_parameter_forces(InteractionClassComputer* const
 
 inline void process_normal_interaction_matrix_elements(InteractionClassComputer* const info, MATRIX_DATA* const mat, const int n_body, int* particle_ids, std::array<double, DIMENSION>* derivatives, const double param_value, const int virial_flag, const double junk = 0.0, const double junk2 = 0.0)
 {
-	int index_among_defined = info->index_among_defined_intrxns;
-	int index_among_matched = info->index_among_matched_interactions;
-    int index_among_tabulated = info->index_among_tabulated_interactions;
-    int first_nonzero_basis_index;
-    int temp_column_index;
-    double basis_sum;
-    
-    if (index_among_tabulated > 0) {
-		// Pull the interaction from a table. 	   
-    	info->table_s_comp->calculate_basis_fn_vals(index_among_defined, param_value, first_nonzero_basis_index, info->table_basis_fn_vals);
-    	basis_sum  = info->table_basis_fn_vals[0] + info->table_basis_fn_vals[1];
-    	
-    	// Add to force target.
-		mat->accumulate_tabulated_forces(info, basis_sum, n_body, particle_ids, derivatives, mat);
-    	
-    	// Add to target virial if virial_flag is non-zero.
-    	switch (virial_flag) {
-    		case 1:
-	    	    if (mat->virial_constraint_rows > 0) mat->accumulate_target_constraint_element(mat, info->trajectory_block_frame_index, -basis_sum * param_value);
-        		break;
-        	
-        	case 0: default:
-    			// These interactions do not contribute to the scalar virial.
-    			// Such interactions include angles and dihedrals.
-        		break;
-    	}
+    if (info->index_among_tabulated_interactions > 0) {
+		process_tabulated_interaction_matrix_elements(info, mat, n_body, particle_ids, derivatives, param_value, virial_flag);
 	}
 
-    if (index_among_matched > 0) {
+    if (info->index_among_matched_interactions > 0) {
 	    // Compute the strength of each basis function.
-	    info->fm_s_comp->calculate_basis_fn_vals(index_among_defined, param_value, first_nonzero_basis_index, info->fm_basis_fn_vals);
-    	
-    	// Add to the force matching.       
-    	mat->accumulate_matching_forces(info, first_nonzero_basis_index, info->fm_basis_fn_vals, n_body, particle_ids, derivatives, mat);
- 			
-    	// Add to virial matching if virial_flag is non-zero.
-    	switch (virial_flag) {
-    		case 1:
-	    	    temp_column_index = info->interaction_class_column_index + info->ispec->interaction_column_indices[index_among_matched - 1] + first_nonzero_basis_index;
-	    		for (unsigned i = 0; i < info->fm_basis_fn_vals.size(); i++) {
-        			int basis_column = temp_column_index + i;
-        			if (mat->virial_constraint_rows > 0)(*mat->accumulate_virial_constraint_matrix_element)(info->trajectory_block_frame_index, basis_column, info->fm_basis_fn_vals[i] * param_value, mat);
-        		}
-        		break;
-        	
-        	case 0: default:
-    			// These interactions do not contribute to the scalar virial.
-    			// Such interactions include angles and dihedrals.
-        		break;
-    	}
+	    int first_nonzero_basis_index;
+	    info->fm_s_comp->calculate_basis_fn_vals(info->index_among_defined_intrxns, param_value, first_nonzero_basis_index, info->fm_basis_fn_vals);
+	    process_matched_interaction_matrix_elements(info, mat, first_nonzero_basis_index, n_body, particle_ids, derivatives, param_value, virial_flag);
 	}    
 }
 
+// Tabulated contributions go straight to the force target, which keeps the target's
+// accumulation order; force-matched interactions wait for a batched basis evaluation.
+
+void queue_normal_interaction_matrix_elements(InteractionClassComputer* const info, MATRIX_DATA* const mat, const int n_body, int* particle_ids, std::array<double, DIMENSION>* derivatives, const double param_value, const int virial_flag, const double junk, const double junk2)
+{
+    if (info->index_among_tabulated_interactions > 0) {
+		process_tabulated_interaction_matrix_elements(info, mat, n_body, particle_ids, derivatives, param_value, virial_flag);
+	}
+
+    if (info->index_among_matched_interactions > 0) {
+    	PendingBasisInteractions &pending = info->pending_interactions[info->index_among_defined_intrxns];
+    	pending.push_back(n_body, particle_ids, derivatives, param_value, virial_flag);
+    	if (pending.size() >= BASIS_BATCH_SIZE) info->flush_pending_interactions(mat, info->index_among_defined_intrxns);
+    }
+}
+
+inline void process_tabulated_interaction_matrix_elements(InteractionClassComputer* const info, MATRIX_DATA* const mat, const int n_body, int* particle_ids, std::array<double, DIMENSION>* derivatives, const double param_value, const int virial_flag)
+{
+    int first_nonzero_basis_index;
+    double basis_sum;
+    
+	// Pull the interaction from a table. 	   
+    info->table_s_comp->calculate_basis_fn_vals(info->index_among_defined_intrxns, param_value, first_nonzero_basis_index, info->table_basis_fn_vals);
+    basis_sum  = info->table_basis_fn_vals[0] + info->table_basis_fn_vals[1];
+    
+    // Add to force target.
+	mat->accumulate_tabulated_forces(info, basis_sum, n_body, particle_ids, derivatives, mat);
+    
+    // Add to target virial if virial_flag is non-zero.
+    switch (virial_flag) {
+    	case 1:
+	        if (mat->virial_constraint_rows > 0) mat->accumulate_target_constraint_element(mat, info->trajectory_block_frame_index, -basis_sum * param_value);
+        	break;
+        
+        case 0: default:
+    		// These interactions do not contribute to the scalar virial.
+    		// Such interactions include angles and dihedrals.
+        	break;
+    }
+}
+
+// Accumulate the matrix elements of a force-matched interaction whose basis function
+// values are already in info->fm_basis_fn_vals.
+
+inline void process_matched_interaction_matrix_elements(InteractionClassComputer* const info, MATRIX_DATA* const mat, const int first_nonzero_basis_index, const int n_body, const int* particle_ids, std::array<double, DIMENSION>* derivatives, const double param_value, const int virial_flag)
+{
+    int temp_column_index;
+    
+    // Add to the force matching.       
+    mat->accumulate_matching_forces(info, first_nonzero_basis_index, info->fm_basis_fn_vals, n_body, particle_ids, derivatives, mat);
+ 		
+    // Add to virial matching if virial_flag is non-zero.
+    switch (virial_flag) {
+    	case 1:
+	        temp_column_index = info->interaction_class_column_index + info->ispec->interaction_column_indices[info->index_among_matched_interactions - 1] + first_nonzero_basis_index;
+	    	for (unsigned i = 0; i < info->fm_basis_fn_vals.size(); i++) {
+        		int basis_column = temp_column_index + i;
+        		if (mat->virial_constraint_rows > 0)(*mat->accumulate_virial_constraint_matrix_element)(info->trajectory_block_frame_index, basis_column, info->fm_basis_fn_vals[i] * param_value, mat);
+        	}
+        	break;
+        
+        case 0: default:
+    		// These interactions do not contribute to the scalar virial.
+    		// Such interactions include angles and dihedrals.
+        	break;
+    }
+}
+
 inline void process_density_matrix_elements(InteractionClassComputer* const info, MATRIX_DATA* const mat, const int n_body, int* particle_ids, std::array<double, DIMENSION>* derivatives, const double density_value, const int virial_flag, const double density_derivative, const double distance)
 {
     int index_among_defined = info->index_among_defined_intrxns;
@@ -771,59 +1292,52 @@ inline void process_density_matrix_elements(InteractionClassComputer* const info
 void calc_isotropic_two_body_fm_matrix_elements(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
 {
     int particle_ids[2] = {info->k, info->l};
-    std::array<double, DIMENSION>* derivatives = new std::array<double, DIMENSION>[1];
+    std::array<double, DIMENSION> derivatives[1];
 	double distance;
 	if ( conditionally_calc_distance_and_derivatives(particle_ids, x, simulation_box_half_lengths, info->cutoff2, distance, derivatives) ) {
-        int index_among_defined = info->index_among_defined_intrxns;
-    	if (distance < info->ispec->lower_cutoffs[index_among_defined] ||
-        	distance > info->ispec->upper_cutoffs[index_among_defined]) {
-        	delete [] derivatives;
-        	return;
-        }
-    	info->process_interaction_matrix_elements(info, mat, 2, particle_ids, derivatives, distance, 1, 0.0 , 0.0);
+		process_one_param_interaction(info, mat, 2, particle_ids, derivatives, distance);
     }
-    delete [] derivatives;
 }
 
 void calc_angular_three_body_fm_matrix_elements(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
 {
     int particle_ids[3] = {info->k, info->l, info->j}; // end indices (k, l), followed by center index (j)
-    std::array<double, DIMENSION>* derivatives = new std::array<double, DIMENSION>[2];
-    int index_among_defined = info->index_among_defined_intrxns;
+    std::array<double, DIMENSION> derivatives[2];
     double angle;
 
     if ( conditionally_calc_angle_and_derivatives(particle_ids, x, simulation_box_half_lengths, info->cutoff2, angle, derivatives) ) {
-        if (angle < info->ispec->lower_cutoffs[index_among_defined] ||
-        	angle > info->ispec->upper_cutoffs[index_among_defined]) {
-        	delete [] derivatives;
-        	return;
-        }
-        info->process_interaction_matrix_elements(info, mat, 3, particle_ids, derivatives, angle, 0, 0.0, 0.0);
+        process_one_param_interaction(info, mat, 3, particle_ids, derivatives, angle);
     }
-    delete [] derivatives;
 }
 
 void calc_dihedral_four_body_fm_matrix_elements(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
 {
     int particle_ids[4] = {info->k, info->l, info->i, info->j}; // end indices (k, l) followed by central bond indices (i, j)
-    std::array<double, DIMENSION>* derivatives = new std::array<double, DIMENSION>[3];
-    int index_among_defined = info->index_among_defined_intrxns;
+    std::array<double, DIMENSION> derivatives[3];
     double dihedral;
 	
 	if ( conditionally_calc_dihedral_and_derivatives(particle_ids, x, simulation_box_half_lengths, info->cutoff2, dihedral, derivatives) ) {
-    	if (info->ispec->class_subtype == 0 && 
-    		dihedral < info->ispec->lower_cutoffs[index_among_defined] &&
-    		info->ispec->defined_to_periodic_intrxn_index_map[index_among_defined] == 2) {
-        		dihedral += 360.0;
-        }
-    	if ( dihedral < info->ispec->lower_cutoffs[index_among_defined] ||
-        	 dihedral > info->ispec->upper_cutoffs[index_among_defined] ) {
-        	delete [] derivatives;
-        	return;
-        } 
-		info->process_interaction_matrix_elements(info, mat, 4, particle_ids, derivatives, dihedral, 0, 0.0, 0.0);
+		process_one_param_interaction(info, mat, 4, particle_ids, derivatives, dihedral);
+    }
+}
+
+// Shared tail of the above once the geometry is known: dihedrals are wrapped onto the
+// periodic range, values outside the interaction's range are dropped, and only
+// distances contribute to the virial.
+
+inline void process_one_param_interaction(InteractionClassComputer* const info, MATRIX_DATA* const mat, const int n_body, int* particle_ids, std::array<double, DIMENSION>* derivatives, double param_value)
+{
+    int index_among_defined = info->index_among_defined_intrxns;
+    if (n_body == 4 && info->ispec->class_subtype == 0 && 
+    	param_value < info->ispec->lower_cutoffs[index_among_defined] &&
+    	info->ispec->defined_to_periodic_intrxn_index_map[index_among_defined] == 2) {
+        	param_value += 360.0;
     }
-	delete [] derivatives;
+    if (param_value < info->ispec->lower_cutoffs[index_among_defined] ||
+    	param_value > info->ispec->upper_cutoffs[index_among_defined]) {
+    	return;
+    }
+    info->process_interaction_matrix_elements(info, mat, n_body, particle_ids, derivatives, param_value, (n_body == 2) ? 1 : 0, 0.0, 0.0);
 }
 
 void calc_nonbonded_1_three_body_fm_matrix_elements(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
@@ -832,9 +1346,9 @@ void calc_nonbonded_1_three_body_fm_matrix_elements(InteractionClassComputer* co
     ThreeBodyNonbondedClassComputer* icomp = static_cast<ThreeBodyNonbondedClassComputer*>(info);
     ThreeBodyNonbondedClassSpec* ispec = static_cast<ThreeBodyNonbondedClassSpec*>(icomp->ispec);
 
-	std::array<double, DIMENSION>* relative_site_position_2 = new std::array<double, DIMENSION>[1];
-	std::array<double, DIMENSION>* relative_site_position_3 = new std::array<double, DIMENSION>[1];
-	std::array<double, DIMENSION>* derivatives = new std::array<double, DIMENSION>[2];
+	std::array<double, DIMENSION> relative_site_position_2[1];
+	std::array<double, DIMENSION> relative_site_position_3[1];
+	std::array<double, DIMENSION> derivatives[2];
 	std::array<double, DIMENSION> tx1, tx2, tx;
 	double theta, rr1, rr2;
     double angle_prefactor, dr1_prefactor, dr2_prefactor;
@@ -842,9 +1356,6 @@ void calc_nonbonded_1_three_body_fm_matrix_elements(InteractionClassComputer* co
 	
 	bool within_cutoff = conditionally_calc_sw_angle_and_intermediates(particle_ids, x, simulation_box_half_lengths, ispec->three_body_nonbonded_cutoffs[icomp->index_among_defined_intrxns], ispec->three_body_gamma, relative_site_position_2, relative_site_position_3, derivatives, theta, rr1, rr2, angle_prefactor, dr1_prefactor, dr2_prefactor);
 	if (!within_cutoff) {
-		delete [] relative_site_position_2;
-		delete [] relative_site_position_3;
-		delete [] derivatives;
 		return;
     }
 
@@ -852,7 +1363,7 @@ void calc_nonbonded_1_three_body_fm_matrix_elements(InteractionClassComputer* co
   
     // Calculate the matrix elements if it's supposed to be force matched
     info->fm_s_comp->calculate_basis_fn_vals(info->index_among_defined_intrxns, info->intrxn_param, info->basis_function_column_index, info->fm_basis_fn_vals); 
-    std::vector<double> basis_der_vals(info->fm_s_comp->get_n_coef());
+    std::vector<double> &basis_der_vals = icomp->fm_basis_deriv_vals;
     BSplineAndDerivComputer *fm_s_comp = static_cast<BSplineAndDerivComputer*>(icomp->fm_s_comp);
     fm_s_comp->calculate_bspline_deriv_vals(info->index_among_defined_intrxns, info->intrxn_param, info->basis_function_column_index, basis_der_vals); 
     
@@ -874,9 +1385,6 @@ void calc_nonbonded_1_three_body_fm_matrix_elements(InteractionClassComputer* co
         (*mat->accumulate_fm_matrix_element)(temp_row_index_2, this_column, &tx2[0], mat);
         (*mat->accumulate_fm_matrix_element)(temp_row_index_3, this_column, &tx[0], mat);
     }
-    delete [] relative_site_position_2;
-	delete [] relative_site_position_3;
-    delete [] derivatives;
 }
 
 void calc_nonbonded_2_three_body_fm_matrix_elements(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
@@ -885,9 +1393,9 @@ void calc_nonbonded_2_three_body_fm_matrix_elements(InteractionClassComputer* co
     ThreeBodyNonbondedClassComputer* icomp = static_cast<ThreeBodyNonbondedClassComputer*>(info);
     ThreeBodyNonbondedClassSpec* ispec = static_cast<ThreeBodyNonbondedClassSpec*>(icomp->ispec);
     
-	std::array<double, DIMENSION>* relative_site_position_2 = new std::array<double, DIMENSION>[1];
-	std::array<double, DIMENSION>* relative_site_position_3 = new std::array<double, DIMENSION>[1];
-	std::array<double, DIMENSION>* derivatives = new std::array<double, DIMENSION>[2];
+	std::array<double, DIMENSION> relative_site_position_2[1];
+	std::array<double, DIMENSION> relative_site_position_3[1];
+	std::array<double, DIMENSION> derivatives[2];
 	std::array<double, DIMENSION> tx1, tx2, tx;
     double theta, rr1, rr2;
     double cos_theta;
@@ -896,9 +1404,6 @@ void calc_nonbonded_2_three_body_fm_matrix_elements(InteractionClassComputer* co
     
     bool within_cutoff = conditionally_calc_sw_angle_and_intermediates(particle_ids, x, simulation_box_half_lengths, ispec->three_body_nonbonded_cutoffs[icomp->index_among_defined_intrxns], ispec->three_body_gamma, relative_site_position_2, relative_site_position_3, derivatives, theta, rr1, rr2, angle_prefactor, dr1_prefactor, dr2_prefactor);
 	if (!within_cutoff) {
-		delete [] relative_site_position_2;
-		delete [] relative_site_position_3;
-		delete [] derivatives;
 		return;
     }
 
@@ -923,124 +1428,64 @@ void calc_nonbonded_2_three_body_fm_matrix_elements(InteractionClassComputer* co
     (*mat->accumulate_fm_matrix_element)(temp_row_index_1, temp_column_index, &tx1[0], mat);
     (*mat->accumulate_fm_matrix_element)(temp_row_index_2, temp_column_index, &tx2[0], mat);
     (*mat->accumulate_fm_matrix_element)(temp_row_index_3, temp_column_index, &tx[0], mat); 
-    
-    delete [] relative_site_position_2;
-	delete [] relative_site_position_3;   
-	delete [] derivatives;
 }
 
-void calc_gaussian_density_values(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
+double calc_gaussian_density_weight(DensityClassComputer* const icomp, DensityClassSpec* const ispec, const double distance2)
 {
-	DensityClassComputer* icomp = static_cast<DensityClassComputer*>(info);
-	DensityClassSpec* ispec = static_cast<DensityClassSpec*>(icomp->ispec);
-	int particle_ids[2] = {icomp->k, icomp->l};
 	int index_among_defined = icomp->index_among_defined_intrxns;
-    double distance2;
-    
-	//Calculate the distance
-	calc_squared_distance(particle_ids, x, simulation_box_half_lengths, distance2);
-	if (distance2 < icomp->cutoff2) {
-		// Calculate the weight function
-		double distance = sqrt(distance2);
-		icomp->density_values[icomp->index_among_defined_intrxns * ispec->n_cg_sites + icomp->k] +=
-										icomp->curr_weight * ( exp( - distance2 / icomp->denomenator[index_among_defined]) + icomp->u_cutoff[index_among_defined]
-										+ icomp->f_cutoff[index_among_defined] * (distance - ispec->cutoff) ) / icomp->denomenator[index_among_defined];
-	}
+	double distance = sqrt(distance2);
+	return icomp->curr_weight * ( exp( - distance2 / icomp->denomenator[index_among_defined]) + icomp->u_cutoff[index_among_defined]
+								+ icomp->f_cutoff[index_among_defined] * (distance - ispec->cutoff) ) / icomp->denomenator[index_among_defined];
 }
 
-void calc_switching_density_values(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
+double calc_switching_density_weight(DensityClassComputer* const icomp, DensityClassSpec* const ispec, const double distance2)
 {
-	DensityClassComputer* icomp = static_cast<DensityClassComputer*>(info);
-	DensityClassSpec* ispec = static_cast<DensityClassSpec*>(icomp->ispec);
-	int particle_ids[2] = {icomp->k, icomp->l};
-    int index_among_defined = icomp->index_among_defined_intrxns;
-    double distance2;
-    
-	//Calculate the distance
-	calc_squared_distance(particle_ids, x, simulation_box_half_lengths, distance2);
-	
-	if (distance2 < icomp->cutoff2) {
-	
-		// Calculate the weight function
-		double distance = sqrt(distance2);
-		icomp->density_values[icomp->index_among_defined_intrxns * ispec->n_cg_sites  + icomp->k] +=
-										icomp->curr_weight * -0.5 * tanh( (distance - ispec->density_switch[index_among_defined])/ispec->density_sigma[index_among_defined] )
-										+ icomp->u_cutoff[index_among_defined] + icomp->f_cutoff[index_among_defined] * (distance - ispec->cutoff);
-	}
+	int index_among_defined = icomp->index_among_defined_intrxns;
+	double distance = sqrt(distance2);
+	return icomp->curr_weight * -0.5 * tanh( (distance - ispec->density_switch[index_among_defined])/ispec->density_sigma[index_among_defined] )
+								+ icomp->u_cutoff[index_among_defined] + icomp->f_cutoff[index_among_defined] * (distance - ispec->cutoff);
 }
 
-void calc_lucy_density_values(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
+double calc_lucy_density_weight(DensityClassComputer* const icomp, DensityClassSpec* const ispec, const double distance2)
 {
-	DensityClassComputer* icomp = static_cast<DensityClassComputer*>(info);
-	DensityClassSpec* ispec = static_cast<DensityClassSpec*>(icomp->ispec);
-	int particle_ids[2] = {icomp->k, icomp->l};
-    int index_among_defined = icomp->index_among_defined_intrxns;
-    double distance2;
-    
-	//Calculate the distance
-	calc_squared_distance(particle_ids, x, simulation_box_half_lengths, distance2);
-	
-	if (distance2 < icomp->cutoff2) {
-	
-		// Calculate the weight function
-		double distance = sqrt(distance2);
-		double cutoff_minus_distance = ispec->cutoff - distance;
-		icomp->density_values[icomp->index_among_defined_intrxns * ispec->n_cg_sites + icomp->k] +=
-										icomp->curr_weight * cutoff_minus_distance * cutoff_minus_distance * cutoff_minus_distance 
-										* (ispec->cutoff + 3.0*distance) / icomp->denomenator[index_among_defined];
-	}
+	int index_among_defined = icomp->index_among_defined_intrxns;
+	double distance = sqrt(distance2);
+	double cutoff_minus_distance = ispec->cutoff - distance;
+	return icomp->curr_weight * cutoff_minus_distance * cutoff_minus_distance * cutoff_minus_distance 
+								* (ispec->cutoff + 3.0*distance) / icomp->denomenator[index_among_defined];
 }
 
-void calc_re_density_values(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
+double calc_re_density_weight(DensityClassComputer* const icomp, DensityClassSpec* const ispec, const double distance2)
 {
-	DensityClassComputer* icomp = static_cast<DensityClassComputer*>(info);
-	DensityClassSpec* ispec = static_cast<DensityClassSpec*>(icomp->ispec);
-	int particle_ids[2] = {icomp->k, icomp->l};
-    int index_among_defined = icomp->index_among_defined_intrxns;
-    double distance2;
-    
-	//Calculate the distance
-	calc_squared_distance(particle_ids, x, simulation_box_half_lengths, distance2);
-	
-	if (distance2 < icomp->cutoff2) {
-	
-		// Calculate the weight function
-		if (distance2 > ispec->density_sigma[index_among_defined] * ispec->density_sigma[index_among_defined]) {
-			icomp->density_values[icomp->index_among_defined_intrxns * ispec->n_cg_sites + icomp->k] +=
-										icomp->curr_weight * (icomp->c0[index_among_defined] +
-										distance2 * icomp->c2[index_among_defined] - 
-										distance2 * distance2 * icomp->c4[index_among_defined] +
-										distance2 * distance2 * distance2 * icomp->c6[index_among_defined]);
-		} else {
-			icomp->density_values[icomp->index_among_defined_intrxns * ispec->n_cg_sites + icomp->k] += 1.0 * icomp->curr_weight;
-		}
+	int index_among_defined = icomp->index_among_defined_intrxns;
+	if (distance2 > ispec->density_sigma[index_among_defined] * ispec->density_sigma[index_among_defined]) {
+		return icomp->curr_weight * (icomp->c0[index_among_defined] +
+								distance2 * icomp->c2[index_among_defined] - 
+								distance2 * distance2 * icomp->c4[index_among_defined] +
+								distance2 * distance2 * distance2 * icomp->c6[index_among_defined]);
+	} else {
+		return 1.0 * icomp->curr_weight;
 	}
 }
 
+// Calculate the matrix elements of the current cached density interaction,
+// using the geometry and weight function derivative cached when the densities were accumulated.
+
 void calc_density_fm_matrix_elements(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
 {
 	info->index_among_matched_interactions = info->ispec->defined_to_matched_intrxn_index_map[info->index_among_defined_intrxns];
 	info->index_among_tabulated_interactions = info->ispec->defined_to_tabulated_intrxn_index_map[info->index_among_defined_intrxns];
 	if ((info->index_among_matched_interactions == 0) && (info->index_among_tabulated_interactions == 0)) return; // if the index is zero, it is not present in the model and should be ignored.
 	
-	double distance;
+	DensityClassComputer* icomp = static_cast<DensityClassComputer*>(info);
+	DensityClassSpec* ispec = static_cast<DensityClassSpec*>(icomp->ispec);
     int particle_ids[2] = {info->k, info->l};
-    std::array<double, DIMENSION>* derivatives = new std::array<double, DIMENSION>[1];
-    if ( conditionally_calc_distance_and_derivatives(particle_ids, x, simulation_box_half_lengths, info->cutoff2, distance, derivatives) ) {
-            
-        DensityClassComputer* icomp = static_cast<DensityClassComputer*>(info);
-		DensityClassSpec* ispec = static_cast<DensityClassSpec*>(icomp->ispec);
+    std::array<double, DIMENSION> derivatives[1] = {icomp->curr_derivatives[0]};
 	
-		// Look-up this particular interaction's density.
-		double density_value = icomp->density_values[info->index_among_defined_intrxns * ispec->n_cg_sites + info->k];
-		
-		// Calculate the weight function derivative.
-		double density_derivative = (*icomp->calculate_density_derivative)(icomp, ispec, distance);
-		density_derivative *= icomp->curr_weight;
-		
-		info->process_interaction_matrix_elements(info, mat, 2, particle_ids, derivatives, density_value, 1, density_derivative, distance);
-    }	
-    delete [] derivatives;
+	// Look-up this particular interaction's density.
+	double density_value = icomp->density_values[info->index_among_defined_intrxns * ispec->n_cg_sites + info->k];
+	
+	info->process_interaction_matrix_elements(info, mat, 2, particle_ids, derivatives, density_value, 1, icomp->curr_density_derivative, icomp->curr_distance);
 }
 
 double calc_gaussian_density_derivative(DensityClassComputer* const icomp, DensityClassSpec* const ispec, const double distance)
@@ -1077,6 +1522,18 @@ double calc_re_density_derivative(DensityClassComputer* const icomp, DensityClas
 	return density_derivative;
 }
 
+double calc_tabulated_density_weight(DensityClassComputer* const icomp, DensityClassSpec* const ispec, const double distance2)
+{
+	const CubicHermiteTable& table = icomp->weight_tables[icomp->index_among_defined_intrxns];
+	double distance = sqrt(distance2);
+	return icomp->curr_weight * table.eval(distance, 0) + table.eval(distance, 1);
+}
+
+double calc_tabulated_density_derivative(DensityClassComputer* const icomp, DensityClassSpec* const ispec, const double distance)
+{
+	return icomp->weight_tables[icomp->index_among_defined_intrxns].eval(distance, 2);
+}
+
 void do_nothing(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat) 
 {
 }
@@ -9,22 +9,45 @@
 #define _force_computation_h
 
 #include <array>
+#include <cstdio>
+#include <list>
 
 #include "trajectory_input.h"
 #include "interaction_model.h"
 
 struct MATRIX_DATA;
 
+// A private set of interaction computers for one thread, so that several frames
+// can be processed at once. The interaction specifications are shared with cg.
+
+struct ThreadLocalComputers {
+    PairNonbondedClassComputer pair_nonbonded_computer;
+    PairBondedClassComputer pair_bonded_computer;
+    AngularClassComputer angular_computer;
+    DihedralClassComputer dihedral_computer;
+    ThreeBodyNonbondedClassComputer three_body_nonbonded_computer;
+	DensityClassComputer density_computer;
+	
+	std::list<InteractionClassComputer*> icomp_list;
+
+	ThreadLocalComputers(CG_MODEL_DATA* const cg);
+	~ThreadLocalComputers();
+};
+
 // Initialization routines to start the FM matrix calculation
 void set_up_force_computers(CG_MODEL_DATA* const cg);
+// Report the accuracy of tabulated density weight functions, if used, in sol_info.out
+void write_density_weight_table_info(CG_MODEL_DATA* const cg, FILE* const solution_file);
 
 // Main routine calling all other matrix element calculation routines
-void calculate_frame_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, FrameConfig* const frame_config, PairCellList pair_cell_list, ThreeBCellList three_body_cell_list, int trajectory_block_frame_index);
-
-// Functions for calculating density values
-void calc_gaussian_density_values(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
-void calc_switching_density_values(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
-void calc_lucy_density_values(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
-void calc_re_density_values(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
+void calculate_frame_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, FrameConfig* const frame_config, PairCellList &pair_cell_list, ThreeBCellList &three_body_cell_list, int trajectory_block_frame_index);
+// As above, but using a thread's own interaction computers
+void calculate_frame_fm_matrix(CG_MODEL_DATA* const cg, ThreadLocalComputers* const computers, MATRIX_DATA* const mat, FrameConfig* const frame_config, PairCellList &pair_cell_list, ThreeBCellList &three_body_cell_list, int trajectory_block_frame_index);
+
+// Functions for calculating density weight functions
+double calc_gaussian_density_weight(DensityClassComputer* const icomp, DensityClassSpec* const ispec, const double distance2);
+double calc_switching_density_weight(DensityClassComputer* const icomp, DensityClassSpec* const ispec, const double distance2);
+double calc_lucy_density_weight(DensityClassComputer* const icomp, DensityClassSpec* const ispec, const double distance2);
+double calc_re_density_weight(DensityClassComputer* const icomp, DensityClassSpec* const ispec, const double distance2);
 
 #endif
@@ -7,11 +7,18 @@
 
 #include <cmath>
 #include "geometry.h"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 #ifndef MAXFLOAT
 #define MAXFLOAT 1.0E10
 #endif
 
+// Number of interactions the batched geometry routines work on together
+// (a multiple of the four doubles in an AVX2 register).
+const int GEOMETRY_BATCH_BLOCK = 16;
+
 // Function prototypes for internal functions.
 void subtract_min_image_vectors(const int* particle_ids, const std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, std::array<double, DIMENSION> &displacement);
 void subtract_min_image_particles(const std::array<double, DIMENSION> &particle_position1, const std::array<double, DIMENSION> &particle_position2, const real *simulation_box_half_lengths, std::array<double, DIMENSION> &displacement);
@@ -20,6 +27,15 @@ double dot_product(const std::array<double, DIMENSION> &a, const std::array<doub
 double dot_product(const double* a, const double* b);
 inline void check_sine(double &s);
 inline void check_cos(double &cos_theta);
+inline double min_image_component(const double displacement, const double half_length);
+inline double clamped_cos(const double cos_theta);
+inline double polynomial_acos(const double x);
+inline void gather_block_displacements(const int n_block, const int* ids_0, const int* ids_1, const std::array<double, DIMENSION>* const &particle_positions, double displacements[][GEOMETRY_BATCH_BLOCK]);
+inline void calc_block_distances(const real *simulation_box_half_lengths, double disp[][GEOMETRY_BATCH_BLOCK], double* rr2, double* rr, double unit_disp[][GEOMETRY_BATCH_BLOCK]);
+inline void calc_block_angle_cosines(const real *simulation_box_half_lengths, double dist_derivs_20[][GEOMETRY_BATCH_BLOCK], double dist_derivs_21[][GEOMETRY_BATCH_BLOCK], double* rr2_20, double* rr2_21, double* rr_20, double* rr_21, double* cos_theta);
+inline void calc_block_angle_derivatives(const double dist_derivs_20[][GEOMETRY_BATCH_BLOCK], const double dist_derivs_21[][GEOMETRY_BATCH_BLOCK], const double* rr_20, const double* rr_21, const double* cos_theta, double derivs_0[][GEOMETRY_BATCH_BLOCK], double derivs_1[][GEOMETRY_BATCH_BLOCK]);
+inline void calc_block_angles(const double* cos_theta, double* theta);
+inline void calc_block_dihedrals(const real *simulation_box_half_lengths, const double disp03[][GEOMETRY_BATCH_BLOCK], const double disp23[][GEOMETRY_BATCH_BLOCK], const double disp12[][GEOMETRY_BATCH_BLOCK], double* theta, double derivs_0[][GEOMETRY_BATCH_BLOCK], double derivs_1[][GEOMETRY_BATCH_BLOCK], double derivs_2[][GEOMETRY_BATCH_BLOCK]);
 
 //------------------------------------------------------------
 // Small helper functions used internally.
@@ -80,7 +96,7 @@ double dot_product(const double* a, const double* b)
 
 // Calculate a squared distance and one derivative.
 
-bool conditionally_calc_squared_distance_and_derivatives(const int* particle_ids, const std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, double &param_val, std::array<double, DIMENSION>* &derivatives)
+bool conditionally_calc_squared_distance_and_derivatives(const int* particle_ids, const std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, double &param_val, std::array<double, DIMENSION>* const &derivatives)
 {
     double rr2 = 0.0;
     std::array<double, DIMENSION> displacement;
@@ -101,7 +117,7 @@ bool conditionally_calc_squared_distance_and_derivatives(const int* particle_ids
 
 // Calculate a distance and one derivative.
 
-bool conditionally_calc_distance_and_derivatives(const int* particle_ids, const std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, double &param_val, std::array<double, DIMENSION>* &derivatives)
+bool conditionally_calc_distance_and_derivatives(const int* particle_ids, const std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, double &param_val, std::array<double, DIMENSION>* const &derivatives)
 {
     bool within_cutoff = conditionally_calc_squared_distance_and_derivatives(particle_ids, particle_positions, simulation_box_half_lengths, cutoff2, param_val, derivatives);
 
@@ -118,10 +134,10 @@ bool conditionally_calc_distance_and_derivatives(const int* particle_ids, const
 
 // Calculate the angle between three particles and its derivatives.
 
-bool conditionally_calc_angle_and_derivatives(const int* particle_ids, const std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, double &param_val, std::array<double, DIMENSION>* &derivatives)
+bool conditionally_calc_angle_and_derivatives(const int* particle_ids, const std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, double &param_val, std::array<double, DIMENSION>* const &derivatives)
 {   
-    std::array<double, DIMENSION>* dist_derivs_20 = new std::array<double, DIMENSION>[1];
-    std::array<double, DIMENSION>* dist_derivs_21 = new std::array<double, DIMENSION>[1];
+    std::array<double, DIMENSION> dist_derivs_20[1];
+    std::array<double, DIMENSION> dist_derivs_21[1];
     int particle_ids_20[2] = {particle_ids[2], particle_ids[0]};
     int particle_ids_21[2] = {particle_ids[2], particle_ids[1]};
     double rr2_20, rr2_21;
@@ -129,8 +145,6 @@ bool conditionally_calc_angle_and_derivatives(const int* particle_ids, const std
     bool within_cutoff_21 = conditionally_calc_squared_distance_and_derivatives(particle_ids_21, particle_positions, simulation_box_half_lengths, cutoff2, rr2_21, dist_derivs_21);
     
     if (!within_cutoff_20 || !within_cutoff_21) {
-    	delete [] dist_derivs_20;
-    	delete [] dist_derivs_21;
         return false;
     } else {
         // Calculate the cosine
@@ -140,11 +154,11 @@ bool conditionally_calc_angle_and_derivatives(const int* particle_ids, const std
 		check_cos(cos_theta);
         
         // Calculate the angle.
-        double theta = acos(cos_theta);
+        double theta = polynomial_acos(cos_theta);
         param_val = theta * DEGREES_PER_RADIAN;
 
         // Calculate the derivatives.
-        double sin_theta = sin(theta);
+        double sin_theta = sqrt((1.0 - cos_theta) * (1.0 + cos_theta));
         double rr_01_1 = 1.0 / (rr_20 * rr_21 * sin_theta);
         double rr_00c = cos_theta / (rr_20 * rr_20 * sin_theta);
         double rr_11c = cos_theta / (rr_21 * rr_21 * sin_theta);
@@ -154,15 +168,13 @@ bool conditionally_calc_angle_and_derivatives(const int* particle_ids, const std
         	derivatives[0][i] = 0.5 * DEGREES_PER_RADIAN * (dist_derivs_21[0][i] * rr_01_1 - rr_00c * dist_derivs_20[0][i]);
             derivatives[1][i] = 0.5 * DEGREES_PER_RADIAN * (dist_derivs_20[0][i] * rr_01_1 - rr_11c * dist_derivs_21[0][i]);
         }
-        delete [] dist_derivs_20;
-    	delete [] dist_derivs_21;
         return true;
     }
 }
 
 // Calculate a the cosine of an angle along with its derivatives.
 
-bool conditionally_calc_angle_and_intermediates(const int* particle_ids, std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, std::array<double, DIMENSION>* &dist_derivs_20, std::array<double, DIMENSION>* &dist_derivs_21, std::array<double, DIMENSION>* &derivatives, double &param_val, double &rr_20, double &rr_21)
+bool conditionally_calc_angle_and_intermediates(const int* particle_ids, std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, std::array<double, DIMENSION>* const &dist_derivs_20, std::array<double, DIMENSION>* const &dist_derivs_21, std::array<double, DIMENSION>* const &derivatives, double &param_val, double &rr_20, double &rr_21)
 {
     int particle_ids_20[2] = {particle_ids[2], particle_ids[0]};
     int particle_ids_21[2] = {particle_ids[2], particle_ids[1]};
@@ -180,11 +192,11 @@ bool conditionally_calc_angle_and_intermediates(const int* particle_ids, std::ar
         check_cos(cos_theta);
         
         // Calculate the angle.
-        double theta = acos(cos_theta);
+        double theta = polynomial_acos(cos_theta);
         param_val = theta * DEGREES_PER_RADIAN;
 
         // Calculate the derivatives.
-        double sin_theta = sin(theta);
+        double sin_theta = sqrt((1.0 - cos_theta) * (1.0 + cos_theta));
         double rr_01_1 = 1.0 / (rr_20 * rr_21 * sin_theta);
         double rr_00c = cos_theta / (rr_20 * rr_20 * sin_theta);
         double rr_11c = cos_theta / (rr_21 * rr_21 * sin_theta);
@@ -199,7 +211,7 @@ bool conditionally_calc_angle_and_intermediates(const int* particle_ids, std::ar
 
 // Calculate a terms for Stillinger-Weber interactions.
 
-bool conditionally_calc_sw_angle_and_intermediates(const int* particle_ids, std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff, const double gamma, std::array<double, DIMENSION>* &dist_derivs_01, std::array<double, DIMENSION>* &dist_derivs_02, std::array<double, DIMENSION>* &derivatives, double &param_val, double &rr1, double &rr2, double &angle_prefactor, double &dr1_prefactor, double &dr2_prefactor)
+bool conditionally_calc_sw_angle_and_intermediates(const int* particle_ids, std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff, const double gamma, std::array<double, DIMENSION>* const &dist_derivs_01, std::array<double, DIMENSION>* const &dist_derivs_02, std::array<double, DIMENSION>* const &derivatives, double &param_val, double &rr1, double &rr2, double &angle_prefactor, double &dr1_prefactor, double &dr2_prefactor)
 {	
 	bool within_cutoff = conditionally_calc_angle_and_intermediates(particle_ids, particle_positions, simulation_box_half_lengths, cutoff*cutoff, dist_derivs_01, dist_derivs_02, derivatives, param_val, rr1, rr2);
 	if(within_cutoff == false) {
@@ -224,7 +236,7 @@ bool conditionally_calc_sw_angle_and_intermediates(const int* particle_ids, std:
 // Calculate a dihedral angle and its derivatives.
 // Thanks to Andrew Jewett (jewett.aij  g m ail) for inspiration from LAMMPS dihedral_table.cpp
 
-bool conditionally_calc_dihedral_and_derivatives(const int* particle_ids, const std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, double &param_val, std::array<double, DIMENSION>* &derivatives)
+bool conditionally_calc_dihedral_and_derivatives(const int* particle_ids, const std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, double &param_val, std::array<double, DIMENSION>* const &derivatives)
 {
     // Find the relevant displacements for defining the angle.
     std::array<double, DIMENSION> disp03, disp23, disp12;
@@ -252,7 +264,7 @@ bool conditionally_calc_dihedral_and_derivatives(const int* particle_ids, const
     double pbpc = dot_product(pb, pc);
     double cos_theta = pbpc * rpb1 * rpc1;
     check_cos(cos_theta);
-    double theta = acos(cos_theta) * DEGREES_PER_RADIAN;
+    double theta = polynomial_acos(cos_theta) * DEGREES_PER_RADIAN;
     
 	// This variable is only used to determine the sign of the angle
 	double sign = - dot_product( pb, disp12) * rpb1 * rrbc; // This is the s calculation that LAMMPS used.
@@ -280,6 +292,91 @@ bool conditionally_calc_dihedral_and_derivatives(const int* particle_ids, const
     return true;
 }
 
+//------------------------------------------------------------
+// Batched forms of the routines above. Each block of interactions
+// is gathered into one array per coordinate so that every step
+// runs over the whole block; the minimum image, the cosine clamp
+// and the dihedral sign are selects rather than branches. Lanes
+// past the end of a short block repeat its first interaction and
+// are not written out. The distance, angle and dihedral arithmetic,
+// including the arccosine (see polynomial_acos), has AVX2 forms,
+// used when built with AVX2 (e.g. -mavx2); they do the same
+// operations in the same order as the portable loops, so the
+// results match the single-interaction routines bit for bit
+// either way.
+//------------------------------------------------------------
+
+void conditionally_calc_distance_and_derivatives_batch(const int n_vals, const int* ids_0, const int* ids_1, const std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, int* within_cutoff, double* param_vals, std::array<double, DIMENSION>* const &derivatives)
+{
+    double disp[DIMENSION][GEOMETRY_BATCH_BLOCK], unit_disp[DIMENSION][GEOMETRY_BATCH_BLOCK];
+    double rr2[GEOMETRY_BATCH_BLOCK], rr[GEOMETRY_BATCH_BLOCK];
+    for (int start = 0; start < n_vals; start += GEOMETRY_BATCH_BLOCK) {
+        int n_block = (n_vals - start < GEOMETRY_BATCH_BLOCK) ? n_vals - start : GEOMETRY_BATCH_BLOCK;
+        gather_block_displacements(n_block, ids_0 + start, ids_1 + start, particle_positions, disp);
+        calc_block_distances(simulation_box_half_lengths, disp, rr2, rr, unit_disp);
+        for (int e = 0; e < n_block; e++) {
+            within_cutoff[start + e] = (rr2[e] <= cutoff2);
+            param_vals[start + e] = rr[e];
+            for (int i = 0; i < DIMENSION; i++) derivatives[start + e][i] = unit_disp[i][e];
+        }
+    }
+}
+
+void conditionally_calc_angle_and_derivatives_batch(const int n_vals, const int* ids_0, const int* ids_1, const int* ids_2, const std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, int* within_cutoff, double* param_vals, std::array<double, DIMENSION>* const &derivatives)
+{
+    double dist_derivs_20[DIMENSION][GEOMETRY_BATCH_BLOCK], dist_derivs_21[DIMENSION][GEOMETRY_BATCH_BLOCK];
+    double derivs_0[DIMENSION][GEOMETRY_BATCH_BLOCK], derivs_1[DIMENSION][GEOMETRY_BATCH_BLOCK];
+    double rr2_20[GEOMETRY_BATCH_BLOCK], rr2_21[GEOMETRY_BATCH_BLOCK], rr_20[GEOMETRY_BATCH_BLOCK], rr_21[GEOMETRY_BATCH_BLOCK];
+    double cos_theta[GEOMETRY_BATCH_BLOCK], theta[GEOMETRY_BATCH_BLOCK];
+    for (int start = 0; start < n_vals; start += GEOMETRY_BATCH_BLOCK) {
+        int n_block = (n_vals - start < GEOMETRY_BATCH_BLOCK) ? n_vals - start : GEOMETRY_BATCH_BLOCK;
+        gather_block_displacements(n_block, ids_2 + start, ids_0 + start, particle_positions, dist_derivs_20);
+        gather_block_displacements(n_block, ids_2 + start, ids_1 + start, particle_positions, dist_derivs_21);
+        calc_block_angle_cosines(simulation_box_half_lengths, dist_derivs_20, dist_derivs_21, rr2_20, rr2_21, rr_20, rr_21, cos_theta);
+        
+        // Calculate the angles.
+        calc_block_angles(cos_theta, theta);
+        for (int e = 0; e < n_block; e++) {
+            within_cutoff[start + e] = (rr2_20[e] <= cutoff2) && (rr2_21[e] <= cutoff2);
+            param_vals[start + e] = theta[e];
+        }
+        
+        // Calculate the derivatives.
+        calc_block_angle_derivatives(dist_derivs_20, dist_derivs_21, rr_20, rr_21, cos_theta, derivs_0, derivs_1);
+        for (int e = 0; e < n_block; e++) {
+            for (int i = 0; i < DIMENSION; i++) {
+                derivatives[2 * (start + e)][i] = derivs_0[i][e];
+                derivatives[2 * (start + e) + 1][i] = derivs_1[i][e];
+            }
+        }
+    }
+}
+
+// Dihedrals are always within the cutoff, as in the single-interaction form.
+
+void conditionally_calc_dihedral_and_derivatives_batch(const int n_vals, const int* ids_0, const int* ids_1, const int* ids_2, const int* ids_3, const std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, int* within_cutoff, double* param_vals, std::array<double, DIMENSION>* const &derivatives)
+{
+    double disp03[DIMENSION][GEOMETRY_BATCH_BLOCK], disp23[DIMENSION][GEOMETRY_BATCH_BLOCK], disp12[DIMENSION][GEOMETRY_BATCH_BLOCK];
+    double derivs_0[DIMENSION][GEOMETRY_BATCH_BLOCK], derivs_1[DIMENSION][GEOMETRY_BATCH_BLOCK], derivs_2[DIMENSION][GEOMETRY_BATCH_BLOCK];
+    double theta[GEOMETRY_BATCH_BLOCK];
+    for (int start = 0; start < n_vals; start += GEOMETRY_BATCH_BLOCK) {
+        int n_block = (n_vals - start < GEOMETRY_BATCH_BLOCK) ? n_vals - start : GEOMETRY_BATCH_BLOCK;
+        gather_block_displacements(n_block, ids_3 + start, ids_0 + start, particle_positions, disp03);
+        gather_block_displacements(n_block, ids_3 + start, ids_2 + start, particle_positions, disp23);
+        gather_block_displacements(n_block, ids_2 + start, ids_1 + start, particle_positions, disp12);
+        calc_block_dihedrals(simulation_box_half_lengths, disp03, disp23, disp12, theta, derivs_0, derivs_1, derivs_2);
+        for (int e = 0; e < n_block; e++) {
+            param_vals[start + e] = theta[e];
+            within_cutoff[start + e] = 1;
+            for (int i = 0; i < DIMENSION; i++) {
+                derivatives[3 * (start + e)][i] = derivs_0[i][e];
+                derivatives[3 * (start + e) + 1][i] = derivs_1[i][e];
+                derivatives[3 * (start + e) + 2][i] = derivs_2[i][e];
+            }
+        }
+    }
+}
+
 //------------------------------------------------------------
 // Without derivatives.
 //------------------------------------------------------------
@@ -309,8 +406,8 @@ void calc_distance(const int* particle_ids, std::array<double, DIMENSION>* const
 
 void calc_angle(const int* particle_ids, const std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, double &param_val)
 {   
-    std::array<double, DIMENSION>* dist_derivs_20 = new std::array<double, DIMENSION>[1];
-    std::array<double, DIMENSION>* dist_derivs_21 = new std::array<double, DIMENSION>[1];
+    std::array<double, DIMENSION> dist_derivs_20[1];
+    std::array<double, DIMENSION> dist_derivs_21[1];
     int particle_ids_20[2] = {particle_ids[2], particle_ids[0]};
     int particle_ids_21[2] = {particle_ids[2], particle_ids[1]};
     double rr2_20, rr2_21;
@@ -324,11 +421,8 @@ void calc_angle(const int* particle_ids, const std::array<double, DIMENSION>* co
     check_cos(cos_theta);
     
     // Calculate the angle.
-    double theta = acos(cos_theta);
+    double theta = polynomial_acos(cos_theta);
     param_val = theta * DEGREES_PER_RADIAN;
-
-    delete [] dist_derivs_20;
-    delete [] dist_derivs_21;
 }
 
 // Calculate a dihedral angle.
@@ -362,7 +456,7 @@ void calc_dihedral(const int* particle_ids, const std::array<double, DIMENSION>*
     double pbpc = dot_product(pb, pc);
     double cos_theta = pbpc * rpb1 * rpc1;
     check_cos(cos_theta);
-    double theta = acos(cos_theta) * DEGREES_PER_RADIAN;
+    double theta = polynomial_acos(cos_theta) * DEGREES_PER_RADIAN;
     
 	// This variable is only used to determine the sign of the angle
 	double sign = - dot_product( pb, disp12) * rpb1 * rrbc; // This is the s calculation that LAMMPS used.
@@ -385,4 +479,344 @@ inline void check_cos(double &cos_theta)
         double min = -1.0 + VERYSMALL_F;
         if (cos_theta > max) cos_theta = max;
         else if (cos_theta < min) cos_theta = min;
-}
\ No newline at end of file
+}
+
+// Minimum image displacement component, as in subtract_min_image_vectors.
+inline double min_image_component(const double displacement, const double half_length)
+{
+    double shift = (displacement > half_length) ? -2.0 * half_length : ((displacement < -half_length) ? 2.0 * half_length : 0.0);
+    return displacement + shift;
+}
+
+// Cosine clamped as in check_cos.
+inline double clamped_cos(const double cos_theta)
+{
+    double max = 1.0 - VERYSMALL_F;
+    double min = -1.0 + VERYSMALL_F;
+    return (cos_theta > max) ? max : ((cos_theta < min) ? min : cos_theta);
+}
+
+// Arccosine from the Cephes rational approximation of the arcsine,
+// written without branches so that it can be taken four at a time
+// (see polynomial_acos_4) with the same result. Arguments above 0.5
+// in magnitude go through asin(t) with t = sqrt((1 - |x|) / 2).
+// Within 1 ulp of the C library's acos on [-1, 1].
+const double ACOS_P[6] = {4.253011369004428248960E-3, -6.019598008014123785661E-1, 5.444622390564711410273E0, -1.626247967210700244449E1, 1.956261983317594739197E1, -8.198089802484824371615E0};
+const double ACOS_Q[5] = {-1.474091372988853791896E1, 7.049610280856842141659E1, -1.471791292232726029859E2, 1.395105614657485689735E2, -4.918853881490881290097E1};
+const double ACOS_PI_HI = 3.141592653589793116;
+const double ACOS_PI_LO = 1.2246467991473532e-16;
+const double ACOS_PIO2_HI = 1.5707963267948966192;
+const double ACOS_PIO2_LO = 6.123233995736766e-17;
+
+inline double polynomial_acos(const double x)
+{
+    double a = fabs(x);
+    double t = (a > 0.5) ? sqrt(0.5 - 0.5 * a) : a;
+    double z = t * t;
+    double p = ((((ACOS_P[0] * z + ACOS_P[1]) * z + ACOS_P[2]) * z + ACOS_P[3]) * z + ACOS_P[4]) * z + ACOS_P[5];
+    double q = ((((z + ACOS_Q[0]) * z + ACOS_Q[1]) * z + ACOS_Q[2]) * z + ACOS_Q[3]) * z + ACOS_Q[4];
+    double asin_t = t + t * (z * p / q);
+    if (a > 0.5) return (x > 0.0) ? 2.0 * asin_t : ACOS_PI_HI - (2.0 * asin_t - ACOS_PI_LO);
+    return ACOS_PIO2_HI - (((x < 0.0) ? -asin_t : asin_t) - ACOS_PIO2_LO);
+}
+
+// Displacements from particles ids_0 to particles ids_1 for a block,
+// before the minimum image is taken. Lanes past n_block repeat lane 0.
+inline void gather_block_displacements(const int n_block, const int* ids_0, const int* ids_1, const std::array<double, DIMENSION>* const &particle_positions, double displacements[][GEOMETRY_BATCH_BLOCK])
+{
+    for (int e = 0; e < GEOMETRY_BATCH_BLOCK; e++) {
+        int n = (e < n_block) ? e : 0;
+        for (int i = 0; i < DIMENSION; i++) {
+            displacements[i][e] = particle_positions[ids_1[n]][i] - particle_positions[ids_0[n]][i];
+        }
+    }
+}
+
+#if defined(__AVX2__)
+// Four lanes of min_image_component.
+inline __m256d min_image_components(const __m256d displacement, const double half_length)
+{
+    __m256d shift = _mm256_blendv_pd(_mm256_setzero_pd(), _mm256_set1_pd(2.0 * half_length), _mm256_cmp_pd(displacement, _mm256_set1_pd(-half_length), _CMP_LT_OQ));
+    shift = _mm256_blendv_pd(shift, _mm256_set1_pd(-2.0 * half_length), _mm256_cmp_pd(displacement, _mm256_set1_pd(half_length), _CMP_GT_OQ));
+    return _mm256_add_pd(displacement, shift);
+}
+
+// Take the minimum image of a block of displacements, then find their
+// squared lengths, lengths, and the unit vectors along them.
+inline void calc_block_distances(const real *simulation_box_half_lengths, double disp[][GEOMETRY_BATCH_BLOCK], double* rr2, double* rr, double unit_disp[][GEOMETRY_BATCH_BLOCK])
+{
+    for (int e = 0; e < GEOMETRY_BATCH_BLOCK; e += 4) {
+        __m256d d[DIMENSION];
+        __m256d sum = _mm256_setzero_pd();
+        for (int i = 0; i < DIMENSION; i++) {
+            d[i] = min_image_components(_mm256_loadu_pd(&disp[i][e]), simulation_box_half_lengths[i]);
+            sum = _mm256_add_pd(sum, _mm256_mul_pd(d[i], d[i]));
+        }
+        __m256d r = _mm256_sqrt_pd(sum);
+        _mm256_storeu_pd(rr2 + e, sum);
+        _mm256_storeu_pd(rr + e, r);
+        for (int i = 0; i < DIMENSION; i++) {
+            __m256d derivative = _mm256_mul_pd(_mm256_set1_pd(0.5), _mm256_mul_pd(_mm256_set1_pd(2.0), d[i]));
+            _mm256_storeu_pd(&unit_disp[i][e], _mm256_div_pd(derivative, r));
+        }
+    }
+}
+
+// Take the minimum image of the center-to-end displacements of a block of
+// angles, replace them by their distance derivatives (twice the
+// displacements), and find the squared lengths, lengths, and clamped cosines.
+inline void calc_block_angle_cosines(const real *simulation_box_half_lengths, double dist_derivs_20[][GEOMETRY_BATCH_BLOCK], double dist_derivs_21[][GEOMETRY_BATCH_BLOCK], double* rr2_20, double* rr2_21, double* rr_20, double* rr_21, double* cos_theta)
+{
+    __m256d two = _mm256_set1_pd(2.0);
+    for (int e = 0; e < GEOMETRY_BATCH_BLOCK; e += 4) {
+        __m256d d20[DIMENSION], d21[DIMENSION];
+        __m256d sum_20 = _mm256_setzero_pd();
+        __m256d sum_21 = _mm256_setzero_pd();
+        for (int i = 0; i < DIMENSION; i++) {
+            __m256d disp_20 = min_image_components(_mm256_loadu_pd(&dist_derivs_20[i][e]), simulation_box_half_lengths[i]);
+            __m256d disp_21 = min_image_components(_mm256_loadu_pd(&dist_derivs_21[i][e]), simulation_box_half_lengths[i]);
+            sum_20 = _mm256_add_pd(sum_20, _mm256_mul_pd(disp_20, disp_20));
+            sum_21 = _mm256_add_pd(sum_21, _mm256_mul_pd(disp_21, disp_21));
+            d20[i] = _mm256_mul_pd(two, disp_20);
+            d21[i] = _mm256_mul_pd(two, disp_21);
+            _mm256_storeu_pd(&dist_derivs_20[i][e], d20[i]);
+            _mm256_storeu_pd(&dist_derivs_21[i][e], d21[i]);
+        }
+        __m256d r_20 = _mm256_sqrt_pd(sum_20);
+        __m256d r_21 = _mm256_sqrt_pd(sum_21);
+        __m256d dot = _mm256_setzero_pd();
+        for (int i = 0; i < DIMENSION; i++) dot = _mm256_add_pd(dot, _mm256_mul_pd(d20[i], d21[i]));
+        __m256d cosine = _mm256_div_pd(dot, _mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(4.0), r_20), r_21));
+        cosine = _mm256_blendv_pd(cosine, _mm256_set1_pd(1.0 - VERYSMALL_F), _mm256_cmp_pd(cosine, _mm256_set1_pd(1.0 - VERYSMALL_F), _CMP_GT_OQ));
+        cosine = _mm256_blendv_pd(cosine, _mm256_set1_pd(-1.0 + VERYSMALL_F), _mm256_cmp_pd(cosine, _mm256_set1_pd(-1.0 + VERYSMALL_F), _CMP_LT_OQ));
+        _mm256_storeu_pd(rr2_20 + e, sum_20);
+        _mm256_storeu_pd(rr2_21 + e, sum_21);
+        _mm256_storeu_pd(rr_20 + e, r_20);
+        _mm256_storeu_pd(rr_21 + e, r_21);
+        _mm256_storeu_pd(cos_theta + e, cosine);
+    }
+}
+
+// Angle derivatives for the two end sites of a block of angles.
+inline void calc_block_angle_derivatives(const double dist_derivs_20[][GEOMETRY_BATCH_BLOCK], const double dist_derivs_21[][GEOMETRY_BATCH_BLOCK], const double* rr_20, const double* rr_21, const double* cos_theta, double derivs_0[][GEOMETRY_BATCH_BLOCK], double derivs_1[][GEOMETRY_BATCH_BLOCK])
+{
+    __m256d one = _mm256_set1_pd(1.0);
+    __m256d prefactor = _mm256_set1_pd(0.5 * DEGREES_PER_RADIAN);
+    for (int e = 0; e < GEOMETRY_BATCH_BLOCK; e += 4) {
+        __m256d cosine = _mm256_loadu_pd(cos_theta + e);
+        __m256d r_20 = _mm256_loadu_pd(rr_20 + e);
+        __m256d r_21 = _mm256_loadu_pd(rr_21 + e);
+        __m256d sin_theta = _mm256_sqrt_pd(_mm256_mul_pd(_mm256_sub_pd(one, cosine), _mm256_add_pd(one, cosine)));
+        __m256d rr_01_1 = _mm256_div_pd(one, _mm256_mul_pd(_mm256_mul_pd(r_20, r_21), sin_theta));
+        __m256d rr_00c = _mm256_div_pd(cosine, _mm256_mul_pd(_mm256_mul_pd(r_20, r_20), sin_theta));
+        __m256d rr_11c = _mm256_div_pd(cosine, _mm256_mul_pd(_mm256_mul_pd(r_21, r_21), sin_theta));
+        for (int i = 0; i < DIMENSION; i++) {
+            __m256d d20 = _mm256_loadu_pd(&dist_derivs_20[i][e]);
+            __m256d d21 = _mm256_loadu_pd(&dist_derivs_21[i][e]);
+            _mm256_storeu_pd(&derivs_0[i][e], _mm256_mul_pd(prefactor, _mm256_sub_pd(_mm256_mul_pd(d21, rr_01_1), _mm256_mul_pd(rr_00c, d20))));
+            _mm256_storeu_pd(&derivs_1[i][e], _mm256_mul_pd(prefactor, _mm256_sub_pd(_mm256_mul_pd(d20, rr_01_1), _mm256_mul_pd(rr_11c, d21))));
+        }
+    }
+}
+
+// Four lanes of polynomial_acos.
+inline __m256d polynomial_acos_4(const __m256d x)
+{
+    __m256d sign_bit = _mm256_set1_pd(-0.0);
+    __m256d half = _mm256_set1_pd(0.5);
+    __m256d a = _mm256_andnot_pd(sign_bit, x);
+    __m256d big = _mm256_cmp_pd(a, half, _CMP_GT_OQ);
+    __m256d t = _mm256_blendv_pd(a, _mm256_sqrt_pd(_mm256_sub_pd(half, _mm256_mul_pd(half, a))), big);
+    __m256d z = _mm256_mul_pd(t, t);
+    __m256d p = _mm256_set1_pd(ACOS_P[0]);
+    for (int k = 1; k < 6; k++) p = _mm256_add_pd(_mm256_mul_pd(p, z), _mm256_set1_pd(ACOS_P[k]));
+    __m256d q = _mm256_add_pd(z, _mm256_set1_pd(ACOS_Q[0]));
+    for (int k = 1; k < 5; k++) q = _mm256_add_pd(_mm256_mul_pd(q, z), _mm256_set1_pd(ACOS_Q[k]));
+    __m256d asin_t = _mm256_add_pd(t, _mm256_mul_pd(t, _mm256_div_pd(_mm256_mul_pd(z, p), q)));
+    
+    __m256d two_asin_t = _mm256_mul_pd(_mm256_set1_pd(2.0), asin_t);
+    __m256d big_value = _mm256_blendv_pd(_mm256_sub_pd(_mm256_set1_pd(ACOS_PI_HI), _mm256_sub_pd(two_asin_t, _mm256_set1_pd(ACOS_PI_LO))), two_asin_t, _mm256_cmp_pd(x, _mm256_setzero_pd(), _CMP_GT_OQ));
+    __m256d signed_asin_t = _mm256_blendv_pd(asin_t, _mm256_xor_pd(sign_bit, asin_t), _mm256_cmp_pd(x, _mm256_setzero_pd(), _CMP_LT_OQ));
+    __m256d small_value = _mm256_sub_pd(_mm256_set1_pd(ACOS_PIO2_HI), _mm256_sub_pd(signed_asin_t, _mm256_set1_pd(ACOS_PIO2_LO)));
+    return _mm256_blendv_pd(small_value, big_value, big);
+}
+
+// Angles in degrees from a block of cosines.
+inline void calc_block_angles(const double* cos_theta, double* theta)
+{
+    for (int e = 0; e < GEOMETRY_BATCH_BLOCK; e += 4) {
+        _mm256_storeu_pd(theta + e, _mm256_mul_pd(polynomial_acos_4(_mm256_loadu_pd(cos_theta + e)), _mm256_set1_pd(DEGREES_PER_RADIAN)));
+    }
+}
+
+// Signed dihedral angles in degrees and their derivatives for a block of
+// dihedrals, from displacements before the minimum image is taken.
+inline void calc_block_dihedrals(const real *simulation_box_half_lengths, const double disp03[][GEOMETRY_BATCH_BLOCK], const double disp23[][GEOMETRY_BATCH_BLOCK], const double disp12[][GEOMETRY_BATCH_BLOCK], double* theta, double derivs_0[][GEOMETRY_BATCH_BLOCK], double derivs_1[][GEOMETRY_BATCH_BLOCK], double derivs_2[][GEOMETRY_BATCH_BLOCK])
+{
+    __m256d one = _mm256_set1_pd(1.0);
+    __m256d sign_bit = _mm256_set1_pd(-0.0);
+    for (int e = 0; e < GEOMETRY_BATCH_BLOCK; e += 4) {
+        __m256d d03[3], d23[3], d12[3];
+        for (int i = 0; i < 3; i++) {
+            d03[i] = min_image_components(_mm256_loadu_pd(&disp03[i][e]), simulation_box_half_lengths[i]);
+            d23[i] = min_image_components(_mm256_loadu_pd(&disp23[i][e]), simulation_box_half_lengths[i]);
+            d12[i] = min_image_components(_mm256_loadu_pd(&disp12[i][e]), simulation_box_half_lengths[i]);
+        }
+        
+        // Normals to the planes of the first three and last three sites.
+        __m256d pb[3], pc[3];
+        for (int i = 0; i < 3; i++) {
+            int j = (i + 1) % 3;
+            int k = (i + 2) % 3;
+            pb[i] = _mm256_sub_pd(_mm256_mul_pd(d03[j], d23[k]), _mm256_mul_pd(d03[k], d23[j]));
+            pc[i] = _mm256_sub_pd(_mm256_mul_pd(d12[j], d23[k]), _mm256_mul_pd(d12[k], d23[j]));
+        }
+        __m256d pb2 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(pb[0], pb[0]), _mm256_mul_pd(pb[1], pb[1])), _mm256_mul_pd(pb[2], pb[2]));
+        __m256d pc2 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(pc[0], pc[0]), _mm256_mul_pd(pc[1], pc[1])), _mm256_mul_pd(pc[2], pc[2]));
+        __m256d pbpc = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(pb[0], pc[0]), _mm256_mul_pd(pb[1], pc[1])), _mm256_mul_pd(pb[2], pc[2]));
+        __m256d rpb1 = _mm256_div_pd(one, _mm256_sqrt_pd(pb2));
+        __m256d rpc1 = _mm256_div_pd(one, _mm256_sqrt_pd(pc2));
+        __m256d cosine = _mm256_mul_pd(_mm256_mul_pd(pbpc, rpb1), rpc1);
+        cosine = _mm256_blendv_pd(cosine, _mm256_set1_pd(1.0 - VERYSMALL_F), _mm256_cmp_pd(cosine, _mm256_set1_pd(1.0 - VERYSMALL_F), _CMP_GT_OQ));
+        cosine = _mm256_blendv_pd(cosine, _mm256_set1_pd(-1.0 + VERYSMALL_F), _mm256_cmp_pd(cosine, _mm256_set1_pd(-1.0 + VERYSMALL_F), _CMP_LT_OQ));
+        __m256d angle = _mm256_mul_pd(polynomial_acos_4(cosine), _mm256_set1_pd(DEGREES_PER_RADIAN));
+        
+        // The sign of the angle follows LAMMPS, as in the single-interaction form.
+        __m256d r23_2 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(d23[0], d23[0]), _mm256_mul_pd(d23[1], d23[1])), _mm256_mul_pd(d23[2], d23[2]));
+        __m256d rrbc = _mm256_div_pd(one, _mm256_sqrt_pd(r23_2));
+        __m256d pb_12 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(pb[0], d12[0]), _mm256_mul_pd(pb[1], d12[1])), _mm256_mul_pd(pb[2], d12[2]));
+        __m256d sign = _mm256_mul_pd(_mm256_mul_pd(_mm256_xor_pd(sign_bit, pb_12), rpb1), rrbc);
+        angle = _mm256_blendv_pd(angle, _mm256_xor_pd(sign_bit, angle), _mm256_cmp_pd(sign, _mm256_setzero_pd(), _CMP_LT_OQ));
+        _mm256_storeu_pd(theta + e, angle);
+        
+        __m256d dot03_23 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(d03[0], d23[0]), _mm256_mul_pd(d03[1], d23[1])), _mm256_mul_pd(d03[2], d23[2]));
+        __m256d dot12_23 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(d12[0], d23[0]), _mm256_mul_pd(d12[1], d23[1])), _mm256_mul_pd(d12[2], d23[2]));
+        __m256d fcoef = _mm256_div_pd(dot03_23, r23_2);
+        __m256d hcoef = _mm256_add_pd(one, _mm256_div_pd(dot12_23, r23_2));
+        __m256d rrbc_pb2 = _mm256_mul_pd(rrbc, pb2);
+        __m256d rrbc_pc2 = _mm256_mul_pd(rrbc, pc2);
+        for (int i = 0; i < 3; i++) {
+            __m256d dtf = _mm256_div_pd(pb[i], rrbc_pb2);
+            __m256d dth = _mm256_div_pd(_mm256_xor_pd(sign_bit, pc[i]), rrbc_pc2);
+            _mm256_storeu_pd(&derivs_0[i][e], _mm256_xor_pd(sign_bit, dtf));
+            _mm256_storeu_pd(&derivs_1[i][e], _mm256_xor_pd(sign_bit, dth));
+            _mm256_storeu_pd(&derivs_2[i][e], _mm256_add_pd(_mm256_mul_pd(dtf, fcoef), _mm256_mul_pd(dth, hcoef)));
+        }
+    }
+}
+#else
+inline void calc_block_distances(const real *simulation_box_half_lengths, double disp[][GEOMETRY_BATCH_BLOCK], double* rr2, double* rr, double unit_disp[][GEOMETRY_BATCH_BLOCK])
+{
+    for (int e = 0; e < GEOMETRY_BATCH_BLOCK; e++) rr2[e] = 0.0;
+    for (int i = 0; i < DIMENSION; i++) {
+        for (int e = 0; e < GEOMETRY_BATCH_BLOCK; e++) {
+            disp[i][e] = min_image_component(disp[i][e], simulation_box_half_lengths[i]);
+            rr2[e] += disp[i][e] * disp[i][e];
+        }
+    }
+    for (int e = 0; e < GEOMETRY_BATCH_BLOCK; e++) rr[e] = sqrt(rr2[e]);
+    for (int i = 0; i < DIMENSION; i++) {
+        for (int e = 0; e < GEOMETRY_BATCH_BLOCK; e++) unit_disp[i][e] = 0.5 * (2.0 * disp[i][e]) / rr[e];
+    }
+}
+
+inline void calc_block_angle_cosines(const real *simulation_box_half_lengths, double dist_derivs_20[][GEOMETRY_BATCH_BLOCK], double dist_derivs_21[][GEOMETRY_BATCH_BLOCK], double* rr2_20, double* rr2_21, double* rr_20, double* rr_21, double* cos_theta)
+{
+    for (int e = 0; e < GEOMETRY_BATCH_BLOCK; e++) {
+        rr2_20[e] = 0.0;
+        rr2_21[e] = 0.0;
+        cos_theta[e] = 0.0;
+    }
+    for (int i = 0; i < DIMENSION; i++) {
+        for (int e = 0; e < GEOMETRY_BATCH_BLOCK; e++) {
+            double disp_20 = min_image_component(dist_derivs_20[i][e], simulation_box_half_lengths[i]);
+            double disp_21 = min_image_component(dist_derivs_21[i][e], simulation_box_half_lengths[i]);
+            rr2_20[e] += disp_20 * disp_20;
+            rr2_21[e] += disp_21 * disp_21;
+            dist_derivs_20[i][e] = 2.0 * disp_20;
+            dist_derivs_21[i][e] = 2.0 * disp_21;
+        }
+    }
+    for (int e = 0; e < GEOMETRY_BATCH_BLOCK; e++) {
+        rr_20[e] = sqrt(rr2_20[e]);
+        rr_21[e] = sqrt(rr2_21[e]);
+    }
+    for (int i = 0; i < DIMENSION; i++) {
+        for (int e = 0; e < GEOMETRY_BATCH_BLOCK; e++) cos_theta[e] += dist_derivs_20[i][e] * dist_derivs_21[i][e];
+    }
+    for (int e = 0; e < GEOMETRY_BATCH_BLOCK; e++) cos_theta[e] = clamped_cos(cos_theta[e] / (4.0 * rr_20[e] * rr_21[e]));
+}
+
+inline void calc_block_angle_derivatives(const double dist_derivs_20[][GEOMETRY_BATCH_BLOCK], const double dist_derivs_21[][GEOMETRY_BATCH_BLOCK], const double* rr_20, const double* rr_21, const double* cos_theta, double derivs_0[][GEOMETRY_BATCH_BLOCK], double derivs_1[][GEOMETRY_BATCH_BLOCK])
+{
+    for (int e = 0; e < GEOMETRY_BATCH_BLOCK; e++) {
+        double sin_theta = sqrt((1.0 - cos_theta[e]) * (1.0 + cos_theta[e]));
+        double rr_01_1 = 1.0 / (rr_20[e] * rr_21[e] * sin_theta);
+        double rr_00c = cos_theta[e] / (rr_20[e] * rr_20[e] * sin_theta);
+        double rr_11c = cos_theta[e] / (rr_21[e] * rr_21[e] * sin_theta);
+        for (int i = 0; i < DIMENSION; i++) {
+            derivs_0[i][e] = 0.5 * DEGREES_PER_RADIAN * (dist_derivs_21[i][e] * rr_01_1 - rr_00c * dist_derivs_20[i][e]);
+            derivs_1[i][e] = 0.5 * DEGREES_PER_RADIAN * (dist_derivs_20[i][e] * rr_01_1 - rr_11c * dist_derivs_21[i][e]);
+        }
+    }
+}
+
+inline void calc_block_angles(const double* cos_theta, double* theta)
+{
+    for (int e = 0; e < GEOMETRY_BATCH_BLOCK; e++) theta[e] = polynomial_acos(cos_theta[e]) * DEGREES_PER_RADIAN;
+}
+
+inline void calc_block_dihedrals(const real *simulation_box_half_lengths, const double disp03[][GEOMETRY_BATCH_BLOCK], const double disp23[][GEOMETRY_BATCH_BLOCK], const double disp12[][GEOMETRY_BATCH_BLOCK], double* theta, double derivs_0[][GEOMETRY_BATCH_BLOCK], double derivs_1[][GEOMETRY_BATCH_BLOCK], double derivs_2[][GEOMETRY_BATCH_BLOCK])
+{
+    double d03[3][GEOMETRY_BATCH_BLOCK], d23[3][GEOMETRY_BATCH_BLOCK], d12[3][GEOMETRY_BATCH_BLOCK];
+    double pb[3][GEOMETRY_BATCH_BLOCK], pc[3][GEOMETRY_BATCH_BLOCK];
+    double cos_theta[GEOMETRY_BATCH_BLOCK];
+    for (int i = 0; i < 3; i++) {
+        for (int e = 0; e < GEOMETRY_BATCH_BLOCK; e++) {
+            d03[i][e] = min_image_component(disp03[i][e], simulation_box_half_lengths[i]);
+            d23[i][e] = min_image_component(disp23[i][e], simulation_box_half_lengths[i]);
+            d12[i][e] = min_image_component(disp12[i][e], simulation_box_half_lengths[i]);
+        }
+    }
+    
+    // Normals to the planes of the first three and last three sites.
+    for (int e = 0; e < GEOMETRY_BATCH_BLOCK; e++) {
+        pb[0][e] = d03[1][e] * d23[2][e] - d03[2][e] * d23[1][e];
+        pb[1][e] = d03[2][e] * d23[0][e] - d03[0][e] * d23[2][e];
+        pb[2][e] = d03[0][e] * d23[1][e] - d03[1][e] * d23[0][e];
+        pc[0][e] = d12[1][e] * d23[2][e] - d12[2][e] * d23[1][e];
+        pc[1][e] = d12[2][e] * d23[0][e] - d12[0][e] * d23[2][e];
+        pc[2][e] = d12[0][e] * d23[1][e] - d12[1][e] * d23[0][e];
+    }
+    for (int e = 0; e < GEOMETRY_BATCH_BLOCK; e++) {
+        double pb2 = pb[0][e] * pb[0][e] + pb[1][e] * pb[1][e] + pb[2][e] * pb[2][e];
+        double pc2 = pc[0][e] * pc[0][e] + pc[1][e] * pc[1][e] + pc[2][e] * pc[2][e];
+        double pbpc = pb[0][e] * pc[0][e] + pb[1][e] * pc[1][e] + pb[2][e] * pc[2][e];
+        cos_theta[e] = clamped_cos(pbpc * (1.0 / sqrt(pb2)) * (1.0 / sqrt(pc2)));
+    }
+    calc_block_angles(cos_theta, theta);
+    
+    for (int e = 0; e < GEOMETRY_BATCH_BLOCK; e++) {
+        double r23_2 = d23[0][e] * d23[0][e] + d23[1][e] * d23[1][e] + d23[2][e] * d23[2][e];
+        double rrbc = 1.0 / sqrt(r23_2);
+        double pb2 = pb[0][e] * pb[0][e] + pb[1][e] * pb[1][e] + pb[2][e] * pb[2][e];
+        double pc2 = pc[0][e] * pc[0][e] + pc[1][e] * pc[1][e] + pc[2][e] * pc[2][e];
+        
+        // The sign of the angle follows LAMMPS, as in the single-interaction form.
+        double sign = - (pb[0][e] * d12[0][e] + pb[1][e] * d12[1][e] + pb[2][e] * d12[2][e]) * (1.0 / sqrt(pb2)) * rrbc;
+        if (sign < 0.0) theta[e] = -theta[e];
+        
+        double dot03_23 = d03[0][e] * d23[0][e] + d03[1][e] * d23[1][e] + d03[2][e] * d23[2][e];
+        double dot12_23 = d12[0][e] * d23[0][e] + d12[1][e] * d23[1][e] + d12[2][e] * d23[2][e];
+        double fcoef = dot03_23 / r23_2;
+        double hcoef = 1.0 + dot12_23 / r23_2;
+        for (int i = 0; i < 3; i++) {
+            double dtf = pb[i][e] / (rrbc * pb2);
+            double dth = - pc[i][e] / (rrbc * pc2);
+            derivs_0[i][e] = -dtf;
+            derivs_1[i][e] = -dth;
+            derivs_2[i][e] = dtf * fcoef + dth * hcoef;
+        }
+    }
+}
+#endif
@@ -18,12 +18,21 @@
 // with respect to the first n-1 particles, since the final 
 // derivative with respect to the last particle is simply
 // the negative sum of the others.
-bool conditionally_calc_squared_distance_and_derivatives(const int* particle_ids, const std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, double &param_val, std::array<double, DIMENSION>* &derivatives);
-bool conditionally_calc_distance_and_derivatives(const int* particle_ids, const std::array<double, DIMENSION>* const &paritlce_positions, const real *simulation_box_half_lengths, const double cutoff2, double &param_val, std::array<double, DIMENSION>* &derivatives);
-bool conditionally_calc_angle_and_derivatives(const int* particle_ids, const std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, double &param_val, std::array<double, DIMENSION>* &derivatives);
-bool conditionally_calc_angle_and_intermediates(const int* particle_ids, std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, std::array<double, DIMENSION>* &dist_derivs_01, std::array<double, DIMENSION>* &dist_derivs_02, std::array<double, DIMENSION>* &derivatives, double &param_val, double &rr_01, double &rr2_02);
-bool conditionally_calc_sw_angle_and_intermediates(const int* particle_ids, std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff, const double gamma, std::array<double, DIMENSION>* &dist_derivs_01, std::array<double, DIMENSION>* &dist_derivs_02, std::array<double, DIMENSION>* &derivatives, double &param_val, double &rr1, double &rr2, double &angle_prefactor, double &dr1_prefactor, double &dr2_prefactor);
-bool conditionally_calc_dihedral_and_derivatives(const int* particle_ids, const std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, double &param_val, std::array<double, DIMENSION>* &derivatives);
+bool conditionally_calc_squared_distance_and_derivatives(const int* particle_ids, const std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, double &param_val, std::array<double, DIMENSION>* const &derivatives);
+bool conditionally_calc_distance_and_derivatives(const int* particle_ids, const std::array<double, DIMENSION>* const &paritlce_positions, const real *simulation_box_half_lengths, const double cutoff2, double &param_val, std::array<double, DIMENSION>* const &derivatives);
+bool conditionally_calc_angle_and_derivatives(const int* particle_ids, const std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, double &param_val, std::array<double, DIMENSION>* const &derivatives);
+bool conditionally_calc_angle_and_intermediates(const int* particle_ids, std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, std::array<double, DIMENSION>* const &dist_derivs_01, std::array<double, DIMENSION>* const &dist_derivs_02, std::array<double, DIMENSION>* const &derivatives, double &param_val, double &rr_01, double &rr2_02);
+bool conditionally_calc_sw_angle_and_intermediates(const int* particle_ids, std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff, const double gamma, std::array<double, DIMENSION>* const &dist_derivs_01, std::array<double, DIMENSION>* const &dist_derivs_02, std::array<double, DIMENSION>* const &derivatives, double &param_val, double &rr1, double &rr2, double &angle_prefactor, double &dr1_prefactor, double &dr2_prefactor);
+bool conditionally_calc_dihedral_and_derivatives(const int* particle_ids, const std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, double &param_val, std::array<double, DIMENSION>* const &derivatives);
+
+// Batched forms of the above for n_vals interactions at once, given one array
+// of particle indices per body (ends first, then centers, as in the
+// particle_ids of the single-interaction forms). Interaction n's parameter goes
+// to param_vals[n], its derivatives to derivatives[(n_body - 1) * n ...], and
+// within_cutoff[n] is set to 0 if it is outside the cutoff.
+void conditionally_calc_distance_and_derivatives_batch(const int n_vals, const int* ids_0, const int* ids_1, const std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, int* within_cutoff, double* param_vals, std::array<double, DIMENSION>* const &derivatives);
+void conditionally_calc_angle_and_derivatives_batch(const int n_vals, const int* ids_0, const int* ids_1, const int* ids_2, const std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, int* within_cutoff, double* param_vals, std::array<double, DIMENSION>* const &derivatives);
+void conditionally_calc_dihedral_and_derivatives_batch(const int n_vals, const int* ids_0, const int* ids_1, const int* ids_2, const int* ids_3, const std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, int* within_cutoff, double* param_vals, std::array<double, DIMENSION>* const &derivatives);
 
 // As above, but without derivatives and unconditionally, for 
 // rangefinding and density.
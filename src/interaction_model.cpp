@@ -108,6 +108,34 @@ std::vector<int> DensityClassSpec::get_interaction_types(const int index_among_d
 	return types;
 }
 
+// Decode site_to_density_group_intrxn_index_map into a list of active interactions for each ordered pair of site types,
+// in increasing bit order, with the density weight that the first site contributes to each.
+
+void DensityClassSpec::set_up_pair_interaction_lists(void)
+{
+	int n_type_pairs = n_cg_types * n_cg_types;
+	pair_interaction_starts = std::vector<int>(n_type_pairs + 1, 0);
+	pair_interaction_indices.clear();
+	pair_interaction_weights.clear();
+	
+	for (int type_pair = 0; type_pair < n_type_pairs; type_pair++) {
+		int type1 = type_pair / n_cg_types;
+		unsigned long interaction_flags = site_to_density_group_intrxn_index_map[type_pair];
+		for (int index_counter = 0; interaction_flags != 0; index_counter++) {
+			if (interaction_flags % 2 == 1) {
+				// The second density group of this interaction (see get_interaction_types).
+				int group_type_index = (index_counter % n_density_groups) * n_cg_types + type1;
+				if (density_groups[group_type_index] == true) {
+					pair_interaction_indices.push_back(index_counter);
+					pair_interaction_weights.push_back(density_weights[group_type_index]);
+				}
+			}
+			interaction_flags = interaction_flags >> 1;
+		}
+		pair_interaction_starts[type_pair + 1] = int(pair_interaction_indices.size());
+	}
+}
+
 // Select the correct type name array for the interaction.
 char** select_name(InteractionClassSpec* const ispec, char ** const cg_name)
 {
@@ -149,6 +177,16 @@ void check_input_values(CG_MODEL_DATA* cg)
 		}
 	}
 	
+	if (cg->verlet_skin < 0.0) {
+		printf("Invalid verlet_skin (%lf)!\n", cg->verlet_skin);
+		cg->verlet_skin = 0.0;
+	}
+	
+	if (cg->density_interactions.weight_table_tolerance < 0.0) {
+		printf("Invalid density_weight_table_tolerance (%lf)!\n", cg->density_interactions.weight_table_tolerance);
+		cg->density_interactions.weight_table_tolerance = 0.0;
+	}
+	
 	if (cg->three_body_nonbonded_interactions.class_subtype < 0 || cg->three_body_nonbonded_interactions.class_subtype > 3) {
 		printf("Invalid class_subtype (%d) for %s!\n", cg->three_body_nonbonded_interactions.class_subtype, cg->three_body_nonbonded_interactions.get_full_name().c_str());
 		cg->three_body_nonbonded_interactions.class_subtype = 0;
@@ -448,6 +486,7 @@ void setup_site_to_density_group_index(DensityClassSpec* iclass)
 			}
 		}
 	}
+	iclass->set_up_pair_interaction_lists();
 }
 
 void setup_periodic_index(InteractionClassSpec* iclass) 
@@ -550,7 +589,7 @@ void InteractionClassSpec::setup_indices_in_fm_matrix(void)
 void ThreeBodyNonbondedClassSpec::setup_indices_in_fm_matrix(void)
 { 
     if (class_subtype > 0) {
-		interaction_column_indices = std::vector<unsigned>(get_n_defined(), 0);
+		interaction_column_indices = std::vector<unsigned>(get_n_defined() + 1, 0);
 		interaction_column_indices[0] = 0;
 
 		n_tabulated = 0;
@@ -592,6 +631,67 @@ void InteractionClassSpec::setup_for_defined_interactions(TopologyData* topo_dat
 	n_tabulated = 0;
 }
 
+// Tabulate the defined, matched, and tabulated indices for every ordered combination
+// of site types so that they do not need to be looked up by hash for each interaction.
+// Entries are ordered with the first type of the interaction hash most significant.
+
+void InteractionClassSpec::set_up_type_lookup(void)
+{
+	type_lookup.clear();
+	if (class_type == kDensity || get_n_defined() == 0) return;
+
+	int n_body = get_n_body();
+	unsigned long n_entries = 1;
+	for (int i = 0; i < n_body; i++) n_entries *= n_cg_types;
+	if (n_entries > MAX_TYPE_LOOKUP_ENTRIES) return;
+
+	type_lookup = std::vector<InteractionTypeLookup>(n_entries);
+	std::vector<int> types(n_body);
+	for (unsigned long entry = 0; entry < n_entries; entry++) {
+		unsigned long remainder = entry;
+		for (int i = n_body - 1; i >= 0; i--) {
+			types[i] = int(remainder % n_cg_types) + 1;
+			remainder /= n_cg_types;
+		}
+		int index_among_defined = get_index_from_hash(calc_interaction_hash(types, n_cg_types));
+		type_lookup[entry].index_among_defined = index_among_defined;
+		if (index_among_defined < 0) {
+			type_lookup[entry].index_among_matched = 0;
+			type_lookup[entry].index_among_tabulated = 0;
+		} else {
+			type_lookup[entry].index_among_matched = defined_to_matched_intrxn_index_map[index_among_defined];
+			type_lookup[entry].index_among_tabulated = defined_to_tabulated_intrxn_index_map[index_among_defined];
+		}
+	}
+}
+
+// Record, for each center site type, the largest squared cutoff among the defined three body
+// interactions centered on it. Without a type lookup table every center uses the overall largest cutoff.
+
+void ThreeBodyNonbondedClassSpec::set_up_center_cutoffs(void)
+{
+	center_type_cutoff2 = std::vector<double>(n_cg_types, 0.0);
+	if (class_subtype == 0 || get_n_defined() == 0) return;
+	
+	if (type_lookup.size() == 0) {
+		double max_cutoff2 = 0.0;
+		for (int i = 0; i < get_n_defined(); i++) {
+			max_cutoff2 = fmax(max_cutoff2, three_body_nonbonded_cutoffs[i] * three_body_nonbonded_cutoffs[i]);
+		}
+		for (int i = 0; i < n_cg_types; i++) center_type_cutoff2[i] = max_cutoff2;
+		return;
+	}
+	
+	int entries_per_center = n_cg_types * n_cg_types;
+	for (unsigned entry = 0; entry < type_lookup.size(); entry++) {
+		int index_among_defined = type_lookup[entry].index_among_defined;
+		if (index_among_defined < 0) continue;
+		int center_type = entry / entries_per_center;
+		double cutoff2 = three_body_nonbonded_cutoffs[index_among_defined] * three_body_nonbonded_cutoffs[index_among_defined];
+		center_type_cutoff2[center_type] = fmax(center_type_cutoff2[center_type], cutoff2);
+	}
+}
+
 void InteractionClassSpec::dummy_setup_for_defined_interactions(TopologyData* topo_data)
 {
 	DensityClassSpec* dspec;
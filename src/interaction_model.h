@@ -24,6 +24,9 @@
 #define DIMENSION 3
 #endif
 
+// Largest number of sites in a single interaction (dihedrals).
+#define MAX_INTERACTION_BODIES 4
+
 struct MATRIX_DATA;
 class PairCellList;
 class ThreeBCellList;
@@ -49,6 +52,20 @@ typedef void (*calc_interaction_matrix_elements)(InteractionClassComputer* const
 // Interaction-model-related type definitions
 //-------------------------------------------------------------
 
+// Indices of the interaction for one ordered combination of site types.
+
+struct InteractionTypeLookup {
+	int index_among_defined;				// -1 if this combination of types is not defined
+	int index_among_matched;
+	int index_among_tabulated;
+};
+
+// Largest type lookup table to build; classes needing more entries keep using the hash search.
+#define MAX_TYPE_LOOKUP_ENTRIES (1 << 22)
+
+// Roles a neighbor of a three body center may take after exclusions are applied.
+enum ThreeBodyNeighborRole {kThreeBodyEndK = 1, kThreeBodyEndL = 2};
+
 // This stores parameters that define an interaction class.
 
 struct InteractionClassSpec {
@@ -87,6 +104,11 @@ struct InteractionClassSpec {
     std::vector<unsigned> defined_to_tabulated_intrxn_index_map;
     std::vector<unsigned> defined_to_periodic_intrxn_index_map;
     std::vector<unsigned> interaction_column_indices;
+    // type_lookup maps the ordered site types of an interaction (in the order used to hash it)
+    // straight to its indices, so that the matrix building loops need one indexed load per
+    // interaction instead of hashing and searching defined_to_possible_intrxn_index_map.
+    // It is filled by set_up_type_lookup and left empty when it would be too large.
+    std::vector<InteractionTypeLookup> type_lookup;
     int n_to_force_match;
     int n_force;
     int n_from_table;
@@ -127,6 +149,7 @@ struct InteractionClassSpec {
 	int read_bspline_table(std::ifstream &external_spline_table, int line, int offset);
 	void copy_table(const int base_defined, const int target_defined, const int num_lines);
 	void free_force_tabulated_interaction_data(void);
+	void set_up_type_lookup(void);
 	
 	inline int get_index_from_hash(const int hash_val) const {if (defined_to_possible_intrxn_index_map.size() == 0) return hash_val; else return SearchIntTable(defined_to_possible_intrxn_index_map, hash_val);}
     inline int get_hash_from_index(const int index) const {if (defined_to_possible_intrxn_index_map.size() > 0) return defined_to_possible_intrxn_index_map[index]; else return index;}
@@ -178,6 +201,175 @@ struct InteractionClassSpec {
 	}
 };
 
+// Bonded interactions of one class compiled once from the topology lists,
+// sorted by interaction type, with their indices already looked up.
+// The site indices use the same names as InteractionClassComputer.
+
+struct BondedInteractionList {
+	bool compiled;                              // False until compiled and after the computer is set up again
+	std::vector<int> site_k;                    // End site
+	std::vector<int> site_l;                    // Other end site
+	std::vector<int> site_i;                    // Central bond site (dihedrals only)
+	std::vector<int> site_j;                    // Center site (angles) or other central bond site (dihedrals)
+	std::vector<int> index_among_defined;
+	std::vector<int> index_among_matched;
+	std::vector<int> index_among_tabulated;
+	std::vector<int> compiled_site_types;       // Site types that the list was compiled for
+	
+	BondedInteractionList() : compiled(false) {}
+	
+	inline int size(void) const { return (int)(index_among_defined.size()); }
+	
+	// The list must be recompiled if the site types have changed since it was compiled (dynamic_types).
+	inline bool is_current(const int* const cg_site_types, const int n_cg_sites) const {
+		if (!compiled || (int)(compiled_site_types.size()) != n_cg_sites) return false;
+		for (int n = 0; n < n_cg_sites; n++) {
+			if (compiled_site_types[n] != cg_site_types[n]) return false;
+		}
+		return true;
+	}
+	
+	inline void clear(void) {
+		compiled = false;
+		site_k.clear();
+		site_l.clear();
+		site_i.clear();
+		site_j.clear();
+		index_among_defined.clear();
+		index_among_matched.clear();
+		index_among_tabulated.clear();
+	}
+};
+
+// Pairs of sites within a nonbonded cutoff plus a skin, in the order the cell list found them.
+// The list can be reused for later frames until some site has moved more than half the skin 
+// since it was built, or the number of sites or the box changes.
+
+struct VerletPairList {
+	double skin;                                // 0 if the cell list is searched every frame instead
+	bool built;                                 // False until built and after the computer is set up again
+	std::vector<int> site_k;
+	std::vector<int> site_l;
+	std::vector<std::array<double, DIMENSION> > reference_x;	// Positions the list was built from
+	double reference_box_half_lengths[DIMENSION];
+	
+	VerletPairList() : skin(0.0), built(false) {}
+	
+	inline int size(void) const { return (int)(site_k.size()); }
+	
+	inline bool is_current(const int n_sites, const std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) const {
+		if (!built || (int)(reference_x.size()) != n_sites) return false;
+		for (int i = 0; i < DIMENSION; i++) {
+			if (reference_box_half_lengths[i] != simulation_box_half_lengths[i]) return false;
+		}
+		double max_displacement2 = 0.25 * skin * skin;
+		for (int n = 0; n < n_sites; n++) {
+			double rr2 = 0.0;
+			for (int i = 0; i < DIMENSION; i++) {
+				double displacement = x[n][i] - reference_x[n][i];
+				if (displacement > simulation_box_half_lengths[i]) displacement -= 2.0 * simulation_box_half_lengths[i];
+				else if (displacement < -simulation_box_half_lengths[i]) displacement += 2.0 * simulation_box_half_lengths[i];
+				rr2 += displacement * displacement;
+			}
+			if (rr2 > max_displacement2) return false;
+		}
+		return true;
+	}
+	
+	inline void clear(void) {
+		built = false;
+		site_k.clear();
+		site_l.clear();
+	}
+};
+
+// Density interactions of the neighbor pairs within the density cutoff, recorded while the
+// densities are accumulated so that the matrix elements can be streamed from it afterwards.
+// Pairs hold their geometry for the order k, l; entries list the active interactions of each
+// pair in the order the matrix elements are accumulated.
+
+struct DensityPairCache {
+	std::vector<int> site_k;
+	std::vector<int> site_l;
+	std::vector<double> distance;
+	std::vector<std::array<double, DIMENSION> > derivatives;	// Derivative of the distance for the order k, l
+	std::vector<int> entry_pair;				// Pair of each entry
+	std::vector<char> entry_reversed;			// 1 if the entry uses the pair in the order l, k
+	std::vector<int> entry_index_among_defined;
+	std::vector<double> entry_density_derivative;	// Weighted weight function derivative
+	
+	inline int n_pairs(void) const { return (int)(site_k.size()); }
+	inline int n_entries(void) const { return (int)(entry_pair.size()); }
+	
+	inline void clear(void) {
+		site_k.clear();
+		site_l.clear();
+		distance.clear();
+		derivatives.clear();
+		entry_pair.clear();
+		entry_reversed.clear();
+		entry_index_among_defined.clear();
+		entry_density_derivative.clear();
+	}
+};
+
+// Cubic Hermite interpolation tables of several functions of distance on a uniform grid from 0 to a cutoff.
+// Each node holds, for every function, its value and its slope times the node spacing.
+
+struct CubicHermiteTable {
+	int n_functions;
+	int n_intervals;
+	double inv_spacing;
+	std::vector<double> nodes;		// [(node * n_functions + function) * 2 + {0 for value, 1 for scaled slope}]
+
+	inline CubicHermiteTable() : n_functions(0), n_intervals(0), inv_spacing(0.0) {}
+
+	inline double eval(const double distance, const int function) const {
+		double t = distance * inv_spacing;
+		int interval = (int)t;
+		if (interval >= n_intervals) interval = n_intervals - 1;
+		double s = t - (double)interval;
+		const double* node_0 = &nodes[(interval * n_functions + function) * 2];
+		const double* node_1 = node_0 + 2 * n_functions;
+		double delta = node_1[0] - node_0[0];
+		return node_0[0] + s * (node_0[1] + s * (3.0 * delta - 2.0 * node_0[1] - node_1[1] + s * (node_0[1] + node_1[1] - 2.0 * delta)));
+	}
+};
+
+// Largest number of intervals used to tabulate a density weight function.
+#define MAX_DENSITY_WEIGHT_TABLE_INTERVALS (1 << 14)
+
+// Force-matched interactions of one defined type waiting for a batched basis
+// evaluation, in the order they were found. Each interaction holds n_body
+// particle ids and n_body - 1 derivative vectors.
+
+struct PendingBasisInteractions {
+	int n_body;
+	std::vector<double> param_vals;
+	std::vector<int> virial_flags;
+	std::vector<int> particle_ids;
+	std::vector<std::array<double, DIMENSION> > derivatives;
+	
+	PendingBasisInteractions() : n_body(0) {}
+	
+	inline int size(void) const { return (int)(param_vals.size()); }
+	
+	inline void push_back(const int interaction_n_body, const int* const ids, const std::array<double, DIMENSION>* const derivs, const double param_val, const int virial_flag) {
+		n_body = interaction_n_body;
+		param_vals.push_back(param_val);
+		virial_flags.push_back(virial_flag);
+		particle_ids.insert(particle_ids.end(), ids, ids + interaction_n_body);
+		derivatives.insert(derivatives.end(), derivs, derivs + interaction_n_body - 1);
+	}
+	
+	inline void clear(void) {
+		param_vals.clear();
+		virial_flags.clear();
+		particle_ids.clear();
+		derivatives.clear();
+	}
+};
+
 // Info needed for FM calculation of each interaction class, very closely
 // related to the below struct. (Will be rebuilt from the below struct later.)
 
@@ -223,8 +415,10 @@ struct InteractionClassComputer {
 	//virtual void class_set_up_range(void) = 0;
     // Function to calculate index of an actual interaction among all possible interactions for the current class
 	virtual int calculate_hash_number(int* const cg_site_types, const int n_cg_types) = 0;
+	// Function to calculate the position of the current interaction's site types in ispec->type_lookup
+	virtual int calculate_type_lookup_index(int* const cg_site_types, const int n_cg_types) = 0;
 	
-	virtual void calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) = 0;
+	virtual void calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) = 0;
 	
 	void set_up_computer(InteractionClassSpec* const ispec_pt, int *curr_iclass_col_index);	
 
@@ -233,14 +427,43 @@ struct InteractionClassComputer {
 	void calc_grid_of_force_vals(const std::vector<double> &spline_coeffs, const int index_among_defined_intrxns, const double binwidth, std::vector<double> &axis_vals, std::vector<double> &force_vals);
 	void calc_grid_of_force_and_deriv_vals(const std::vector<double> &spline_coeffs, const int index_among_defined_intrxns, const double binwidth, std::vector<double> &axis_vals, std::vector<double> &force_vals, std::vector<double> &deriv_vals);
 	
-	void walk_neighbor_list(MATRIX_DATA* const mat, calc_pair_matrix_elements calc_matrix_elements, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths);
-	void walk_3B_neighbor_list(MATRIX_DATA* const mat, const int n_cg_types, const TopologyData& topo_data, const ThreeBCellList& three_body_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths);
+	void walk_neighbor_list(MATRIX_DATA* const mat, calc_pair_matrix_elements calc_matrix_elements, const int n_cg_types, const TopologyData& topo_data, PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths);
+	void visit_cell_pair(MATRIX_DATA* const mat, calc_pair_matrix_elements calc_matrix_elements, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, const int a, const int b, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths);
 
 	void set_indices(void) {
 		index_among_matched_interactions   = ispec->defined_to_matched_intrxn_index_map[index_among_defined_intrxns];
 		index_among_tabulated_interactions = ispec->defined_to_tabulated_intrxn_index_map[index_among_defined_intrxns];
 	};
 	
+	void set_indices_from_lookup(const InteractionTypeLookup &entry) {
+		index_among_defined_intrxns        = entry.index_among_defined;
+		index_among_matched_interactions   = entry.index_among_matched;
+		index_among_tabulated_interactions = entry.index_among_tabulated;
+	};
+	
+	// Bonded interactions compiled from the topology (bonded classes only).
+	BondedInteractionList bonded_list;
+	void add_to_bonded_list(int* const cg_site_types, const int n_cg_types);
+	void finish_bonded_list(const int* const cg_site_types, const int n_cg_sites);
+	void walk_bonded_list(MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths);
+	void walk_bonded_list_in_batches(MATRIX_DATA* const mat, const int n_body, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths);
+	// Geometry of a block of the bonded list, computed together.
+	std::vector<int> bonded_within_cutoff;
+	std::vector<double> bonded_param_vals;
+	std::vector<std::array<double, DIMENSION> > bonded_derivatives;
+	
+	// Force-matched interactions queued by defined type so that their bases are evaluated in
+	// batches (pair nonbonded and bonded classes only); flushed at the end of each walk.
+	std::vector<PendingBasisInteractions> pending_interactions;
+	std::vector<int> batch_first_nonzero_basis_indices;
+	std::vector<double> batch_basis_fn_vals;
+	void flush_pending_interactions(MATRIX_DATA* const mat, const int index_among_defined);
+	void flush_all_pending_interactions(MATRIX_DATA* const mat);
+	
+	// Nonbonded pairs reused across frames (pair nonbonded and density classes with a Verlet skin only).
+	VerletPairList verlet_list;
+	void update_verlet_list(PairCellList& pair_cell_list, const TopologyData& topo_data, const TopoList* const exclusion_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths);
+	
     // Spline computation objects for force matched and
     // tabulated interactions.
     SplineComputer* fm_s_comp;
@@ -385,6 +608,10 @@ struct ThreeBodyNonbondedClassSpec: InteractionClassSpec {
     // Three body topology temporaries.
     int* tb_n;
     int** tb_list;
+    
+    // Largest squared cutoff of any defined interaction centered on each site type (index type - 1).
+    // Filled by set_up_center_cutoffs; neighbors farther than this from a center are never used.
+    std::vector<double> center_type_cutoff2;
 
 	inline ThreeBodyNonbondedClassSpec(ControlInputs* control_input) {
 		class_type = kThreeBodyNonbonded;
@@ -407,6 +634,8 @@ struct ThreeBodyNonbondedClassSpec: InteractionClassSpec {
 		}
 	}
 	
+	void set_up_center_cutoffs(void);
+	
 	void determine_defined_intrxns(TopologyData *topo_data) {
 		defined_to_possible_intrxn_index_map = std::vector<unsigned>(get_n_defined(), 0);
       	
@@ -463,6 +692,7 @@ struct DensityClassSpec: InteractionClassSpec {
 	
 	int density_weights_flag; // 0 for number density, 1 to read other weights for each CG type in each density group (e.g. mass, charge)
 	double* density_weights;  // Specifies the weight of each CG type to each density group
+	double weight_table_tolerance; // 0 to evaluate weight functions analytically; otherwise the relative error allowed in their tables
 	
 	unsigned long* site_to_density_group_intrxn_index_map; 
 							// This indicates which density_group interactions are active between a pair of site types.
@@ -472,6 +702,13 @@ struct DensityClassSpec: InteractionClassSpec {
 							// The value at an index of this array indicates which density_group - density_group interactions are active
 							// based on a set of bitwise flags (i.e. The value is a binary number representing a series of bolean flags for each type).
 	
+	// The same interactions decoded into a list per ordered pair of site types, keeping only those where the first
+	// site belongs to the interaction's second density group. The interactions for types [1st_type * n_cg_types + 2nd_type]
+	// are entries pair_interaction_starts[that index] to pair_interaction_starts[that index + 1] - 1.
+	std::vector<int> pair_interaction_starts;
+	std::vector<int> pair_interaction_indices;		// index_among_defined of each interaction.
+	std::vector<double> pair_interaction_weights;	// Density weight of the first site's type in the interaction's second density group.
+	
 	inline DensityClassSpec(ControlInputs* control_input) {
 		// PairNonbondedInteractionClass constructor
 		cutoff = control_input->density_cutoff_distance;
@@ -489,6 +726,7 @@ struct DensityClassSpec: InteractionClassSpec {
 		class_type = kDensity;
 		class_subtype = control_input->density_flag;
 		density_weights_flag = control_input->density_weights_flag;
+		weight_table_tolerance = control_input->density_weight_table_tolerance;
 		fm_binwidth = control_input->density_fm_binwidth;
 		bspline_k = control_input->density_bspline_k;
 		output_binwidth = control_input->density_output_binwidth;
@@ -508,6 +746,7 @@ struct DensityClassSpec: InteractionClassSpec {
 	void read_rmin_class(std::string* &elements, const int position, const int index_among_defined, char* mode);
 	std::vector<int> get_interaction_types(const int index_among_defined_intrxns) const;
 	std::string get_interaction_name(char **type_names, const int intrxn_index_among_defined, const std::string &delimiter) const;
+	void set_up_pair_interaction_lists(void);
 	
 	void determine_defined_intrxns(TopologyData *topo_data) {
 		n_cg_sites = int(topo_data->n_cg_sites);
@@ -538,57 +777,84 @@ struct DensityClassSpec: InteractionClassSpec {
 struct PairNonbondedClassComputer : InteractionClassComputer {
 	void class_set_up_computer(void);
 	//void class_set_up_range(void);
-	void calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths);
+	void calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths);
 
     int calculate_hash_number(int* const cg_site_types, const int n_cg_types) {
 	    return calc_two_body_interaction_hash(cg_site_types[k], cg_site_types[l], n_cg_types);
 	}
+	int calculate_type_lookup_index(int* const cg_site_types, const int n_cg_types) {
+		return (cg_site_types[k] - 1) * n_cg_types + cg_site_types[l] - 1;
+	}
 };
 
 struct PairBondedClassComputer : InteractionClassComputer {
 	void class_set_up_computer(void);
 	//void class_set_up_range(void);
-	void calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths); 
+	void calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths); 
 
     int calculate_hash_number(int* const cg_site_types, const int n_cg_types) {
 	    return calc_two_body_interaction_hash(cg_site_types[k], cg_site_types[l], n_cg_types);
 	}
+	int calculate_type_lookup_index(int* const cg_site_types, const int n_cg_types) {
+		return (cg_site_types[k] - 1) * n_cg_types + cg_site_types[l] - 1;
+	}
 };
 
 struct AngularClassComputer : InteractionClassComputer {
 	void class_set_up_computer(void);
 	//void class_set_up_range(void);
-	void calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths);
+	void calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths);
 
     int calculate_hash_number(int* const cg_site_types, const int n_cg_types) {
 	    return calc_three_body_interaction_hash(cg_site_types[j], cg_site_types[k], cg_site_types[l], n_cg_types);
 	}
+	int calculate_type_lookup_index(int* const cg_site_types, const int n_cg_types) {
+		return ((cg_site_types[j] - 1) * n_cg_types + cg_site_types[k] - 1) * n_cg_types + cg_site_types[l] - 1;
+	}
 };
 
 struct DihedralClassComputer : InteractionClassComputer {
 	void class_set_up_computer(void);
 	//void class_set_up_range(void);
-	void calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths);
+	void calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths);
 
     int calculate_hash_number(int* const cg_site_types, const int n_cg_types) {
 		return calc_four_body_interaction_hash(cg_site_types[i], cg_site_types[j], cg_site_types[k], cg_site_types[l], n_cg_types);
 	}
+	int calculate_type_lookup_index(int* const cg_site_types, const int n_cg_types) {
+		return (((cg_site_types[i] - 1) * n_cg_types + cg_site_types[j] - 1) * n_cg_types + cg_site_types[k] - 1) * n_cg_types + cg_site_types[l] - 1;
+	}
 };
 
 struct ThreeBodyNonbondedClassComputer : InteractionClassComputer {
 	double coef1[100];
+	std::vector<double> fm_basis_deriv_vals; // Preallocated like fm_basis_fn_vals for the B-spline derivatives.
+	
+	// Neighbor list of the current center site, in the order the cell list visits them.
+	std::vector<int> center_neighbors;			// Site index of each neighbor within the center type's cutoff.
+	std::vector<int> center_neighbor_types;		// Site type of each neighbor.
+	std::vector<double> center_neighbor_rr2;	// Squared minimum image distance from the center to each neighbor.
+	std::vector<char> center_neighbor_roles;	// kThreeBodyEndK if the neighbor may be site k, kThreeBodyEndL if it may be site l (exclusions).
  	
 	void special_set_up_computer(InteractionClassSpec* const ispec_pt, int *curr_iclass_col_index);
 	void class_set_up_computer(void) {} ;
 	//void class_set_up_range(void);
-	void calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) {};
+	void calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) {};
 	void calculate_3B_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const ThreeBCellList& three_body_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths);
 	
+	void walk_3B_neighbor_list(MATRIX_DATA* const mat, const int n_cg_types, const TopologyData& topo_data, const ThreeBCellList& three_body_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths);
+	void build_center_neighbor_list(const int center_cell, const int center_slot, const TopologyData& topo_data, const ThreeBCellList& three_body_cell_list, const real* simulation_box_half_lengths);
+	void sort_center_neighbors_by_index(void);
+	void walk_center_neighbor_pairs(MATRIX_DATA* const mat, const int n_cg_types, const TopologyData& topo_data, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths);
+	
     void calculate_bspline_elements_and_deriv_elements(double* coef1);
 	void calculate_bspline_deriv_elements(double* coef1);
     int calculate_hash_number(int* const cg_site_types, const int n_cg_types) {
 	    return calc_three_body_interaction_hash(cg_site_types[j], cg_site_types[k], cg_site_types[l], n_cg_types);
 	}
+	int calculate_type_lookup_index(int* const cg_site_types, const int n_cg_types) {
+		return ((cg_site_types[j] - 1) * n_cg_types + cg_site_types[k] - 1) * n_cg_types + cg_site_types[l] - 1;
+	}
 };
 
 struct DensityClassComputer : InteractionClassComputer {
@@ -603,6 +869,19 @@ struct DensityClassComputer : InteractionClassComputer {
 	
 	// Stores the density weight for the current interaction.
 	double curr_weight;
+
+	// Tables of the weight function and its derivative for each defined interaction, used in place of the
+	// analytic functions when the class has a weight_table_tolerance. Their functions are the weight
+	// at unit curr_weight less the weight at zero curr_weight, the weight at zero curr_weight, and the derivative.
+	std::vector<CubicHermiteTable> weight_tables;
+	double weight_table_max_error;		// Largest relative error of the tables, found at points between their nodes
+	
+	// Neighbor pairs and their active interactions found while accumulating the densities of the current frame.
+	DensityPairCache pair_cache;
+	// Geometry of the current cached interaction, read by calculate_fm_matrix_elements.
+	double curr_distance;
+	double curr_density_derivative;
+	std::array<double, DIMENSION> curr_derivatives[1];
 	
 	// A "flattened" 2D-array that stores the density of each density group at each CG site. 
 	// Only the needed elements are calculated
@@ -615,19 +894,25 @@ struct DensityClassComputer : InteractionClassComputer {
 	// Specific Implementaitons of InteractionClassComputer functions
 	void class_set_up_computer(void);
 	//void class_set_up_range(void);
-	void calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths);
-	void walk_density_neighbor_list(MATRIX_DATA* const mat, calc_pair_matrix_elements calc_matrix_elements, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths);
+	void calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths);
+	void walk_density_neighbor_list(const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths);
+	void accumulate_pair_densities(const int n_cg_types, const TopologyData& topo_data, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths);
+	void stream_cached_matrix_elements(MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths);
 	
 	// Additional Computer functions specific to Density.
 	void reset_density_array(void);
+	void set_up_weight_tables(const double tolerance);
 	
-	// Additional function pointer to calculate the density_values array before computing the interaction
-	void (*calculate_density_values)(InteractionClassComputer* const self, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
+	// Additional function pointers for the weighted weight function of the current interaction at a squared distance,
+	// which is accumulated into the density_values array before computing the interaction, and for its derivative.
+	// The derivative is only needed for force matching and is NULL when range finding.
+	double (*calculate_density_weight)(DensityClassComputer* const icomp, DensityClassSpec* const ispec, const double distance2);
    	void (*process_density)(InteractionClassComputer* const self, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
 	double (*calculate_density_derivative)(DensityClassComputer* const icomp, DensityClassSpec* const ispec, const double distance);
 	
 	// Need to implement these functions
 	int calculate_hash_number(int* const cg_site_types, const int n_cg_types) {return -1;}
+	int calculate_type_lookup_index(int* const cg_site_types, const int n_cg_types) {return -1;}
 		
 	inline ~DensityClassComputer() {
 		if(ispec->get_n_defined() > 0) {
@@ -654,6 +939,7 @@ struct CG_MODEL_DATA {
     // Cutoff specifications.
     double pair_nonbonded_cutoff;           // Nonbonded pair interaction cutoff
     double pair_nonbonded_cutoff2;          // Squared cutoff distance for pair nonbonded interactions
+    double verlet_skin;                     // Skin of the reusable nonbonded pair lists (0 if not used)
     double three_body_nonbonded_cutoff2;    // Squared cutoff distance for three body nonbonded interactions
 
     // Topology specifications.
@@ -689,6 +975,7 @@ struct CG_MODEL_DATA {
 
 	inline CG_MODEL_DATA(ControlInputs* control_input) :
 		pair_nonbonded_cutoff(control_input->pair_nonbonded_cutoff),
+		verlet_skin(control_input->verlet_skin),
 		topo_data(control_input->max_pair_bonds_per_site, control_input->max_angles_per_site, control_input->max_dihedrals_per_site),
 		pair_nonbonded_interactions(control_input), pair_bonded_interactions(control_input),
 		angular_interactions(control_input), dihedral_interactions(control_input),
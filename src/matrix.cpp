@@ -11,7 +11,10 @@
 #include <cstdlib>
 #include <cstring>
 
+#include <algorithm>
 #include <array>
+#include <thread>
+#include <vector>
 
 #include "control_input.h"
 #include "interaction_model.h"
@@ -29,6 +32,7 @@ void initialize_accumulation_matrix(MATRIX_DATA* const mat, ControlInputs* const
 void initialize_sparse_matrix(MATRIX_DATA* const mat, ControlInputs* const control_input, CG_MODEL_DATA* const cg);
 void initialize_sparse_dense_normal_matrix(MATRIX_DATA* const mat, ControlInputs* const control_input, CG_MODEL_DATA* const cg);
 void initialize_sparse_sparse_normal_matrix(MATRIX_DATA* const mat, ControlInputs* const control_input, CG_MODEL_DATA* const cg);
+void initialize_direct_normal_matrix(MATRIX_DATA* const mat, ControlInputs* const control_input, CG_MODEL_DATA* const cg);
 void initialize_dummy_matrix(MATRIX_DATA* const mat, ControlInputs* const control_input, CG_MODEL_DATA* const cg);
 
 // Helper matrix initialization routines
@@ -45,7 +49,6 @@ void set_dense_matrix_to_zero(MATRIX_DATA* const mat);
 void set_sparse_matrix_to_zero(MATRIX_DATA* const mat);
 void set_sparse_accumulation_matrix_to_zero(MATRIX_DATA* const mat);
 void set_accumulation_matrix_to_zero(MATRIX_DATA* const mat);
-void set_accumulation_matrix_to_zero(MATRIX_DATA* const mat, dense_matrix* const dense_fm_matrix);
 void set_dummy_matrix_to_zero(MATRIX_DATA* const mat);
 
 // Interface-level functions that convert force magnitude and derivatives to matrix elements.
@@ -84,16 +87,18 @@ void calculate_target_force_accumulation_vector(int shift_i, int site_i, MATRIX_
 
 void convert_dense_fm_equation_to_normal_form_and_accumulate(MATRIX_DATA* const mat);
 void convert_dense_target_force_vector_to_normal_form_and_accumulate(MATRIX_DATA* const mat);
+void scale_dense_fm_rows_by_frame_weights(MATRIX_DATA* const mat);
 void accumulate_accumulation_matrices(MATRIX_DATA* const mat);
 void solve_sparse_matrix(MATRIX_DATA* const mat);
 void convert_sparse_fm_equation_to_sparse_normal_form_and_accumulate(MATRIX_DATA* const mat);
 void convert_sparse_fm_equation_to_dense_normal_form_and_accumulate(MATRIX_DATA* const mat);
+void accumulate_direct_fm_equation_into_normal_form(MATRIX_DATA* const mat);
 void do_nothing_to_fm_matrix(MATRIX_DATA* const mat);
 
 // Helper solver routines
 
 int get_n_nonzero_matrix_elements(MATRIX_DATA* const mat);
-void convert_linked_list_to_csr_matrix(MATRIX_DATA* const mat, csr_matrix& csr_fm_matrix);
+void convert_sparse_builder_to_csr_matrix(MATRIX_DATA* const mat, csr_matrix& csr_fm_matrix);
 void precondition_sparse_matrix(int const fm_matrix_columns, double* h, csr_matrix* csr_normal_matrix);
 void sparse_matrix_addition(MATRIX_DATA* const mat, double frame_weight, int nnzmax, csr_matrix& csr_normal_matrix, csr_matrix* main_normal_matrix);
 void regularize_sparse_matrix(MATRIX_DATA* const mat);
@@ -101,9 +106,16 @@ void regularize_vector_sparse_matrix(MATRIX_DATA* const mat, double* regularizat
 void regularize_sparse_matrix(MATRIX_DATA* const mat, csr_matrix* csr_matrix);
 void regularize_vector_sparse_matrix(MATRIX_DATA* const mat, csr_matrix* csr_normal_matrix, double* regularization_vector);
 void pardiso_solve(MATRIX_DATA* const mat, csr_matrix* const sparse_matrix, double* const dense_fm_normal_rhs_vector);
+void native_csr_transpose_times_csr(const int num_threads, const int nnzmax, csr_matrix* const csr_fm_matrix, csr_matrix* const csr_normal_matrix);
+void native_csr_transpose_times_csr_to_packed(const double alpha, csr_matrix* const csr_fm_matrix, packed_symmetric_matrix* const normal_matrix);
+void native_csr_times_vector(const char trans, csr_matrix* const csr, const double* const x, double* const y);
+void native_csr_addition(const int n_rows, const int n_cols, const int nnzmax, csr_matrix* const a, const double beta, csr_matrix* const b, double* const values, int* const column_indices, int* const row_sizes);
+void native_sparse_solve(MATRIX_DATA* const mat, csr_matrix* const sparse_matrix, double* const dense_fm_normal_rhs_vector);
 void solve_this_sparse_matrix(MATRIX_DATA* const mat);
 inline void create_sparse_normal_form_matrix(MATRIX_DATA* const mat, const int nnzmax, csr_matrix& csr_fm_matrix, csr_matrix& csr_normal_matrix, double* const dense_fm_rhs_vector, double* const dense_rhs_normal_vector);
-inline void create_dense_normal_form(MATRIX_DATA* const mat, const double frame_weight, dense_matrix* const dense_fm_matrix, dense_matrix* normal_matrix, double* const dense_fm_rhs_vector, double* dense_fm_normal_rhs_vector);
+inline void create_dense_normal_form(MATRIX_DATA* const mat, const double frame_weight, dense_matrix* const dense_fm_matrix, packed_symmetric_matrix* normal_matrix, double* const dense_fm_rhs_vector, double* dense_fm_normal_rhs_vector);
+void add_gram_matrix_to_packed(const double alpha, const int n_rows, const int n_cols, const double* const values, packed_symmetric_matrix* const normal_matrix);
+void add_direct_normal_form(MATRIX_DATA* const mat, const double frame_weight, packed_symmetric_matrix* normal_matrix, double* dense_fm_normal_rhs_vector);
 inline double calculate_dense_residual(MATRIX_DATA* const mat, dense_matrix* const dense_fm_normal_matrix, double* const dense_fm_rhs_vector, std::vector<double> &fm_solution, double normalziation);
 inline double calculate_sparse_residual(MATRIX_DATA* const mat, csr_matrix* sparse_fm_normal_matrix, double* const dense_fm_rhs_vector, std::vector<double> &fm_solution, double normalization);
 inline void calculate_and_apply_dense_preconditioning(MATRIX_DATA* mat, dense_matrix* dense_fm_normal_matrix, double* h);
@@ -124,10 +136,10 @@ void solve_sparse_matrix_for_bootstrap(MATRIX_DATA* const mat);
 void convert_sparse_fm_equation_to_sparse_normal_form_and_bootstrap(MATRIX_DATA* const mat);
 void accumulate_accumulation_matrices_for_bootstrap(MATRIX_DATA* const mat);
 void convert_sparse_fm_equation_to_dense_normal_form_and_bootstrap(MATRIX_DATA* const mat);
+void accumulate_direct_fm_equation_into_normal_form_and_bootstrap(MATRIX_DATA* const mat);
 void average_sparse_bootstrapping_solutions(MATRIX_DATA* const mat);
 void solve_sparse_fm_bootstrapping_equations(MATRIX_DATA* const mat);
 void solve_dense_fm_normal_bootstrapping_equations(MATRIX_DATA* const mat);
-void solve_accumulation_form_bootstrapping_equations(MATRIX_DATA* const mat);
 
 // Matrix-implementation-dependent functions for reading 
 // batches of FM matrices.
@@ -160,6 +172,7 @@ MATRIX_DATA::MATRIX_DATA(ControlInputs* const control_input, CG_MODEL_DATA *cons
     rcond							= control_input->rcond;
     itnlim 							= control_input->itnlim;
 	num_sparse_threads 				= control_input->num_sparse_threads;
+	num_frame_threads 				= control_input->num_frame_threads;
 	position_dimension 				= control_input->position_dimension;
 	volume_weighting_flag 			= control_input->volume_weighting_flag;
 
@@ -183,6 +196,7 @@ MATRIX_DATA::MATRIX_DATA(ControlInputs* const control_input, CG_MODEL_DATA *cons
     // Set blockwise composition weighting factors
     frames_per_traj_block 			= control_input->frames_per_traj_block;
 	current_frame_weight 			= 1.0;
+	block_frame_weights 			= NULL;
 	use_statistical_reweighting 	= control_input->use_statistical_reweighting;
 	dynamic_state_samples_per_frame = 1;
 	if(control_input->dynamic_state_sampling == 1) dynamic_state_samples_per_frame = control_input->dynamic_state_samples_per_frame;
@@ -220,6 +234,10 @@ MATRIX_DATA::MATRIX_DATA(ControlInputs* const control_input, CG_MODEL_DATA *cons
     	matrix_type = kSparseSparse;
         initialize_sparse_sparse_normal_matrix(this, control_input, cg);
         break;
+    case kDirectNormal:
+    	matrix_type = kDirectNormal;
+        initialize_direct_normal_matrix(this, control_input, cg);
+        break;
 	case kDummy: // Used as a placeholder (e.g., rangefinder)
         matrix_type = kDummy;
         initialize_dummy_matrix(this, control_input, cg);
@@ -242,26 +260,20 @@ void matrix_sanity_checks(ControlInputs* const control_input) {
 
     #if _mkl_flag == 1
 	mkl_set_num_threads(control_input->num_sparse_threads);
-	#else 
-	if (MatrixType(control_input->matrix_type) == kSparse || MatrixType(control_input->matrix_type) == kSparseSparse) {
-        printf("Cannot use sparse solving (matrix_type 1 or 4) unless compiling with MKL (use newfm_mkl.x in makefile).\n");
-		exit(EXIT_FAILURE);
-    }
-	if (MatrixType(control_input->matrix_type) == kSparseNormal) {
-        printf("Cannot use sparse accumulation (matrix_type 3) unless compiling with MKL for the time being (use newfm_mkl.x in makefile).\n");
-		exit(EXIT_FAILURE);
-    }
 	#endif
     
     // Ignore a user's choice to output certain quantities if they will not be calculated.
-    if ( ((MatrixType)(control_input->matrix_type) != kDense) && ((MatrixType)(control_input->matrix_type) != kSparseNormal) && (control_input->output_normal_equations_rhs_flag != 0) ) {
+    if ( ((MatrixType)(control_input->matrix_type) != kDense) && ((MatrixType)(control_input->matrix_type) != kSparseNormal) && ((MatrixType)(control_input->matrix_type) != kDirectNormal) && (control_input->output_normal_equations_rhs_flag != 0) ) {
         printf("Cannot output normal equations if normal equations are not being calculated.\n");
         printf("Use a different FM matrix format.\n");
         exit(EXIT_FAILURE);
     }
     
-    // Override a user's choice of block_size if it conflicts with use_statistical_reweighting flag
-    if ( (control_input->use_statistical_reweighting == 1) && (control_input->frames_per_traj_block != 1) ) {
+    // Override a user's choice of block_size if it conflicts with use_statistical_reweighting flag.
+    // Stacked dense blocks instead apply each frame's weight by scaling that frame's rows.
+    if ( (control_input->use_statistical_reweighting == 1) && (control_input->frames_per_traj_block != 1) &&
+         ( ((MatrixType)(control_input->matrix_type) != kDense) || (control_input->dense_frame_stacking_flag == 0) || 
+           (control_input->iterative_calculation_flag == 1) || (control_input->dynamic_state_sampling == 1) ) ) {
     	printf("Cannot use statistical reweighting with %d frames per trajectory block.\n", control_input->frames_per_traj_block);
     	printf("Setting block_size to 1.\n");
     	control_input->frames_per_traj_block = 1;
@@ -279,10 +291,38 @@ void matrix_sanity_checks(ControlInputs* const control_input) {
 		exit(EXIT_FAILURE);
 	}
 
-	if ( ((MatrixType)(control_input->matrix_type) == kDense) && (control_input->frames_per_traj_block != 1) ) {
-		printf("Cannot use dense matrix_type (0) with %d frames per trajectory block\n", control_input->frames_per_traj_block);
-		printf("Setting block_size to 1.\n");
-		control_input->frames_per_traj_block = 1;
+	// Dense blocks hold a single frame unless stacking is requested. Stacked dense blocks 
+	// must evenly divide the trajectory and are built by a single thread.
+	if ( ((MatrixType)(control_input->matrix_type) == kDense) && (control_input->frames_per_traj_block > 1) ) {
+		int n_frame_samples = control_input->n_frames;
+		if (control_input->dynamic_state_sampling == 1) n_frame_samples *= control_input->dynamic_state_samples_per_frame;
+		if (control_input->dense_frame_stacking_flag == 0) {
+			printf("Cannot use dense matrix_type (0) with %d frames per trajectory block unless dense_frame_stacking_flag is 1\n", control_input->frames_per_traj_block);
+			printf("Setting block_size to 1.\n");
+			control_input->frames_per_traj_block = 1;
+		} else if (control_input->num_frame_threads > 1) {
+			printf("Cannot use dense matrix_type (0) with %d frames per trajectory block and %d frame threads\n", control_input->frames_per_traj_block, control_input->num_frame_threads);
+			printf("Setting block_size to 1.\n");
+			control_input->frames_per_traj_block = 1;
+		} else if (n_frame_samples % control_input->frames_per_traj_block != 0) {
+			printf("Cannot use dense matrix_type (0) with %d frames per trajectory block since the number of frame samples (%d) is not divisible by it\n", control_input->frames_per_traj_block, n_frame_samples);
+			printf("Setting block_size to 1.\n");
+			control_input->frames_per_traj_block = 1;
+		}
+	}
+	
+	if (control_input->num_frame_threads < 1) {
+		printf("Please change num_frame_threads to a positive number and recheck your inputs before rerunning.\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	// Frames are only processed in parallel when each frame's normal equations can be formed independently.
+	if ( (control_input->num_frame_threads > 1) &&
+		 ( ((MatrixType)(control_input->matrix_type) != kDense) || (control_input->bootstrapping_flag == 1) || (control_input->iterative_calculation_flag == 1) ||
+		   (control_input->dynamic_types == 1) || (control_input->dynamic_state_sampling == 1) ) ) {
+		printf("Frame-parallel matrix construction is only available for dense matrix_type (0) without bootstrapping, iterative force matching, dynamic types, or dynamic state sampling.\n");
+		printf("Setting num_frame_threads to 1.\n");
+		control_input->num_frame_threads = 1;
 	}
 	
 	if (control_input->frames_per_traj_block < 1) {
@@ -351,7 +391,7 @@ void initialize_dense_matrix(MATRIX_DATA* const mat, ControlInputs* const contro
         exit(EXIT_FAILURE);
     }
     
-    printf("Size of per-frame matrix: %lu bytes \n", mat->fm_matrix_rows * mat->fm_matrix_columns * sizeof(double));
+    printf("Size of per-block matrix: %lu bytes \n", mat->fm_matrix_rows * mat->fm_matrix_columns * sizeof(double));
     printf("Size of normal matrix: %lu bytes \n", mat->fm_matrix_columns * mat->fm_matrix_columns * sizeof(double));
 
     // Allocate memory for the FM matrix and target vector as well as their normal form
@@ -360,10 +400,16 @@ void initialize_dense_matrix(MATRIX_DATA* const mat, ControlInputs* const contro
     mat->dense_fm_matrix = new dense_matrix(mat->fm_matrix_rows, mat->fm_matrix_columns);
     mat->dense_fm_rhs_vector = new double[mat->fm_matrix_rows]();
     
+    // Frame weights are applied by row scaling when several weighted frames share a block.
+    if ( (mat->frames_per_traj_block > 1) && (mat->use_statistical_reweighting == 1) ) {
+    	mat->block_frame_weights = new double[mat->frames_per_traj_block];
+    	for (int i = 0; i < mat->frames_per_traj_block; i++) mat->block_frame_weights[i] = 1.0;
+    }
+    
     if (control_input->bootstrapping_flag == 1) {
-		allocate_bootstrapping(mat, control_input, mat->fm_matrix_columns, mat->fm_matrix_columns);
+		allocate_bootstrapping(mat, control_input, mat->fm_matrix_columns);
     }
-	mat->dense_fm_normal_matrix = new dense_matrix(mat->fm_matrix_columns , mat->fm_matrix_columns);
+	mat->dense_fm_normal_matrix = new packed_symmetric_matrix(mat->fm_matrix_columns);
     mat->dense_fm_normal_rhs_vector = new double[mat->fm_matrix_columns]();
     // Initialized the matrix and vector to zero.
     printf("Initialized a dense FM matrix.\n");
@@ -387,11 +433,7 @@ void initialize_accumulation_matrix(MATRIX_DATA* const mat, ControlInputs* const
     
     mat->accumulate_virial_constraint_matrix_element = insert_accumulation_matrix_virial_element;
     
-    if (control_input->bootstrapping_flag == 1) {
-		mat->finish_fm = solve_accumulation_form_bootstrapping_equations;
-	} else {
-	    mat->finish_fm = solve_accumulation_form_fm_equations;
-	}
+    mat->finish_fm = solve_accumulation_form_fm_equations;
 	        
     // Check that the matrix dimensions are reasonable.
     if ( (unsigned)(mat->fm_matrix_rows / mat->frames_per_traj_block) * (unsigned)(control_input->n_frames) < (unsigned)(mat->fm_matrix_columns) ) {
@@ -410,7 +452,6 @@ void initialize_accumulation_matrix(MATRIX_DATA* const mat, ControlInputs* const
     if (control_input->bootstrapping_flag == 1) {
 		printf("Bootstrapping is not currently supported for accumulation matrix type.\n");
 		exit(EXIT_FAILURE);
- 		allocate_bootstrapping(mat, control_input, mat->fm_matrix_columns, mat->fm_matrix_columns);
     }
 	mat->dense_fm_matrix = new dense_matrix(mat->accumulation_matrix_rows, mat->accumulation_matrix_columns);
 	mat->dense_fm_normal_rhs_vector = new double[mat->accumulation_matrix_columns]();
@@ -479,15 +520,11 @@ void initialize_sparse_matrix(MATRIX_DATA* const mat, ControlInputs* const contr
     	exit(EXIT_FAILURE);
     }
     
-    // Allocate memory for the FM matrix in linked list format and a dense target 
+    // Allocate memory for the FM matrix in sparse row builder format and a dense target 
     // vector as well as temp space for the solution routines and final 
     // solution averaging operation.
     mat->dense_fm_rhs_vector = new double[mat->fm_matrix_rows]();
-    mat->ll_sparse_matrix_row_heads = new linked_list_sparse_matrix_row_head[mat->rows_less_constraint_rows];
-	for(int i = 0; i < mat->rows_less_constraint_rows; i++) {
-    	mat->ll_sparse_matrix_row_heads[i].n = 0;
-    	mat->ll_sparse_matrix_row_heads[i].h = NULL;
-    }
+    mat->sparse_fm_matrix_builder = new sparse_matrix_builder(mat->rows_less_constraint_rows);
     if (control_input->pressure_constraint_flag == 1) mat->dense_fm_matrix = new dense_matrix(control_input->frames_per_traj_block, mat->fm_matrix_columns);
     
     // Allocate a preconditioning temp array.
@@ -498,7 +535,7 @@ void initialize_sparse_matrix(MATRIX_DATA* const mat, ControlInputs* const contr
 
     // Set up the temps and parameters for solving the sparse normal equations.
    	if (control_input->bootstrapping_flag == 1) {
-		allocate_bootstrapping(mat, control_input, mat->fm_matrix_columns, mat->fm_matrix_columns);	
+		allocate_bootstrapping(mat, control_input, mat->fm_matrix_columns);	
 	}
 
     mat->block_fm_solution = new double[mat->fm_matrix_columns]();
@@ -567,23 +604,19 @@ void initialize_sparse_dense_normal_matrix(MATRIX_DATA* const mat, ControlInputs
     
     printf("Size of dense normal matrix: %lu bytes \n", mat->fm_matrix_columns * mat->fm_matrix_columns * sizeof(double));
 
-    // Allocate memory for the FM matrix in linked list format and a dense target 
+    // Allocate memory for the FM matrix in sparse row builder format and a dense target 
     // vector as well as temp space for the solution routines and final 
     // solution averaging operation.
     mat->dense_fm_rhs_vector = new double[mat->fm_matrix_rows]();
-    mat->ll_sparse_matrix_row_heads = new linked_list_sparse_matrix_row_head[mat->rows_less_constraint_rows];
-	for(int i = 0; i < mat->rows_less_constraint_rows; i++) {
-    	mat->ll_sparse_matrix_row_heads[i].n = 0;
-    	mat->ll_sparse_matrix_row_heads[i].h = NULL;
-    }
+    mat->sparse_fm_matrix_builder = new sparse_matrix_builder(mat->rows_less_constraint_rows);
     if (control_input->pressure_constraint_flag == 1) mat->dense_fm_matrix = new dense_matrix(control_input->frames_per_traj_block, mat->fm_matrix_columns);
 	else mat->dense_fm_matrix = new dense_matrix(1, 1); // This is to line-up with memory allocation in solve_dense_matrix
 	
     // These matrices are used for accumulation of normal form before solving
     if (control_input->bootstrapping_flag == 1) {
-		allocate_bootstrapping(mat, control_input, mat->fm_matrix_columns, mat->fm_matrix_columns);
+		allocate_bootstrapping(mat, control_input, mat->fm_matrix_columns);
     }
-	mat->dense_fm_normal_matrix = new dense_matrix(mat->fm_matrix_columns, mat->fm_matrix_columns);
+	mat->dense_fm_normal_matrix = new packed_symmetric_matrix(mat->fm_matrix_columns);
 	mat->dense_fm_normal_rhs_vector = new double[mat->fm_matrix_columns]();
 	printf("Initialized a sparse normal FM matrix.\n");
 }
@@ -651,15 +684,11 @@ void initialize_sparse_sparse_normal_matrix(MATRIX_DATA* const mat, ControlInput
     
     printf("Size of dense normal matrix: %lu bytes \n", mat->fm_matrix_columns * mat->fm_matrix_columns * sizeof(double));
 
-    // Allocate memory for the FM matrix in linked list format and a dense target 
+    // Allocate memory for the FM matrix in sparse row builder format and a dense target 
     // vector as well as temp space for the solution routines and final 
     // solution averaging operation.
     mat->dense_fm_rhs_vector = new double[mat->fm_matrix_rows]();
-    mat->ll_sparse_matrix_row_heads = new linked_list_sparse_matrix_row_head[mat->rows_less_constraint_rows];
-	for(int i = 0; i < mat->rows_less_constraint_rows; i++) {
-    	mat->ll_sparse_matrix_row_heads[i].n = 0;
-    	mat->ll_sparse_matrix_row_heads[i].h = NULL;
-    }
+    mat->sparse_fm_matrix_builder = new sparse_matrix_builder(mat->rows_less_constraint_rows);
     if (control_input->pressure_constraint_flag == 1) mat->dense_fm_matrix = new dense_matrix(control_input->frames_per_traj_block, mat->fm_matrix_columns);
 
 	mat->fm_solution = std::vector<double>(mat->fm_matrix_columns);
@@ -671,7 +700,7 @@ void initialize_sparse_sparse_normal_matrix(MATRIX_DATA* const mat, ControlInput
     
 	// These matrices are used for accumulation of sparse normal form before solving
 	if (control_input->bootstrapping_flag == 1) {
-		allocate_bootstrapping(mat, control_input, mat->fm_matrix_columns, mat->fm_matrix_columns);
+		allocate_bootstrapping(mat, control_input, mat->fm_matrix_columns);
 	}
 	mat->dense_fm_normal_rhs_vector = new double[mat->fm_matrix_columns]();
     mat->sparse_matrix = new csr_matrix(mat->fm_matrix_columns, mat->fm_matrix_columns, mat->max_nonzero_normal_elements);
@@ -679,6 +708,73 @@ void initialize_sparse_sparse_normal_matrix(MATRIX_DATA* const mat, ControlInput
 	printf("Initialized a sparse-sparse normal FM matrix.\n");
 }
 
+// Initialize a sparse-row accumulation whose rows are added directly into dense normal form.
+
+void initialize_direct_normal_matrix(MATRIX_DATA* const mat, ControlInputs* const control_input, CG_MODEL_DATA* const cg)
+{
+    // Set pseudopolymorphic methods
+    mat->set_fm_matrix_to_zero = set_sparse_accumulation_matrix_to_zero;
+    mat->accumulate_fm_matrix_element = insert_sparse_matrix_element;
+    mat->accumulate_target_force_element = accumulate_force_into_dense_target_vector;
+    mat->accumulate_target_constraint_element = accumulate_constraint_into_dense_target_vector;
+    mat->sparse_matrix = NULL;
+    
+    if (control_input->bootstrapping_flag == 1) {
+    	mat->do_end_of_frameblock_matrix_manipulations = accumulate_direct_fm_equation_into_normal_form_and_bootstrap;
+    } else {
+    	mat->do_end_of_frameblock_matrix_manipulations = accumulate_direct_fm_equation_into_normal_form;
+    }
+    
+    mat->accumulate_virial_constraint_matrix_element = insert_sparse_matrix_virial_element;
+    
+    if (control_input->bootstrapping_flag == 1) {
+    	mat->finish_fm = solve_dense_fm_normal_bootstrapping_equations;
+    } else {
+		mat->finish_fm = solve_dense_fm_normal_equations;
+	}
+	
+    // Check that the matrix dimensions are enough that that the equations
+    // will be overdetermined (in a perfect world where all the data is 
+    // linearly independent for each row).
+    if ( (unsigned)(mat->fm_matrix_rows / mat->frames_per_traj_block) * (unsigned)(control_input->n_frames) < (unsigned)(mat->fm_matrix_columns) ) {
+        printf("Current number of frames in this trajectory is too low to provide a fully-determined set of FM equations. Provide more frames in the input trajectory.\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    mat->accumulation_matrix_columns = mat->fm_matrix_columns;
+    mat->accumulation_matrix_rows = mat->fm_matrix_rows;
+ 
+    printf("Number of rows for direct normal matrix algorithm: %d \n", mat->fm_matrix_rows);
+    printf("Number of columns for direct normal matrix algorithm: %d \n", mat->fm_matrix_columns);
+ 
+    // Check that the memory usage is reasonable and print 
+    // memory diagnostics if so. These are checks for integer 
+    // overflow when calculating the size of the matrices.
+
+    if ( (int(INT_MAX) / mat->fm_matrix_columns) <
+        (mat->fm_matrix_columns * (int)(sizeof(double))) ) {
+        printf("Using this number of columns will lead to integer overflow in memory allocation for the normal matrix equations. Decrease the number of basis functions.\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    printf("Size of dense normal matrix: %lu bytes \n", mat->fm_matrix_columns * mat->fm_matrix_columns * sizeof(double));
+
+    // Allocate memory for the FM matrix in sparse row builder format and a dense target 
+    // vector. Only the virial constraint rows are kept as a dense matrix.
+    mat->dense_fm_rhs_vector = new double[mat->fm_matrix_rows]();
+    mat->sparse_fm_matrix_builder = new sparse_matrix_builder(mat->rows_less_constraint_rows);
+    if (control_input->pressure_constraint_flag == 1) mat->dense_fm_matrix = new dense_matrix(control_input->frames_per_traj_block, mat->fm_matrix_columns);
+	else mat->dense_fm_matrix = new dense_matrix(1, 1); // This is to line-up with memory allocation in solve_dense_matrix
+	
+    // These matrices are used for accumulation of normal form before solving
+    if (control_input->bootstrapping_flag == 1) {
+		allocate_bootstrapping(mat, control_input, mat->fm_matrix_columns);
+    }
+	mat->dense_fm_normal_matrix = new packed_symmetric_matrix(mat->fm_matrix_columns);
+	mat->dense_fm_normal_rhs_vector = new double[mat->fm_matrix_columns]();
+	printf("Initialized a direct normal FM matrix.\n");
+}
+
 // "Initialize" a dummy matrix.
 
 void initialize_dummy_matrix(MATRIX_DATA* const mat, ControlInputs* const control_input, CG_MODEL_DATA* const cg) 
@@ -817,12 +913,12 @@ void determine_BI_interaction_rows_and_cols(MATRIX_DATA* mat, InteractionClassCo
   mat->fm_matrix_columns = icomp->ispec->get_num_basis_func();
 }
 
-void allocate_bootstrapping(MATRIX_DATA* mat, ControlInputs* const control_input, const int rows, const int cols)
+void allocate_bootstrapping(MATRIX_DATA* mat, ControlInputs* const control_input, const int cols)
 {
 	// matrices
-	mat->bootstrapping_dense_fm_normal_matrices = new dense_matrix*[control_input->bootstrapping_num_estimates];
+	mat->bootstrapping_dense_fm_normal_matrices = new packed_symmetric_matrix*[control_input->bootstrapping_num_estimates];
   	for (int i = 0; i < control_input->bootstrapping_num_estimates; i++) {
-		mat->bootstrapping_dense_fm_normal_matrices[i] = new dense_matrix(rows, cols);
+		mat->bootstrapping_dense_fm_normal_matrices[i] = new packed_symmetric_matrix(cols);
 	}
 	
 	// rhs vectors
@@ -883,11 +979,12 @@ inline void set_dense_matrix_to_zero(MATRIX_DATA* const mat)
     mat->dense_fm_matrix->reset_matrix();
 }
 
-// Set all elements of a linked-list sparse matrix to zero.
+// Set all elements of a sparse-row-builder sparse matrix to zero.
 
 inline void set_sparse_matrix_to_zero(MATRIX_DATA* const mat)
 {
-	// The row head and element information is cleared in convert_linked_list_to_csr_matrix.
+	// Discard the elements of the sparse part of the matrix.
+	mat->sparse_fm_matrix_builder->reset();
 
     // Set the elements of the dense part of the matrix to zero.
 	for (int k = 0; k < mat->virial_constraint_rows * mat->fm_matrix_columns; k++) {
@@ -895,11 +992,12 @@ inline void set_sparse_matrix_to_zero(MATRIX_DATA* const mat)
     }
 }
 
-// Set all elements of a linked-list sparse matrix to zero when accumulating normal matrix.
+// Set all elements of a sparse-row-builder sparse matrix to zero when accumulating normal matrix.
 
 inline void set_sparse_accumulation_matrix_to_zero(MATRIX_DATA* const mat)
 {
-	// The row head and element information is cleared in convert_linked_list_to_csr_matrix.
+	// Discard the elements of the sparse part of the matrix.
+	mat->sparse_fm_matrix_builder->reset();
 
     // Set the elements of the dense part of the matrix to zero.
    for (int k = 0; k < mat->virial_constraint_rows * mat->fm_matrix_columns; k++) {
@@ -925,22 +1023,6 @@ void set_accumulation_matrix_to_zero(MATRIX_DATA* const mat)
     }
 }
 
-void set_accumulation_matrix_to_zero(MATRIX_DATA* const mat, dense_matrix* const dense_fm_matrix)
-{
-    int k, l;
-    for (k = 0; k < mat->accumulation_matrix_columns; k++) {
-        for (l = 0; l < k; l++) {
-            dense_fm_matrix->values[l * mat->accumulation_matrix_rows + k] = 0.0;
-        }
-    }
-    
-    for (k = mat->accumulation_matrix_columns; k < mat->accumulation_matrix_rows; k++) {
-        for (l = 0; l < mat->accumulation_matrix_columns; l++) {
-           dense_fm_matrix->values[l * mat->accumulation_matrix_rows + k] = 0.0;
-        }
-    }
-}
-
 void set_dummy_matrix_to_zero(MATRIX_DATA* const mat) {}
 
 //---------------------------------------------------------------------
@@ -952,8 +1034,8 @@ void set_dummy_matrix_to_zero(MATRIX_DATA* const mat) {}
 void accumulate_vector_tabulated_forces(InteractionClassComputer* const info, const double &table_fn_val, const int n_body, const int* particle_ids, std::array<double, DIMENSION>* const &derivatives, MATRIX_DATA * const mat) 
 {
     // Calculate the associated forces.
-    // Use flat arrays for performance.
-    std::vector<double> forces(DIMENSION * n_body);
+    // Use flat stack arrays for performance.
+    double forces[DIMENSION * MAX_INTERACTION_BODIES];
     for (int j = 0; j < DIMENSION; j++) forces[DIMENSION * (n_body - 1) + j] = 0.0;
     for (int i = 0; i < n_body - 1; i++) {
         for (int j = 0; j < DIMENSION; j++) {
@@ -974,7 +1056,7 @@ void accumulate_vector_matching_forces(InteractionClassComputer* const info, con
 	int ref_column = info->interaction_class_column_index + info->ispec->interaction_column_indices[info->index_among_matched_interactions - 1];
 	int basis_columns = info->ispec->interaction_column_indices[info->index_among_matched_interactions] - info->ispec->interaction_column_indices[info->index_among_matched_interactions - 1];
 
-    std::vector<double> forces(DIMENSION * n_body);
+    double forces[DIMENSION * MAX_INTERACTION_BODIES];
     for (unsigned k = 0; k < basis_fn_vals.size(); k++) {
         // Calculate the associated forces.
         // Use flat force array for performance.
@@ -1016,72 +1098,11 @@ void accumulate_tabulated_error(InteractionClassComputer* const info, const doub
 // Matrix insertion routines
 //--------------------------------------------------------------------
 
-// Add a three-component nonzero force value to a linked list format sparse matrix.
+// Add a three-component nonzero force value to a sparse row builder format sparse matrix.
 
 void insert_sparse_matrix_element(const int i, const int j, double* const x, MATRIX_DATA* const mat)
 {
-    struct linked_list_sparse_matrix_element* curr_elem, *prev_elem, *head, *pt;
-    int k;
-    
-    head = mat->ll_sparse_matrix_row_heads[i].h;
-    
-    // If the linked list is empty
-    if (head == NULL) {
-        pt = new linked_list_sparse_matrix_element;
-        mat->ll_sparse_matrix_row_heads[i].h = pt;
-        pt->col = j;
-        for (k = 0; k < DIMENSION; k++) pt->valx[k] = x[k];
-        pt->next = NULL;
-        mat->ll_sparse_matrix_row_heads[i].n += 1;
-        
-    // If the linked list is not empty
-    } else {
-        curr_elem = head;
-        prev_elem = NULL;
-        while (curr_elem != NULL) {
-            // If the element exists, add
-            if (curr_elem->col == j) {
-                for (k = 0; k < DIMENSION; k++) curr_elem->valx[k] += x[k];
-                prev_elem = curr_elem;
-                break;
-            
-            // If the new element should be ahead of the next in the list
-            } else if (curr_elem->col > j) {
-                
-                // If the new element should be the first in the list
-                if (prev_elem == NULL) {
-                    pt = new linked_list_sparse_matrix_element;
-                    mat->ll_sparse_matrix_row_heads[i].h = pt;
-                    pt->col = j;
-                    for (k = 0; k < DIMENSION; k++) pt->valx[k] = x[k];
-                    pt->next = curr_elem;
-
-                // General case
-                } else {
-                    pt = new linked_list_sparse_matrix_element;
-                    prev_elem->next = pt;
-                    pt->col = j;
-                    for (k = 0; k < DIMENSION; k++) pt->valx[k] = x[k];
-                    pt->next = curr_elem;
-                }
-                mat->ll_sparse_matrix_row_heads[i].n += 1;
-                prev_elem = curr_elem;
-                break;
-            }
-            prev_elem = curr_elem;
-            curr_elem = prev_elem->next;
-        }
-        
-        // If the new element should be the last
-        if (prev_elem->col < j) {
-            pt = new linked_list_sparse_matrix_element;
-            prev_elem->next = pt;
-            pt->col = j;
-            for (k = 0; k < DIMENSION; k++) pt->valx[k] = x[k];
-            pt->next = NULL;
-            mat->ll_sparse_matrix_row_heads[i].n += 1;
-        }
-    }   
+    mat->sparse_fm_matrix_builder->insert(i, j, x);
 }
 
 // Add a dimension-sized force element to a dense matrix.
@@ -1111,7 +1132,7 @@ inline void insert_scalar_matrix_element(const int i, const int j, double const
 
 inline void insert_dense_matrix_virial_element(const int m, const int n, const double x, MATRIX_DATA* const mat)
 {
-    mat->dense_fm_matrix->add_scalar(mat->rows_less_constraint_rows * DIMENSION, n, x);
+    mat->dense_fm_matrix->add_scalar(mat->rows_less_constraint_rows * DIMENSION + m, n, x);
 }
 
 // Add a scalar virial contribution to a sparse matrix.
@@ -1134,7 +1155,7 @@ inline void insert_accumulation_matrix_virial_element(const int m, const int n,
 
 void add_target_virials_from_trajectory(MATRIX_DATA* const mat, double *pressure_constraint_rhs_vector)
 {
-    if (mat->matrix_type == kDense || mat->matrix_type == kSparse) {
+    if (mat->matrix_type == kDense || mat->matrix_type == kSparse || mat->matrix_type == kSparseNormal || mat->matrix_type == kSparseSparse || mat->matrix_type == kDirectNormal) {
         calculate_target_virial_in_dense_vector(mat, pressure_constraint_rhs_vector);
     } else if (mat->matrix_type == kAccumulation) {
         calculate_target_virial_in_accumulation_vector(mat, pressure_constraint_rhs_vector);
@@ -1151,7 +1172,6 @@ void calculate_target_virial_in_dense_vector(MATRIX_DATA* const mat, double *pre
 	int frame_sample  =  mat->trajectory_block_index * mat->virial_constraint_rows;
     for (int k = 0; k < mat->virial_constraint_rows; k++) {
         mat->dense_fm_rhs_vector[mat->rows_less_constraint_rows * DIMENSION + k] = pressure_constraint_rhs_vector[(int)((frame_sample + k)/ mat->dynamic_state_samples_per_frame)];
-        frame_sample++;
     }
 }
 
@@ -1163,13 +1183,12 @@ void calculate_target_virial_in_accumulation_vector(MATRIX_DATA* const mat, doub
 	int frame_sample  =  mat->trajectory_block_index * mat->virial_constraint_rows;
     for (int k = 0; k < mat->virial_constraint_rows; k++) {
         mat->dense_fm_matrix->values[mat->fm_matrix_columns * mat->accumulation_matrix_rows + mat->rows_less_constraint_rows * DIMENSION + mat->accumulation_row_shift + k] = pressure_constraint_rhs_vector[(int)((frame_sample + k) / mat->dynamic_state_samples_per_frame)];
-    	frame_sample++;
     }
 }
 
 void add_target_force_from_trajectory(int shift_i, int site_i, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &f) 
 {
-    if (mat->matrix_type == kDense || mat->matrix_type == kSparse || mat->matrix_type == kSparseNormal || mat->matrix_type == kSparseSparse) {
+    if (mat->matrix_type == kDense || mat->matrix_type == kSparse || mat->matrix_type == kSparseNormal || mat->matrix_type == kSparseSparse || mat->matrix_type == kDirectNormal) {
         calculate_target_force_dense_vector(shift_i, site_i, mat, f);
     } else if (mat->matrix_type == kAccumulation) {
         calculate_target_force_accumulation_vector(shift_i, site_i, mat, f);
@@ -1233,25 +1252,29 @@ void accumulate_scalar_into_dense_target_vector(MATRIX_DATA* mat, int particle_i
 // End-of-frame-block routines
 //--------------------------------------------------------------------
 
-// The dense matrix calculation uses single-frame blocks and proceeds
-// by taking the normal form of each frame's MS-CG equations and
-// adding all of those up frame by frame until the trajectory is
-// exhausted.
+// The dense matrix calculation proceeds by taking the normal form of 
+// each block's MS-CG equations and adding all of those up block by 
+// block until the trajectory is exhausted. Stacking several frames 
+// in one block turns many thin rank-k updates into a single larger one.
 
 void convert_dense_fm_equation_to_normal_form_and_accumulate(MATRIX_DATA* const mat)
 {
     double frame_weight = mat->get_frame_weight() * mat->normalization;
+    if (mat->block_frame_weights != NULL) {
+    	scale_dense_fm_rows_by_frame_weights(mat);
+    	frame_weight = mat->normalization;
+    }
  	create_dense_normal_form(mat, frame_weight, mat->dense_fm_matrix,mat->dense_fm_normal_matrix, mat->dense_fm_rhs_vector, mat->dense_fm_normal_rhs_vector);
 }
 
 void convert_dense_fm_equation_to_normal_form_and_bootstrap(MATRIX_DATA* const mat)
 {
 	int onei = 1.0;
-	int matrix_size = mat->fm_matrix_columns * mat->fm_matrix_columns;
 
 	// Create temp normal matrix and rhs vector.
-	dense_matrix* temp_normal_matrix = new dense_matrix(mat->fm_matrix_columns, mat->fm_matrix_columns);
+	packed_symmetric_matrix* temp_normal_matrix = new packed_symmetric_matrix(mat->fm_matrix_columns);
 	double* temp_normal_rhs_vector = new double[mat->fm_matrix_columns]();
+	int matrix_size = temp_normal_matrix->get_size();
 
 	create_dense_normal_form(mat, 1.0, mat->dense_fm_matrix, temp_normal_matrix, mat->dense_fm_rhs_vector, temp_normal_rhs_vector);
 	
@@ -1278,6 +1301,34 @@ void convert_dense_fm_equation_to_normal_form_and_bootstrap(MATRIX_DATA* const m
 	delete [] temp_normal_rhs_vector;
 }
 
+// Scale each frame's rows of a dense block (forces, virial, and targets)
+// by the square root of that frame's weight so that the normal form of 
+// the block carries the weight of every frame.
+
+void scale_dense_fm_rows_by_frame_weights(MATRIX_DATA* const mat)
+{
+	int n_frame_rows = DIMENSION * mat->rows_less_constraint_rows / mat->frames_per_traj_block;
+	for (int frame = 0; frame < mat->frames_per_traj_block; frame++) {
+		double weight = mat->block_frame_weights[frame];
+		if (weight == 1.0) continue;
+		if (weight < 0.0) {
+			printf("Cannot apply negative frame weight %lf by row scaling. Set block_size to 1.\n", weight);
+			exit(EXIT_FAILURE);
+		}
+		double row_scale = sqrt(weight);
+		int first_row = frame * n_frame_rows;
+		for (int l = 0; l < mat->fm_matrix_columns; l++) {
+			cblas_dscal(n_frame_rows, row_scale, &mat->dense_fm_matrix->values[l * mat->fm_matrix_rows + first_row], 1);
+		}
+		cblas_dscal(n_frame_rows, row_scale, &mat->dense_fm_rhs_vector[first_row], 1);
+		if (mat->virial_constraint_rows > 0) {
+			int virial_row = DIMENSION * mat->rows_less_constraint_rows + frame;
+			cblas_dscal(mat->fm_matrix_columns, row_scale, &mat->dense_fm_matrix->values[virial_row], mat->fm_matrix_rows);
+			mat->dense_fm_rhs_vector[virial_row] *= row_scale;
+		}
+	}
+}
+
 // As above, but ignoring the FM matrix.
 // Used for Lanyuan's iterative method, in which only the FM target vector is recalculated.
 
@@ -1291,6 +1342,48 @@ void convert_dense_target_force_vector_to_normal_form_and_accumulate(MATRIX_DATA
     cblas_dgemv(CblasColMajor, CblasTrans, mat->fm_matrix_rows, mat->fm_matrix_columns, frame_weight, mat->dense_fm_matrix->values, mat->fm_matrix_rows, mat->dense_fm_rhs_vector, onei, oned, mat->dense_fm_normal_rhs_vector, onei);
 }
 
+// Frame-parallel dense calculations give each thread a copy of the matrix
+// with its own per-frame FM matrix and its own partial normal equations.
+// Since the normal equations are sums over frames, the partial sums are
+// added into the original matrix once all frames have been processed.
+
+MATRIX_DATA* copy_dense_matrix_for_thread(MATRIX_DATA* const mat)
+{
+	// Start from a shallow copy so that the layout, weighting, and function pointers match.
+	MATRIX_DATA* thread_mat = new MATRIX_DATA(*mat);
+
+	thread_mat->dense_fm_matrix = new dense_matrix(mat->fm_matrix_rows, mat->fm_matrix_columns);
+	thread_mat->dense_fm_rhs_vector = new double[mat->fm_matrix_rows]();
+	thread_mat->dense_fm_normal_matrix = new packed_symmetric_matrix(mat->fm_matrix_columns);
+	thread_mat->dense_fm_normal_rhs_vector = new double[mat->fm_matrix_columns]();
+	thread_mat->force_sq_total = 0.0;
+
+	// The regularization, bootstrapping, and block weighting data still belong to the original matrix.
+	thread_mat->regularization_style = 0;
+	thread_mat->bootstrapping_flag = 0;
+	thread_mat->block_frame_weights = NULL;
+	return thread_mat;
+}
+
+void reduce_and_free_thread_dense_matrix(MATRIX_DATA* const mat, MATRIX_DATA* const thread_mat)
+{
+	int onei = 1;
+	int matrix_size = mat->dense_fm_normal_matrix->get_size();
+
+	cblas_daxpy(matrix_size, 1.0, thread_mat->dense_fm_normal_matrix->values, onei, mat->dense_fm_normal_matrix->values, onei);
+	cblas_daxpy(mat->fm_matrix_columns, 1.0, thread_mat->dense_fm_normal_rhs_vector, onei, mat->dense_fm_normal_rhs_vector, onei);
+	mat->force_sq_total += thread_mat->force_sq_total;
+
+	delete thread_mat->dense_fm_matrix;
+	delete [] thread_mat->dense_fm_rhs_vector;
+	delete thread_mat->dense_fm_normal_matrix;
+	delete [] thread_mat->dense_fm_normal_rhs_vector;
+	// The destructor must not free these again.
+	thread_mat->dense_fm_rhs_vector = NULL;
+	thread_mat->dense_fm_normal_rhs_vector = NULL;
+	delete thread_mat;
+}
+
 // Perform the accumulation operation (QR decomposition followed by composition) to combine the
 // current frame's FM matrix with the growing accumulation matrix.
 
@@ -1403,11 +1496,11 @@ void convert_sparse_fm_equation_to_sparse_normal_form_and_accumulate(MATRIX_DATA
     // Calculate the weight of this part of the normal equations in the overall equations
 	double frame_weight = mat->get_frame_weight() * mat->normalization;
 
-    // Convert from linked list format to CSR format
+    // Convert from sparse row builder format to CSR format
     // Note: These MKL functions use a one-based index for row_sizes and column_indices
     int n_nonzero_matrix_elements = get_n_nonzero_matrix_elements(mat);
     csr_matrix csr_fm_matrix(mat->fm_matrix_rows, mat->fm_matrix_columns, n_nonzero_matrix_elements);
-    convert_linked_list_to_csr_matrix(mat, csr_fm_matrix);
+    convert_sparse_builder_to_csr_matrix(mat, csr_fm_matrix);
 	
    // Convert CSR matrix and dense RHS vector to normal-form    
    // Form sparse normal-form left-hand side matrix using mkl_dcsrmultcsr
@@ -1437,13 +1530,11 @@ void convert_sparse_fm_equation_to_sparse_normal_form_and_accumulate(MATRIX_DATA
    // Frame weight is applied to normal matrix in this step
    sparse_matrix_addition(mat, frame_weight, nnzmax, csr_normal_matrix, mat->sparse_matrix);
 
-   #if _mkl_flag == 1
    int onei = 1;	
    // Accumulate normal form right-hand size vector with previous/future vectors
    // Frame weight is applied to normal vector in this step
    cblas_daxpy(mat->fm_matrix_columns, frame_weight,
 		dense_rhs_normal_vector, onei, mat->dense_fm_normal_rhs_vector, onei);
-   #endif
 		
    // CSR formatted FM and normal temp matrices are freed by destructor at end of function
    // Free the intermediate normal form matrix and vector
@@ -1453,11 +1544,11 @@ void convert_sparse_fm_equation_to_sparse_normal_form_and_accumulate(MATRIX_DATA
 void convert_sparse_fm_equation_to_sparse_normal_form_and_bootstrap(MATRIX_DATA* const mat)
 {
 	double frame_weight = 1.0;
-    // Convert from linked list format to CSR format
+    // Convert from sparse row builder format to CSR format
     // Note: These MKL functions use a one-based index for row_sizes and column_indices
     int n_nonzero_matrix_elements = get_n_nonzero_matrix_elements(mat);
     csr_matrix csr_fm_matrix(mat->fm_matrix_rows, mat->fm_matrix_columns, n_nonzero_matrix_elements);
-    convert_linked_list_to_csr_matrix(mat, csr_fm_matrix);
+    convert_sparse_builder_to_csr_matrix(mat, csr_fm_matrix);
    
    // Convert CSR matrix and dense RHS vector to normal-form    
    // Form sparse normal-form left-hand side matrix using mkl_dcsrmultcsr
@@ -1532,11 +1623,11 @@ void convert_sparse_fm_equation_to_dense_normal_form_and_accumulate(MATRIX_DATA*
     // Calculate the weight of this part of the normal equations in the overall equations
     double frame_weight = mat->get_frame_weight() * mat->normalization; 
 
-   // Convert from linked list format to CSR format
+   // Convert from sparse row builder format to CSR format
    // Note: These MKL functions use a one-based index for row_sizes and column_indices
    int n_nonzero_matrix_elements = get_n_nonzero_matrix_elements(mat);
    csr_matrix csr_fm_matrix(mat->fm_matrix_rows, mat->fm_matrix_columns, n_nonzero_matrix_elements);
-   convert_linked_list_to_csr_matrix(mat, csr_fm_matrix);
+   convert_sparse_builder_to_csr_matrix(mat, csr_fm_matrix);
    
    // Convert CSR matrix and dense RHS vector to normal-form    
    // Form sparse normal-form left-hand side matrix using mkl_dcsrmultcsr
@@ -1555,12 +1646,14 @@ void convert_sparse_fm_equation_to_dense_normal_form_and_accumulate(MATRIX_DATA*
    mkl_dcsrgemv(&trans, &(mat->fm_matrix_rows), csr_fm_matrix.values, 
 		csr_fm_matrix.row_sizes, csr_fm_matrix.column_indices,
    		mat->dense_fm_rhs_vector, dense_rhs_normal_vector);
+   #else
+   native_csr_times_vector('t', &csr_fm_matrix, mat->dense_fm_rhs_vector, dense_rhs_normal_vector);
+   #endif
 
    // Accumulate normal form right-hand size vector with previous/future vectors
    // Frame weight is applied to normal vector in this step  
    cblas_daxpy( mat->fm_matrix_columns, frame_weight,
 		dense_rhs_normal_vector, 1, mat->dense_fm_normal_rhs_vector, 1);
-   #endif
    
 	// Free the intermediate normal form vector
 	delete [] dense_rhs_normal_vector;
@@ -1568,25 +1661,10 @@ void convert_sparse_fm_equation_to_dense_normal_form_and_accumulate(MATRIX_DATA*
    // Check if it makes more sense to create intermediate normal form matrix as sparse or dense
    // Either way frame weight is applied to normal matrix
    if (nnzmax * 2 > mat->fm_matrix_columns * mat->fm_matrix_columns) {
-      // Process intermediate using dense matrix
-	  // Allocate space for dense normal_form_matrix
-      double* normal_matrix = new double[mat->fm_matrix_columns * mat->fm_matrix_columns]();
-	
-	  #if _mkl_flag == 1
-	  // Form dense normal form matrix using 
-	  mkl_dcsrmultd(&trans, &(mat->fm_matrix_rows), &(mat->fm_matrix_columns), &(mat->fm_matrix_columns),
-	    csr_fm_matrix.values, csr_fm_matrix.column_indices, csr_fm_matrix.row_sizes, 
-   		csr_fm_matrix.values, csr_fm_matrix.column_indices, csr_fm_matrix.row_sizes, 
-   	    normal_matrix, &(mat->fm_matrix_columns) );
-	  
-	  // Accumulate normal form matrix with previous/future normal form matrices
+      // Process intermediate by adding the products of each row's elements
+	  // directly into the packed normal matrix.
 	  // This operation also applies the frame weight
-	  cblas_daxpy( mat->fm_matrix_columns * mat->fm_matrix_columns, frame_weight,
-	  	normal_matrix, 1, mat->dense_fm_normal_matrix->values, 1);
-	  #endif
-	    
-	  // Free the temp normal matrix
-	  delete [] normal_matrix;
+	  native_csr_transpose_times_csr_to_packed(frame_weight, &csr_fm_matrix, mat->dense_fm_normal_matrix);
 	  
    } else {
 	  // Process intermediate using sparse matrix
@@ -1604,6 +1682,8 @@ void convert_sparse_fm_equation_to_dense_normal_form_and_accumulate(MATRIX_DATA*
    		printf("Error: Value returned from mkl_dcsrmultcsr is %d!\n", info);
    		exit(EXIT_FAILURE);
       }
+	  #else
+	  native_csr_transpose_times_csr(mat->num_sparse_threads, nnzmax, &csr_fm_matrix, &csr_normal_matrix);
 	  #endif
 	
 	  // Accumulate normal form matrix with previous/future normal form matrices
@@ -1611,7 +1691,9 @@ void convert_sparse_fm_equation_to_dense_normal_form_and_accumulate(MATRIX_DATA*
 	  // but for now it is being done manually.
 	  for( k = 0; k < mat->fm_matrix_columns; k++) { // k is actually rows of normal matrix is this context
 		for( l = csr_normal_matrix.row_sizes[k] - 1; l < csr_normal_matrix.row_sizes[k+1] - 1; l++) {
-			mat->dense_fm_normal_matrix->values[ k * mat->fm_matrix_columns + csr_normal_matrix.column_indices[l] ] += csr_normal_matrix.values[l] * frame_weight;
+			// Column indices are one-based and only the upper triangle is kept.
+			if (csr_normal_matrix.column_indices[l] - 1 > k) continue;
+			mat->dense_fm_normal_matrix->add_scalar(csr_normal_matrix.column_indices[l] - 1, k, csr_normal_matrix.values[l] * frame_weight);
 		}
 	  } 
       // CSR formatted FM and normal temp matrices are freed by destructor at end of function
@@ -1623,14 +1705,13 @@ void convert_sparse_fm_equation_to_dense_normal_form_and_bootstrap(MATRIX_DATA*
    int k, l;
    // Calculate the weight of this part of the normal equations in the overall equations
    double frame_weight; 
-   int num_elements = mat->fm_matrix_columns * mat->fm_matrix_columns;
    int onei=1;
 	
-   // Convert from linked list format to CSR format
+   // Convert from sparse row builder format to CSR format
    // Note: These MKL functions use a one-based index for row_sizes and column_indices
    int n_nonzero_matrix_elements = get_n_nonzero_matrix_elements(mat);
    csr_matrix csr_fm_matrix(mat->fm_matrix_rows, mat->fm_matrix_columns, n_nonzero_matrix_elements);
-   convert_linked_list_to_csr_matrix(mat, csr_fm_matrix);
+   convert_sparse_builder_to_csr_matrix(mat, csr_fm_matrix);
    
    // Convert CSR matrix and dense RHS vector to normal-form    
    // Form sparse normal-form left-hand side matrix using mkl_dcsrmultcsr
@@ -1649,7 +1730,9 @@ void convert_sparse_fm_equation_to_dense_normal_form_and_bootstrap(MATRIX_DATA*
    mkl_dcsrgemv(&trans, &(mat->fm_matrix_rows), csr_fm_matrix.values, 
 		csr_fm_matrix.row_sizes, csr_fm_matrix.column_indices,
    		mat->dense_fm_rhs_vector, dense_rhs_normal_vector);
-	#endif
+   #else
+   native_csr_times_vector('t', &csr_fm_matrix, mat->dense_fm_rhs_vector, dense_rhs_normal_vector);
+   #endif
    
    // Accumulate for master.
    frame_weight = mat->get_frame_weight() * mat->normalization; 
@@ -1669,21 +1752,11 @@ void convert_sparse_fm_equation_to_dense_normal_form_and_bootstrap(MATRIX_DATA*
    // Check if it makes more sense to create intermediate normal form matrix as sparse or dense.
    // Either way frame weight is applied to normal matrix.
    if (nnzmax * 2 > mat->fm_matrix_columns * mat->fm_matrix_columns) {
-      // Process intermediate using dense matrix
-	  // Allocate space for dense normal_form_matrix
-      double* normal_matrix = new double[mat->fm_matrix_columns * mat->fm_matrix_columns]();
-	
-	  #if _mkl_flag == 1
-	  // Form dense normal form matrix using 
-	  mkl_dcsrmultd(&trans, &(mat->fm_matrix_rows), &(mat->fm_matrix_columns), &(mat->fm_matrix_columns),
-	    csr_fm_matrix.values, csr_fm_matrix.column_indices, csr_fm_matrix.row_sizes, 
-   		csr_fm_matrix.values, csr_fm_matrix.column_indices, csr_fm_matrix.row_sizes, 
-   	    normal_matrix, &(mat->fm_matrix_columns) );
-	  #endif
-	  
+      // Process intermediate by adding the products of each row's elements
+	  // directly into each packed normal matrix.
 	  // Accumulate for master.
 	  frame_weight = mat->get_frame_weight() * mat->normalization; 
-	  cblas_daxpy(num_elements, frame_weight, normal_matrix, onei, mat->dense_fm_normal_matrix->values, onei);
+	  native_csr_transpose_times_csr_to_packed(frame_weight, &csr_fm_matrix, mat->dense_fm_normal_matrix);
 	  
 	  // Accumulate normal form matrix with previous/future normal form matrices.
 	  // This operation also applies the frame weight.
@@ -1692,11 +1765,8 @@ void convert_sparse_fm_equation_to_dense_normal_form_and_bootstrap(MATRIX_DATA*
 		if(frame_weight == 0.0) continue;
 		frame_weight *= mat->bootstrapping_normalization[i];
 
-	  	cblas_daxpy(num_elements, frame_weight, normal_matrix, onei, mat->bootstrapping_dense_fm_normal_matrices[i]->values, onei);
+	  	native_csr_transpose_times_csr_to_packed(frame_weight, &csr_fm_matrix, mat->bootstrapping_dense_fm_normal_matrices[i]);
 	  }
-	    
-	  // Free the temp normal matrix
-	  delete [] normal_matrix;
 	  
    } else {
 	  // Process intermediate using sparse matrix
@@ -1714,13 +1784,17 @@ void convert_sparse_fm_equation_to_dense_normal_form_and_bootstrap(MATRIX_DATA*
    		printf("Error: Value returned from mkl_dcsrmultcsr is %d!\n", info);
    		exit(EXIT_FAILURE);
       }
+	  #else
+	  native_csr_transpose_times_csr(mat->num_sparse_threads, nnzmax, &csr_fm_matrix, &csr_normal_matrix);
 	  #endif
 	
 	  // Accumulate for master.
 	  frame_weight = mat->get_frame_weight() * mat->normalization; 
 	  for( k = 0; k < mat->fm_matrix_columns; k++) { // k is actually rows of normal matrix is this context
 		for( l = csr_normal_matrix.row_sizes[k] - 1; l < csr_normal_matrix.row_sizes[k+1] - 1; l++) {
-			mat->dense_fm_normal_matrix->values[ k * mat->fm_matrix_columns + csr_normal_matrix.column_indices[l] ] += csr_normal_matrix.values[l] * frame_weight;
+			// Column indices are one-based and only the upper triangle is kept.
+			if (csr_normal_matrix.column_indices[l] - 1 > k) continue;
+			mat->dense_fm_normal_matrix->add_scalar(csr_normal_matrix.column_indices[l] - 1, k, csr_normal_matrix.values[l] * frame_weight);
 		}
 	  } 
       
@@ -1734,7 +1808,8 @@ void convert_sparse_fm_equation_to_dense_normal_form_and_bootstrap(MATRIX_DATA*
 
 	    for( k = 0; k < mat->fm_matrix_columns; k++) { // k is actually rows of normal matrix is this context
 			for( l = csr_normal_matrix.row_sizes[k] - 1; l < csr_normal_matrix.row_sizes[k+1] - 1; l++) {
-				mat->bootstrapping_dense_fm_normal_matrices[i]->values[ k * mat->fm_matrix_columns + csr_normal_matrix.column_indices[l] ] += csr_normal_matrix.values[l] * frame_weight;
+				if (csr_normal_matrix.column_indices[l] - 1 > k) continue;
+				mat->bootstrapping_dense_fm_normal_matrices[i]->add_scalar(csr_normal_matrix.column_indices[l] - 1, k, csr_normal_matrix.values[l] * frame_weight);
 			}
 	  	}
 	  } 
@@ -1742,11 +1817,37 @@ void convert_sparse_fm_equation_to_dense_normal_form_and_bootstrap(MATRIX_DATA*
   	 }
 }
 
+// The sparse rows of the FM matrix are added into the dense normal form 
+// directly after every block, and the accumulated normal form equations 
+// are solved after the entire trajectory is read.
+
+void accumulate_direct_fm_equation_into_normal_form(MATRIX_DATA* const mat)
+{
+    double frame_weight = mat->get_frame_weight() * mat->normalization;
+    add_direct_normal_form(mat, frame_weight, mat->dense_fm_normal_matrix, mat->dense_fm_normal_rhs_vector);
+}
+
+// Each bootstrap estimate adds the block's rows into its own normal equations
+// with its own weight, as is done for the master equations.
+
+void accumulate_direct_fm_equation_into_normal_form_and_bootstrap(MATRIX_DATA* const mat)
+{
+	double frame_weight = mat->get_frame_weight() * mat->normalization;
+	add_direct_normal_form(mat, frame_weight, mat->dense_fm_normal_matrix, mat->dense_fm_normal_rhs_vector);
+	
+	for (int i = 0; i < mat->bootstrapping_num_estimates; i++) {
+		frame_weight = mat->bootstrapping_weights[i][mat->trajectory_block_index];
+		if(frame_weight == 0.0) continue;
+		frame_weight *= mat->bootstrapping_normalization[i];
+		add_direct_normal_form(mat, frame_weight, mat->bootstrapping_dense_fm_normal_matrices[i], mat->bootstrapping_dense_fm_normal_rhs_vectors[i]);
+	}
+}
+
 void do_nothing_to_fm_matrix(MATRIX_DATA* const mat) {}
 
 // Helper routines for sparse matrix operations.
 
-// This function determines the number of non-zero matrix elements by walking the linked-list matrix and dense virial constraint data
+// This function determines the number of non-zero matrix elements by walking the sparse row builder and dense virial constraint data
 
 int get_n_nonzero_matrix_elements(MATRIX_DATA* const mat)
 {
@@ -1754,7 +1855,7 @@ int get_n_nonzero_matrix_elements(MATRIX_DATA* const mat)
 	
     // Begin by calculating the total number of non-zero elements in this block
     for (int k = 0; k < mat->rows_less_constraint_rows; k++) {
-        n_nonzero_matrix_elements += mat->ll_sparse_matrix_row_heads[k].n;
+        n_nonzero_matrix_elements += mat->sparse_fm_matrix_builder->row_size(k);
     }
     n_nonzero_matrix_elements *= DIMENSION;
     if (mat->virial_constraint_rows > 0) {
@@ -1769,45 +1870,35 @@ int get_n_nonzero_matrix_elements(MATRIX_DATA* const mat)
    return n_nonzero_matrix_elements;
 }
  
-// Helper function to convert the sparse matrix accumulated as a linked list to CSR format
-void convert_linked_list_to_csr_matrix(MATRIX_DATA* const mat, csr_matrix& csr_fm_matrix)
+// Helper function to convert the sparse matrix accumulated in the sparse row builder to CSR format
+void convert_sparse_builder_to_csr_matrix(MATRIX_DATA* const mat, csr_matrix& csr_fm_matrix)
 {   
    int row_counter, row_size, num_in_row, rowD;
-   struct linked_list_sparse_matrix_element* curr_elem, *prev_elem;
+   sparse_matrix_builder* builder = mat->sparse_fm_matrix_builder;
    double value;
    	
    for (int k = 0; k < mat->rows_less_constraint_rows; k++) {
-        curr_elem = mat->ll_sparse_matrix_row_heads[k].h;
-        row_counter = 0;
-        while (curr_elem != NULL) {
-            row_size = csr_fm_matrix.row_sizes[DIMENSION * k];
-            num_in_row = mat->ll_sparse_matrix_row_heads[k].n;
+        row_size = csr_fm_matrix.row_sizes[DIMENSION * k];
+        num_in_row = builder->row_size(k);
+        const sparse_matrix_element* row_elements = builder->row_elements(k);
+        for (row_counter = 0; row_counter < num_in_row; row_counter++) {
+            const sparse_matrix_element& curr_elem = row_elements[row_counter];
 
             for (int i = 0; i < DIMENSION; i++) {
 	            // add to element values list (adjust for built-in one-base added in row_size[0] above
-	            csr_fm_matrix.values[row_size + i * num_in_row + row_counter - 1] = curr_elem->valx[i];
+	            csr_fm_matrix.values[row_size + i * num_in_row + row_counter - 1] = curr_elem.valx[i];
     	
     	        // add to column indices list
-        	    csr_fm_matrix.column_indices[row_size + i * num_in_row + row_counter - 1] = curr_elem->col + 1;					// convert to one-base for columns
+        	    csr_fm_matrix.column_indices[row_size + i * num_in_row + row_counter - 1] = curr_elem.col + 1;					// convert to one-base for columns
 			}
-			
-            //move on and delete previous element
-            prev_elem = curr_elem;
-            curr_elem = prev_elem->next;
-            delete prev_elem;
-            row_counter++;
         }
         // add to row size list
         rowD =  DIMENSION * k;
         // Note: one-base in taken into account at element 0, so no further modification is needed for rows
         
         for (int i = 0; i < DIMENSION; i++) {
-	        csr_fm_matrix.row_sizes[rowD + 1 + i] = csr_fm_matrix.row_sizes[rowD + i] + row_counter;		
+	        csr_fm_matrix.row_sizes[rowD + 1 + i] = csr_fm_matrix.row_sizes[rowD + i] + num_in_row;		
 		}
-				
-		// reset row head information
-		mat->ll_sparse_matrix_row_heads[k].h = NULL;
-        mat->ll_sparse_matrix_row_heads[k].n = 0;
 	}
 
     if (mat->virial_constraint_rows > 0) {
@@ -1916,6 +2007,9 @@ void sparse_matrix_addition(MATRIX_DATA* const mat, double frame_weight, int nnz
    		printf("Error: Value returned from mkl_dcsradd is %d!\n", info);
    		exit(EXIT_FAILURE);
    	}
+	#else
+	native_csr_addition(mat->fm_matrix_columns, mat->fm_matrix_columns, nnzmax, main_normal_matrix, frame_weight, &csr_normal_matrix,
+		extra_csr_normal_matrix_values, extra_csr_normal_matrix_column_indices, extra_csr_normal_matrix_row_sizes);
 	#endif
 	
    	// Switch accumulated normal matrix with extra (temp array)
@@ -1962,15 +2056,283 @@ void regularize_vector_sparse_matrix(MATRIX_DATA* const mat, csr_matrix* csr_nor
    // temp regularization matrix is automatically deleted at end of function
 }
  
+// Native sparse kernels used in place of the MKL sparse BLAS and PARDISO
+// routines when compiling without MKL. All CSR matrices use the same
+// one-based row_sizes and column_indices convention as the MKL routines.
+
+// Form the rows [first_row, last_row) of the product of the transpose of a
+// CSR matrix with itself, given the transpose in (zero-based) CSR form.
+// Each row is accumulated densely and written out with sorted columns.
+
+void native_csr_transpose_times_csr_rows(const csr_matrix* const csr_fm_matrix, const int* const transpose_row_sizes, const int* const transpose_row_indices, const double* const transpose_values, const int first_row, const int last_row, std::vector<int>& row_counts, std::vector<int>& column_indices, std::vector<double>& values)
+{
+	std::vector<double> accumulator(csr_fm_matrix->n_cols, 0.0);
+	std::vector<int> marker(csr_fm_matrix->n_cols, -1);
+	std::vector<int> row_columns;
+	
+	for (int i = first_row; i < last_row; i++) {
+		row_columns.clear();
+		// Each entry k of column i of the FM matrix contributes that entry times row k.
+		for (int p = transpose_row_sizes[i]; p < transpose_row_sizes[i + 1]; p++) {
+			int k = transpose_row_indices[p];
+			double a_ki = transpose_values[p];
+			for (int q = csr_fm_matrix->row_sizes[k] - 1; q < csr_fm_matrix->row_sizes[k + 1] - 1; q++) {
+				int j = csr_fm_matrix->column_indices[q] - 1;
+				if (marker[j] != i) {
+					marker[j] = i;
+					accumulator[j] = 0.0;
+					row_columns.push_back(j);
+				}
+				accumulator[j] += a_ki * csr_fm_matrix->values[q];
+			}
+		}
+		std::sort(row_columns.begin(), row_columns.end());
+		for (unsigned q = 0; q < row_columns.size(); q++) {
+			column_indices.push_back(row_columns[q] + 1);
+			values.push_back(accumulator[row_columns[q]]);
+		}
+		row_counts.push_back(row_columns.size());
+	}
+}
+
+// Form the normal matrix (A^T * A) of a CSR matrix as a CSR matrix with 
+// at most nnzmax entries, splitting the rows over num_sparse_threads threads.
+
+void native_csr_transpose_times_csr(const int num_threads, const int nnzmax, csr_matrix* const csr_fm_matrix, csr_matrix* const csr_normal_matrix)
+{
+	int n_rows = csr_fm_matrix->n_rows;
+	int n_cols = csr_fm_matrix->n_cols;
+	
+	// Build the transpose so that each column of the FM matrix can be walked directly.
+	std::vector<int> transpose_row_sizes(n_cols + 1, 0);
+	for (int k = 0; k < n_rows; k++) {
+		for (int q = csr_fm_matrix->row_sizes[k] - 1; q < csr_fm_matrix->row_sizes[k + 1] - 1; q++) {
+			transpose_row_sizes[csr_fm_matrix->column_indices[q]]++;
+		}
+	}
+	for (int i = 0; i < n_cols; i++) transpose_row_sizes[i + 1] += transpose_row_sizes[i];
+	std::vector<int> transpose_row_indices(transpose_row_sizes[n_cols] + 1);
+	std::vector<double> transpose_values(transpose_row_sizes[n_cols] + 1);
+	std::vector<int> next_entry(transpose_row_sizes.begin(), transpose_row_sizes.end() - 1);
+	for (int k = 0; k < n_rows; k++) {
+		for (int q = csr_fm_matrix->row_sizes[k] - 1; q < csr_fm_matrix->row_sizes[k + 1] - 1; q++) {
+			int p = next_entry[csr_fm_matrix->column_indices[q] - 1]++;
+			transpose_row_indices[p] = k;
+			transpose_values[p] = csr_fm_matrix->values[q];
+		}
+	}
+	
+	// Each thread forms a contiguous block of rows of the normal matrix.
+	int n_threads = std::max(1, std::min(num_threads, n_cols));
+	std::vector< std::vector<int> > row_counts(n_threads);
+	std::vector< std::vector<int> > column_indices(n_threads);
+	std::vector< std::vector<double> > values(n_threads);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < n_threads; t++) {
+		int first_row = (int)(((long)n_cols * t) / n_threads);
+		int last_row = (int)(((long)n_cols * (t + 1)) / n_threads);
+		if (t == n_threads - 1) {
+			native_csr_transpose_times_csr_rows(csr_fm_matrix, &transpose_row_sizes[0], &transpose_row_indices[0], &transpose_values[0], first_row, last_row, row_counts[t], column_indices[t], values[t]);
+		} else {
+			threads.push_back(std::thread(native_csr_transpose_times_csr_rows, csr_fm_matrix, &transpose_row_sizes[0], &transpose_row_indices[0], &transpose_values[0], first_row, last_row, std::ref(row_counts[t]), std::ref(column_indices[t]), std::ref(values[t])));
+		}
+	}
+	for (unsigned t = 0; t < threads.size(); t++) threads[t].join();
+	
+	// Gather the rows into the output matrix.
+	int total_entries = 0;
+	for (int t = 0; t < n_threads; t++) total_entries += values[t].size();
+	if (total_entries > nnzmax) {
+		printf("Error: Normal form matrix has %d non-zero entries, but only %d were allocated!\n", total_entries, nnzmax);
+		exit(EXIT_FAILURE);
+	}
+	int row = 0;
+	int entry = 0;
+	csr_normal_matrix->row_sizes[0] = 1;
+	for (int t = 0; t < n_threads; t++) {
+		for (unsigned r = 0; r < row_counts[t].size(); r++, row++) {
+			csr_normal_matrix->row_sizes[row + 1] = csr_normal_matrix->row_sizes[row] + row_counts[t][r];
+		}
+		for (unsigned q = 0; q < values[t].size(); q++, entry++) {
+			csr_normal_matrix->column_indices[entry] = column_indices[t][q];
+			csr_normal_matrix->values[entry] = values[t][q];
+		}
+	}
+}
+
+// Add alpha times the normal matrix (A^T * A) of a CSR matrix to the upper 
+// triangle of a packed symmetric matrix, one row of A at a time.
+
+void native_csr_transpose_times_csr_to_packed(const double alpha, csr_matrix* const csr_fm_matrix, packed_symmetric_matrix* const normal_matrix)
+{
+	for (int k = 0; k < csr_fm_matrix->n_rows; k++) {
+		for (int p = csr_fm_matrix->row_sizes[k] - 1; p < csr_fm_matrix->row_sizes[k + 1] - 1; p++) {
+			int col_p = csr_fm_matrix->column_indices[p] - 1;
+			double* normal_column = normal_matrix->values + normal_matrix->get_index(0, col_p);
+			double a_kp = alpha * csr_fm_matrix->values[p];
+			for (int q = csr_fm_matrix->row_sizes[k] - 1; q < csr_fm_matrix->row_sizes[k + 1] - 1; q++) {
+				int col_q = csr_fm_matrix->column_indices[q] - 1;
+				if (col_q <= col_p) normal_column[col_q] += a_kp * csr_fm_matrix->values[q];
+			}
+		}
+	}
+}
+
+// Multiply a CSR matrix (or its transpose) by a dense vector, overwriting the output vector.
+
+void native_csr_times_vector(const char trans, csr_matrix* const csr, const double* const x, double* const y)
+{
+	if (trans == 't') {
+		for (int j = 0; j < csr->n_cols; j++) y[j] = 0.0;
+		for (int k = 0; k < csr->n_rows; k++) {
+			for (int q = csr->row_sizes[k] - 1; q < csr->row_sizes[k + 1] - 1; q++) {
+				y[csr->column_indices[q] - 1] += csr->values[q] * x[k];
+			}
+		}
+	} else {
+		for (int k = 0; k < csr->n_rows; k++) {
+			double sum = 0.0;
+			for (int q = csr->row_sizes[k] - 1; q < csr->row_sizes[k + 1] - 1; q++) {
+				sum += csr->values[q] * x[csr->column_indices[q] - 1];
+			}
+			y[k] = sum;
+		}
+	}
+}
+
+// Add beta times a CSR matrix to another CSR matrix (A + beta * B) 
+// writing the sorted result into preallocated arrays with at most nnzmax entries.
+
+void native_csr_addition(const int n_rows, const int n_cols, const int nnzmax, csr_matrix* const a, const double beta, csr_matrix* const b, double* const values, int* const column_indices, int* const row_sizes)
+{
+	std::vector<double> accumulator(n_cols, 0.0);
+	std::vector<int> marker(n_cols, -1);
+	std::vector<int> row_columns;
+	int entry = 0;
+	
+	row_sizes[0] = 1;
+	for (int i = 0; i < n_rows; i++) {
+		row_columns.clear();
+		// A freshly allocated accumulation matrix has zero row_sizes past the first, which reads as empty rows here.
+		for (int q = a->row_sizes[i] - 1; q < a->row_sizes[i + 1] - 1; q++) {
+			int j = a->column_indices[q] - 1;
+			if (marker[j] != i) {
+				marker[j] = i;
+				accumulator[j] = 0.0;
+				row_columns.push_back(j);
+			}
+			accumulator[j] += a->values[q];
+		}
+		for (int q = b->row_sizes[i] - 1; q < b->row_sizes[i + 1] - 1; q++) {
+			int j = b->column_indices[q] - 1;
+			if (marker[j] != i) {
+				marker[j] = i;
+				accumulator[j] = 0.0;
+				row_columns.push_back(j);
+			}
+			accumulator[j] += beta * b->values[q];
+		}
+		if (entry + (int)row_columns.size() > nnzmax) {
+			printf("Error: Sum of sparse matrices has more than the %d non-zero entries allocated!\n", nnzmax);
+			exit(EXIT_FAILURE);
+		}
+		std::sort(row_columns.begin(), row_columns.end());
+		for (unsigned q = 0; q < row_columns.size(); q++, entry++) {
+			column_indices[entry] = row_columns[q] + 1;
+			values[entry] = accumulator[row_columns[q]];
+		}
+		row_sizes[i + 1] = entry + 1;
+	}
+}
+
+// Solve the preconditioned sparse normal equations by Jacobi-preconditioned 
+// conjugate gradients. The matrix passed in has had its columns rescaled by
+// h in precondition_sparse_matrix, so rescaling its rows by h as well gives
+// back a symmetric positive semi-definite system for the rescaled solution.
+// A positive itnlim limits the number of iterations and a positive rcond sets
+// the relative residual at which the iterations stop.
+
+void native_sparse_solve(MATRIX_DATA* const mat, csr_matrix* const sparse_matrix, double* const dense_fm_normal_rhs_vector)
+{
+	int n = mat->fm_matrix_columns;
+	int max_iterations = 10 * n;
+	double tolerance = 1.0e-12;
+	if (mat->itnlim > 0) max_iterations = mat->itnlim;
+	if (mat->rcond > 0.0) tolerance = mat->rcond;
+	double* h = mat->h;
+	double* x = mat->block_fm_solution;
+	std::vector<double> r(n), z(n), p(n), q(n), inverse_diagonal(n);
+	
+	// Set up the Jacobi preconditioner from the diagonal of the symmetrized system.
+	for (int i = 0; i < n; i++) {
+		inverse_diagonal[i] = 1.0;
+		for (int l = sparse_matrix->row_sizes[i] - 1; l < sparse_matrix->row_sizes[i + 1] - 1; l++) {
+			if (sparse_matrix->column_indices[l] - 1 == i && h[i] * sparse_matrix->values[l] > VERYSMALL) {
+				inverse_diagonal[i] = 1.0 / (h[i] * sparse_matrix->values[l]);
+			}
+		}
+	}
+	
+	// Start from zero so that the iterates stay in the range of a singular matrix.
+	double rhs_norm = 0.0;
+	double rz = 0.0;
+	for (int i = 0; i < n; i++) {
+		x[i] = 0.0;
+		r[i] = h[i] * dense_fm_normal_rhs_vector[i];
+		z[i] = inverse_diagonal[i] * r[i];
+		p[i] = z[i];
+		rhs_norm += r[i] * r[i];
+		rz += r[i] * z[i];
+	}
+	rhs_norm = sqrt(rhs_norm);
+	if (rhs_norm == 0.0) return;
+	
+	double residual_norm = rhs_norm;
+	int iteration = 0;
+	while (iteration < max_iterations) {
+		iteration++;
+		native_csr_times_vector('n', sparse_matrix, &p[0], &q[0]);
+		double pq = 0.0;
+		for (int i = 0; i < n; i++) {
+			q[i] *= h[i];
+			pq += p[i] * q[i];
+		}
+		if (pq <= 0.0) break;
+		double alpha = rz / pq;
+		residual_norm = 0.0;
+		for (int i = 0; i < n; i++) {
+			x[i] += alpha * p[i];
+			r[i] -= alpha * q[i];
+			residual_norm += r[i] * r[i];
+		}
+		residual_norm = sqrt(residual_norm);
+		if (residual_norm < tolerance * rhs_norm) break;
+		
+		double new_rz = 0.0;
+		for (int i = 0; i < n; i++) {
+			z[i] = inverse_diagonal[i] * r[i];
+			new_rz += r[i] * z[i];
+		}
+		double beta = new_rz / rz;
+		rz = new_rz;
+		for (int i = 0; i < n; i++) p[i] = z[i] + beta * p[i];
+	}
+	
+	printf("Conjugate gradient solve finished after %d iterations with relative residual %le.\n", iteration, residual_norm / rhs_norm);
+	if (residual_norm >= tolerance * rhs_norm) {
+		printf("Warning: Conjugate gradient solve did not reach a relative residual of %le.\n", tolerance);
+	}
+}
+
 // Wrapper function for PARDISO sparse matrix solver
 
 void pardiso_solve(MATRIX_DATA* const mat, csr_matrix* const sparse_matrix, double* const dense_fm_normal_rhs_vector)
 {
+	#if _mkl_flag == 1
 	printf("Solving sparse normal matrix using PARDISO.\n");
 	fflush(stdout);
     // Solve the normal equations using PARDISO
 	// Set-up workspace and variables for PARDISO
-	#if _mkl_flag == 1
 	void *pt[64];					// handle for PARDISO internal memory
 	int *iparm = new int[64](); 	// PARDISO parameters set to default values on first call
 	int nrhs = 1;		// number of right hand side vectors to solve for
@@ -2033,16 +2395,20 @@ void pardiso_solve(MATRIX_DATA* const mat, csr_matrix* const sparse_matrix, doub
     // Free temp variables
     delete [] iparm;
     delete [] perm;
+    #else
+	printf("Solving sparse normal matrix using preconditioned conjugate gradients.\n");
+	fflush(stdout);
+	native_sparse_solve(mat, sparse_matrix, dense_fm_normal_rhs_vector);
     #endif
 }
 
 void solve_this_sparse_matrix(MATRIX_DATA* const mat)
 {
-    // Convert from linked list format to CSR format
+    // Convert from sparse row builder format to CSR format
     // Note: These MKL functions use a one-based index for row_sizes and column_indices
     int n_nonzero_matrix_elements = get_n_nonzero_matrix_elements(mat);
 	csr_matrix csr_fm_matrix(mat->fm_matrix_rows, mat->fm_matrix_columns, n_nonzero_matrix_elements);
-    convert_linked_list_to_csr_matrix(mat, csr_fm_matrix);
+    convert_sparse_builder_to_csr_matrix(mat, csr_fm_matrix);
 	
    // Convert CSR matrix and dense RHS vector to normal-form    
    // Form sparse normal-form left-hand side matrix using mkl_dcsrmultcsr
@@ -2066,6 +2432,8 @@ void solve_this_sparse_matrix(MATRIX_DATA* const mat)
    		printf("Error: Value returned from mkl_dcsrmultcsr is %d!\n", info);
    		exit(EXIT_FAILURE);
    	}
+	#else
+	native_csr_transpose_times_csr(mat->num_sparse_threads, nnzmax, &csr_fm_matrix, mat->sparse_matrix);
 	#endif
    	
    	printf("Actual number of non-zero normal form matrix entries is %d.\n This is a density of %.2lf percent.\n", mat->sparse_matrix->row_sizes[mat->fm_matrix_columns] - 1, 100.0 * (double) (mat->sparse_matrix->row_sizes[mat->fm_matrix_columns] - 1)/ (double) nnzmax);
@@ -2078,6 +2446,8 @@ void solve_this_sparse_matrix(MATRIX_DATA* const mat)
    mkl_dcsrgemv(&trans, &(mat->fm_matrix_rows), csr_fm_matrix.values, 
 		csr_fm_matrix.row_sizes, csr_fm_matrix.column_indices,
    		mat->dense_fm_rhs_vector, mat->dense_fm_normal_rhs_vector);
+   #else
+   native_csr_times_vector('t', &csr_fm_matrix, mat->dense_fm_rhs_vector, mat->dense_fm_normal_rhs_vector);
    #endif
    	
    // Apply vector regularization if requested by user.
@@ -2129,6 +2499,8 @@ inline void create_sparse_normal_form_matrix(MATRIX_DATA* const mat, const int n
    		printf("Error: Value returned from mkl_dcsrmultcsr is %d!\n", info);
    		exit(EXIT_FAILURE);
    	}
+	#else
+	native_csr_transpose_times_csr(mat->num_sparse_threads, nnzmax, &csr_fm_matrix, &csr_normal_matrix);
 	#endif
     printf("Actual number of non-zero normal form matrix entries is %d.\n This is a density of %.2lf percent.\n", csr_normal_matrix.row_sizes[mat->fm_matrix_columns] - 1, 100.0 * (double) (csr_normal_matrix.row_sizes[mat->fm_matrix_columns] - 1)/ (double) nnzmax);
 
@@ -2137,24 +2509,80 @@ inline void create_sparse_normal_form_matrix(MATRIX_DATA* const mat, const int n
    mkl_dcsrgemv(&trans, &(mat->fm_matrix_rows), csr_fm_matrix.values, 
 		csr_fm_matrix.row_sizes, csr_fm_matrix.column_indices,
    		dense_fm_rhs_vector, dense_rhs_normal_vector);
+   #else
+   native_csr_times_vector('t', &csr_fm_matrix, dense_fm_rhs_vector, dense_rhs_normal_vector);
    #endif  
 }
 
-inline void create_dense_normal_form(MATRIX_DATA* const mat, const double frame_weight, dense_matrix* const dense_fm_matrix, dense_matrix* normal_matrix, double* const dense_fm_rhs_vector, double* dense_fm_normal_rhs_vector)
+inline void create_dense_normal_form(MATRIX_DATA* const mat, const double frame_weight, dense_matrix* const dense_fm_matrix, packed_symmetric_matrix* normal_matrix, double* const dense_fm_rhs_vector, double* dense_fm_normal_rhs_vector)
 {	
-    double oned = 1.0;    
-    // Take normal form of the current frame's matrix and add to the existing normal form matrix.
-    #if _mkl_flag == 1
-	char upper = 'u';
-	char trans = 't';
-	dsyrk(&upper, &trans, &mat->fm_matrix_columns, &mat->fm_matrix_rows, &frame_weight, dense_fm_matrix->values, &mat->fm_matrix_rows, &oned, normal_matrix->values, &mat->fm_matrix_columns);
-	#else
-	cblas_dsyrk(CblasColMajor, CblasUpper, CblasTrans, mat->fm_matrix_columns, mat->fm_matrix_rows, frame_weight, dense_fm_matrix->values, mat->fm_matrix_rows, oned, normal_matrix->values, mat->fm_matrix_columns);
-	#endif
+    // Take normal form of the current block's matrix and add to the existing normal form matrix.
+	add_gram_matrix_to_packed(frame_weight, mat->fm_matrix_rows, mat->fm_matrix_columns, dense_fm_matrix->values, normal_matrix);
 	// Take normal form of the current frame's target vector and add to the existing normal form target vector.
 	cblas_dgemv(CblasColMajor, CblasTrans, mat->fm_matrix_rows, mat->fm_matrix_columns, frame_weight, dense_fm_matrix->values, mat->fm_matrix_rows, dense_fm_rhs_vector, 1, 1.0, dense_fm_normal_rhs_vector, 1);
 }
 
+// Add alpha * A^T * A for a column-major n_rows by n_cols matrix A to a packed 
+// symmetric matrix. There is no packed rank-k update in BLAS, so the upper 
+// triangle is formed in panels of columns with dgemm into a small temp.
+
+void add_gram_matrix_to_packed(const double alpha, const int n_rows, const int n_cols, const double* const values, packed_symmetric_matrix* const normal_matrix)
+{
+	const int panel_width = 64;
+	double* panel = new double[n_cols * std::min(panel_width, n_cols)];
+	for (int first_col = 0; first_col < n_cols; first_col += panel_width) {
+		int n_panel_cols = std::min(panel_width, n_cols - first_col);
+		int n_panel_rows = first_col + n_panel_cols;
+		
+		// Rows 0 to the end of the panel of columns first_col onward.
+		cblas_dgemm(CblasColMajor, CblasTrans, CblasNoTrans, n_panel_rows, n_panel_cols, n_rows, alpha, values, n_rows, values + first_col * n_rows, n_rows, 0.0, panel, n_panel_rows);
+		for (int j = 0; j < n_panel_cols; j++) {
+			int col = first_col + j;
+			double* packed_column = normal_matrix->values + normal_matrix->get_index(0, col);
+			for (int row = 0; row <= col; row++) packed_column[row] += panel[j * n_panel_rows + row];
+		}
+	}
+	delete [] panel;
+}
+
+// Add the normal form of the block's FM equations to the upper triangle of a 
+// packed normal matrix one site row at a time. Each row only has a few nonzero 
+// columns, so its contribution is a small outer product.
+
+void add_direct_normal_form(MATRIX_DATA* const mat, const double frame_weight, packed_symmetric_matrix* normal_matrix, double* dense_fm_normal_rhs_vector)
+{
+	int n_cols = mat->fm_matrix_columns;
+	sparse_matrix_builder* builder = mat->sparse_fm_matrix_builder;
+	
+	for (int k = 0; k < mat->rows_less_constraint_rows; k++) {
+		int num_in_row = builder->row_size(k);
+		const sparse_matrix_element* row_elements = builder->row_elements(k);
+		const double* target = &mat->dense_fm_rhs_vector[DIMENSION * k];
+		
+		// Columns are sorted within the row, so col_a <= col_b below.
+		for (int b = 0; b < num_in_row; b++) {
+			const double* valx_b = row_elements[b].valx;
+			double* normal_column = normal_matrix->values + normal_matrix->get_index(0, row_elements[b].col);
+			for (int a = 0; a <= b; a++) {
+				double product = 0.0;
+				for (int i = 0; i < DIMENSION; i++) product += row_elements[a].valx[i] * valx_b[i];
+				normal_column[row_elements[a].col] += frame_weight * product;
+			}
+			double projection = 0.0;
+			for (int i = 0; i < DIMENSION; i++) projection += valx_b[i] * target[i];
+			dense_fm_normal_rhs_vector[row_elements[b].col] += frame_weight * projection;
+		}
+	}
+	
+	// The virial constraint rows are dense.
+	for (int k = 0; k < mat->virial_constraint_rows; k++) {
+		const double* virial_row = &mat->dense_fm_matrix->values[k];
+		double target = mat->dense_fm_rhs_vector[mat->rows_less_constraint_rows * DIMENSION + k];
+		cblas_dspr(CblasColMajor, CblasUpper, n_cols, frame_weight, virial_row, mat->virial_constraint_rows, normal_matrix->values);
+		cblas_daxpy(n_cols, frame_weight * target, virial_row, mat->virial_constraint_rows, dense_fm_normal_rhs_vector, 1);
+	}
+}
+
 // Calculate the residual for a dense matrix.
 inline double calculate_dense_residual(MATRIX_DATA* const mat, dense_matrix* const dense_fm_normal_matrix, double* const dense_fm_normal_rhs_vector, std::vector<double> &fm_solution, double normalization)
 {
@@ -2220,6 +2648,8 @@ inline double calculate_sparse_residual(MATRIX_DATA* const mat, csr_matrix* csr_
    mkl_dcsrgemv(&none, &mat->fm_matrix_columns, csr_normal_matrix->values, 
 		csr_normal_matrix->row_sizes, csr_normal_matrix->column_indices,
    		solution, intermediate);
+   #else
+   native_csr_times_vector('n', csr_normal_matrix, solution, intermediate);
    #endif  
 	
 	normal_matrix = cblas_ddot(mat->fm_matrix_columns, intermediate, onei, solution, onei);
@@ -2288,6 +2718,8 @@ inline double calculate_sparse_residual(MATRIX_DATA* const mat, csr_matrix* csr_
    mkl_dcsrgemv(&none, &mat->fm_matrix_columns, csr_normal_matrix->values, 
 		csr_normal_matrix->row_sizes, csr_normal_matrix->column_indices,
    		solution, intermediate);
+   #else
+   native_csr_times_vector('n', csr_normal_matrix, solution, intermediate);
    #endif  
 	
 	normal_matrix = cblas_ddot(mat->fm_matrix_columns, intermediate, onei, solution, onei);
@@ -2529,7 +2961,7 @@ void solve_sparse_fm_normal_equations(MATRIX_DATA* const mat)
    for (int i = 0; i < mat->fm_matrix_columns; i++) {
 	  backup_normal_matrix->row_sizes[i + 1] = mat->sparse_matrix->row_sizes[i + 1];
    } 
-   for (int i = 0; i < matrix_size; i++) {
+   for (int i = 0; i < matrix_size - 1; i++) {
       backup_normal_matrix->column_indices[i] = mat->sparse_matrix->column_indices[i];
       backup_normal_matrix->values[i]         = mat->sparse_matrix->values[i];
    }
@@ -2627,7 +3059,7 @@ void solve_sparse_fm_normal_equations(MATRIX_DATA* const mat)
    			for (int i = 0; i < mat->fm_matrix_columns; i++) {
 	  		   mat->sparse_matrix->row_sizes[i + 1] = backup_normal_matrix->row_sizes[i + 1];
    			} 
-   			for (int i = 0; i < matrix_size; i++) {
+   			for (int i = 0; i < matrix_size - 1; i++) {
       		   mat->sparse_matrix->column_indices[i] = backup_normal_matrix->column_indices[i];
       		   mat->sparse_matrix->values[i]         = backup_normal_matrix->values[i];
    			}
@@ -2844,9 +3276,7 @@ void solve_dense_fm_normal_equations(MATRIX_DATA* const mat)
         // Save the results in binary form for parallel runs.
         if (mat->output_style >= 2) {
             FILE* mat_out = open_file("result.out", "wb");
-            for (i = 0; i < mat->fm_matrix_columns; i++) {
-                fwrite(&mat->dense_fm_normal_matrix->values[i * mat->fm_matrix_columns], sizeof(double), i + 1, mat_out);
-            }
+            fwrite(mat->dense_fm_normal_matrix->values, sizeof(double), mat->dense_fm_normal_matrix->get_size(), mat_out);
        		double inv_norm = 1.0/mat->normalization;
             fwrite(&mat->dense_fm_normal_rhs_vector[0], sizeof(double), mat->fm_matrix_columns, mat_out);
         	fwrite(&mat->force_sq_total, sizeof(double), 1, mat_out);
@@ -2857,18 +3287,17 @@ void solve_dense_fm_normal_equations(MATRIX_DATA* const mat)
         }
     }
 
-	// Assign the upper diagonal to the lower lower diagonal (symmetric matrix)
-    for (i = 0; i < mat->fm_matrix_columns; i++) {
-        for (j = 0; j < i; j++) {
-            mat->dense_fm_normal_matrix->assign_scalar(i, j, mat->dense_fm_normal_matrix->get_scalar(j, i));
-        }
-    }
+	// Unpack the symmetric normal matrix into full storage for the solver.
+	dense_matrix* normal_matrix = new dense_matrix(mat->fm_matrix_columns, mat->fm_matrix_columns);
+	mat->dense_fm_normal_matrix->unpack(normal_matrix);
+	delete mat->dense_fm_normal_matrix;
+	mat->dense_fm_normal_matrix = NULL;
 
 	// Store a temporary backup of the normal matrix since it is changed by the solver.
 	dense_matrix* backup_normal_matrix = new dense_matrix(mat->fm_matrix_columns, mat->fm_matrix_columns);
 	for (i = 0; i < mat->fm_matrix_columns; i++) {
 		for (int z = 0; z < mat->fm_matrix_columns; z++) {
-			backup_normal_matrix->assign_scalar(z, i, mat->dense_fm_normal_matrix->get_scalar(z, i));
+			backup_normal_matrix->assign_scalar(z, i, normal_matrix->get_scalar(z, i));
 		}
 	}
     
@@ -2876,7 +3305,7 @@ void solve_dense_fm_normal_equations(MATRIX_DATA* const mat)
     if (mat->regularization_style == 2) {
     	printf("Regularizing FM normal equations.\n"); fflush(stdout);
     	for (i = 0; i < mat->fm_matrix_columns; i++) {
-            mat->dense_fm_normal_matrix->add_scalar(i, i, mat->regularization_vector[i]);
+            normal_matrix->add_scalar(i, i, mat->regularization_vector[i]);
     	}
     }
     
@@ -2884,7 +3313,7 @@ void solve_dense_fm_normal_equations(MATRIX_DATA* const mat)
     // of the columns as column scaling factors.
     printf("Preconditioning FM normal equations.\n"); fflush(stdout);
     double* h = new double[mat->fm_matrix_columns];
-    calculate_and_apply_dense_preconditioning(mat, mat->dense_fm_normal_matrix, h);
+    calculate_and_apply_dense_preconditioning(mat, normal_matrix, h);
 
     // Apply Tikhonov regularization.
     if (mat->regularization_style == 1) {
@@ -2892,14 +3321,14 @@ void solve_dense_fm_normal_equations(MATRIX_DATA* const mat)
         double squared_regularization_parameter;
         squared_regularization_parameter = mat->tikhonov_regularization_param * mat->tikhonov_regularization_param;
         for (i = 0; i < mat->fm_matrix_columns; i++) {
-            mat->dense_fm_normal_matrix->add_scalar(i, i, squared_regularization_parameter);
+            normal_matrix->add_scalar(i, i, squared_regularization_parameter);
         }
     }
     
     // Solve the normal equation by singular value decomposition using LAPACK routines.
     printf("Computing singular value decomposition of preconditioned, regularized FM normal equations.\n"); fflush(stdout);
     double* singular_values = new double[mat->fm_matrix_columns];
-    calculate_dense_svd(mat, mat->fm_matrix_columns, mat->dense_fm_normal_matrix, mat->dense_fm_normal_rhs_vector, singular_values);
+    calculate_dense_svd(mat, mat->fm_matrix_columns, normal_matrix, mat->dense_fm_normal_rhs_vector, singular_values);
     
     // Print singular values.
     printf("Printing FM singular values.\n"); fflush(stdout);
@@ -3100,9 +3529,8 @@ void solve_dense_fm_normal_equations(MATRIX_DATA* const mat)
     delete [] h;
     delete [] singular_values;
  	delete backup_normal_matrix;
- 	delete mat->dense_fm_normal_matrix;
+ 	delete normal_matrix;
     delete [] backup_rhs;
- 	if(mat->matrix_type == 3) delete [] mat->dense_fm_normal_rhs_vector;
 }
   
 void solve_this_BI_equation(MATRIX_DATA* const mat, int &solution_counter)
@@ -3189,9 +3617,7 @@ void solve_dense_fm_normal_bootstrapping_equations(MATRIX_DATA* const mat)
         if (mat->output_style >= 2) {
             FILE* mat_out = open_file("result.out", "wb");
             for (int j = 0; j < mat->bootstrapping_num_estimates; j++) {
-            	for (int i = 0; i < mat->fm_matrix_columns; i++) {
-                	fwrite(&mat->bootstrapping_dense_fm_normal_matrices[j]->values[i * mat->fm_matrix_columns], sizeof(double), i + 1, mat_out);
-            	}
+            	fwrite(mat->bootstrapping_dense_fm_normal_matrices[j]->values, sizeof(double), mat->bootstrapping_dense_fm_normal_matrices[j]->get_size(), mat_out);
             	fwrite(&mat->bootstrapping_dense_fm_normal_rhs_vectors[j][0], sizeof(double), mat->fm_matrix_columns, mat_out);
             }
             double inv_norm = 1.0/mat->normalization;
@@ -3203,21 +3629,19 @@ void solve_dense_fm_normal_bootstrapping_equations(MATRIX_DATA* const mat)
         }
     }
 	
+	// Each estimate is unpacked into the same full matrix in turn for the solver.
+	dense_matrix* normal_matrix = new dense_matrix(mat->fm_matrix_columns, mat->fm_matrix_columns);
     for (int k = 0; k < mat->bootstrapping_num_estimates; k++) {
     
-		// Copy over symmetric off-diagonal values in normal matrix;
-	    for (int i = 0; i < mat->fm_matrix_columns; i++) {
-	        for (int j = 0; j < i; j++) {
-    	        mat->bootstrapping_dense_fm_normal_matrices[k]->assign_scalar(i, j, mat->bootstrapping_dense_fm_normal_matrices[k]->get_scalar(j , i));
-        	}
-    	}
+		// Copy the symmetric normal matrix into full storage.
+		mat->bootstrapping_dense_fm_normal_matrices[k]->unpack(normal_matrix);
 
     	// Apply vector regularization.
     	if (mat->regularization_style == 2) {
 	    	printf("Regularizing FM normal equations (estimate %d).\n", k);
     		fflush(stdout);
         	for (int i = 0; i < mat->fm_matrix_columns; i++) {
-    	       	mat->bootstrapping_dense_fm_normal_matrices[k]->add_scalar(i, i, mat->regularization_vector[i]);
+    	       	normal_matrix->add_scalar(i, i, mat->regularization_vector[i]);
         	}
         }
 
@@ -3225,7 +3649,7 @@ void solve_dense_fm_normal_bootstrapping_equations(MATRIX_DATA* const mat)
     	// of the columns as column scaling factors.
     	printf("Preconditioning FM normal equations (estimate %d).\n", k);
     	fflush(stdout);
-		calculate_and_apply_dense_preconditioning(mat, mat->bootstrapping_dense_fm_normal_matrices[k], h);
+		calculate_and_apply_dense_preconditioning(mat, normal_matrix, h);
 	    
     	// Apply Tikhonov regularization.
     	if (mat->regularization_style == 1) {
@@ -3234,7 +3658,7 @@ void solve_dense_fm_normal_bootstrapping_equations(MATRIX_DATA* const mat)
         	double squared_regularization_parameter;
         	squared_regularization_parameter = mat->tikhonov_regularization_param * mat->tikhonov_regularization_param;
         	for (int i = 0; i < mat->fm_matrix_columns; i++) {
-    	       	mat->bootstrapping_dense_fm_normal_matrices[k]->add_scalar(i, i, squared_regularization_parameter);
+    	       	normal_matrix->add_scalar(i, i, squared_regularization_parameter);
         	}
         }
     
@@ -3242,7 +3666,7 @@ void solve_dense_fm_normal_bootstrapping_equations(MATRIX_DATA* const mat)
     	printf("Computing singular value decomposition of preconditioned, regularized FM normal equations (estimate %d).\n", k);
     	fflush(stdout);
     	double* singular_values = new double[mat->fm_matrix_columns];
-    	calculate_dense_svd(mat, mat->fm_matrix_columns, mat->bootstrapping_dense_fm_normal_matrices[k], mat->bootstrapping_dense_fm_normal_rhs_vectors[k], singular_values);
+    	calculate_dense_svd(mat, mat->fm_matrix_columns, normal_matrix, mat->bootstrapping_dense_fm_normal_rhs_vectors[k], singular_values);
     	
     	// Print singular values.
     	printf("Printing FM singular values (estimate %d).\n", k);
@@ -3266,7 +3690,7 @@ void solve_dense_fm_normal_bootstrapping_equations(MATRIX_DATA* const mat)
     	
     	// Calculate and output the residual if requested.
     	if (mat->output_residual == 1) {
-	    	double residual = calculate_dense_residual(mat, mat->bootstrapping_dense_fm_normal_matrices[k], backup_rhs, mat->bootstrap_solutions[k], mat->normalization);
+	    	double residual = calculate_dense_residual(mat, normal_matrix, backup_rhs, mat->bootstrap_solutions[k], mat->normalization);
 	    	printf ("Estimate %d: residual %lf\n", k, residual);
     	}
 	}
@@ -3274,6 +3698,7 @@ void solve_dense_fm_normal_bootstrapping_equations(MATRIX_DATA* const mat)
     // Free the preconditioner
     delete [] h;
     delete [] backup_rhs;
+    delete normal_matrix;
     
     // For iterative calculations, the solution is a difference, so the computed quantity
     // should be added on to the previous solution value to obtain the final solution.
@@ -3406,108 +3831,6 @@ void solve_accumulation_form_fm_equations(MATRIX_DATA* const mat)
     delete mat->dense_fm_matrix;
 }
 
-void solve_accumulation_form_bootstrapping_equations(MATRIX_DATA* const mat)
-{
-    int i, j, k;
-
- 	for (k = 0; k < mat->bootstrapping_num_estimates; k++) {
-	    for (i = 0; i < mat->accumulation_matrix_columns; i++) {
-    	    mat->bootstrapping_dense_fm_normal_rhs_vectors[k][i] = mat->bootstrapping_dense_fm_normal_matrices[k]->values[mat->fm_matrix_columns * mat->accumulation_matrix_rows + i];
-    	}
-    	set_accumulation_matrix_to_zero(mat, mat->bootstrapping_dense_fm_normal_matrices[k]);
-	}
-	    
-   	if (mat->output_style >= 2) {
-       	FILE* mat_out = open_file("final_equations.out", "wb");
-	
-		for (k = 0; k < mat->bootstrapping_num_estimates; k++) {
-			// Save the results in binary form and exit if no other output is desired.
-    	   	for (i = 0; i < mat->fm_matrix_columns; i++) {
-        	   	fwrite(&mat->bootstrapping_dense_fm_normal_matrices[k]->values[i * mat->accumulation_matrix_rows], sizeof(double), i + 1, mat_out);
-       	 	}
-        	fwrite(&mat->bootstrapping_dense_fm_normal_rhs_vectors[k][0], sizeof(double), mat->accumulation_matrix_columns, mat_out);        
-    	}    
-     	double inv_norm = 1.0/mat->normalization;
-        fwrite(&mat->force_sq_total, sizeof(double), 1, mat_out);
-        fwrite(&inv_norm, sizeof(double), 1, mat_out);
-    	fclose(mat_out);
-	    if (mat->output_style == 3) exit(EXIT_SUCCESS);
-	}
-    	
-   	for (k = 0; k < mat->bootstrapping_num_estimates; k++) {
-
-    	double resid = mat->bootstrapping_dense_fm_normal_matrices[k]->values[(mat->accumulation_matrix_columns - 1) * mat->accumulation_matrix_rows + mat->accumulation_matrix_columns - 1];
-    
-    	// Precondition the accumulation matrix using the root-of-sum-of-squares of the columns
-    	// as column scaling factors.
-    	double* h = new double[mat->fm_matrix_columns]();
-    
-    	for (i = 0; i < mat->fm_matrix_columns; i++) {
-        	for (j = 0; j < mat->fm_matrix_columns; j++) {
-            	h[j] += mat->bootstrapping_dense_fm_normal_matrices[k]->values[j * mat->accumulation_matrix_rows + i] * mat->bootstrapping_dense_fm_normal_matrices[k]->values[j * mat->accumulation_matrix_rows + i];
-        	}
-    	}
-    
-    	for (i = 0; i < mat->fm_matrix_columns; i++) {
-        	if (h[i] < VERYSMALL) h[i] = 1.0;
-        	else h[i] = 1.0 / sqrt(h[i]);
-    	}
-    
-    	for (i = 0; i < mat->fm_matrix_columns; i++) {
-        	for (j = 0; j < mat->fm_matrix_columns; j++) {
-            	mat->bootstrapping_dense_fm_normal_matrices[k]->values[j * mat->accumulation_matrix_rows + i] *= h[j];
-        	}
-    	}
-    
-    	// Solve the normal equation by singular value decomposition using LAPACK routines.
-    	// The SVD routine works in two modes: first, the routine is run with a dummy workspace to
-	    // determine the size of the needed workspace, then that workspace is allocated, then the
-    	// routine is run again with a sufficient workspace to perform SVD.
-
-    	double* singular_values = new double[mat->fm_matrix_columns];
-    	int onei = 1;
-    	int irank_in, info_in;
-    	int lapack_setup_flag = -1;
-    	double* lapack_temp_workspace = new double[1];
-    	dgelss_(&mat->fm_matrix_columns, &mat->fm_matrix_columns, &onei, mat->bootstrapping_dense_fm_normal_matrices[k]->values, &mat->accumulation_matrix_rows, mat->bootstrapping_dense_fm_normal_rhs_vectors[k], &mat->fm_matrix_columns, singular_values, &mat->rcond, &irank_in, lapack_temp_workspace, &lapack_setup_flag, &info_in);
-    	lapack_setup_flag = lapack_temp_workspace[0];
-    	delete [] lapack_temp_workspace;
-    	lapack_temp_workspace = new double[lapack_setup_flag];
-    	dgelss_(&mat->fm_matrix_columns, &mat->fm_matrix_columns, &onei, mat->bootstrapping_dense_fm_normal_matrices[k]->values, &mat->accumulation_matrix_rows, mat->bootstrapping_dense_fm_normal_rhs_vectors[k], &mat->fm_matrix_columns, singular_values, &mat->rcond, &irank_in, lapack_temp_workspace, &lapack_setup_flag, &info_in);
-    	delete [] lapack_temp_workspace;
-    
-    	// Print singular values to file.
-    	FILE* solution_file;
-    	solution_file = open_file("sol_info.out", "a");
-    	fprintf(solution_file, "Singular vector:\n");
-    	for (i = 0; i < mat->fm_matrix_columns; i++) {
-        	fprintf(solution_file, "%le\n", singular_values[i]);
-    	}
-
-    	// Calculate final results from the singular value decomposition.
-    	for (i = 0; i < mat->fm_matrix_columns; i++) {
-    	    mat->bootstrap_solutions[k][i] = mat->bootstrapping_dense_fm_normal_rhs_vectors[k][i] * h[i];
-    	}
-    
-    	// Print the Euclidean norm of the solution and and print the residual
-    	double xnorm = 0.0;
-    	for (i = 0; i < mat->fm_matrix_columns; i++) {
-        	xnorm += mat->fm_solution[i] * mat->fm_solution[i];
-    	}
-    	fprintf(solution_file, "Solution 2-norm:\n%le\n", xnorm);    
-    	fprintf(solution_file, "Residual 2-norm:\n%le\n", resid);
-    
-    	// Deallocate the remaining temps.
-    	fclose(solution_file);
-    	delete [] singular_values;
-    	delete [] h;
-    	delete [] mat->bootstrapping_dense_fm_normal_rhs_vectors[k];
-    	delete mat->bootstrapping_dense_fm_normal_matrices[k];
-	}
-	delete [] mat->bootstrapping_dense_fm_normal_matrices;
-	delete [] mat->bootstrapping_dense_fm_normal_rhs_vectors;
-}
-
 //--------------------------------------------------------------------
 // Binary file reading routines
 //--------------------------------------------------------------------
@@ -3515,7 +3838,7 @@ void solve_accumulation_form_bootstrapping_equations(MATRIX_DATA* const mat)
 void read_binary_matrix(MATRIX_DATA* const mat)
 {
     switch (mat->matrix_type) {
-    case kDense: case kSparseNormal:
+    case kDense: case kSparseNormal: case kDirectNormal:
         read_binary_dense_fm_matrix(mat);
         break;
     case kSparse: case kSparseSparse:
@@ -3569,7 +3892,7 @@ void read_binary_dense_fm_matrix(MATRIX_DATA* const mat)
     // element to get a final set of normal form equations.
     // Each matrix is "un-normalized" by its number of frames before accumulating.
     FILE* single_binary_matrix_input;
-	dense_matrix* read_matrix = new dense_matrix(mat->fm_matrix_columns, mat->fm_matrix_columns);
+	packed_symmetric_matrix* read_matrix = new packed_symmetric_matrix(mat->fm_matrix_columns);
 	double* read_rhs = new double[mat->fm_matrix_columns];
     for (int i = 0; i < n_batch; i++) {
         // Read the new normal form matrix.
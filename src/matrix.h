@@ -8,6 +8,7 @@
 #ifndef _matrix_h
 #define _matrix_h
 
+#include <algorithm>
 #include <vector>
 
 #include "external_matrix_routines.h"
@@ -29,21 +30,104 @@ void solve_this_BI_equation(MATRIX_DATA* const mat, int &solution_counter);
 // Matrix-equation-related type definitions
 //-------------------------------------------------------------
 
-enum MatrixType {kDense = 0, kSparse = 1, kAccumulation = 2, kSparseNormal = 3, kSparseSparse = 4, kDummy = -1};
+enum MatrixType {kDense = 0, kSparse = 1, kAccumulation = 2, kSparseNormal = 3, kSparseSparse = 4, kDirectNormal = 5, kDummy = -1};
 
-// Linked-list-based sparse row matrix element struct. x,y,z components are stored together.
+// Sparse row matrix element struct. x,y,z components are stored together.
 
-struct linked_list_sparse_matrix_element { 
+struct sparse_matrix_element { 
     int col;                                        // Column number
-    double valx[DIMENSION];                                 // x,y,z components
-    struct linked_list_sparse_matrix_element* next; // Pointer to the next element in the linked list
+    double valx[DIMENSION];                         // x,y,z components
 };
 
-// Linked-list-based sparse row matrix row head struct, one linked list for each row.
+// Sparse row matrix row struct, one sorted array of elements for each row.
 
-struct linked_list_sparse_matrix_row_head { 
+struct sparse_matrix_row { 
     int n;                                          // Total number of nonzero elements in this row
-    struct linked_list_sparse_matrix_element* h;    // Link to first nonzero element in the row
+    int capacity;                                   // Number of elements that fit in this row's array
+    int offset;                                     // Start of this row's array in the element arena
+    int generation;                                 // Builder generation this row was last written in
+};
+
+// Sparse row matrix builder. Each row keeps its elements sorted by column in an 
+// array carved out of a bump-allocated arena; a full row moves to a new array 
+// twice its size. Resetting abandons the arena and all rows at once by 
+// advancing the generation, so the arena storage is reused between blocks.
+
+struct sparse_matrix_builder {
+    int n_rows;
+    int generation;                                 // Rows from earlier generations are empty
+    int arena_used;                                 // Number of arena elements handed out so far
+    std::vector<sparse_matrix_row> rows;
+    std::vector<sparse_matrix_element> arena;
+    
+    inline sparse_matrix_builder(const int new_n_rows) : n_rows(new_n_rows), generation(0), arena_used(0) {
+    	sparse_matrix_row empty_row = {0, 0, 0, -1};
+    	rows.assign(n_rows, empty_row);
+    }
+    
+    // Discard all elements without releasing the arena.
+    inline void reset(void) {
+    	generation++;
+    	arena_used = 0;
+    }
+    
+    inline void resize(const int new_n_rows) {
+    	n_rows = new_n_rows;
+    	sparse_matrix_row empty_row = {0, 0, 0, -1};
+    	rows.assign(n_rows, empty_row);
+    	reset();
+    }
+    
+    inline int row_size(const int i) const {
+    	return (rows[i].generation == generation) ? rows[i].n : 0;
+    }
+    
+    inline const sparse_matrix_element* row_elements(const int i) const {
+    	return arena.data() + rows[i].offset;
+    }
+    
+    // Add x to element (i, j), creating it if needed.
+    inline void insert(const int i, const int j, const double* const x) {
+    	sparse_matrix_row& row = rows[i];
+    	if (row.generation != generation) {
+    		row.n = 0;
+    		row.capacity = 0;
+    		row.generation = generation;
+    	}
+    	
+    	// Find the first element in the row with a column not less than j.
+    	sparse_matrix_element* elements = arena.data() + row.offset;
+    	int low = 0;
+    	int high = row.n;
+    	while (low < high) {
+    		int mid = (low + high) / 2;
+    		if (elements[mid].col < j) low = mid + 1;
+    		else high = mid;
+    	}
+    	if (low < row.n && elements[low].col == j) {
+    		for (int k = 0; k < DIMENSION; k++) elements[low].valx[k] += x[k];
+    		return;
+    	}
+    	
+    	// Move a full row to a larger array at the end of the arena.
+    	if (row.n == row.capacity) {
+    		int new_capacity = (row.capacity < 4) ? 4 : 2 * row.capacity;
+    		if (arena_used + new_capacity > (int)arena.size()) {
+    			arena.resize(std::max(2 * arena.size(), (size_t)(arena_used + new_capacity)));
+    		}
+    		std::copy(arena.begin() + row.offset, arena.begin() + row.offset + row.n, arena.begin() + arena_used);
+    		row.offset = arena_used;
+    		row.capacity = new_capacity;
+    		arena_used += new_capacity;
+    		elements = arena.data() + row.offset;
+    	}
+    	
+    	// Shift the rest of the row over to insert the new element in order.
+    	std::copy_backward(elements + low, elements + row.n, elements + row.n + 1);
+    	elements[low].col = j;
+    	for (int k = 0; k < DIMENSION; k++) elements[low].valx[k] = x[k];
+    	row.n++;
+    }
 };
 
 // CSR sparse matrix struct w/ constructor & destructor.
@@ -254,6 +338,55 @@ struct dense_matrix {
 	}
 };
 
+// Symmetric matrix storing only its upper triangle, packed column by column 
+// as in LAPACK's packed storage: element (row, col) with row <= col is 
+// values[row + col * (col + 1) / 2]. Used for normal form matrices.
+
+struct packed_symmetric_matrix {
+    int n;
+    double *values;
+
+    inline packed_symmetric_matrix(const int new_n) : n(new_n) {
+        values = new double[get_size()]();
+    }
+
+    inline int get_size() const {
+    	return n * (n + 1) / 2;
+    }
+
+    inline int get_index(const int row, const int col) const {
+    	return row + col * (col + 1) / 2;
+    }
+
+	inline void add_scalar(const int row, const int col, const double x) {
+		values[get_index(row, col)] += x;
+	}
+
+	inline void assign_scalar(const int row, const int col, const double x) {
+		values[get_index(row, col)] = x;
+	}
+	
+	inline double get_scalar(const int row, const int col) const {
+		return values[get_index(row, col)];
+	}
+	
+	// Fill both triangles of a full n by n matrix.
+	inline void unpack(dense_matrix* const full_matrix) const {
+		const double* packed_column = values;
+		for (int col = 0; col < n; col++) {
+			for (int row = 0; row <= col; row++) {
+				full_matrix->values[col * n + row] = packed_column[row];
+				full_matrix->values[row * n + col] = packed_column[row];
+			}
+			packed_column += col + 1;
+		}
+	}
+	
+    inline ~packed_symmetric_matrix() {
+        delete [] values;
+	}
+};
+
 struct MATRIX_DATA {
     // Poor-man's polymorphism.
     MatrixType matrix_type;
@@ -279,7 +412,7 @@ struct MATRIX_DATA {
 
     // For dense-matrix-based calculations
     dense_matrix* dense_fm_matrix;
-    dense_matrix* dense_fm_normal_matrix;           // Normal form of the force-matching matrix. Constructed one frame at a time.
+    packed_symmetric_matrix* dense_fm_normal_matrix; // Normal form of the force-matching matrix (upper triangle). Constructed one block at a time.
     double* dense_fm_rhs_vector;
     double* dense_fm_normal_rhs_vector;             // Normal form of the target force vector. Constructed one frame at a time.
     double normalization;
@@ -298,6 +431,7 @@ struct MATRIX_DATA {
 	
     // Optional extras for dense-matrix-based calculations
     double current_frame_weight;
+    double* block_frame_weights;            // Weight of each frame in the current block when several reweighted frames share a dense block; NULL otherwise
     int iterative_calculation_flag;         // 0 for a non-iterative calculation; 1 to use Lanyuan's iterative force matching method
 	
 	// Optional extras for bootstrapping (dense and sparse)
@@ -307,7 +441,7 @@ struct MATRIX_DATA {
 	double* bootstrapping_normalization;
 	double** bootstrapping_weights;
 	double** bootstrapping_dense_fm_normal_rhs_vectors;
-	dense_matrix** bootstrapping_dense_fm_normal_matrices;
+	packed_symmetric_matrix** bootstrapping_dense_fm_normal_matrices;
 	csr_matrix** bootstrapping_sparse_fm_normal_matrices;
 	std::vector<double>* bootstrap_solutions;
 
@@ -315,9 +449,10 @@ struct MATRIX_DATA {
     int max_nonzero_normal_elements;                // Total number of nonzero values in the sparse normal matrix
 	int min_nonzero_normal_elements;				// Lower bound for safe size of sparse normal matrix
 	int num_sparse_threads;							// Number of threads for sparse solver
+	int num_frame_threads;							// Number of threads building the FM equations for separate frames at once (matrix_type = 0)
 	int itnlim;										// Maximum number of iterative refinement
 	double sparse_safety_factor;					// % to oversize the next frame-block's normal matrix from the current one (matrix_type = 4)
-	struct linked_list_sparse_matrix_row_head* ll_sparse_matrix_row_heads;      // A linked-list-based sparse matrix
+	sparse_matrix_builder* sparse_fm_matrix_builder;	// Sparse FM matrix being assembled for the current block
    	csr_matrix* sparse_matrix;						// CSR matrix "object" (matrix_type = 4)
 	double* block_fm_solution;                      // FM solutions from one single block
     double* h;                                      // Temp for preconditioning
@@ -368,20 +503,25 @@ struct MATRIX_DATA {
 		if (matrix_type == kDense) {
 			delete [] dense_fm_rhs_vector;
 			delete [] dense_fm_normal_rhs_vector;
+			if (block_frame_weights != NULL) delete [] block_frame_weights;
 		} else if (matrix_type == kSparse) {
-			delete [] ll_sparse_matrix_row_heads;
+			delete sparse_fm_matrix_builder;
 			delete [] block_fm_solution;
 			delete [] dense_fm_rhs_vector;
 		} else if (matrix_type == kAccumulation) {
 			delete [] lapack_temp_workspace;
 			delete [] lapack_tau;
 		} else if (matrix_type == kSparseNormal) {
-			delete [] ll_sparse_matrix_row_heads;
+			delete sparse_fm_matrix_builder;
 			delete [] dense_fm_rhs_vector;
 			delete [] dense_fm_normal_rhs_vector;
 		} else if (matrix_type == kSparseSparse) {
-			delete [] ll_sparse_matrix_row_heads;
+			delete sparse_fm_matrix_builder;
+			delete [] dense_fm_rhs_vector;
+		} else if (matrix_type == kDirectNormal) {
+			delete sparse_fm_matrix_builder;
 			delete [] dense_fm_rhs_vector;
+			delete [] dense_fm_normal_rhs_vector;
 		} else if (matrix_type == kDummy) {
 		    delete [] dense_fm_rhs_vector;
 			delete [] dense_fm_normal_rhs_vector;
@@ -415,7 +555,8 @@ struct MATRIX_DATA {
 		if (matrix_type == kDense) {
 		    delete dense_fm_matrix;
 		    dense_fm_matrix = new dense_matrix(fm_matrix_rows, fm_matrix_columns);
-		} else if ( (matrix_type == kSparse) || (matrix_type == kSparseNormal) || (matrix_type == kSparseSparse) ) {
+		} else if ( (matrix_type == kSparse) || (matrix_type == kSparseNormal) || (matrix_type == kSparseSparse) || (matrix_type == kDirectNormal) ) {
+			sparse_fm_matrix_builder->resize(rows_less_constraint_rows);
 			if (sparse_matrix != NULL) {
 				int max_entries = sparse_matrix->max_entries;
 				delete sparse_matrix;   		
@@ -428,6 +569,11 @@ struct MATRIX_DATA {
 	    }
     }
     
+	inline void set_frame_weight(const int trajectory_block_frame_index, const double weight) {
+		current_frame_weight = weight;
+		if (block_frame_weights != NULL) block_frame_weights[trajectory_block_frame_index] = weight;
+	}
+	
 	inline double get_frame_weight(void) {
     	if (use_statistical_reweighting) {
         	return current_frame_weight;
@@ -444,7 +590,12 @@ inline void set_normalization(MATRIX_DATA* mat, const double new_normalization_c
 }
 
 void set_bootstrapping_normalization(MATRIX_DATA* mat, double** const bootstrapping_weights, int const n_frames);
-void allocate_bootstrapping(MATRIX_DATA* mat, ControlInputs* const control_input, const int rows, const int cols);
+void allocate_bootstrapping(MATRIX_DATA* mat, ControlInputs* const control_input, const int cols);
+
+// Thread-local dense matrices for frame-parallel construction of the normal equations
+
+MATRIX_DATA* copy_dense_matrix_for_thread(MATRIX_DATA* const mat);
+void reduce_and_free_thread_dense_matrix(MATRIX_DATA* const mat, MATRIX_DATA* const thread_mat);
 
 // Target (RHS) vector calculation routines
 
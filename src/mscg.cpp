@@ -195,17 +195,12 @@ void* mscg_startup_part2(void* void_in)
 	}
 	
 	printf("Check matrix type, block size, and samples per frame\n"); fflush(stdout);
-    if (mscg_struct->mat->matrix_type == kDense) {
-        n_blocks = total_frame_samples;
-        mscg_struct->mat->frames_per_traj_block = 1;
-    } else {
-		// Check if number of frames is divisible by frames per trajectory block.
-		if (total_frame_samples % mscg_struct->mat->frames_per_traj_block != 0) {
-			printf("Total number of frame samples %d is not divisible by block size %d.\n", total_frame_samples, mscg_struct->mat->frames_per_traj_block);
-			exit(EXIT_FAILURE);
-		}
-		n_blocks = total_frame_samples / mscg_struct->mat->frames_per_traj_block;
+	// Check if number of frames is divisible by frames per trajectory block.
+	if (total_frame_samples % mscg_struct->mat->frames_per_traj_block != 0) {
+		printf("Total number of frame samples %d is not divisible by block size %d.\n", total_frame_samples, mscg_struct->mat->frames_per_traj_block);
+		exit(EXIT_FAILURE);
 	}
+	n_blocks = total_frame_samples / mscg_struct->mat->frames_per_traj_block;
 	(*mscg_struct->mat->set_fm_matrix_to_zero)(mscg_struct->mat);
 
 	//Initialize other data types
@@ -224,6 +219,7 @@ void* mscg_startup_part2(void* void_in)
     FILE* solution_file = fopen("sol_info.out", "w");
     fprintf(solution_file, "fm_matrix_rows:%d; fm_matrix_columns:%d;\n",
             mscg_struct->mat->fm_matrix_rows, mscg_struct->mat->fm_matrix_columns);
+    write_density_weight_table_info(p_cg, solution_file);
     fclose(solution_file);
     
 	return(void*)(mscg_struct);
@@ -275,17 +271,12 @@ void* rangefinder_startup_part2(void* void_in)
 	mscg_struct->traj_frame_num = 0;
 
 	// Check and modify matrix settings.
-    if (mscg_struct->mat->matrix_type == kDense) {
-        mscg_struct->nblocks = total_frame_samples;
-        mscg_struct->mat->frames_per_traj_block = 1;
-    } else {
-		// Check if number of frames is divisible by frames per trajectory block.
-		if (total_frame_samples % mscg_struct->mat->frames_per_traj_block != 0) {
-			printf("Total number of frame samples %d is not divisible by block size %d.\n", total_frame_samples, mscg_struct->mat->frames_per_traj_block);
-			exit(EXIT_FAILURE);
-		}
-		mscg_struct->nblocks = total_frame_samples / mscg_struct->mat->frames_per_traj_block;
+	// Check if number of frames is divisible by frames per trajectory block.
+	if (total_frame_samples % mscg_struct->mat->frames_per_traj_block != 0) {
+		printf("Total number of frame samples %d is not divisible by block size %d.\n", total_frame_samples, mscg_struct->mat->frames_per_traj_block);
+		exit(EXIT_FAILURE);
 	}
+	mscg_struct->nblocks = total_frame_samples / mscg_struct->mat->frames_per_traj_block;
     mscg_struct->mat->accumulation_row_shift = 0;
 	(*mscg_struct->mat->set_fm_matrix_to_zero)(mscg_struct->mat);
 
@@ -318,7 +309,7 @@ void* mscg_process_frame(void* void_in, double* const x, double* const f)
     // NVT trajectories are assumed, so this only needs to be done once.
     PairCellList pair_cell_list = PairCellList();
     ThreeBCellList three_body_cell_list = ThreeBCellList();
-    pair_cell_list.init(p_cg->pair_nonbonded_interactions.cutoff, p_frame_source);
+    pair_cell_list.init(p_cg->pair_nonbonded_interactions.cutoff + p_cg->verlet_skin, p_frame_source);
     if (p_cg->three_body_nonbonded_interactions.class_subtype > 0) {
         double max_cutoff = 0.0;
         for (int i = 0; i < p_cg->three_body_nonbonded_interactions.get_n_defined(); i++) {
@@ -340,7 +331,7 @@ void* mscg_process_frame(void* void_in, double* const x, double* const f)
     // by the appropriate weighting factor
     if (p_frame_source->use_statistical_reweighting == 1) {
        printf("Reweighting entries for trajectory frame %d. ", traj_frame_num);
-       mscg_struct->mat->current_frame_weight = p_frame_source->frame_weights[traj_frame_num];
+       mscg_struct->mat->set_frame_weight(trajectory_block_frame_index, p_frame_source->frame_weights[traj_frame_num]);
 	}
             
     //Skip processing frame if frame weight is 0.
@@ -413,7 +404,7 @@ void* rangefinder_process_frame(void* void_in, double* const x, double* const f)
     // NVT trajectories are assumed, so this only needs to be done once.
     PairCellList pair_cell_list = PairCellList();
     ThreeBCellList three_body_cell_list = ThreeBCellList();
-    pair_cell_list.init(p_cg->pair_nonbonded_interactions.cutoff, p_frame_source);
+    pair_cell_list.init(p_cg->pair_nonbonded_interactions.cutoff + p_cg->verlet_skin, p_frame_source);
     if (p_cg->three_body_nonbonded_interactions.class_subtype > 0) {
         double max_cutoff = 0.0;
         for (int i = 0; i < p_cg->three_body_nonbonded_interactions.get_n_defined(); i++) {
@@ -434,7 +425,7 @@ void* rangefinder_process_frame(void* void_in, double* const x, double* const f)
     // by the appropriate weighting factor
     if (p_frame_source->use_statistical_reweighting) {
        printf("Reweighting entries for trajectory frame %d. ", traj_frame_num);
-       mscg_struct->mat->current_frame_weight = p_frame_source->frame_weights[traj_frame_num];
+       mscg_struct->mat->set_frame_weight(trajectory_block_frame_index, p_frame_source->frame_weights[traj_frame_num]);
 	}
             
     //Skip processing frame if frame weight is 0.
@@ -970,6 +961,8 @@ void* set_exclusion_topology(void* void_in, unsigned** exclusion_partners, unsig
 	p_topo_data->exclusion_list->partners_ = exclusion_partners;
 	// For a given CG site, it lists the CG site indices of all partnered particles (for this topological attribute).
 	p_topo_data->exclusion_list->partner_numbers_ = exclusion_partner_numbers;
+	// Index the supplied exclusions for fast lookup.
+	p_topo_data->exclusion_list->build_sorted_partners();
 	
 	return (void*)(mscg_struct);
 }
@@ -7,9 +7,14 @@
 //  Copyright (c) 2016 The Voth Group at The University of Chicago. All rights reserved.
 //
 
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
+#include <condition_variable>
 #include <ctime>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include "control_input.h"
 #include "force_computation.h"
 #include "fm_output.h"
@@ -19,7 +24,38 @@
 #include "misc.h"
 #include "trajectory_input.h"
 
+// One frame copied out of the trajectory so that it can be processed by a separate thread.
+
+struct FrameSlot {
+	int frame_index;                    // Index of the frame sample among all samples; -1 if the slot is unused
+	double frame_weight;                // Statistical weight of the frame sample
+	FrameConfig* frame_config;          // Private copy of the frame's positions, forces and box
+	PairCellList pair_cell_list;        // Cell lists set up for this frame's box
+	ThreeBCellList three_body_cell_list;
+};
+
+// Worker threads kept for the whole frame-parallel loop. Each set of slots is handed to
+// them by advancing set_index; each thread processes its own slot of the set.
+
+struct FrameWorkers {
+	std::vector<std::thread> threads;
+	std::mutex lock;
+	std::condition_variable set_ready;     // Signalled when a new set of slots can be processed
+	std::condition_variable set_finished;  // Signalled when all threads are done with the set
+	int n_threads;
+	int set_index;                         // Index of the set being processed; -1 before the first
+	int n_finished;                        // Number of threads done with the current set
+	int stop;                              // 1 to make the threads finish
+	FrameSlot* current_slots;
+};
+
 void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, FrameSource* const frame_source);
+void construct_full_fm_matrix_in_parallel(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, FrameSource* const frame_source);
+void init_cell_lists(CG_MODEL_DATA* const cg, FrameSource* const frame_source, PairCellList &pair_cell_list, ThreeBCellList &three_body_cell_list);
+void update_cell_lists(CG_MODEL_DATA* const cg, FrameSource* const frame_source, PairCellList &pair_cell_list, ThreeBCellList &three_body_cell_list);
+void load_frame_slot(FrameSlot* const slot, const int frame_index, MATRIX_DATA* const mat, FrameSource* const frame_source, CG_MODEL_DATA* const cg, PairCellList &pair_cell_list, ThreeBCellList &three_body_cell_list, double* const ref_box_half_lengths);
+void process_frame_slot(CG_MODEL_DATA* const cg, ThreadLocalComputers* const computers, MATRIX_DATA* const thread_mat, FrameSlot* const slot, double* const pressure_constraint_rhs_vector);
+void run_frame_worker(FrameWorkers* const workers, const int thread_index, CG_MODEL_DATA* const cg, ThreadLocalComputers* const computers, MATRIX_DATA* const thread_mat, double* const pressure_constraint_rhs_vector);
 
 int main(int argc, char* argv[])
 {
@@ -103,6 +139,7 @@ int main(int argc, char* argv[])
     printf("Beginning to read frames.\n");
     printf("Finding first frame...\n");
     frame_source.get_first_frame(&frame_source, cg.topo_data.n_cg_sites, cg.topo_data.cg_site_types);
+    enable_frame_prefetching(&frame_source);
 	if (frame_source.dynamic_state_sampling == 1) frame_source.sampleTypesFromProbs();
 	
     // Assign a host of function pointers in 'cg' new definitions
@@ -129,6 +166,7 @@ int main(int argc, char* argv[])
     FILE* solution_file = open_file("sol_info.out", "w");
     fprintf(solution_file, "fm_matrix_rows:%d; fm_matrix_columns:%d;\n",
             mat.fm_matrix_rows, mat.fm_matrix_columns);
+    write_density_weight_table_info(&cg, solution_file);
     fclose(solution_file);
 
     //----------------------------------------------------------------
@@ -169,6 +207,12 @@ int main(int argc, char* argv[])
 
 void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, FrameSource* const frame_source)
 {
+    // Hand frames out to several threads if requested.
+    if (mat->num_frame_threads > 1) {
+    	construct_full_fm_matrix_in_parallel(cg, mat, frame_source);
+    	return;
+    }
+    
     int n_blocks;
     int read_stat = 1;
     int total_frame_samples = frame_source->n_frames;
@@ -181,20 +225,9 @@ void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, F
     
     // Perform initial generation of cell lists user for generating neighbor lists.
     // This list will only be rebuilt if the box dimensions change.
-    
-    // Initialize the cell linked lists for finding neighbors in the provided frames;
-    PairCellList pair_cell_list = PairCellList();
-    ThreeBCellList three_body_cell_list = ThreeBCellList();
-    
-    // Populate the cell linked lists.
-    pair_cell_list.init(cg->pair_nonbonded_interactions.cutoff, frame_source);
-    if (cg->three_body_nonbonded_interactions.class_subtype > 0) {
-    	double max_cutoff = 0.0;
-        for (int i = 0; i < cg->three_body_nonbonded_interactions.get_n_defined(); i++) {
-        	max_cutoff = fmax(max_cutoff, cg->three_body_nonbonded_interactions.three_body_nonbonded_cutoffs[i]);
-        }
-    three_body_cell_list.init(max_cutoff, frame_source);
-    }
+    PairCellList pair_cell_list;
+    ThreeBCellList three_body_cell_list;
+    init_cell_lists(cg, frame_source, pair_cell_list, three_body_cell_list);
     
 	// Record this box's dimensions.
 	for (int i = 0; i < frame_source->position_dimension; i++) {
@@ -211,17 +244,12 @@ void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, F
     if (frame_source->dynamic_state_sampling == 1) {
 		total_frame_samples = frame_source->n_frames * frame_source->dynamic_state_samples_per_frame;
 	}	
-    if (mat->matrix_type == kDense) {
-        n_blocks = total_frame_samples;
-	    mat->frames_per_traj_block = 1;
-    } else {
-		// Check if number of frames is divisible by frames per trajectory block.
-		if (total_frame_samples % mat->frames_per_traj_block != 0) {
-			printf("Total number of frame samples %d is not divisible by block size %d.\n", total_frame_samples, mat->frames_per_traj_block);
-			exit(EXIT_FAILURE);
-		}
-		n_blocks = total_frame_samples / mat->frames_per_traj_block;
+	// Check if number of frames is divisible by frames per trajectory block.
+	if (total_frame_samples % mat->frames_per_traj_block != 0) {
+		printf("Total number of frame samples %d is not divisible by block size %d.\n", total_frame_samples, mat->frames_per_traj_block);
+		exit(EXIT_FAILURE);
 	}
+	n_blocks = total_frame_samples / mat->frames_per_traj_block;
 
     mat->accumulation_row_shift = 0;
 
@@ -247,7 +275,7 @@ void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, F
             if (frame_source->use_statistical_reweighting) {
                 int frame_index = mat->trajectory_block_index * mat->frames_per_traj_block + trajectory_block_frame_index;
                 printf("Reweighting entries for frame %d. ", frame_index);
-                mat->current_frame_weight = frame_source->frame_weights[frame_index];
+                mat->set_frame_weight(trajectory_block_frame_index, frame_source->frame_weights[frame_index]);
             }
             
             //Skip processing frame if frame weight is 0.
@@ -263,19 +291,9 @@ void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, F
 					}
 				}
 				
-				// Redo cell list set-up and update reference box size if box has changed.
+				// Adapt the cell lists and update reference box size if box has changed.
 				if (box_change == 1) {
-	            	// Re-initialize the cell linked lists for finding neighbors in the provided frames;
-  					pair_cell_list = PairCellList();
-    				three_body_cell_list = ThreeBCellList();
-    				pair_cell_list.init(cg->pair_nonbonded_interactions.cutoff, frame_source);
-    				if (cg->three_body_nonbonded_interactions.class_subtype > 0) {
-        				double max_cutoff = 0.0;
-        				for (int i = 0; i < cg->three_body_nonbonded_interactions.get_n_defined(); i++) {
-            				max_cutoff = fmax(max_cutoff, cg->three_body_nonbonded_interactions.three_body_nonbonded_cutoffs[i]);
-        				}
-        				three_body_cell_list.init(max_cutoff, frame_source);
-    				}
+	            	update_cell_lists(cg, frame_source, pair_cell_list, three_body_cell_list);
     			
     				// Update the reference_box_half_lengths for this new box size.
     				for (int i = 0; i < frame_source->position_dimension; i++) {
@@ -337,3 +355,248 @@ void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, F
     frame_source->cleanup(frame_source);
     delete [] ref_box_half_lengths;
 }
+
+// Set up fresh cell linked lists for finding neighbors in the current frame's box.
+
+void init_cell_lists(CG_MODEL_DATA* const cg, FrameSource* const frame_source, PairCellList &pair_cell_list, ThreeBCellList &three_body_cell_list)
+{
+	pair_cell_list = PairCellList();
+	three_body_cell_list = ThreeBCellList();
+	pair_cell_list.init(cg->pair_nonbonded_interactions.cutoff + cg->verlet_skin, frame_source);
+	if (cg->three_body_nonbonded_interactions.class_subtype > 0) {
+		double max_cutoff = 0.0;
+		for (int i = 0; i < cg->three_body_nonbonded_interactions.get_n_defined(); i++) {
+			max_cutoff = fmax(max_cutoff, cg->three_body_nonbonded_interactions.three_body_nonbonded_cutoffs[i]);
+		}
+		three_body_cell_list.init(max_cutoff, frame_source);
+	}
+}
+
+// Adapt the cell lists to a changed box without rebuilding them unless their grid must change.
+
+void update_cell_lists(CG_MODEL_DATA* const cg, FrameSource* const frame_source, PairCellList &pair_cell_list, ThreeBCellList &three_body_cell_list)
+{
+	pair_cell_list.updateBox(frame_source);
+	if (cg->three_body_nonbonded_interactions.class_subtype > 0) {
+		three_body_cell_list.updateBox(frame_source);
+	}
+}
+
+// Frame-parallel version of the dense matrix-building loop.
+// Each thread owns a copy of the FM matrix with its own per-frame matrix and its own partial
+// normal equations, along with its own interaction computers. The main thread reads one frame
+// for each thread into a slot while the threads work on the previous set of slots.
+// Once all frames are processed, the partial normal equations are added together.
+
+void construct_full_fm_matrix_in_parallel(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, FrameSource* const frame_source)
+{
+	int n_threads = mat->num_frame_threads;
+	int n_frames = frame_source->n_frames;
+	int n_sites = frame_source->frame_config->current_n_sites;
+	double* ref_box_half_lengths = new double[frame_source->position_dimension];
+	
+	printf("Processing frames with %d threads.\n", n_threads);
+	mat->frames_per_traj_block = 1;
+	mat->accumulation_row_shift = 0;
+	
+	// Skip the desired number of frames before starting the matrix building loops.
+	frame_source->move_to_start_frame(frame_source);
+	
+	// Set up the cell lists and record this box's dimensions.
+	PairCellList pair_cell_list;
+	ThreeBCellList three_body_cell_list;
+	init_cell_lists(cg, frame_source, pair_cell_list, three_body_cell_list);
+	for (int i = 0; i < frame_source->position_dimension; i++) {
+		ref_box_half_lengths[i] = frame_source->frame_config->simulation_box_half_lengths[i];
+	}
+	
+	// Allocate thread-local matrices and computers and two sets of frame slots,
+	// one being processed and one being read.
+	std::vector<MATRIX_DATA*> thread_mats(n_threads);
+	std::vector<ThreadLocalComputers*> thread_computers(n_threads);
+	std::vector<FrameSlot> slots(2 * n_threads);
+	for (int t = 0; t < n_threads; t++) {
+		thread_mats[t] = copy_dense_matrix_for_thread(mat);
+		thread_computers[t] = new ThreadLocalComputers(cg);
+	}
+	for (int s = 0; s < 2 * n_threads; s++) {
+		slots[s].frame_config = new FrameConfig(n_sites);
+		slots[s].frame_index = -1;
+	}
+	
+	// Start the worker threads; they wait for the first set of frames.
+	FrameWorkers workers;
+	workers.n_threads = n_threads;
+	workers.set_index = -1;
+	workers.n_finished = 0;
+	workers.stop = 0;
+	workers.current_slots = NULL;
+	for (int t = 0; t < n_threads; t++) {
+		workers.threads.push_back(std::thread(run_frame_worker, &workers, t, cg, thread_computers[t], thread_mats[t], frame_source->pressure_constraint_rhs_vector));
+	}
+	
+	// Read the first set of frames.
+	int n_frames_read = 0;
+	for (int t = 0; t < n_threads; t++) {
+		if (n_frames_read < n_frames) {
+			load_frame_slot(&slots[t], n_frames_read, mat, frame_source, cg, pair_cell_list, three_body_cell_list, ref_box_half_lengths);
+			n_frames_read++;
+		}
+	}
+	
+	printf("Entering primary matrix-building loop.\n"); fflush(stdout);
+	int n_sets = (n_frames + n_threads - 1) / n_threads;
+	for (int set = 0; set < n_sets; set++) {
+		FrameSlot* current_slots = &slots[(set % 2) * n_threads];
+		FrameSlot* next_slots = &slots[((set + 1) % 2) * n_threads];
+		
+		// Start processing the current set of frames.
+		{
+			std::lock_guard<std::mutex> guard(workers.lock);
+			workers.current_slots = current_slots;
+			workers.n_finished = 0;
+			workers.set_index = set;
+		}
+		workers.set_ready.notify_all();
+		
+		// Read the next set of frames in the meantime.
+		for (int t = 0; t < n_threads; t++) {
+			next_slots[t].frame_index = -1;
+			if (n_frames_read < n_frames) {
+				load_frame_slot(&next_slots[t], n_frames_read, mat, frame_source, cg, pair_cell_list, three_body_cell_list, ref_box_half_lengths);
+				n_frames_read++;
+			}
+		}
+		
+		{
+			std::unique_lock<std::mutex> guard(workers.lock);
+			while (workers.n_finished < n_threads) workers.set_finished.wait(guard);
+		}
+		
+		printf("\r%d (%d) frames have been sampled. ", frame_source->current_frame_n, std::min((set + 1) * n_threads, n_frames));
+		fflush(stdout);
+	}
+	mat->trajectory_block_index = n_frames;
+	{
+		std::lock_guard<std::mutex> guard(workers.lock);
+		workers.stop = 1;
+	}
+	workers.set_ready.notify_all();
+	for (int t = 0; t < n_threads; t++) workers.threads[t].join();
+	
+	// Add the partial normal equations together in a fixed order.
+	for (int t = 0; t < n_threads; t++) {
+		reduce_and_free_thread_dense_matrix(mat, thread_mats[t]);
+		delete thread_computers[t];
+	}
+	for (int s = 0; s < 2 * n_threads; s++) {
+		delete slots[s].frame_config;
+	}
+	
+	printf("\nFinishing frame parsing.\n");
+	
+	// Close the trajectory and free the relevant temp variables.
+	frame_source->cleanup(frame_source);
+	delete [] ref_box_half_lengths;
+}
+
+// Read the next frame from the trajectory (unless it is the first) and copy it into a slot.
+// The frame weight and cell lists are determined here, in trajectory order, exactly as in
+// the serial matrix-building loop.
+
+void load_frame_slot(FrameSlot* const slot, const int frame_index, MATRIX_DATA* const mat, FrameSource* const frame_source, CG_MODEL_DATA* const cg, PairCellList &pair_cell_list, ThreeBCellList &three_body_cell_list, double* const ref_box_half_lengths)
+{
+	if (frame_index > 0) {
+		int read_stat = (*frame_source->get_next_frame)(frame_source);
+		if (read_stat == 0) {
+			printf("Failure reading frame %d (%d). Check trajectory for errors.\n", frame_source->current_frame_n, frame_index);
+			exit(EXIT_FAILURE);
+		}
+	}
+	
+	// If reweighting is being used, look up the weighting factor for this frame.
+	if (frame_source->use_statistical_reweighting) {
+		printf("Reweighting entries for frame %d. ", frame_index);
+		mat->current_frame_weight = frame_source->frame_weights[frame_index];
+		
+		// Skip processing frame if frame weight is 0.
+		if (mat->current_frame_weight == 0.0) {
+			slot->frame_index = -1;
+			return;
+		}
+	}
+	
+	// Adapt the cell lists and update reference box size if box has changed.
+	FrameConfig* frame_config = frame_source->getFrameConfig();
+	int box_change = 0;
+	for (int i = 0; i < frame_source->position_dimension; i++) {
+		if ( fabs(ref_box_half_lengths[i] - frame_config->simulation_box_half_lengths[i]) > VERYSMALL_F ) {
+			box_change = 1;
+			break;
+		}
+	}
+	if (box_change == 1) {
+		update_cell_lists(cg, frame_source, pair_cell_list, three_body_cell_list);
+		for (int i = 0; i < frame_source->position_dimension; i++) {
+			ref_box_half_lengths[i] = frame_config->simulation_box_half_lengths[i];
+		}
+	}
+	
+	// Modify frame weight if using volume weighting.
+	if (mat->volume_weighting_flag == 1) {
+		double volume = 1.0;
+		for (int i = 0; i < mat->position_dimension; i++) volume *= 2.0 * frame_config->simulation_box_half_lengths[i];
+		mat->current_frame_weight *= volume * volume;
+	}
+	
+	// Copy the frame.
+	slot->frame_index = frame_index;
+	slot->frame_weight = mat->current_frame_weight;
+	slot->pair_cell_list = pair_cell_list;
+	slot->three_body_cell_list = three_body_cell_list;
+	slot->frame_config->current_n_sites = frame_config->current_n_sites;
+	for (int i = 0; i < DIMENSION; i++) {
+		slot->frame_config->simulation_box_half_lengths[i] = frame_config->simulation_box_half_lengths[i];
+	}
+	for (int i = 0; i < frame_config->current_n_sites; i++) {
+		slot->frame_config->x[i] = frame_config->x[i];
+		slot->frame_config->f[i] = frame_config->f[i];
+	}
+}
+
+// Build the FM equations for the frame in a slot and add their normal form into
+// the thread's partial normal equations.
+
+void process_frame_slot(CG_MODEL_DATA* const cg, ThreadLocalComputers* const computers, MATRIX_DATA* const thread_mat, FrameSlot* const slot, double* const pressure_constraint_rhs_vector)
+{
+	if (slot->frame_index < 0) return;
+	
+	thread_mat->trajectory_block_index = slot->frame_index;
+	thread_mat->current_frame_weight = slot->frame_weight;
+	
+	(*thread_mat->set_fm_matrix_to_zero)(thread_mat);
+	add_target_virials_from_trajectory(thread_mat, pressure_constraint_rhs_vector);
+	calculate_frame_fm_matrix(cg, computers, thread_mat, slot->frame_config, slot->pair_cell_list, slot->three_body_cell_list, 0);
+	(*thread_mat->do_end_of_frameblock_matrix_manipulations)(thread_mat);
+}
+
+// Body of a worker thread: process this thread's slot of each set of frames as it is handed out.
+
+void run_frame_worker(FrameWorkers* const workers, const int thread_index, CG_MODEL_DATA* const cg, ThreadLocalComputers* const computers, MATRIX_DATA* const thread_mat, double* const pressure_constraint_rhs_vector)
+{
+	int last_set_index = -1;
+	while (true) {
+		std::unique_lock<std::mutex> guard(workers->lock);
+		while (workers->stop == 0 && workers->set_index == last_set_index) workers->set_ready.wait(guard);
+		if (workers->stop == 1) return;
+		last_set_index = workers->set_index;
+		FrameSlot* slot = &workers->current_slots[thread_index];
+		guard.unlock();
+		
+		process_frame_slot(cg, computers, thread_mat, slot, pressure_constraint_rhs_vector);
+		
+		guard.lock();
+		workers->n_finished++;
+		if (workers->n_finished == workers->n_threads) workers->set_finished.notify_one();
+	}
+}
@@ -109,6 +109,8 @@ void initialize_single_class_range_finding_temps(InteractionClassSpec *iclass, I
     icomp->ispec = iclass;
 	if (iclass->class_type == kPairNonbonded) {
         icomp->calculate_fm_matrix_elements = calc_isotropic_two_body_sampling_range;
+        // Sample every pair found in the cell list, not just those within the cutoff.
+        icomp->cutoff2 = VERYLARGE * VERYLARGE;
     } else if (iclass->class_type == kPairBonded) {
         icomp->calculate_fm_matrix_elements = calc_isotropic_two_body_sampling_range;
     } else if (iclass->class_type == kAngularBonded) {
@@ -132,20 +134,22 @@ void initialize_single_class_range_finding_temps(InteractionClassSpec *iclass, I
 		dcomp->cutoff2 = iclass->cutoff * iclass->cutoff;
 		dcomp->process_density = evaluate_density_sampling_range;
 		dcomp->calculate_fm_matrix_elements = calc_nothing;
+		// Only densities are sampled, so no pairs are cached for matrix elements.
+		dcomp->calculate_density_derivative = NULL;
 		if (iclass->class_subtype == 1) { // Continuously varying (Gaussian) weight function
-			dcomp->calculate_density_values	= calc_gaussian_density_values;
+			dcomp->calculate_density_weight = calc_gaussian_density_weight;
 			printf("Will calculate density using shifted-force Gaussian weight functions.\n");
 		} else if (iclass->class_subtype == 2) { // Switching function (tanh) weight function
-			dcomp->calculate_density_values = calc_switching_density_values;
+			dcomp->calculate_density_weight = calc_switching_density_weight;
 			printf("Will calculate density using shifted-force switching (tanh) weight functions.\n");
 		} else if (iclass->class_subtype == 3) { // Lucy-type weight function
-			dcomp->calculate_density_values = calc_lucy_density_values;
+			dcomp->calculate_density_weight = calc_lucy_density_weight;
 			printf("Will calculate density using Lucy-style weight functions.\n");
 		}  else if (iclass->class_subtype == 4) { // Lucy-type weight function
-			dcomp->calculate_density_values = calc_re_density_values;
+			dcomp->calculate_density_weight = calc_re_density_weight;
 			printf("Will calculate density using Relative-Entropy style weight functions.\n");
 		} else if (iclass->class_subtype == 0) { // Do nothing
-			dcomp->calculate_density_values = calc_nothing;
+			dcomp->calculate_density_weight = NULL;
 		} else {
 			report_unrecognized_class_subtype(iclass);
 		}
@@ -284,6 +288,7 @@ void setup_site_to_density_group_index_for_range(DensityClassSpec* iclass)
 			}
 		}
 	}
+	iclass->set_up_pair_interaction_lists();
 }
 
 //--------------------------------------------------------------------------
@@ -54,6 +54,7 @@ int main(int argc, char* argv[])
     printf("Reading first frame.\n");
     printf("Finding first frame ...\n");
     fs.get_first_frame(&fs, cg.n_cg_sites, cg.topo_data.cg_site_types);
+    enable_frame_prefetching(&fs);
 
     printf("Reading interaction ranges.\n");
     initialize_range_finding_temps(&cg);
@@ -192,18 +193,12 @@ void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, F
 					}
 				}
 				
-				// Redo cell list set-up and update reference box size if box has changed.
+				// Adapt the cell lists and update reference box size if box has changed.
 				if (box_change == 1) {
-	            	// Re-initialize the cell linked lists for finding neighbors in the provided frames;
-  					pair_cell_list = PairCellList();
-    				three_body_cell_list = ThreeBCellList();
-    				pair_cell_list.init(cg->pair_nonbonded_interactions.cutoff, frame_source);
+	            	// The grid is only rebuilt when the box has changed enough to need a different one.
+    				pair_cell_list.updateBox(frame_source);
     				if (cg->three_body_nonbonded_interactions.class_subtype > 0) {
-        				double max_cutoff = 0.0;
-        				for (int i = 0; i < cg->three_body_nonbonded_interactions.get_n_defined(); i++) {
-            				max_cutoff = fmax(max_cutoff, cg->three_body_nonbonded_interactions.three_body_nonbonded_cutoffs[i]);
-        				}
-        				three_body_cell_list.init(max_cutoff, frame_source);
+        				three_body_cell_list.updateBox(frame_source);
     				}
     				
     				// Update the reference_box_half_lengths for this new box size.
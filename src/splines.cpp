@@ -6,8 +6,24 @@
 //
 
 #include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
 #include "splines.h"
 #include "interaction_model.h"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#if _bspline_gsl_reference
+#include "gsl/gsl_bspline.h"
+#endif
+
+// Largest spline order the uniform B-spline evaluator keeps scratch space for.
+const int MAX_BSPLINE_ORDER = 32;
+// Number of parameter values the batched B-spline evaluator runs through the recurrence together
+// (a multiple of the eight doubles in an AVX-512 register).
+const int BSPLINE_BATCH_BLOCK = 8;
 
 // Helper function to print a sizing error message.
 inline void check_bspline_size(const int control_points, const int order);
@@ -18,6 +34,15 @@ inline void check_bspline_sizing(const size_t coeffs_size, const int first_nonze
 inline void adjust_splines_for_periodicity(const InteractionClassType class_type, const int n_coef, const std::vector<unsigned> defined_to_periodic_intrxn_index_map, std::vector<unsigned> &interaction_column_indices);
 inline void shift_remaining_indices(const int start, const int bspline_k, std::vector<unsigned> &interaction_column_indices, const int size);
 
+// Helper functions for evaluating B-splines on uniform breakpoints
+template <int order_template> inline void calc_uniform_bspline_vals(const int runtime_order, const int interval, const int n_breaks, const double u, const double inv_spacing, double* vals, double* derivs);
+template <int order> void calc_uniform_bspline_vals_batch(const UniformBSplineBasis &basis, const int n_vals, const double* x, int* first_nonzero_basis_indices, double* vals);
+template <int order> inline void calc_interior_bspline_block(const double* u, double block_vals[][BSPLINE_BATCH_BLOCK]);
+inline int clamp_breakpoint_index(const int index, const int n_breaks);
+#if _bspline_gsl_reference
+void check_uniform_bspline_against_gsl(const UniformBSplineBasis &basis);
+#endif
+
 SplineComputer* set_up_fm_spline_comp(InteractionClassSpec *ispec)
 {
     if (ispec->n_to_force_match > 0) {
@@ -76,6 +101,72 @@ double SplineComputer::get_param_less_lower_cutoff(const int index_among_defined
     return param_less_lower_cutoff;
 }
 
+// Generic batched evaluation: one call of calculate_basis_fn_vals per value.
+void SplineComputer::calculate_basis_fn_vals_batch(const int index_among_defined, const int n_vals, const double* param_vals, int* first_nonzero_basis_indices, double* vals)
+{
+    std::vector<double> single_vals(n_coef);
+    for (int n = 0; n < n_vals; n++) {
+        calculate_basis_fn_vals(index_among_defined, param_vals[n], first_nonzero_basis_indices[n], single_vals);
+        for (unsigned m = 0; m < n_coef; m++) vals[n * n_coef + m] = single_vals[m];
+    }
+}
+
+
+void UniformBSplineBasis::init(const int spline_order, const int breakpoints, const double lower_break, const double upper_break)
+{
+    if (spline_order > MAX_BSPLINE_ORDER) {
+        printf("Spline order %d is larger than the maximum supported order (%d)!\n", spline_order, MAX_BSPLINE_ORDER);
+        exit(EXIT_FAILURE);
+    }
+    order = spline_order;
+    n_breaks = breakpoints;
+    lower = lower_break;
+    upper = upper_break;
+    spacing = (upper - lower) / (n_breaks - 1.0);
+    inv_spacing = 1.0 / spacing;
+}
+
+void UniformBSplineBasis::eval(const double x, int &first_nonzero_basis_index, double* vals) const
+{
+    first_nonzero_basis_index = find_interval(x);
+    double u = (x - lower) * inv_spacing - first_nonzero_basis_index;
+    switch (order) {
+        case 2: calc_uniform_bspline_vals<2>(order, first_nonzero_basis_index, n_breaks, u, inv_spacing, vals, NULL); break;
+        case 3: calc_uniform_bspline_vals<3>(order, first_nonzero_basis_index, n_breaks, u, inv_spacing, vals, NULL); break;
+        case 4: calc_uniform_bspline_vals<4>(order, first_nonzero_basis_index, n_breaks, u, inv_spacing, vals, NULL); break;
+        case 5: calc_uniform_bspline_vals<5>(order, first_nonzero_basis_index, n_breaks, u, inv_spacing, vals, NULL); break;
+        case 6: calc_uniform_bspline_vals<6>(order, first_nonzero_basis_index, n_breaks, u, inv_spacing, vals, NULL); break;
+        default: calc_uniform_bspline_vals<0>(order, first_nonzero_basis_index, n_breaks, u, inv_spacing, vals, NULL); break;
+    }
+}
+
+void UniformBSplineBasis::eval_with_deriv(const double x, int &first_nonzero_basis_index, double* vals, double* derivs) const
+{
+    first_nonzero_basis_index = find_interval(x);
+    double u = (x - lower) * inv_spacing - first_nonzero_basis_index;
+    switch (order) {
+        case 2: calc_uniform_bspline_vals<2>(order, first_nonzero_basis_index, n_breaks, u, inv_spacing, vals, derivs); break;
+        case 3: calc_uniform_bspline_vals<3>(order, first_nonzero_basis_index, n_breaks, u, inv_spacing, vals, derivs); break;
+        case 4: calc_uniform_bspline_vals<4>(order, first_nonzero_basis_index, n_breaks, u, inv_spacing, vals, derivs); break;
+        case 5: calc_uniform_bspline_vals<5>(order, first_nonzero_basis_index, n_breaks, u, inv_spacing, vals, derivs); break;
+        case 6: calc_uniform_bspline_vals<6>(order, first_nonzero_basis_index, n_breaks, u, inv_spacing, vals, derivs); break;
+        default: calc_uniform_bspline_vals<0>(order, first_nonzero_basis_index, n_breaks, u, inv_spacing, vals, derivs); break;
+    }
+}
+
+void UniformBSplineBasis::eval_batch(const int n_vals, const double* x, int* first_nonzero_basis_indices, double* vals) const
+{
+    switch (order) {
+        case 2: calc_uniform_bspline_vals_batch<2>(*this, n_vals, x, first_nonzero_basis_indices, vals); break;
+        case 3: calc_uniform_bspline_vals_batch<3>(*this, n_vals, x, first_nonzero_basis_indices, vals); break;
+        case 4: calc_uniform_bspline_vals_batch<4>(*this, n_vals, x, first_nonzero_basis_indices, vals); break;
+        case 5: calc_uniform_bspline_vals_batch<5>(*this, n_vals, x, first_nonzero_basis_indices, vals); break;
+        case 6: calc_uniform_bspline_vals_batch<6>(*this, n_vals, x, first_nonzero_basis_indices, vals); break;
+        default: 
+            for (int n = 0; n < n_vals; n++) eval(x[n], first_nonzero_basis_indices[n], &vals[n * order]);
+            break;
+    }
+}
 
 BSplineComputer::BSplineComputer(InteractionClassSpec* ispec) : SplineComputer(ispec)
 {
@@ -87,8 +178,8 @@ BSplineComputer::BSplineComputer(InteractionClassSpec* ispec) : SplineComputer(i
     }
 
     printf("Allocating b-spline temporaries for %d interactions.\n", n_to_force_match);
-    bspline_workspaces = new gsl_bspline_workspace*[n_to_force_match];
-    bspline_vectors = gsl_vector_alloc(n_coef);
+    bspline_bases = std::vector<UniformBSplineBasis>(n_to_force_match);
+    bspline_vals = std::vector<double>(n_coef, 0.0);
 	adjust_splines_for_periodicity(ispec->class_type, n_coef, ispec->defined_to_periodic_intrxn_index_map, interaction_column_indices_);
 	
     int counter = 0;
@@ -97,54 +188,49 @@ BSplineComputer::BSplineComputer(InteractionClassSpec* ispec) : SplineComputer(i
             ici_index = interaction_column_indices_[counter + 1] - interaction_column_indices_[counter];
             n_to_print_minus_bspline_k = ici_index - n_coef + 2;
             check_bspline_size(n_to_print_minus_bspline_k, (int)(n_coef));
-            bspline_workspaces[counter] = gsl_bspline_alloc(n_coef, n_to_print_minus_bspline_k);
-            gsl_bspline_knots_uniform(ispec_->lower_cutoffs[i] - VERYSMALL_F, ispec_->upper_cutoffs[i] + VERYSMALL_F, bspline_workspaces[counter]);
+            bspline_bases[counter].init(n_coef, n_to_print_minus_bspline_k, ispec_->lower_cutoffs[i] - VERYSMALL_F, ispec_->upper_cutoffs[i] + VERYSMALL_F);
+#if _bspline_gsl_reference
+            check_uniform_bspline_against_gsl(bspline_bases[counter]);
+#endif
             counter++;
         }
     }
 }
 
-BSplineComputer::~BSplineComputer()
-{
-    for (unsigned i = 0; i < n_to_force_match; i++) {
-        gsl_bspline_free(bspline_workspaces[i]);
-    }
-    delete [] bspline_workspaces;
-    gsl_vector_free(bspline_vectors);   
-};
-
 // Calculate the value of a one-parameter B-spline; direction of the corresponding
 // forces is calculated in the function calling this one.
 void BSplineComputer::calculate_basis_fn_vals(const int index_among_defined, const double param_val, int &first_nonzero_basis_index, std::vector<double> &vals)
 {
     assert(vals.size() == n_coef);
-	size_t istart, iend;
     double param_less_lower_cutoff = get_param_less_lower_cutoff(index_among_defined, param_val);
-    first_nonzero_basis_index = (int)(param_less_lower_cutoff / ispec_->get_fm_binwidth());
-
     int index_among_matched = ispec_->defined_to_matched_intrxn_index_map[index_among_defined] - 1;
-    gsl_bspline_eval_nonzero(param_less_lower_cutoff + ispec_->lower_cutoffs[index_among_defined], bspline_vectors, &istart, &iend, bspline_workspaces[index_among_matched]);
-    first_nonzero_basis_index = istart;
-    
-    for (unsigned i = 0; i < n_coef; i++) {
-        vals[i] = gsl_vector_get(bspline_vectors, i);
+    bspline_bases[index_among_matched].eval(param_less_lower_cutoff + ispec_->lower_cutoffs[index_among_defined], first_nonzero_basis_index, &vals[0]);
+}
+
+void BSplineComputer::calculate_basis_fn_vals_batch(const int index_among_defined, const int n_vals, const double* param_vals, int* first_nonzero_basis_indices, double* vals)
+{
+    if ((int)(batch_param_vals.size()) < n_vals) batch_param_vals.resize(n_vals);
+    for (int n = 0; n < n_vals; n++) {
+        batch_param_vals[n] = get_param_less_lower_cutoff(index_among_defined, param_vals[n]) + ispec_->lower_cutoffs[index_among_defined];
     }
+    int index_among_matched = ispec_->defined_to_matched_intrxn_index_map[index_among_defined] - 1;
+    bspline_bases[index_among_matched].eval_batch(n_vals, &batch_param_vals[0], first_nonzero_basis_indices, vals);
 }
 
 double BSplineComputer::evaluate_spline(const int index_among_defined, const int first_nonzero_basis_index, const std::vector<double> &spline_coeffs, const double axis) 
 {
-    size_t istart, iend;
+    int istart;
     int ici_value = 0;
     double force = 0.0;
     int index_among_matched_interactions = ispec_->defined_to_matched_intrxn_index_map[index_among_defined];
     double axis_val = check_against_cutoffs(axis, ispec_->lower_cutoffs[index_among_defined], ispec_->upper_cutoffs[index_among_defined]);
-    gsl_bspline_eval_nonzero(axis_val, bspline_vectors, &istart, &iend, bspline_workspaces[index_among_matched_interactions - 1]);
+    bspline_bases[index_among_matched_interactions - 1].eval(axis_val, istart, &bspline_vals[0]);
     if (index_among_matched_interactions > 0) {
 		ici_value = interaction_column_indices_[index_among_matched_interactions - 1];
     }
-    for (int tn = int(istart); tn <= int(iend); tn++) {
+    for (int tn = istart; tn < istart + int(n_coef); tn++) {
         check_bspline_sizing(spline_coeffs.size(), first_nonzero_basis_index, index_among_matched_interactions, ici_value, tn, istart);
-        force += gsl_vector_get(bspline_vectors, tn - istart) * spline_coeffs[first_nonzero_basis_index + ici_value + tn];
+        force += bspline_vals[tn - istart] * spline_coeffs[first_nonzero_basis_index + ici_value + tn];
     }
     return force;
 }
@@ -162,14 +248,9 @@ BSplineAndDerivComputer::BSplineAndDerivComputer(InteractionClassSpec* ispec) :
     }
  
 	printf("Allocating b-spline and derivative temporaries for %d interactions.\n", ispec_->get_n_defined());
-	bspline_vectors = gsl_vector_alloc(n_coef);
-	bspline_matrices = gsl_matrix_alloc(n_coef, 2);
-	
-	if (n_to_force_match < 1) {
-		bspline_workspaces = new gsl_bspline_workspace*[1];
-	} else {
-		bspline_workspaces = new gsl_bspline_workspace*[n_to_force_match];
-	}
+	bspline_bases = std::vector<UniformBSplineBasis>(n_to_force_match);
+	bspline_vals = std::vector<double>(n_coef, 0.0);
+	bspline_derivs = std::vector<double>(n_coef, 0.0);
 	
 	int counter = 0; // this is a stand in for index_among_matched_interxns
 	for (unsigned i = 0; i < n_defined; i++) {
@@ -177,72 +258,59 @@ BSplineAndDerivComputer::BSplineAndDerivComputer(InteractionClassSpec* ispec) :
 			ici_index = interaction_column_indices_[counter + 1] - interaction_column_indices_[counter];
 			n_to_print_minus_bspline_k = ici_index - n_coef + 2;
 			check_bspline_size(n_to_print_minus_bspline_k, (int)(n_coef));
-			bspline_workspaces[counter] = gsl_bspline_alloc(n_coef, n_to_print_minus_bspline_k);
-			gsl_bspline_knots_uniform(ispec_->lower_cutoffs[i], ispec_->upper_cutoffs[i], bspline_workspaces[counter]);
+			bspline_bases[counter].init(n_coef, n_to_print_minus_bspline_k, ispec_->lower_cutoffs[i], ispec_->upper_cutoffs[i]);
+#if _bspline_gsl_reference
+			check_uniform_bspline_against_gsl(bspline_bases[counter]);
+#endif
 			counter++;
 		}
 	}
 }
 
-BSplineAndDerivComputer::~BSplineAndDerivComputer() 
-{
-	if (ispec_->class_type != kThreeBodyNonbonded) {
-		for (unsigned i = 0; i < n_to_force_match; i++)	gsl_bspline_free(bspline_workspaces[i]);
-	} else {
-		for (unsigned i = 0; i < n_defined; i++)  gsl_bspline_free(bspline_workspaces[i]);
-	}
-	
-	delete [] bspline_workspaces;
-	gsl_vector_free(bspline_vectors);
-	gsl_matrix_free(bspline_matrices);
-}
-
 void BSplineAndDerivComputer::calculate_bspline_deriv_vals(const int index_among_defined, const double param_val, int &first_nonzero_basis_index, std::vector<double> &vals)
 {
     assert(vals.size() == n_coef);
-	size_t istart, iend;
     double param_less_lower_cutoff = get_param_less_lower_cutoff(index_among_defined, param_val);
-    first_nonzero_basis_index = (int)(param_less_lower_cutoff / ispec_->get_fm_binwidth());
-
     int index_among_matched = ispec_->defined_to_matched_intrxn_index_map[index_among_defined] - 1;
-    gsl_bspline_deriv_eval_nonzero(param_less_lower_cutoff + ispec_->lower_cutoffs[index_among_defined], (size_t)(1), bspline_matrices, &istart, &iend, bspline_workspaces[index_among_matched]);
-    first_nonzero_basis_index = istart;
+    bspline_bases[index_among_matched].eval_with_deriv(param_less_lower_cutoff + ispec_->lower_cutoffs[index_among_defined], first_nonzero_basis_index, &bspline_vals[0], &vals[0]);
     
     for (unsigned i = 0; i < n_coef; i++) {
-    	vals[i] = -gsl_matrix_get(bspline_matrices, i, 1);
+    	vals[i] = -vals[i];
     }
 }
 
 void BSplineAndDerivComputer::calculate_basis_fn_vals(const int index_among_defined, const double param_val, int &first_nonzero_basis_index, std::vector<double> &vals) 
 {
     assert(vals.size() == n_coef);
-    size_t istart, iend;
     double param_less_lower_cutoff = get_param_less_lower_cutoff(index_among_defined, param_val);
-    first_nonzero_basis_index = (int)(param_less_lower_cutoff / ispec_->get_fm_binwidth());
-    
     int index_among_matched = ispec_->defined_to_matched_intrxn_index_map[index_among_defined] - 1;
-    gsl_bspline_eval_nonzero(param_less_lower_cutoff + ispec_->lower_cutoffs[index_among_defined], bspline_vectors, &istart, &iend, bspline_workspaces[index_among_matched]);
-    first_nonzero_basis_index = istart;
-    
-    for (unsigned i = 0; i < n_coef; i++) {
-        vals[i] = gsl_vector_get(bspline_vectors, i);
+    bspline_bases[index_among_matched].eval(param_less_lower_cutoff + ispec_->lower_cutoffs[index_among_defined], first_nonzero_basis_index, &vals[0]);
+}
+
+void BSplineAndDerivComputer::calculate_basis_fn_vals_batch(const int index_among_defined, const int n_vals, const double* param_vals, int* first_nonzero_basis_indices, double* vals)
+{
+    if ((int)(batch_param_vals.size()) < n_vals) batch_param_vals.resize(n_vals);
+    for (int n = 0; n < n_vals; n++) {
+        batch_param_vals[n] = get_param_less_lower_cutoff(index_among_defined, param_vals[n]) + ispec_->lower_cutoffs[index_among_defined];
     }
+    int index_among_matched = ispec_->defined_to_matched_intrxn_index_map[index_among_defined] - 1;
+    bspline_bases[index_among_matched].eval_batch(n_vals, &batch_param_vals[0], first_nonzero_basis_indices, vals);
 }
 
 double BSplineAndDerivComputer::evaluate_spline(const int index_among_defined, const int first_nonzero_basis_index, const std::vector<double> &spline_coeffs, const double axis) 
 {
-    size_t istart, iend;
+    int istart;
     int ici_value = 0;
     double force = 0.0;
     int index_among_matched_interactions = ispec_->defined_to_matched_intrxn_index_map[index_among_defined];
 	double axis_val = check_against_cutoffs(axis, ispec_->lower_cutoffs[index_among_defined], ispec_->upper_cutoffs[index_among_defined]);
-    gsl_bspline_eval_nonzero(axis_val, bspline_vectors, &istart, &iend, bspline_workspaces[index_among_matched_interactions - 1]);
+    bspline_bases[index_among_matched_interactions - 1].eval(axis_val, istart, &bspline_vals[0]);
     if (index_among_matched_interactions > 0) {
 		ici_value = interaction_column_indices_[index_among_matched_interactions - 1];
     }
-    for (int tn = int(istart); tn <= int(iend); tn++) {
+    for (int tn = istart; tn < istart + int(n_coef); tn++) {
     	check_bspline_sizing(spline_coeffs.size(), first_nonzero_basis_index, index_among_matched_interactions, ici_value, tn, istart);
-    	force += gsl_vector_get(bspline_vectors, tn - istart) * spline_coeffs[first_nonzero_basis_index + ici_value + tn];
+    	force += bspline_vals[tn - istart] * spline_coeffs[first_nonzero_basis_index + ici_value + tn];
     }
     return force;
 }
@@ -250,17 +318,17 @@ double BSplineAndDerivComputer::evaluate_spline(const int index_among_defined, c
 double BSplineAndDerivComputer::evaluate_spline_deriv(const int index_among_defined, const int first_nonzero_basis_index, const std::vector<double> &spline_coeffs, const double axis) 
 {
     double deriv = 0.0;
-    size_t istart, iend;
+    int istart;
     int ici_value = 0;
     int index_among_matched_interactions = ispec_->defined_to_matched_intrxn_index_map[index_among_defined];
     double axis_val = check_against_cutoffs(axis, ispec_->lower_cutoffs[index_among_defined], ispec_->upper_cutoffs[index_among_defined]);
-	gsl_bspline_deriv_eval_nonzero(axis_val, size_t(1), bspline_matrices, &istart, &iend, bspline_workspaces[index_among_matched_interactions - 1]);
+	bspline_bases[index_among_matched_interactions - 1].eval_with_deriv(axis_val, istart, &bspline_vals[0], &bspline_derivs[0]);
     if (index_among_matched_interactions > 0) {
 		ici_value = interaction_column_indices_[index_among_matched_interactions - 1];
     }
-    for (int tn = int(istart); tn <= int(iend); tn++) {
+    for (int tn = istart; tn < istart + int(n_coef); tn++) {
     	check_bspline_sizing(spline_coeffs.size(), first_nonzero_basis_index, index_among_matched_interactions, ici_value, tn, istart);
-        deriv += gsl_matrix_get(bspline_matrices, tn - istart, 1) * spline_coeffs[first_nonzero_basis_index + ici_value + tn];
+        deriv += bspline_derivs[tn - istart] * spline_coeffs[first_nonzero_basis_index + ici_value + tn];
     }
     return deriv;
 }
@@ -283,6 +351,18 @@ void LinearSplineComputer::calculate_basis_fn_vals(const int index_among_defined
     vals[0] = 1.0 - vals[1];
 }
 
+// The fractional part is taken by subtracting the bin index, which matches
+// fmod exactly for these nonnegative values and keeps the loop vectorizable.
+void LinearSplineComputer::calculate_basis_fn_vals_batch(const int index_among_defined, const int n_vals, const double* param_vals, int* first_nonzero_basis_indices, double* vals)
+{
+    for (int n = 0; n < n_vals; n++) {
+        double scaled = get_param_less_lower_cutoff(index_among_defined, param_vals[n]) / ispec_->get_fm_binwidth();
+        first_nonzero_basis_indices[n] = int(scaled);
+        vals[2 * n + 1] = scaled - double(first_nonzero_basis_indices[n]);
+        vals[2 * n] = 1.0 - vals[2 * n + 1];
+    }
+}
+
 double LinearSplineComputer::evaluate_spline(const int index_among_defined, const int first_nonzero_basis_index, const std::vector<double> &spline_coeffs, const double axis) 
 {
     double force = 0.0;
@@ -382,4 +462,205 @@ inline void adjust_splines_for_periodicity(const InteractionClassType class_type
 inline void shift_remaining_indices(const int start, const int bspline_k, std::vector<unsigned> &interaction_column_indices, const int size)
 {
 	for(int i = start; i < size; i++) interaction_column_indices[i] += bspline_k;
-}
\ No newline at end of file
+}
+
+inline int clamp_breakpoint_index(const int index, const int n_breaks)
+{
+	if (index < 0) return 0;
+	if (index > n_breaks - 1) return n_breaks - 1;
+	return index;
+}
+
+// Cox-de Boor recurrence for the nonzero B-splines on one interval, run in
+// units of the breakpoint spacing; u is the position within the interval.
+// The knots repeat at both ends, so away from the ends every knot difference
+// is a whole number of spacings and each step only divides by its order.
+// Within order - 2 intervals of an end the repeated knots are clamped in
+// explicitly. A template order of zero falls back to the runtime order.
+// Derivatives, if requested, come from the order - 1 values of the same pass.
+template <int order_template> inline void calc_uniform_bspline_vals(const int runtime_order, const int interval, const int n_breaks, const double u, const double inv_spacing, double* vals, double* derivs)
+{
+	const int order = (order_template > 0) ? order_template : runtime_order;
+	double left[MAX_BSPLINE_ORDER], right[MAX_BSPLINE_ORDER], lower_order_vals[MAX_BSPLINE_ORDER];
+	bool interior = (interval >= order - 2) && (interval + order <= n_breaks);
+	
+	vals[0] = 1.0;
+	for (int j = 1; j < order; j++) {
+		if (derivs != NULL && j == order - 1) {
+			for (int r = 0; r < j; r++) lower_order_vals[r] = vals[r];
+		}
+		double saved = 0.0;
+		if (interior) {
+			double inv_j = 1.0 / double(j);
+			for (int r = 0; r < j; r++) {
+				double temp = vals[r] * inv_j;
+				vals[r] = saved + (double(r + 1) - u) * temp;
+				saved = (u + double(j - r - 1)) * temp;
+			}
+		} else {
+			left[j] = u + double(interval - clamp_breakpoint_index(interval + 1 - j, n_breaks));
+			right[j] = double(clamp_breakpoint_index(interval + j, n_breaks) - interval) - u;
+			for (int r = 0; r < j; r++) {
+				double temp = vals[r] / (right[r + 1] + left[j - r]);
+				vals[r] = saved + right[r + 1] * temp;
+				saved = left[j - r] * temp;
+			}
+		}
+		vals[j] = saved;
+	}
+	
+	if (derivs == NULL) return;
+	if (order == 1) {
+		derivs[0] = 0.0;
+		return;
+	}
+	// Basis function interval + m uses the order - 1 functions interval + m
+	// and interval + m + 1, which are lower_order_vals[m - 1] and [m].
+	for (int m = 0; m < order; m++) {
+		double d = 0.0;
+		if (interior) {
+			if (m >= 1) d += lower_order_vals[m - 1];
+			if (m < order - 1) d -= lower_order_vals[m];
+		} else {
+			if (m >= 1) d += double(order - 1) * lower_order_vals[m - 1] / double(clamp_breakpoint_index(interval + m, n_breaks) - clamp_breakpoint_index(interval + m - order + 1, n_breaks));
+			if (m < order - 1) d -= double(order - 1) * lower_order_vals[m] / double(clamp_breakpoint_index(interval + m + 1, n_breaks) - clamp_breakpoint_index(interval + m - order + 2, n_breaks));
+		}
+		derivs[m] = d * inv_spacing;
+	}
+}
+
+// Interior Cox-de Boor recurrence for a block of BSPLINE_BATCH_BLOCK values
+// at offsets u within their intervals. Built with AVX-512 (e.g. -mavx512f),
+// eight values go through each step at once, and with AVX2 (e.g. -mavx2),
+// four; otherwise the block index is the innermost loop for the compiler to
+// vectorize if it can. All versions do the same multiplications and
+// additions in the same order as calc_uniform_bspline_vals, so the results
+// are identical.
+#if defined(__AVX512F__)
+template <int order> inline void calc_interior_bspline_block(const double* u, double block_vals[][BSPLINE_BATCH_BLOCK])
+{
+	for (int e = 0; e < BSPLINE_BATCH_BLOCK; e += 8) {
+		__m512d u_e = _mm512_loadu_pd(u + e);
+		__m512d v[order];
+		v[0] = _mm512_set1_pd(1.0);
+		for (int j = 1; j < order; j++) {
+			__m512d inv_j = _mm512_set1_pd(1.0 / double(j));
+			__m512d saved = _mm512_setzero_pd();
+			for (int r = 0; r < j; r++) {
+				__m512d temp = _mm512_mul_pd(v[r], inv_j);
+				v[r] = _mm512_add_pd(saved, _mm512_mul_pd(_mm512_sub_pd(_mm512_set1_pd(double(r + 1)), u_e), temp));
+				saved = _mm512_mul_pd(_mm512_add_pd(u_e, _mm512_set1_pd(double(j - r - 1))), temp);
+			}
+			v[j] = saved;
+		}
+		for (int m = 0; m < order; m++) _mm512_storeu_pd(&block_vals[m][e], v[m]);
+	}
+}
+#elif defined(__AVX2__)
+template <int order> inline void calc_interior_bspline_block(const double* u, double block_vals[][BSPLINE_BATCH_BLOCK])
+{
+	for (int e = 0; e < BSPLINE_BATCH_BLOCK; e += 4) {
+		__m256d u_e = _mm256_loadu_pd(u + e);
+		__m256d v[order];
+		v[0] = _mm256_set1_pd(1.0);
+		for (int j = 1; j < order; j++) {
+			__m256d inv_j = _mm256_set1_pd(1.0 / double(j));
+			__m256d saved = _mm256_setzero_pd();
+			for (int r = 0; r < j; r++) {
+				__m256d temp = _mm256_mul_pd(v[r], inv_j);
+				v[r] = _mm256_add_pd(saved, _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(double(r + 1)), u_e), temp));
+				saved = _mm256_mul_pd(_mm256_add_pd(u_e, _mm256_set1_pd(double(j - r - 1))), temp);
+			}
+			v[j] = saved;
+		}
+		for (int m = 0; m < order; m++) _mm256_storeu_pd(&block_vals[m][e], v[m]);
+	}
+}
+#else
+template <int order> inline void calc_interior_bspline_block(const double* u, double block_vals[][BSPLINE_BATCH_BLOCK])
+{
+	double saved[BSPLINE_BATCH_BLOCK];
+	for (int e = 0; e < BSPLINE_BATCH_BLOCK; e++) block_vals[0][e] = 1.0;
+	for (int j = 1; j < order; j++) {
+		double inv_j = 1.0 / double(j);
+		for (int e = 0; e < BSPLINE_BATCH_BLOCK; e++) saved[e] = 0.0;
+		for (int r = 0; r < j; r++) {
+			for (int e = 0; e < BSPLINE_BATCH_BLOCK; e++) {
+				double temp = block_vals[r][e] * inv_j;
+				block_vals[r][e] = saved[e] + (double(r + 1) - u[e]) * temp;
+				saved[e] = (u[e] + double(j - r - 1)) * temp;
+			}
+		}
+		for (int e = 0; e < BSPLINE_BATCH_BLOCK; e++) block_vals[j][e] = saved[e];
+	}
+}
+#endif
+
+// Batched form of calc_uniform_bspline_vals for a fixed order. Blocks of
+// values run through the interior recurrence together (see
+// calc_interior_bspline_block); values within order - 2 intervals of an end
+// are then redone one at a time.
+template <int order> void calc_uniform_bspline_vals_batch(const UniformBSplineBasis &basis, const int n_vals, const double* x, int* first_nonzero_basis_indices, double* vals)
+{
+	double u[BSPLINE_BATCH_BLOCK];
+	double block_vals[order][BSPLINE_BATCH_BLOCK];
+	
+	for (int start = 0; start < n_vals; start += BSPLINE_BATCH_BLOCK) {
+		int n_block = (n_vals - start < BSPLINE_BATCH_BLOCK) ? n_vals - start : BSPLINE_BATCH_BLOCK;
+		int* first = first_nonzero_basis_indices + start;
+		for (int e = 0; e < n_block; e++) {
+			first[e] = basis.find_interval(x[start + e]);
+			u[e] = (x[start + e] - basis.lower) * basis.inv_spacing - first[e];
+		}
+		for (int e = n_block; e < BSPLINE_BATCH_BLOCK; e++) u[e] = 0.0;
+		calc_interior_bspline_block<order>(u, block_vals);
+		
+		for (int e = 0; e < n_block; e++) {
+			double* row = vals + (start + e) * order;
+			if (first[e] >= order - 2 && first[e] + order <= basis.n_breaks) {
+				for (int m = 0; m < order; m++) row[m] = block_vals[m][e];
+			} else {
+				calc_uniform_bspline_vals<order>(order, first[e], basis.n_breaks, u[e], basis.inv_spacing, row, NULL);
+			}
+		}
+	}
+}
+
+#if _bspline_gsl_reference
+// Compare the uniform B-spline evaluator with GSL on a grid of points
+// spanning every interval of this basis; build with
+// -D"_bspline_gsl_reference=1" to enable.
+void check_uniform_bspline_against_gsl(const UniformBSplineBasis &basis)
+{
+	const int samples_per_interval = 7;
+	gsl_bspline_workspace* workspace = gsl_bspline_alloc(basis.order, basis.n_breaks);
+	gsl_vector* gsl_vals = gsl_vector_alloc(basis.order);
+	gsl_matrix* gsl_derivs = gsl_matrix_alloc(basis.order, 2);
+	gsl_bspline_knots_uniform(basis.lower, basis.upper, workspace);
+	std::vector<double> vals(basis.order), derivs(basis.order);
+	double max_val_diff = 0.0, max_deriv_diff = 0.0;
+	
+	for (int i = 0; i <= samples_per_interval * (basis.n_breaks - 1); i++) {
+		double x = basis.lower + (basis.upper - basis.lower) * double(i) / double(samples_per_interval * (basis.n_breaks - 1));
+		int first_nonzero_basis_index;
+		size_t istart, iend;
+		basis.eval_with_deriv(x, first_nonzero_basis_index, &vals[0], &derivs[0]);
+		gsl_bspline_deriv_eval_nonzero(x, (size_t)(1), gsl_derivs, &istart, &iend, workspace);
+		gsl_bspline_eval_nonzero(x, gsl_vals, &istart, &iend, workspace);
+		// Both index choices are valid on a breakpoint, where the spline is continuous.
+		if (int(istart) != first_nonzero_basis_index) continue;
+		for (int m = 0; m < basis.order; m++) {
+			max_val_diff = fmax(max_val_diff, fabs(vals[m] - gsl_vector_get(gsl_vals, m)));
+			max_deriv_diff = fmax(max_deriv_diff, fabs(derivs[m] - gsl_matrix_get(gsl_derivs, m, 1)) * basis.spacing);
+		}
+	}
+	gsl_bspline_free(workspace);
+	gsl_vector_free(gsl_vals);
+	gsl_matrix_free(gsl_derivs);
+	
+	if (max_val_diff > 1.0e-10 || max_deriv_diff > 1.0e-10) {
+		fprintf(stderr, "Uniform B-spline of order %d disagrees with GSL: value difference %g, scaled derivative difference %g.\n", basis.order, max_val_diff, max_deriv_diff);
+		exit(EXIT_FAILURE);
+	}
+}
+#endif
@@ -9,12 +9,41 @@
 #define _splines_h
 
 #include <vector>
-#include "gsl/gsl_bspline.h"
 
 enum BasisType {kBSpline = 0, kLinearSpline = 1, kBSplineAndDeriv = 2, kNone = 3};
 
 struct InteractionClassSpec;
 
+// Clamped B-spline basis on uniformly spaced breakpoints; this is the knot
+// sequence gsl_bspline_knots_uniform builds, evaluated directly so that the
+// nonzero basis values land in the caller's buffer.
+struct UniformBSplineBasis {
+    int order;              // Spline order k (polynomial degree k - 1)
+    int n_breaks;           // Number of breakpoints, including both ends
+    double lower;           // First breakpoint
+    double upper;           // Last breakpoint
+    double spacing;         // Distance between breakpoints
+    double inv_spacing;
+
+    void init(const int spline_order, const int breakpoints, const double lower_break, const double upper_break);
+
+    // Index of the interval holding x, clamped to the breakpoint range; this
+    // is also the index of the first nonzero basis function.
+    inline int find_interval(const double x) const {
+        double scaled = (x - lower) * inv_spacing;
+        if (scaled <= 0.0) return 0;
+        if (scaled >= n_breaks - 1) return n_breaks - 2;
+        return (int)(scaled);
+    }
+
+    // Fill vals[0 .. order - 1] with the nonzero basis values at x and,
+    // for eval_with_deriv, derivs[0 .. order - 1] with their derivatives.
+    void eval(const double x, int &first_nonzero_basis_index, double* vals) const;
+    void eval_with_deriv(const double x, int &first_nonzero_basis_index, double* vals, double* derivs) const;
+    // Fill an n_vals x order block of basis values, one row per x value.
+    void eval_batch(const int n_vals, const double* x, int* first_nonzero_basis_indices, double* vals) const;
+};
+
 class SplineComputer {
 
 protected:
@@ -33,6 +62,9 @@ public:
     void get_bin(void);
     inline int get_n_coef(void) { return n_coef; };
     virtual void calculate_basis_fn_vals(const int index_among_defined, const double param_val, int &first_nonzero_basis_index, std::vector<double> &vals) = 0;
+    // Evaluate the basis for n_vals parameter values of one interaction at once;
+    // vals is filled as an n_vals x n_coef block, one row per parameter value.
+    virtual void calculate_basis_fn_vals_batch(const int index_among_defined, const int n_vals, const double* param_vals, int* first_nonzero_basis_indices, double* vals);
     virtual double evaluate_spline(const int index_among_defined, const int first_nonzero_basis_index, const std::vector<double> &spline_coeffs, const double axis) = 0;
 };
 
@@ -42,14 +74,16 @@ SplineComputer* set_up_table_spline_comp(InteractionClassSpec *ispec);
 class BSplineComputer : public SplineComputer {  
 
 protected:
-    gsl_bspline_workspace** bspline_workspaces;
-    gsl_vector* bspline_vectors;
+    std::vector<UniformBSplineBasis> bspline_bases;
+    std::vector<double> bspline_vals;
+    std::vector<double> batch_param_vals;
 
 public:
     BSplineComputer(InteractionClassSpec* ispec);
-    virtual ~BSplineComputer();
+    virtual ~BSplineComputer() {}
     
    virtual void calculate_basis_fn_vals(const int index_among_defined, const double param_val, int &first_nonzero_basis_index, std::vector<double> &vals);
+   virtual void calculate_basis_fn_vals_batch(const int index_among_defined, const int n_vals, const double* param_vals, int* first_nonzero_basis_indices, double* vals);
    virtual double evaluate_spline(const int index_among_defined, const int first_nonzero_basis_index, const std::vector<double> &spline_coeffs, const double axis);
 };
 
@@ -57,15 +91,17 @@ class BSplineAndDerivComputer : public SplineComputer {
 
 protected:
     int class_subtype;
-    gsl_bspline_workspace** bspline_workspaces;
-    gsl_vector* bspline_vectors;
-    gsl_matrix* bspline_matrices;
+    std::vector<UniformBSplineBasis> bspline_bases;
+    std::vector<double> bspline_vals;
+    std::vector<double> bspline_derivs;
+    std::vector<double> batch_param_vals;
 
 public:
     BSplineAndDerivComputer(InteractionClassSpec* ispec);
-    virtual ~BSplineAndDerivComputer();
+    virtual ~BSplineAndDerivComputer() {}
 
    virtual void calculate_basis_fn_vals(const int index_among_defined, const double param_val, int &first_nonzero_basis_index, std::vector<double> &vals);
+   virtual void calculate_basis_fn_vals_batch(const int index_among_defined, const int n_vals, const double* param_vals, int* first_nonzero_basis_indices, double* vals);
    void calculate_bspline_deriv_vals(const int index_among_defined, const double param_val, int &first_nonzero_basis_index, std::vector<double> &vals);
    virtual double evaluate_spline(const int index_among_defined, const int first_nonzero_basis_index, const std::vector<double> &spline_coeffs, const double axis);
    double evaluate_spline_deriv(const int index_among_defined, const int first_nonzero_basis_index, const std::vector<double> &spline_coeffs, const double axis); 
@@ -78,6 +114,7 @@ public:
     virtual ~LinearSplineComputer() {}
 
     virtual void calculate_basis_fn_vals(const int index_among_defined, const double param_val, int &first_nonzero_basis_index, std::vector<double> &vals);
+    virtual void calculate_basis_fn_vals_batch(const int index_among_defined, const int n_vals, const double* param_vals, int* first_nonzero_basis_indices, double* vals);
     virtual double evaluate_spline(const int index_among_defined, const int first_nonzero_basis_index, const std::vector<double> &spline_coeffs, const double axis);
 };
 
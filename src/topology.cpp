@@ -8,6 +8,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <cassert>
+#include <algorithm>
 #include <fstream>
 #include <vector>
 
@@ -33,6 +34,8 @@ bool new_excluded_partner(unsigned** const excluded_partners, const int location
 void report_topology_input_format_error(const int line, char *parameter_name);
 // Search function for molecular exclusion.
 void recursive_exclusion_search(TopologyData const* topo_data, TopoList* &exclusion_list, std::vector<int> &path_list);
+// Fill the exclusion partner lists based on bonded topology and excluded_style setting.
+void generate_excluded_partners(TopologyData const* topo_data, TopoList* &exclusion_list, const int excluded_style);
 
 //---------------------------------------------------------------
 // Functions for managing TopoList structs
@@ -46,6 +49,9 @@ TopoList::TopoList(unsigned n_sites, unsigned partners_per, unsigned max_partner
     for (unsigned i = 0; i < n_sites_; i++) {
         partners_[i] = new unsigned[partners_per_ * max_partners_]();
     }
+    // Start with an empty sorted table so that lookups are valid before it is built.
+    sorted_offsets_ = new unsigned[n_sites_ + 1]();
+    sorted_partners_ = NULL;
 }
 
 TopoList::~TopoList() {
@@ -56,6 +62,22 @@ TopoList::~TopoList() {
     	delete [] partners_;
     	delete [] partner_numbers_;
 	}
+	delete [] sorted_offsets_;
+	if (sorted_partners_ != NULL) delete [] sorted_partners_;
+}
+
+void TopoList::build_sorted_partners(void) {
+	assert(partners_per_ == 1);
+	sorted_offsets_[0] = 0;
+	for (unsigned i = 0; i < n_sites_; i++) {
+		sorted_offsets_[i + 1] = sorted_offsets_[i] + partner_numbers_[i];
+	}
+	if (sorted_partners_ != NULL) delete [] sorted_partners_;
+	sorted_partners_ = new unsigned[sorted_offsets_[n_sites_] + 1]();
+	for (unsigned i = 0; i < n_sites_; i++) {
+		std::copy(partners_[i], partners_[i] + partner_numbers_[i], sorted_partners_ + sorted_offsets_[i]);
+		std::sort(sorted_partners_ + sorted_offsets_[i], sorted_partners_ + sorted_offsets_[i + 1]);
+	}
 }
 
 //---------------------------------------------------------------
@@ -796,6 +818,13 @@ void recursive_exclusion_search(TopologyData const* topo_data, TopoList* &exclus
 }
 
 void setup_excluded_list( TopologyData const* topo_data, TopoList* &exclusion_list, const int excluded_style) 
+{
+	generate_excluded_partners(topo_data, exclusion_list, excluded_style);
+	// Index the exclusions for fast lookup during neighbor processing.
+	exclusion_list->build_sorted_partners();
+}
+
+void generate_excluded_partners(TopologyData const* topo_data, TopoList* &exclusion_list, const int excluded_style)
 {
 	// Automatically determine topology to set appropriate
     // bond, angle, and/or dihedral exclusion as appropriate.
@@ -21,10 +21,31 @@ struct TopoList {
 
 	int modified;					// A flag indicating if the pointers for partners_ and partner_numbers_ arrays are shared (1 for yes, 0 for no).
 									// This is primarily useful in the LAMMPS fix when these arrays are allocated, freed, and owned by LAMMPS.
+	
+	unsigned* sorted_offsets_;		// Start of each site's partners in sorted_partners_ (n_sites_ + 1 entries); always owned by this list.
+	unsigned* sorted_partners_;		// Each site's partners in ascending order, packed back to back (only used for one-partner lists such as exclusions).
 									
     inline TopoList() : TopoList(0, 0, 0) {}
     TopoList(unsigned n_sites, unsigned partners_per, unsigned max_partners);
     ~TopoList();
+    
+    // Rebuild sorted_offsets_ and sorted_partners_ from partners_ and partner_numbers_.
+    // This must be called whenever the partner arrays change.
+    void build_sorted_partners(void);
+    
+    // Check whether j is listed as a partner of site i using the sorted partner table.
+    inline bool is_sorted_partner(const unsigned i, const unsigned j) const {
+    	const unsigned* base = sorted_partners_ + sorted_offsets_[i];
+    	unsigned n = sorted_offsets_[i + 1] - sorted_offsets_[i];
+    	if (n == 0) return false;
+    	// Branch-free lower bound search; the lists are short enough that this beats early exits.
+    	while (n > 1) {
+    		unsigned half = n / 2;
+    		base = (base[half] <= j) ? base + half : base;
+    		n -= half;
+    	}
+    	return (*base == j);
+    }
 };
 
 // Struct responsible for keeping track of all cg site numbers, types, bonds,
@@ -5,13 +5,22 @@
 //  Copyright (c) 2016 The Voth Group at The University of Chicago. All rights reserved.
 //
 
+#include <algorithm>
 #include <cassert>
+#include <cstddef>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <vector>
 #include <random>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "control_input.h"
 #include "misc.h"
@@ -32,16 +41,40 @@ extern "C" {
 // struct for keeping track of LAMMPS frame data
 //-------------------------------------------------------------
 
+// Size of the chunks in which LAMMPS trajectories are read.
+#define LAMMPS_READ_CHUNK_SIZE (1 << 22)
+
+// Number of bytes at the start of a LAMMPS trajectory hashed to check that a frame index belongs to it.
+#define LAMMPS_FRAME_INDEX_CHECK_SIZE 4096
+
+// What a column of a LAMMPS frame body holds, as far as frames are read.
+enum LammpsColumnRole {kLammpsIgnored = 0, kLammpsPosition = 1, kLammpsForce = 2, kLammpsType = 3, kLammpsState = 4};
+
 struct LammpsData {
-	std::ifstream trajectory_stream;
+	FILE* trajectory_file;		// The trajectory itself, or the output of the program decompressing it
+	int compressed;				// 1 if trajectory_file is read from a decompressing program
+	std::vector<char> buffer;	// Chunk of the trajectory being parsed, always followed by a '\0'
+	size_t buffer_start;		// First character in buffer not yet parsed
+	size_t buffer_end;			// End of the characters read into buffer
+	long long buffer_file_offset;	// Position in the file of the start of buffer
+	int end_of_file;			// 1 once the whole file has been read into buffer
 	int type_pos;			// Index for type element in frame body
 	int x_pos;				// Starting index for position elements in frame body
 	int f_pos;				// Starting index for force elements in frame body
 	int state_pos;			// Starting index for state probabilities in frame_body
 	int header_size;		// Number of columns for header/body of frame
-	std::string* elements; 	// Array to store tokenized header elements 
+	std::vector<int> column_roles;		// LammpsColumnRole of each column of the frame body
+	std::vector<int> column_components;	// Dimension of each position or force column
 	double* cg_site_state_probabilities;   // A list of the probabilities for all states of all CG particles (used if dynamic_state_sampling = 1) (currently only for 2 states)
-	int (*read_lammps_body)(LammpsData *const lammps_data, FrameConfig *const frame_config, const int dynamic_types, const int dynamic_state_sampling, const int no_forces);
+	int (*read_lammps_body)(LammpsData *const lammps_data, FrameConfig *const frame_config);
+};
+
+// Where a frame of a LAMMPS trajectory starts, with its timestep and box, as listed in a frame index.
+
+struct LammpsFrameIndexEntry {
+	long long offset;
+	long long timestep;
+	double box_lengths[DIMENSION];
 };
 
 //-------------------------------------------------------------
@@ -80,11 +113,100 @@ struct XRDData {
 #endif
 };
 
+//-------------------------------------------------------------
+// structs for keeping track of binary trajectory data
+//-------------------------------------------------------------
+
+// A binary trajectory (.cgb) is a header padded to BINARY_TRAJECTORY_DATA_OFFSET bytes followed by
+// n_frames frame records of frame_size bytes each, in native byte order. Each record holds the timestep,
+// time and box lengths of the frame, the positions and forces of all sites (as floats or doubles),
+// their types and state probabilities if the trajectory has them, and a checksum of all of these.
+// Records are padded to a multiple of BINARY_TRAJECTORY_ALIGNMENT bytes.
+
+#define BINARY_TRAJECTORY_VERSION 1
+#define BINARY_TRAJECTORY_DATA_OFFSET 4096
+#define BINARY_TRAJECTORY_ALIGNMENT 64
+
+// What a binary trajectory holds in addition to positions and forces.
+enum BinaryTrajectoryContents {kBinaryTypes = 1, kBinaryStateProbabilities = 2};
+
+struct BinaryTrajectoryHeader {
+	char magic[8];				// "MSCGBTRJ"
+	int32_t version;
+	int32_t dimension;
+	int32_t n_sites;
+	int32_t n_frames;
+	int32_t first_frame;		// Frame number in the original trajectory of the first frame
+	int32_t precision;			// Bytes per position or force component (4 or 8)
+	int32_t contents;			// Sum of the BinaryTrajectoryContents flags
+	int32_t reserved;
+	int64_t frame_size;			// Bytes per frame record
+	int64_t data_offset;		// Position of the first frame record
+	uint64_t checksum;			// Checksum of the header fields above
+};
+
+// Position of each part of a frame record, as set by the header.
+struct BinaryFrameLayout {
+	size_t x_offset;
+	size_t f_offset;
+	size_t types_offset;
+	size_t state_probabilities_offset;
+	size_t checksum_offset;
+	size_t frame_size;
+};
+
+struct BinaryTrajectoryData {
+	int file_descriptor;
+	const char* mapping;		// The whole trajectory, mapped read-only
+	size_t mapping_size;
+	BinaryTrajectoryHeader header;
+	BinaryFrameLayout layout;
+	int next_frame;				// Index of the next frame record to read
+	double* cg_site_state_probabilities;   // A list of the probabilities for all states of all CG particles (used if dynamic_state_sampling = 1)
+};
+
+//-------------------------------------------------------------
+// struct for reading frames ahead of their use in a background thread
+//-------------------------------------------------------------
+
+// One frame read ahead, with the frame-level data its reader set.
+
+struct PrefetchedFrame {
+	FrameConfig* frame_config;
+	int read_stat;
+	int timestep;
+	real time;
+	matrix simulation_box_limits;
+};
+
+// The reading thread works on its own copy of the frame source, filling a ring of frames
+// that the frame source's get_next_frame takes from in order.
+
+struct FramePrefetcher {
+	FrameSource reader_source;				// Frame source used by the reading thread only
+	std::vector<PrefetchedFrame> ring;
+	int started;							// 1 once the reading thread has been started
+	int n_frames_to_read;					// Number of frames the reading thread reads before it finishes
+	int n_read;								// Number of frames put into the ring so far
+	int n_taken;							// Number of frames taken from the ring so far
+	int stop;								// 1 to make the reading thread finish early
+	std::thread reading_thread;
+	std::mutex ring_lock;
+	std::condition_variable frame_read;
+	std::condition_variable frame_taken;
+	
+	// The frame source's own reading functions.
+	int (*get_next_frame)(FrameSource* const frame_source);
+	int (*get_junk_frame)(FrameSource* const frame_source);
+	void (*cleanup)(FrameSource* const frame_source);
+};
+
 // Prototypes for exclusively internal functions.
 
 // Helper for command line to file type setup
 void trr_setup(FrameSource* const frame_source, const char* filename);
 void lammps_setup(FrameSource* const frame_source, const char* filename);
+void binary_setup(FrameSource* const frame_source, const char* filename);
 void xtc_setup(FrameSource* const frame_source, const char* filename1, const char* filename2);
 
 // Misc. small helpers.
@@ -98,6 +220,7 @@ inline void check_file_extension(const char* name, const char* suffix);
 void read_initial_trr_frame(FrameSource* const frame_source, const int n_cg_sites, int* cg_site_types);
 void read_initial_xtc_frame(FrameSource* const frame_source, const int n_cg_sites,  int* cg_site_types);
 void read_initial_lammps_frame(FrameSource* const frame_source, const int n_cg_sites, int* cg_site_types);
+void read_initial_binary_frame(FrameSource* const frame_source, const int n_cg_sites, int* cg_site_types);
 void initial_nothing(FrameSource* const frame_source, const int n_cg_sites, int* cg_site_types);
 
 // Read a frame of a trajectory after the first has been read.
@@ -105,25 +228,58 @@ int read_next_trr_frame(FrameSource* const frame_source);
 int read_next_xtc_frame(FrameSource* const frame_source);
 int read_next_lammps_frame(FrameSource* const frame_source);
 int read_junk_lammps_frame(FrameSource* const frame_source);
+int read_next_binary_frame(FrameSource* const frame_source);
+int read_junk_binary_frame(FrameSource* const frame_source);
 int next_nothing(FrameSource* const frame_source);
 
 // Read all frames up until a starting frame.
 void default_move_to_starting_frame(FrameSource* const frame_source);
+void move_to_lammps_starting_frame(FrameSource* const frame_source);
+void move_to_binary_starting_frame(FrameSource* const frame_source);
 
 // Read frame-wise entries into an array.
 inline void read_stream_into_array(std::ifstream &in_file, const int start_frame, const int n_frames, double* &values);
 
+// Read frames ahead in a background thread and hand them out in order.
+void start_frame_prefetching(FrameSource* const frame_source);
+void read_frames_ahead(FramePrefetcher* const prefetcher);
+int take_prefetched_frame(FrameSource* const frame_source);
+int skip_prefetched_frame(FrameSource* const frame_source);
+void finish_prefetched_reading(FrameSource* const frame_source);
+
 // Finish reading a trajectory by closing relevant files and cleaning up temps.
 inline void finish_general_reading(FrameSource *const frame_source);
 void finish_trr_reading(FrameSource* const frame_source);
 void finish_xtc_reading(FrameSource* const frame_source);
 void finish_lammps_reading(FrameSource* const frame_source);
+void finish_binary_reading(FrameSource* const frame_source);
 
 // Additional helper functions.
+void open_lammps_trajectory(LammpsData* const lammps_data, const char* filename);
+void close_lammps_trajectory(LammpsData* const lammps_data);
+void refill_lammps_buffer(LammpsData* const lammps_data);
+void reset_lammps_buffer(LammpsData* const lammps_data, const long long file_offset);
+inline int lammps_label_matches(const char* line, const size_t length, const size_t pos, const char* label);
+int read_next_lammps_line(LammpsData* const lammps_data, char* &line, size_t &length);
+void check_and_read_next_lammps_line(LammpsData* const lammps_data, char* &line, size_t &length);
 void read_lammps_header(LammpsData* const lammps_data, int* const current_n_sites, int* const timestep, real* const time, matrix box, const int dynamic_types, const int dynamic_state_sampling, const int no_forces);
-int read_dimension_lammps_body(LammpsData* const lammps_data, FrameConfig* const frame_config, const int dynamic_types, const int dynamic_state_sampling, const int no_forces);
+int read_dimension_lammps_body(LammpsData* const lammps_data, FrameConfig* const frame_config);
 inline void set_random_number_seed(const uint_fast32_t random_num_seed);
 
+// Frame index of a LAMMPS trajectory, kept in a sidecar file next to it.
+void load_lammps_frame_index(const char* trajectory_filename, const int first_timestep, std::vector<LammpsFrameIndexEntry> &frame_index);
+void build_lammps_frame_index(const char* trajectory_filename, std::vector<LammpsFrameIndexEntry> &frame_index);
+uint64_t hash_lammps_trajectory_start(const char* trajectory_filename);
+int read_lammps_frame_index(const char* index_filename, const struct stat &trajectory_stat, const uint64_t start_hash, const int first_timestep, std::vector<LammpsFrameIndexEntry> &frame_index);
+void write_lammps_frame_index(const char* index_filename, const struct stat &trajectory_stat, const uint64_t start_hash, const std::vector<LammpsFrameIndexEntry> &frame_index);
+void check_lammps_frame_index_entry(LammpsData* const lammps_data, const LammpsFrameIndexEntry &entry, const int frame_n);
+
+// Helper functions for binary trajectories.
+void set_binary_frame_layout(const BinaryTrajectoryHeader &header, BinaryFrameLayout &layout);
+inline uint64_t binary_trajectory_checksum(const char* data, const size_t n_bytes);
+void load_binary_frame(FrameSource* const frame_source, const int frame_index);
+inline const double* current_state_probabilities(const FrameSource* const frame_source);
+
 //-------------------------------------------------------------
 // Misc. small file-reading helper functions.
 //-------------------------------------------------------------
@@ -132,7 +288,7 @@ inline void set_random_number_seed(const uint_fast32_t random_num_seed);
 
 inline void report_usage_error(const char *exe_name)
 {
-    printf("Usage: %s -f file.trr OR %s -f file.xtc -f1 file1.xtc OR %s -l file.lammpstrj\n", exe_name, exe_name, exe_name);
+    printf("Usage: %s -f file.trr OR %s -f file.xtc -f1 file1.xtc OR %s -l file.lammpstrj OR %s -b file.cgb\n", exe_name, exe_name, exe_name, exe_name);
     exit(EXIT_SUCCESS);
 }
 
@@ -203,6 +359,8 @@ void parse_command_line_arguments(const int num_arg, char** arg, FrameSource* co
         	trr_setup(frame_source, arg[2]); 
         } else if (strcmp(arg[1], "-l") == 0) {
             lammps_setup(frame_source, arg[2]);
+        } else if (strcmp(arg[1], "-b") == 0) {
+            binary_setup(frame_source, arg[2]);
         } else {
             report_usage_error(arg[0]);
         }
@@ -211,6 +369,8 @@ void parse_command_line_arguments(const int num_arg, char** arg, FrameSource* co
         xtc_setup(frame_source, arg[2], arg[4]);
     }
     frame_source->move_to_start_frame = default_move_to_starting_frame;
+    if (frame_source->trajectory_type == kLAMMPSDump) frame_source->move_to_start_frame = move_to_lammps_starting_frame;
+    if (frame_source->trajectory_type == kBinaryTrajectory) frame_source->move_to_start_frame = move_to_binary_starting_frame;
 }
 
 void trr_setup(FrameSource* const frame_source, const char* filename)
@@ -239,6 +399,17 @@ void lammps_setup(FrameSource* const frame_source, const char* filename)
 	frame_source->cleanup = finish_lammps_reading;
 }
 
+void binary_setup(FrameSource* const frame_source, const char* filename)
+{
+	sscanf(filename, "%s", frame_source->trajectory_filename);
+	check_file_extension(filename, "cgb");
+	frame_source->trajectory_type = kBinaryTrajectory;
+	frame_source->get_first_frame = read_initial_binary_frame;
+	frame_source->get_next_frame = read_next_binary_frame;
+	frame_source->get_junk_frame = read_junk_binary_frame;
+	frame_source->cleanup = finish_binary_reading;
+}
+
 void xtc_setup(FrameSource* const frame_source, const char* filename1, const char* filename2)
 {
 	sscanf(filename1, "%s", frame_source->trajectory_filename);
@@ -273,6 +444,9 @@ void copy_control_inputs_to_frd(ControlInputs* const control_input, FrameSource*
     frame_source->position_dimension = control_input->position_dimension;
     frame_source->starting_frame = control_input->starting_frame;
     frame_source->n_frames = control_input->n_frames;
+    frame_source->prefetch_frames = control_input->prefetch_frames;
+    frame_source->prefetcher = NULL;
+    frame_source->frame_index_flag = control_input->frame_index_flag;
     frame_source->no_forces = 0;
     
     if(frame_source->position_dimension != DIMENSION) {
@@ -312,17 +486,29 @@ void finish_xtc_reading(FrameSource *const frame_source)
 void finish_lammps_reading(FrameSource *const frame_source)
 {
     //close trajectory file
-    frame_source->lammps_data->trajectory_stream.close();
+    close_lammps_trajectory(frame_source->lammps_data);
     
     //cleanup allocated memory
     if ( (frame_source->dynamic_types == 1) || (frame_source->dynamic_state_sampling == 1) ) frame_source->frame_config->cg_site_types = NULL; //undo alias of cg.topo_data.cg_site_types
     if (frame_source->dynamic_state_sampling == 1) delete [] frame_source->lammps_data->cg_site_state_probabilities;
-    delete [] frame_source->lammps_data->elements;
 	delete frame_source->lammps_data;
 	
 	finish_general_reading(frame_source);
 }
 
+void finish_binary_reading(FrameSource *const frame_source)
+{
+	BinaryTrajectoryData* binary_data = frame_source->binary_data;
+	munmap((void*)(binary_data->mapping), binary_data->mapping_size);
+	close(binary_data->file_descriptor);
+	
+	if ( (frame_source->dynamic_types == 1) || (frame_source->dynamic_state_sampling == 1) ) frame_source->frame_config->cg_site_types = NULL; //undo alias of cg.topo_data.cg_site_types
+	if (frame_source->dynamic_state_sampling == 1) delete [] binary_data->cg_site_state_probabilities;
+	delete binary_data;
+	
+	finish_general_reading(frame_source);
+}
+
 //-------------------------------------------------------------
 // Frame-by-frame trajectory reading functions
 //-------------------------------------------------------------
@@ -438,11 +624,8 @@ void read_initial_lammps_frame(FrameSource* const frame_source, const int n_cg_s
 	frame_source->lammps_data->read_lammps_body = read_dimension_lammps_body;
 	
     // Get the number of sites in this initial frame and allocate memory to store their forces and positions.
-	frame_source->lammps_data->trajectory_stream.open(frame_source->trajectory_filename, std::ifstream::in);
-	if (frame_source->lammps_data->trajectory_stream.fail()) {
-		printf("Problem opening lammps trajcetory %s\n", frame_source->trajectory_filename);
-		exit(EXIT_FAILURE);
-	}
+	frame_source->lammps_data->buffer.resize(LAMMPS_READ_CHUNK_SIZE + 1);
+	open_lammps_trajectory(frame_source->lammps_data, frame_source->trajectory_filename);
 	
 	//read header for first frame 
 	read_lammps_header(frame_source->lammps_data, &n_sites, &frame_source->current_timestep, &frame_source->time, frame_source->simulation_box_limits, frame_source->dynamic_types, frame_source->dynamic_state_sampling, frame_source->no_forces);
@@ -452,7 +635,6 @@ void read_initial_lammps_frame(FrameSource* const frame_source, const int n_cg_s
     
     //allocate position and force vectors
     frame_source->frame_config = new FrameConfig(n_sites);
-    frame_source->lammps_data->elements = new std::string[frame_source->lammps_data->header_size];
     if (frame_source->dynamic_state_sampling == 1) frame_source->lammps_data->cg_site_state_probabilities = new double[n_sites];
 	else frame_source->lammps_data->state_pos = -1;
     if ( (frame_source->dynamic_types == 1) || (frame_source->dynamic_state_sampling == 1) ) {
@@ -469,11 +651,10 @@ void read_initial_lammps_frame(FrameSource* const frame_source, const int n_cg_s
 	}
     
     //read the body of the frame into memory
-    if ( frame_source->lammps_data->read_lammps_body(frame_source->lammps_data, frame_source->frame_config, frame_source->dynamic_types, frame_source->dynamic_state_sampling, frame_source->no_forces) != 1 ) {
+    if ( frame_source->lammps_data->read_lammps_body(frame_source->lammps_data, frame_source->frame_config) != 1 ) {
     	printf("Cannot read the first frame!\n");			
     	if ( (frame_source->dynamic_types == 1) || (frame_source->dynamic_state_sampling == 1) ) frame_source->frame_config->cg_site_types = NULL; //undo aliasing to cg.topo_data.cg_site_types
 		if (frame_source->dynamic_state_sampling == 1) delete [] frame_source->lammps_data->cg_site_state_probabilities;			
-		delete [] frame_source->lammps_data->elements;			
 		delete frame_source->frame_config;
     	exit(EXIT_FAILURE);
     }
@@ -489,6 +670,89 @@ void read_initial_lammps_frame(FrameSource* const frame_source, const int n_cg_s
     return;
 }
 
+// Map a binary trajectory into memory, check its header against the run, and load its first frame.
+
+void read_initial_binary_frame(FrameSource* const frame_source, const int n_cg_sites, int* cg_site_types)
+{
+	BinaryTrajectoryData* binary_data = new BinaryTrajectoryData;
+	frame_source->binary_data = binary_data;
+	BinaryTrajectoryHeader* header = &binary_data->header;
+	
+	binary_data->file_descriptor = open(frame_source->trajectory_filename, O_RDONLY);
+	struct stat trajectory_stat;
+	if (binary_data->file_descriptor < 0 || fstat(binary_data->file_descriptor, &trajectory_stat) != 0) {
+		printf("Problem opening binary trajectory %s\n", frame_source->trajectory_filename);
+		exit(EXIT_FAILURE);
+	}
+	binary_data->mapping_size = (size_t)(trajectory_stat.st_size);
+	if (binary_data->mapping_size < sizeof(BinaryTrajectoryHeader)) {
+		printf("Binary trajectory %s is too short to hold a header.\n", frame_source->trajectory_filename);
+		exit(EXIT_FAILURE);
+	}
+	void* mapping = mmap(NULL, binary_data->mapping_size, PROT_READ, MAP_SHARED, binary_data->file_descriptor, 0);
+	if (mapping == MAP_FAILED) {
+		printf("Problem mapping binary trajectory %s into memory\n", frame_source->trajectory_filename);
+		exit(EXIT_FAILURE);
+	}
+	binary_data->mapping = (const char*)(mapping);
+	madvise(mapping, binary_data->mapping_size, MADV_SEQUENTIAL);
+	
+	// Check that the header is intact and fits both the file and this run.
+	memcpy(header, binary_data->mapping, sizeof(BinaryTrajectoryHeader));
+	if (memcmp(header->magic, "MSCGBTRJ", 8) != 0 || header->version != BINARY_TRAJECTORY_VERSION) {
+		printf("%s is not a binary trajectory of this version.\n", frame_source->trajectory_filename);
+		exit(EXIT_FAILURE);
+	}
+	if (binary_trajectory_checksum((const char*)(header), offsetof(BinaryTrajectoryHeader, checksum)) != header->checksum) {
+		printf("The header of binary trajectory %s is corrupted.\n", frame_source->trajectory_filename);
+		exit(EXIT_FAILURE);
+	}
+	if (header->dimension != DIMENSION || header->dimension != frame_source->position_dimension) {
+		printf("Binary trajectory %s holds %d dimensional positions, but %d dimensional positions are used!\n", frame_source->trajectory_filename, header->dimension, frame_source->position_dimension);
+		exit(EXIT_FAILURE);
+	}
+	set_binary_frame_layout(*header, binary_data->layout);
+	if (header->n_sites <= 0 || header->n_frames <= 0 || header->frame_size != (int64_t)(binary_data->layout.frame_size) ||
+		header->data_offset + header->n_frames * header->frame_size > (int64_t)(binary_data->mapping_size)) {
+		printf("Binary trajectory %s is truncated or its header is inconsistent.\n", frame_source->trajectory_filename);
+		exit(EXIT_FAILURE);
+	}
+	if (frame_source->dynamic_state_sampling == 1 && (header->contents & kBinaryStateProbabilities) == 0) {
+		printf("Binary trajectory %s has no state probabilities for dynamic_state_sampling!\n", frame_source->trajectory_filename);
+		exit(EXIT_FAILURE);
+	}
+	if (frame_source->dynamic_types == 1 && frame_source->dynamic_state_sampling == 0 && (header->contents & kBinaryTypes) == 0) {
+		printf("Binary trajectory %s has no site types for dynamic_types!\n", frame_source->trajectory_filename);
+		exit(EXIT_FAILURE);
+	}
+	
+	// Allocate position and force vectors.
+	frame_source->frame_config = new FrameConfig(header->n_sites);
+	if (frame_source->dynamic_state_sampling == 1) binary_data->cg_site_state_probabilities = new double[header->n_sites];
+	if ( (frame_source->dynamic_types == 1) || (frame_source->dynamic_state_sampling == 1) ) {
+		frame_source->frame_config->cg_site_types = cg_site_types;
+	}
+	
+	// Check that the trajectory is consistent with the desired CG model.
+	check_molecule_sites(n_cg_sites, frame_source->frame_config->current_n_sites);
+	
+	if ( (frame_source->dynamic_types == 1) && (frame_source->dynamic_state_sampling == 1) ) {
+		printf("Warning: Dynamic_state_sampling will override dynamic_types!\n");
+	}
+	
+	for (int i = 0; i < DIMENSION; i++) {
+		for (int j = 0; j < DIMENSION; j++) frame_source->simulation_box_limits[i][j] = 0.0;
+	}
+	load_binary_frame(frame_source, 0);
+	binary_data->next_frame = 1;
+	frame_source->current_frame_n = 1;
+	
+	// Setup random number generator, if appropriate.
+	if ( (frame_source->dynamic_state_sampling == 1) || (frame_source->bootstrapping_flag == 1) ) {
+		frame_source->mt_rand_gen = std::mt19937(frame_source->random_num_seed);
+	}
+}
+
 void initial_nothing(FrameSource* const frame_source, const int n_cg_sites, int* cg_site_types)
 {
 }
@@ -555,7 +819,7 @@ int read_next_lammps_frame(FrameSource* const frame_source)
  	if (reference_atoms != frame_source->frame_config->current_n_sites) {
  		printf("Warning: Number of CG sites defined in top.in is not consistent with trajectory!\n");
  		return_value = 0;
- 	} else if ( frame_source->lammps_data->read_lammps_body(frame_source->lammps_data, frame_source->frame_config, frame_source->dynamic_types, frame_source->dynamic_state_sampling, frame_source->no_forces) != 1) {
+ 	} else if ( frame_source->lammps_data->read_lammps_body(frame_source->lammps_data, frame_source->frame_config) != 1) {
     	printf("Cannot read the frame at time %lf!\n", frame_source->time);
     	return_value = 0;
     }
@@ -572,7 +836,8 @@ int read_junk_lammps_frame(FrameSource* const frame_source)
 {
 	int return_value = 1;  
 	int reference_atoms  = frame_source->frame_config->current_n_sites;
-	std::string line;
+	char* line;
+	size_t length;
 
 	read_lammps_header(frame_source->lammps_data, &frame_source->frame_config->current_n_sites, &frame_source->current_timestep, &frame_source->time, frame_source->simulation_box_limits, frame_source->dynamic_types, frame_source->dynamic_state_sampling, frame_source->no_forces);    
 
@@ -582,7 +847,7 @@ int read_junk_lammps_frame(FrameSource* const frame_source)
  	} else {
  		// Skip through expected number of lines in frame body without parsing.
 		for(int i=0; i < frame_source->frame_config->current_n_sites; i++) {
-			check_and_read_next_line(frame_source->lammps_data->trajectory_stream, line);
+			check_and_read_next_lammps_line(frame_source->lammps_data, line, length);
     	}
 	}
 	 
@@ -594,6 +859,32 @@ int read_junk_lammps_frame(FrameSource* const frame_source)
  	return return_value;
 }
 
+// Read the next frame record of a binary trajectory.
+
+int read_next_binary_frame(FrameSource* const frame_source)
+{
+	BinaryTrajectoryData* binary_data = frame_source->binary_data;
+	if (binary_data->next_frame >= binary_data->header.n_frames) {
+		printf("Binary trajectory %s has no frames after its last (%d)!\n", frame_source->trajectory_filename, binary_data->header.n_frames);
+		return 0;
+	}
+	load_binary_frame(frame_source, binary_data->next_frame);
+	binary_data->next_frame++;
+	frame_source->current_frame_n += 1;
+	return 1;
+}
+
+// Frame records have a fixed size, so skipping one does not touch it.
+
+int read_junk_binary_frame(FrameSource* const frame_source)
+{
+	BinaryTrajectoryData* binary_data = frame_source->binary_data;
+	if (binary_data->next_frame >= binary_data->header.n_frames) return 0;
+	binary_data->next_frame++;
+	frame_source->current_frame_n += 1;
+	return 1;
+}
+
 int next_nothing(FrameSource* const frame_source)
 {
 	return 1;
@@ -608,95 +899,634 @@ void default_move_to_starting_frame(FrameSource* const frame_source) {
     }
 }
 
+// Make frame starting_frame of a LAMMPS trajectory the current frame. The frames before it are skipped
+// by reading only their headers or, if frame_index_flag is set, by seeking straight to it using
+// the trajectory's frame index after checking that the index entry matches the frame header there.
+// Either way, the starting frame itself is read in full and its timestep comes from its header.
+
+void move_to_lammps_starting_frame(FrameSource* const frame_source)
+{
+	std::vector<LammpsFrameIndexEntry> frame_index;
+	int use_frame_index = frame_source->frame_index_flag;
+	if (use_frame_index == 1 && frame_source->lammps_data->compressed == 1) {
+		printf("Compressed trajectories cannot be indexed; skipping frames in turn.\n");
+		use_frame_index = 0;
+	}
+	if (use_frame_index == 1) load_lammps_frame_index(frame_source->trajectory_filename, frame_source->current_timestep, frame_index);
+	if (frame_source->starting_frame <= 1) return;
+	
+	if (use_frame_index == 1) {
+		if (frame_source->starting_frame > (int)(frame_index.size())) {
+			printf("Cannot start from frame %d of a trajectory with %d frames.\n", frame_source->starting_frame, (int)(frame_index.size()));
+			exit(EXIT_FAILURE);
+		}
+		LammpsData* lammps_data = frame_source->lammps_data;
+		const LammpsFrameIndexEntry &entry = frame_index[frame_source->starting_frame - 1];
+		check_lammps_frame_index_entry(lammps_data, entry, frame_source->starting_frame);
+		if (fseeko(lammps_data->trajectory_file, (off_t)(entry.offset), SEEK_SET) != 0) {
+			printf("Failure seeking to frame %d. Check the trajectory file for errors.\n", frame_source->starting_frame);
+			exit(EXIT_FAILURE);
+		}
+		reset_lammps_buffer(lammps_data, entry.offset);
+		frame_source->current_frame_n += frame_source->starting_frame - 2;
+	} else {
+		for (int i = 0; i < frame_source->starting_frame - 2; i++) {
+			if (read_junk_lammps_frame(frame_source) == 0) {
+				printf("Failure attempting to skip frame %d. Check the trajectory file for errors.\n", i);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	if (read_next_lammps_frame(frame_source) == 0) {
+		printf("Failure reading starting frame %d. Check the trajectory file for errors.\n", frame_source->starting_frame);
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Frame starting_frame of the original trajectory is loaded straight from its record in a binary trajectory.
+
+void move_to_binary_starting_frame(FrameSource* const frame_source)
+{
+	BinaryTrajectoryData* binary_data = frame_source->binary_data;
+	int frame_index = frame_source->starting_frame - binary_data->header.first_frame;
+	if (frame_index < 0 || frame_index >= binary_data->header.n_frames) {
+		printf("Binary trajectory %s holds frames %d to %d, not starting frame %d.\n", frame_source->trajectory_filename, binary_data->header.first_frame, binary_data->header.first_frame + binary_data->header.n_frames - 1, frame_source->starting_frame);
+		exit(EXIT_FAILURE);
+	}
+	if (frame_index > 0) load_binary_frame(frame_source, frame_index);
+	binary_data->next_frame = frame_index + 1;
+	frame_source->current_frame_n += frame_source->starting_frame - 1;
+}
+
+//-------------------------------------------------------------
+// Frame index of a LAMMPS trajectory
+//-------------------------------------------------------------
+
+// The index of trajectory.lammpstrj is kept in trajectory.lammpstrj.idx. It starts with a comment line and
+// a line with the size and modification time of the trajectory it was built from, a hash of the start of
+// the trajectory and its number of frames, followed by a line per frame with the position in the file of
+// its first header line, its timestep and its box lengths. It is rebuilt whenever it does not match the
+// trajectory, including when its first timestep is not that of the trajectory's first frame.
+
+void load_lammps_frame_index(const char* trajectory_filename, const int first_timestep, std::vector<LammpsFrameIndexEntry> &frame_index)
+{
+	struct stat trajectory_stat;
+	if (stat(trajectory_filename, &trajectory_stat) != 0) {
+		printf("Problem finding the size of trajectory %s\n", trajectory_filename);
+		exit(EXIT_FAILURE);
+	}
+	std::string index_filename = std::string(trajectory_filename) + ".idx";
+	uint64_t start_hash = hash_lammps_trajectory_start(trajectory_filename);
+	if (read_lammps_frame_index(index_filename.c_str(), trajectory_stat, start_hash, first_timestep, frame_index) == 1) {
+		printf("Read the frame index %s (%d frames).\n", index_filename.c_str(), (int)(frame_index.size()));
+		return;
+	}
+	
+	printf("Building the frame index %s.\n", index_filename.c_str());
+	build_lammps_frame_index(trajectory_filename, frame_index);
+	write_lammps_frame_index(index_filename.c_str(), trajectory_stat, start_hash, frame_index);
+	printf("Indexed %d frames.\n", (int)(frame_index.size()));
+}
+
+// Scan a whole trajectory for the frame headers, parsing only the timestep and box of each frame.
+
+void build_lammps_frame_index(const char* trajectory_filename, std::vector<LammpsFrameIndexEntry> &frame_index)
+{
+	LammpsData scan_data;
+	scan_data.trajectory_file = fopen(trajectory_filename, "r");
+	if (scan_data.trajectory_file == NULL) {
+		printf("Problem opening lammps trajcetory %s\n", trajectory_filename);
+		exit(EXIT_FAILURE);
+	}
+	scan_data.buffer.resize(LAMMPS_READ_CHUNK_SIZE + 1);
+	reset_lammps_buffer(&scan_data, 0);
+	
+	char* line;
+	size_t length;
+	frame_index.clear();
+	while (true) {
+		long long line_offset = scan_data.buffer_file_offset + (long long)(scan_data.buffer_start);
+		if (read_next_lammps_line(&scan_data, line, length) == 0) break;
+		if (!lammps_label_matches(line, length, 0, "ITEM:")) continue;
+		if (lammps_label_matches(line, length, 6, "TIMESTEP")) {
+			LammpsFrameIndexEntry entry;
+			entry.offset = line_offset;
+			entry.timestep = 0;
+			for (int i = 0; i < DIMENSION; i++) entry.box_lengths[i] = 0.0;
+			if (read_next_lammps_line(&scan_data, line, length) == 1) entry.timestep = strtoll(line, NULL, 10);
+			frame_index.push_back(entry);
+		} else if (lammps_label_matches(line, length, 6, "BOX BOUNDS") && frame_index.size() > 0) {
+			for (int i = 0; i < DIMENSION; i++) {
+				if (read_next_lammps_line(&scan_data, line, length) == 0) break;
+				char* number_end;
+				double low = strtod(line, &number_end);
+				double high = strtod(number_end, NULL);
+				frame_index.back().box_lengths[i] = high - low;
+			}
+		}
+	}
+	fclose(scan_data.trajectory_file);
+}
+
+// FNV-1a hash of the first LAMMPS_FRAME_INDEX_CHECK_SIZE bytes of a trajectory (or all of it, if shorter).
+
+uint64_t hash_lammps_trajectory_start(const char* trajectory_filename)
+{
+	FILE* trajectory_file = fopen(trajectory_filename, "r");
+	if (trajectory_file == NULL) {
+		printf("Problem opening lammps trajcetory %s\n", trajectory_filename);
+		exit(EXIT_FAILURE);
+	}
+	unsigned char start[LAMMPS_FRAME_INDEX_CHECK_SIZE];
+	size_t n_read = fread(start, 1, LAMMPS_FRAME_INDEX_CHECK_SIZE, trajectory_file);
+	fclose(trajectory_file);
+	
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < n_read; i++) {
+		hash ^= start[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// Read a frame index, returning 1 if it exists and matches the trajectory.
+
+int read_lammps_frame_index(const char* index_filename, const struct stat &trajectory_stat, const uint64_t start_hash, const int first_timestep, std::vector<LammpsFrameIndexEntry> &frame_index)
+{
+	FILE* index_file = fopen(index_filename, "r");
+	if (index_file == NULL) return 0;
+	
+	char comment[1000];
+	long long file_size, modification_time;
+	unsigned long long index_start_hash;
+	int n_frames;
+	int valid = 0;
+	if (fgets(comment, sizeof(comment), index_file) != NULL &&
+		fscanf(index_file, "%lld %lld %llx %d", &file_size, &modification_time, &index_start_hash, &n_frames) == 4 &&
+		file_size == (long long)(trajectory_stat.st_size) && modification_time == (long long)(trajectory_stat.st_mtime) &&
+		(uint64_t)(index_start_hash) == start_hash && n_frames >= 0) {
+		frame_index.resize(n_frames);
+		valid = 1;
+		for (int n = 0; n < n_frames; n++) {
+			LammpsFrameIndexEntry* entry = &frame_index[n];
+			if (fscanf(index_file, "%lld %lld", &entry->offset, &entry->timestep) != 2) valid = 0;
+			for (int i = 0; i < DIMENSION; i++) {
+				if (fscanf(index_file, "%lf", &entry->box_lengths[i]) != 1) valid = 0;
+			}
+			if (valid == 0) break;
+		}
+		if (valid == 1 && n_frames > 0 && frame_index[0].timestep != first_timestep) valid = 0;
+	}
+	fclose(index_file);
+	if (valid == 0) frame_index.clear();
+	return valid;
+}
+
+// Write a frame index to a temporary file and move it into place, so that several runs
+// starting at once on the same trajectory never read a partial index.
+
+void write_lammps_frame_index(const char* index_filename, const struct stat &trajectory_stat, const uint64_t start_hash, const std::vector<LammpsFrameIndexEntry> &frame_index)
+{
+	char temp_filename[1100];
+	sprintf(temp_filename, "%s.%d.tmp", index_filename, (int)getpid());
+	FILE* index_file = fopen(temp_filename, "w");
+	if (index_file == NULL) {
+		printf("Warning: Could not write the frame index %s; it will be rebuilt next time.\n", index_filename);
+		return;
+	}
+	fprintf(index_file, "# LAMMPS frame index: trajectory size, modification time, start hash and frames; then offset, timestep and box lengths of each frame\n");
+	fprintf(index_file, "%lld %lld %llx %d\n", (long long)(trajectory_stat.st_size), (long long)(trajectory_stat.st_mtime), (unsigned long long)(start_hash), (int)(frame_index.size()));
+	for (unsigned n = 0; n < frame_index.size(); n++) {
+		fprintf(index_file, "%lld %lld", frame_index[n].offset, frame_index[n].timestep);
+		for (int i = 0; i < DIMENSION; i++) fprintf(index_file, " %.10g", frame_index[n].box_lengths[i]);
+		fprintf(index_file, "\n");
+	}
+	fclose(index_file);
+	if (rename(temp_filename, index_filename) != 0) {
+		printf("Warning: Could not write the frame index %s; it will be rebuilt next time.\n", index_filename);
+		remove(temp_filename);
+	}
+}
+
+// Check that a frame header with the timestep listed in a frame index entry starts at the entry's offset
+// before the trajectory is read from there. The buffer is left empty; the caller seeks again.
+
+void check_lammps_frame_index_entry(LammpsData* const lammps_data, const LammpsFrameIndexEntry &entry, const int frame_n)
+{
+	char* line;
+	size_t length;
+	int matches = 0;
+	if (fseeko(lammps_data->trajectory_file, (off_t)(entry.offset), SEEK_SET) == 0) {
+		reset_lammps_buffer(lammps_data, entry.offset);
+		if (read_next_lammps_line(lammps_data, line, length) == 1 && lammps_label_matches(line, length, 0, "ITEM: TIMESTEP") &&
+			read_next_lammps_line(lammps_data, line, length) == 1 && strtoll(line, NULL, 10) == entry.timestep) {
+			matches = 1;
+		}
+	}
+	if (matches == 0) {
+		printf("The frame index does not match the trajectory at frame %d; delete the .idx file to rebuild it.\n", frame_n);
+		exit(EXIT_FAILURE);
+	}
+	reset_lammps_buffer(lammps_data, entry.offset);
+}
+
+//-------------------------------------------------------------
+// Reading frames ahead in a background thread
+//-------------------------------------------------------------
+
+// Replace the frame source's reading functions by ones handing out frames read ahead.
+// The reading thread is only started when the first frame after the initial one is needed,
+// so that frames skipped before the starting frame are read in turn.
+
+void enable_frame_prefetching(FrameSource* const frame_source)
+{
+	if (frame_source->prefetch_frames <= 0) return;
+	if (frame_source->dynamic_state_sampling == 1) {
+		printf("Frames are not prefetched with dynamic_state_sampling; reading them in turn.\n");
+		return;
+	}
+	printf("Reading up to %d frames ahead in a background thread.\n", frame_source->prefetch_frames);
+	
+	FramePrefetcher* prefetcher = new FramePrefetcher;
+	prefetcher->started = 0;
+	prefetcher->n_frames_to_read = 0;
+	prefetcher->n_read = 0;
+	prefetcher->n_taken = 0;
+	prefetcher->stop = 0;
+	prefetcher->get_next_frame = frame_source->get_next_frame;
+	prefetcher->get_junk_frame = frame_source->get_junk_frame;
+	prefetcher->cleanup = frame_source->cleanup;
+	
+	frame_source->prefetcher = prefetcher;
+	frame_source->get_next_frame = take_prefetched_frame;
+	frame_source->get_junk_frame = skip_prefetched_frame;
+	frame_source->cleanup = finish_prefetched_reading;
+}
+
+// Hand the frame source, as it stands after the current frame, to a reading thread.
+// Only the frames that the matrix-building loops will ask for are read ahead (all but the
+// current one), so that the thread never reads past the end of a trajectory that is exactly
+// as long as needed.
+
+void start_frame_prefetching(FrameSource* const frame_source)
+{
+	FramePrefetcher* prefetcher = frame_source->prefetcher;
+	int n_sites = frame_source->frame_config->current_n_sites;
+	
+	prefetcher->reader_source = *frame_source;
+	prefetcher->reader_source.get_next_frame = prefetcher->get_next_frame;
+	prefetcher->reader_source.get_junk_frame = prefetcher->get_junk_frame;
+	prefetcher->reader_source.cleanup = prefetcher->cleanup;
+	prefetcher->reader_source.prefetcher = NULL;
+	prefetcher->n_frames_to_read = std::max(frame_source->n_frames - 1, 0);
+	
+	prefetcher->ring.resize(frame_source->prefetch_frames);
+	for (unsigned i = 0; i < prefetcher->ring.size(); i++) {
+		prefetcher->ring[i].frame_config = new FrameConfig(n_sites);
+		if (frame_source->dynamic_types == 1) prefetcher->ring[i].frame_config->cg_site_types = new int[n_sites]();
+		else prefetcher->ring[i].frame_config->cg_site_types = NULL;
+	}
+	
+	prefetcher->started = 1;
+	prefetcher->reading_thread = std::thread(read_frames_ahead, prefetcher);
+}
+
+// Body of the reading thread. Frames with zero statistical weight are not processed,
+// so only what is needed to skip them is read.
+
+void read_frames_ahead(FramePrefetcher* const prefetcher)
+{
+	FrameSource* reader_source = &prefetcher->reader_source;
+	int ring_size = (int)(prefetcher->ring.size());
+	
+	for (int n = 0; n < prefetcher->n_frames_to_read; n++) {
+		std::unique_lock<std::mutex> guard(prefetcher->ring_lock);
+		while (prefetcher->stop == 0 && prefetcher->n_read - prefetcher->n_taken >= ring_size) prefetcher->frame_taken.wait(guard);
+		if (prefetcher->stop == 1) return;
+		PrefetchedFrame* frame = &prefetcher->ring[prefetcher->n_read % ring_size];
+		guard.unlock();
+		
+		reader_source->frame_config = frame->frame_config;
+		int frame_index = n + 1;
+		if (reader_source->use_statistical_reweighting == 1 && reader_source->frame_weights[frame_index] == 0.0) {
+			frame->read_stat = (*prefetcher->get_junk_frame)(reader_source);
+		} else {
+			frame->read_stat = (*prefetcher->get_next_frame)(reader_source);
+		}
+		frame->timestep = reader_source->current_timestep;
+		frame->time = reader_source->time;
+		memcpy(frame->simulation_box_limits, reader_source->simulation_box_limits, sizeof(matrix));
+		
+		guard.lock();
+		prefetcher->n_read++;
+		prefetcher->frame_read.notify_one();
+		if (frame->read_stat == 0) return;
+	}
+}
+
+// Make the next frame read ahead the current frame of the frame source. Its positions and
+// forces are swapped in rather than copied; the current frame's arrays go back to the ring.
+
+int take_prefetched_frame(FrameSource* const frame_source)
+{
+	FramePrefetcher* prefetcher = frame_source->prefetcher;
+	if (prefetcher->started == 0) start_frame_prefetching(frame_source);
+	
+	// Any frames beyond those read ahead are read in turn once the reading thread is done.
+	if (prefetcher->n_taken >= prefetcher->n_frames_to_read) {
+		if (prefetcher->reading_thread.joinable()) prefetcher->reading_thread.join();
+		FrameSource* reader_source = &prefetcher->reader_source;
+		reader_source->frame_config = frame_source->frame_config;
+		int read_stat = (*prefetcher->get_next_frame)(reader_source);
+		frame_source->current_timestep = reader_source->current_timestep;
+		frame_source->time = reader_source->time;
+		memcpy(frame_source->simulation_box_limits, reader_source->simulation_box_limits, sizeof(matrix));
+		frame_source->current_frame_n += 1;
+		return read_stat;
+	}
+	
+	std::unique_lock<std::mutex> guard(prefetcher->ring_lock);
+	while (prefetcher->n_read == prefetcher->n_taken) prefetcher->frame_read.wait(guard);
+	PrefetchedFrame* frame = &prefetcher->ring[prefetcher->n_taken % (int)(prefetcher->ring.size())];
+	guard.unlock();
+	
+	FrameConfig* frame_config = frame_source->frame_config;
+	std::swap(frame_config->x, frame->frame_config->x);
+	std::swap(frame_config->f, frame->frame_config->f);
+	frame_config->current_n_sites = frame->frame_config->current_n_sites;
+	for (int i = 0; i < DIMENSION; i++) frame_config->simulation_box_half_lengths[i] = frame->frame_config->simulation_box_half_lengths[i];
+	if (frame_source->dynamic_types == 1 && frame->read_stat == 1) {
+		memcpy(frame_config->cg_site_types, frame->frame_config->cg_site_types, frame_config->current_n_sites * sizeof(int));
+	}
+	frame_source->current_timestep = frame->timestep;
+	frame_source->time = frame->time;
+	memcpy(frame_source->simulation_box_limits, frame->simulation_box_limits, sizeof(matrix));
+	frame_source->current_frame_n += 1;
+	int read_stat = frame->read_stat;
+	
+	guard.lock();
+	prefetcher->n_taken++;
+	prefetcher->frame_taken.notify_one();
+	return read_stat;
+}
+
+// Frames are skipped in turn until frames are read ahead; after that, skipping takes a frame.
+
+int skip_prefetched_frame(FrameSource* const frame_source)
+{
+	if (frame_source->prefetcher->started == 0) return (*frame_source->prefetcher->get_junk_frame)(frame_source);
+	return take_prefetched_frame(frame_source);
+}
+
+// Stop the reading thread, then finish reading as the frame source itself would.
+
+void finish_prefetched_reading(FrameSource* const frame_source)
+{
+	FramePrefetcher* prefetcher = frame_source->prefetcher;
+	if (prefetcher->started == 1) {
+		{
+			std::lock_guard<std::mutex> guard(prefetcher->ring_lock);
+			prefetcher->stop = 1;
+		}
+		prefetcher->frame_taken.notify_one();
+		if (prefetcher->reading_thread.joinable()) prefetcher->reading_thread.join();
+	}
+	for (unsigned i = 0; i < prefetcher->ring.size(); i++) {
+		if (prefetcher->ring[i].frame_config->cg_site_types != NULL) delete [] prefetcher->ring[i].frame_config->cg_site_types;
+		delete prefetcher->ring[i].frame_config;
+	}
+	
+	frame_source->get_next_frame = prefetcher->get_next_frame;
+	frame_source->get_junk_frame = prefetcher->get_junk_frame;
+	frame_source->cleanup = prefetcher->cleanup;
+	frame_source->prefetcher = NULL;
+	delete prefetcher;
+	(*frame_source->cleanup)(frame_source);
+}
+
 //-------------------------------------------------------------
 // Helper functions for reading LAMMPS header and body
 //-------------------------------------------------------------
 
+// Open a LAMMPS trajectory for reading. Trajectories ending in .gz or .zst are read from gzip or zstd
+// decompressing them in a separate process, so that decompression overlaps with parsing.
+
+void open_lammps_trajectory(LammpsData* const lammps_data, const char* filename)
+{
+	const char* decompressor = NULL;
+	size_t length = strlen(filename);
+	if (length > 3 && strcmp(filename + length - 3, ".gz") == 0) decompressor = "gzip";
+	else if (length > 4 && strcmp(filename + length - 4, ".zst") == 0) decompressor = "zstd";
+	
+	if (decompressor == NULL) {
+		lammps_data->compressed = 0;
+		lammps_data->trajectory_file = fopen(filename, "r");
+	} else {
+		// Check the file here, since the shell would only report a missing file on stderr.
+		FILE* check_file = fopen(filename, "r");
+		if (check_file == NULL) {
+			printf("Problem opening lammps trajcetory %s\n", filename);
+			exit(EXIT_FAILURE);
+		}
+		fclose(check_file);
+		
+		// Quote the file name for the shell, escaping any single quotes in it.
+		std::string command = std::string(decompressor) + " -dc -- '";
+		for (size_t i = 0; i < length; i++) {
+			if (filename[i] == '\'') command += "'\\''";
+			else command += filename[i];
+		}
+		command += "'";
+		lammps_data->compressed = 1;
+		lammps_data->trajectory_file = popen(command.c_str(), "r");
+		printf("Decompressing lammps trajectory %s with %s.\n", filename, decompressor);
+	}
+	if (lammps_data->trajectory_file == NULL) {
+		printf("Problem opening lammps trajcetory %s\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	
+	reset_lammps_buffer(lammps_data, 0);
+	refill_lammps_buffer(lammps_data);
+	if (lammps_data->buffer_end == 0) {
+		if (lammps_data->compressed == 1) printf("Could not decompress lammps trajectory %s; check that %s is installed and the file is intact.\n", filename, decompressor);
+		else printf("Lammps trajectory %s is empty.\n", filename);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void close_lammps_trajectory(LammpsData* const lammps_data)
+{
+	if (lammps_data->compressed == 1) pclose(lammps_data->trajectory_file);
+	else fclose(lammps_data->trajectory_file);
+}
+
+// Move the unparsed end of the buffer to its front and read the next chunk of the trajectory after it,
+// growing the buffer if a single line does not fit in half of it.
+
+void refill_lammps_buffer(LammpsData* const lammps_data)
+{
+	size_t remaining = lammps_data->buffer_end - lammps_data->buffer_start;
+	if (remaining > 0) memmove(&lammps_data->buffer[0], &lammps_data->buffer[lammps_data->buffer_start], remaining);
+	lammps_data->buffer_file_offset += lammps_data->buffer_start;
+	lammps_data->buffer_start = 0;
+	lammps_data->buffer_end = remaining;
+	if (remaining > (lammps_data->buffer.size() - 1) / 2) lammps_data->buffer.resize(2 * lammps_data->buffer.size() - 1);
+	
+	size_t n_read = fread(&lammps_data->buffer[remaining], 1, lammps_data->buffer.size() - 1 - remaining, lammps_data->trajectory_file);
+	if (n_read == 0) lammps_data->end_of_file = 1;
+	lammps_data->buffer_end += n_read;
+	lammps_data->buffer[lammps_data->buffer_end] = '\0';
+}
+
+// Empty the buffer so that reading continues from the given position in the file.
+
+void reset_lammps_buffer(LammpsData* const lammps_data, const long long file_offset)
+{
+	lammps_data->buffer[0] = '\0';
+	lammps_data->buffer_start = 0;
+	lammps_data->buffer_end = 0;
+	lammps_data->buffer_file_offset = file_offset;
+	lammps_data->end_of_file = 0;
+}
+
+// Find the next line of the trajectory in the buffer and terminate it in place, so that its fields
+// can be parsed without copying. The line stays valid until the next line is read.
+// Returns 0 if there are no more lines.
+
+int read_next_lammps_line(LammpsData* const lammps_data, char* &line, size_t &length)
+{
+	while (true) {
+		char* start = &lammps_data->buffer[lammps_data->buffer_start];
+		size_t available = lammps_data->buffer_end - lammps_data->buffer_start;
+		char* newline = (char*)memchr(start, '\n', available);
+		if (newline != NULL) {
+			*newline = '\0';
+			line = start;
+			length = newline - start;
+			lammps_data->buffer_start += length + 1;
+			return 1;
+		}
+		if (lammps_data->end_of_file == 1) {
+			if (available == 0) return 0;
+			// The last line has no newline; it is already followed by the buffer's '\0'.
+			line = start;
+			length = available;
+			lammps_data->buffer_start = lammps_data->buffer_end;
+			return 1;
+		}
+		refill_lammps_buffer(lammps_data);
+	}
+}
+
+void check_and_read_next_lammps_line(LammpsData* const lammps_data, char* &line, size_t &length)
+{
+	if (read_next_lammps_line(lammps_data, line, length) == 0) {
+		fprintf(stderr, "\nIt appears that the file is no longer open.\n");
+		fprintf(stderr, "Please check that you are not attempting to read past the end of the file and try again.\n");
+		fflush(stderr);
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Test if a character separates fields of a LAMMPS line; '\r' is included so that
+// dumps with DOS line endings parse the same as others.
+
+inline int is_lammps_separator(const char c)
+{
+	return (c == ' ') || (c == '\t') || (c == '\r');
+}
+
+// Test if a line has the given label starting at position pos. A space in the label
+// matches any separator in the line.
+
+inline int lammps_label_matches(const char* line, const size_t length, const size_t pos, const char* label)
+{
+	size_t label_length = strlen(label);
+	if (length < pos + label_length) return 0;
+	for (size_t i = 0; i < label_length; i++) {
+		if (label[i] == ' ') {
+			if (!is_lammps_separator(line[pos + i])) return 0;
+		} else if (line[pos + i] != label[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
 void read_lammps_header(LammpsData *const lammps_data, int* const current_n_sites, int *const timestep, real *const time, matrix box, const int dynamic_types, const int dynamic_state_sampling, const int no_forces)
 {
 	double low = 0.0;
 	double high = 0.0;
-	std::string line;
+	char* line;
+	char* number_end;
+	size_t length;
 	int flag = 1; 
 	
 	while(flag == 1) {
 		//read next line of header (and wrap-up if end-of-file)
-		check_and_read_next_line(lammps_data->trajectory_stream, line);
+		check_and_read_next_lammps_line(lammps_data, line, length);
 		
 		//test if it is a labeled line (all LAMMPS labels start with "ITEM:")
-		if( line.compare(0, 5, "ITEM:") == 0 ) {
+		if( lammps_label_matches(line, length, 0, "ITEM:") ) {
 			//find out which label matched (skip space after ITEM:)
-			if( line.compare(6, 15, "NUMBER OF ATOMS") == 0) {
+			if( lammps_label_matches(line, length, 6, "NUMBER OF ATOMS") ) {
 				
 				//read number of atoms
-				lammps_data->trajectory_stream >> *current_n_sites;
+				check_and_read_next_lammps_line(lammps_data, line, length);
+				*current_n_sites = (int)strtol(line, NULL, 10);
 				
-			} else if( line.compare(6, 10, "BOX BOUNDS") == 0) {
+			} else if( lammps_label_matches(line, length, 6, "BOX BOUNDS") ) {
 					
 				//read in bounds (low high) for each dimensions
 				for(int pos=0; pos <  DIMENSION; pos++) {
-					lammps_data->trajectory_stream >> low >> high;
+					check_and_read_next_lammps_line(lammps_data, line, length);
+					low = strtod(line, &number_end);
+					high = strtod(number_end, NULL);
 					box[pos][pos] = high - low;
 				}	
 				
-			} else if( line.compare(6, 8, "TIMESTEP") == 0) {
+			} else if( lammps_label_matches(line, length, 6, "TIMESTEP") ) {
 				
 				//read in timestep value
-				lammps_data->trajectory_stream >> *time;
-				(*timestep)++;
+				check_and_read_next_lammps_line(lammps_data, line, length);
+				*time = strtof(line, NULL);
+				*timestep = (int)strtol(line, NULL, 10);
 			
-			} else if( line.compare(6, 5, "ATOMS") == 0) {
+			} else if( lammps_label_matches(line, length, 6, "ATOMS") ) {
 				
 				//read labels for body of frame
 				flag = 0; 
-				size_t prev = 11;
-				size_t next = 0;
 				int set_x = 0;
 				int set_f = 0;
 				int set_type = 0;
 				int set_state = 0;
 				lammps_data->header_size = 0;
 				
-				//check for xpos and fpos as we tokenize string to determine number of columns in body
-				while ((next = line.find_first_of(" ", prev)) != std::string::npos) {
-					if( (next - prev) == 0 ) { //check if empty
-						prev++;
+				//check for xpos and fpos as we tokenize the labels (separated by spaces or tabs) to determine number of columns in body
+				for (size_t pos = 11; pos < length; ) {
+					if (is_lammps_separator(line[pos])) {
+						pos++;
 						continue;
-					} else if( (line.compare(prev, 1, "x") == 0) ||
-							   (line.compare(prev, 1, "xu") == 0) ) {
+					}
+					size_t label_length = 0;
+					while (pos + label_length < length && !is_lammps_separator(line[pos + label_length])) label_length++;
+					if( line[pos] == 'x' ) {
 						lammps_data->x_pos = lammps_data->header_size;
 						set_x = 1;
-					} else if( line.compare(prev, 2, "fx") == 0 ) {
+					} else if( lammps_label_matches(line + pos, label_length, 0, "fx") ) {
 						lammps_data->f_pos = lammps_data->header_size;
 						set_f = 1;
-					} else if( line.compare(prev, 4, "type") == 0 ) {		
+					} else if( lammps_label_matches(line + pos, label_length, 0, "type") ) {		
 						lammps_data->type_pos = lammps_data->header_size;
 						set_type = 1;
-					} else if( line.compare(prev, 5, "state") == 0 ) {
+					} else if( lammps_label_matches(line + pos, label_length, 0, "state") ) {
 						lammps_data->state_pos = lammps_data->header_size;
 						set_state = 1;
 					}
 					lammps_data->header_size++;
-					prev = next;
+					pos += label_length;
 				}
-		
-				if (prev < line.size()) {
-                	if( (line.compare(prev, 1, "x") == 0 )  ||
-					    (line.compare(prev, 1, "xu") == 0) ) {
-                        lammps_data->x_pos = lammps_data->header_size;
-                    	set_x = 1;
-                    } else if( line.compare(prev, 2, "fx") == 0 ) {
-                        lammps_data->f_pos = lammps_data->header_size;
-                    	set_f = 1;
-                    } else if( line.compare(prev, 4, "type") == 0 ) {
-                        lammps_data->type_pos = lammps_data->header_size;
-                    	set_type = 1;
-					} else if( line.compare(prev, 5, "state") == 0 ) {
-						lammps_data->state_pos = lammps_data->header_size;
-						set_state = 1;
-					}
-                	lammps_data->header_size++;
-                }
 				
 				//verify that necessary information was extracted to input
 				if(set_x == 0 ) {
@@ -715,8 +1545,28 @@ void read_lammps_header(LammpsData *const lammps_data, int* const current_n_site
 					printf("Warning: State probability information not detected in header when parsing LAMMPS frame header!\n");
 					exit(EXIT_FAILURE);
 				}
+				
+				//record which columns of the body are read
+				lammps_data->column_roles.assign(lammps_data->header_size, kLammpsIgnored);
+				lammps_data->column_components.assign(lammps_data->header_size, 0);
+				for (int j = 0; j < DIMENSION; j++) {
+					if (lammps_data->x_pos + j < lammps_data->header_size) {
+						lammps_data->column_roles[lammps_data->x_pos + j] = kLammpsPosition;
+						lammps_data->column_components[lammps_data->x_pos + j] = j;
+					}
+				}
+				if (no_forces == 0) {
+					for (int j = 0; j < DIMENSION; j++) {
+						if (lammps_data->f_pos + j < lammps_data->header_size) {
+							lammps_data->column_roles[lammps_data->f_pos + j] = kLammpsForce;
+							lammps_data->column_components[lammps_data->f_pos + j] = j;
+						}
+					}
+				}
+				if (dynamic_types == 1) lammps_data->column_roles[lammps_data->type_pos] = kLammpsType;
+				if (dynamic_state_sampling == 1) lammps_data->column_roles[lammps_data->state_pos] = kLammpsState;
 			} else {
-				printf("Unrecognized line in frame header: %s", line.c_str() );
+				printf("Unrecognized line in frame header: %s", line);
 				
 			}	//close inner if/else if structure
 		}		//close ITEM match
@@ -724,58 +1574,266 @@ void read_lammps_header(LammpsData *const lammps_data, int* const current_n_site
 	return;
 }
 
-int read_dimension_lammps_body(LammpsData *const lammps_data, FrameConfig *const frame_config, const int dynamic_types, const int dynamic_state_sampling, const int no_forces)
+// Read the body of a frame, parsing only the columns that are needed in place.
+
+int read_dimension_lammps_body(LammpsData *const lammps_data, FrameConfig *const frame_config)
 {
 	//read in current_n_sites lines to extract position and force information
-	int j = 0;
 	int return_value = 1;
-	std::string line;
+	char* line;
+	size_t length;
+	const int* column_roles = &lammps_data->column_roles[0];
+	const int* column_components = &lammps_data->column_components[0];
 	
-	//allocate space for array of strings based on lammps_data->header_size
 	for(int i=0; i < frame_config->current_n_sites; i++)
 	{
-		//read in next line and tokenize 
-		check_and_read_next_line(lammps_data->trajectory_stream, line);
-		if(  (j = StringSplit(line, " \t", lammps_data->elements)) != lammps_data->header_size ) {	//allow for trailing white space
+		//read in next line and walk through its fields (separated by spaces or tabs)
+		check_and_read_next_lammps_line(lammps_data, line, length);
+		char* pos = line;
+		char* end = line + length;
+		int n_fields = 0;
+		while (true) {
+			while (pos < end && is_lammps_separator(*pos)) pos++;
+			if (pos == end) break;
+			char* field = pos;
+			while (pos < end && !is_lammps_separator(*pos)) pos++;
+			if (n_fields < lammps_data->header_size) {
+				switch (column_roles[n_fields]) {
+					case kLammpsPosition:
+						frame_config->x[i][column_components[n_fields]] = strtod(field, NULL);
+						break;
+					case kLammpsForce:
+						frame_config->f[i][column_components[n_fields]] = strtod(field, NULL);
+						break;
+					case kLammpsType:
+						frame_config->cg_site_types[i] = (int)strtol(field, NULL, 10);
+						break;
+					case kLammpsState:
+						lammps_data->cg_site_state_probabilities[i] = strtod(field, NULL);
+						break;
+					default:
+						break;
+				}
+			}
+			n_fields++;
+		}
+		if( n_fields != lammps_data->header_size ) {	//allow for trailing white space
 			printf("Warning: Number of fields detected in frame body");
-			printf(" (%d) does not agree with number expected from frame header (%d)!\n", j, lammps_data->header_size);
+			printf(" (%d) does not agree with number expected from frame header (%d)!\n", n_fields, lammps_data->header_size);
 			return_value = -1;
 			break;
-			}
-			
-		//extract position information
-		for(j = 0; j < DIMENSION; j++) {
-			frame_config->x[i][j] = atof( lammps_data->elements[j + lammps_data->x_pos].c_str() );
+		}
+	}
+	return return_value;
+}
+
+//-------------------------------------------------------------
+// Helper functions for reading and writing binary trajectories
+//-------------------------------------------------------------
+
+// Lay out a frame record: timestep, time and box lengths, then positions, forces, types and state
+// probabilities, each starting on an 8 byte boundary, then the checksum of everything before it.
+
+void set_binary_frame_layout(const BinaryTrajectoryHeader &header, BinaryFrameLayout &layout)
+{
+	size_t offset = 2 * sizeof(int64_t) + DIMENSION * sizeof(double);
+	size_t vector_size = (size_t)(header.n_sites) * DIMENSION * header.precision;
+	vector_size = (vector_size + 7) / 8 * 8;
+	layout.x_offset = offset;
+	offset += vector_size;
+	layout.f_offset = offset;
+	offset += vector_size;
+	layout.types_offset = offset;
+	if (header.contents & kBinaryTypes) offset += ((size_t)(header.n_sites) * sizeof(int32_t) + 7) / 8 * 8;
+	layout.state_probabilities_offset = offset;
+	if (header.contents & kBinaryStateProbabilities) offset += (size_t)(header.n_sites) * sizeof(double);
+	layout.checksum_offset = offset;
+	offset += sizeof(uint64_t);
+	layout.frame_size = (offset + BINARY_TRAJECTORY_ALIGNMENT - 1) / BINARY_TRAJECTORY_ALIGNMENT * BINARY_TRAJECTORY_ALIGNMENT;
+}
+
+// FNV-1a hash taken a 64 bit word at a time, so that checking a frame costs little next to copying it.
+// n_bytes must be a multiple of 8.
+
+inline uint64_t binary_trajectory_checksum(const char* data, const size_t n_bytes)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < n_bytes; i += 8) {
+		uint64_t word;
+		memcpy(&word, data + i, sizeof(uint64_t));
+		hash ^= word;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// Copy a frame record of a binary trajectory into the frame source after checking it.
+// Positions are wrapped in place while frames are processed, so they cannot be used
+// straight from the read-only mapping.
+
+void load_binary_frame(FrameSource* const frame_source, const int frame_index)
+{
+	BinaryTrajectoryData* binary_data = frame_source->binary_data;
+	const BinaryFrameLayout &layout = binary_data->layout;
+	const char* record = binary_data->mapping + binary_data->header.data_offset + (size_t)(frame_index) * layout.frame_size;
+	FrameConfig* frame_config = frame_source->frame_config;
+	int n_components = frame_config->current_n_sites * DIMENSION;
+	
+	uint64_t checksum;
+	memcpy(&checksum, record + layout.checksum_offset, sizeof(uint64_t));
+	if (binary_trajectory_checksum(record, layout.checksum_offset) != checksum) {
+		printf("Frame %d of binary trajectory %s is corrupted.\n", binary_data->header.first_frame + frame_index, frame_source->trajectory_filename);
+		exit(EXIT_FAILURE);
+	}
+	
+	int64_t timestep;
+	double time;
+	double box_lengths[DIMENSION];
+	memcpy(&timestep, record, sizeof(int64_t));
+	memcpy(&time, record + sizeof(int64_t), sizeof(double));
+	memcpy(box_lengths, record + 2 * sizeof(int64_t), DIMENSION * sizeof(double));
+	frame_source->current_timestep = (int)(timestep);
+	frame_source->time = (real)(time);
+	for (int i = 0; i < DIMENSION; i++) {
+		frame_source->simulation_box_limits[i][i] = (real)(box_lengths[i]);
+		frame_config->simulation_box_half_lengths[i] = frame_source->simulation_box_limits[i][i] * 0.5;
+	}
+	
+	if (binary_data->header.precision == sizeof(double)) {
+		memcpy(&frame_config->x[0][0], record + layout.x_offset, n_components * sizeof(double));
+		if (frame_source->no_forces == 0) memcpy(&frame_config->f[0][0], record + layout.f_offset, n_components * sizeof(double));
+	} else {
+		const float* x = (const float*)(record + layout.x_offset);
+		const float* f = (const float*)(record + layout.f_offset);
+		double* frame_x = &frame_config->x[0][0];
+		double* frame_f = &frame_config->f[0][0];
+		for (int k = 0; k < n_components; k++) frame_x[k] = x[k];
+		if (frame_source->no_forces == 0) {
+			for (int k = 0; k < n_components; k++) frame_f[k] = f[k];
+		}
+	}
+	
+	if (frame_source->dynamic_state_sampling == 1) {
+		memcpy(binary_data->cg_site_state_probabilities, record + layout.state_probabilities_offset, frame_config->current_n_sites * sizeof(double));
+	} else if (frame_source->dynamic_types == 1) {
+		const int32_t* types = (const int32_t*)(record + layout.types_offset);
+		for (int i = 0; i < frame_config->current_n_sites; i++) frame_config->cg_site_types[i] = types[i];
+	}
+}
+
+// State probabilities of the current frame, from whichever trajectory holds them.
+
+inline const double* current_state_probabilities(const FrameSource* const frame_source)
+{
+	if (frame_source->trajectory_type == kBinaryTrajectory) return frame_source->binary_data->cg_site_state_probabilities;
+	return frame_source->lammps_data->cg_site_state_probabilities;
+}
+
+// Write n_frames frames, starting from the current one, to a binary trajectory. Types are written
+// if dynamic_types is set and state probabilities if dynamic_state_sampling is set. The header is
+// rewritten at the end with the number of frames actually read.
+
+void write_binary_trajectory(FrameSource* const frame_source, const char* filename, const int precision)
+{
+	check_file_extension(filename, "cgb");
+	FrameConfig* frame_config = frame_source->frame_config;
+	int n_sites = frame_config->current_n_sites;
+	
+	BinaryTrajectoryHeader header;
+	memset(&header, 0, sizeof(BinaryTrajectoryHeader));
+	memcpy(header.magic, "MSCGBTRJ", 8);
+	header.version = BINARY_TRAJECTORY_VERSION;
+	header.dimension = DIMENSION;
+	header.n_sites = n_sites;
+	header.n_frames = 0;
+	header.first_frame = frame_source->starting_frame;
+	header.precision = precision;
+	header.contents = 0;
+	if (frame_source->dynamic_state_sampling == 1) header.contents += kBinaryStateProbabilities;
+	else if (frame_source->dynamic_types == 1) header.contents += kBinaryTypes;
+	BinaryFrameLayout layout;
+	set_binary_frame_layout(header, layout);
+	header.frame_size = layout.frame_size;
+	header.data_offset = BINARY_TRAJECTORY_DATA_OFFSET;
+	
+	FILE* binary_file = fopen(filename, "wb");
+	if (binary_file == NULL) {
+		printf("Problem opening binary trajectory %s for writing\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	std::vector<char> record(BINARY_TRAJECTORY_DATA_OFFSET, 0);
+	int write_ok = (fwrite(&record[0], 1, BINARY_TRAJECTORY_DATA_OFFSET, binary_file) == BINARY_TRAJECTORY_DATA_OFFSET);
+	
+	record.assign(layout.frame_size, 0);
+	int n_components = n_sites * DIMENSION;
+	for (int n = 0; n < frame_source->n_frames && write_ok == 1; n++) {
+		if (n > 0 && (*frame_source->get_next_frame)(frame_source) == 0) {
+			printf("Could only read %d of %d frames.\n", n, frame_source->n_frames);
+			break;
+		}
+		if (frame_config->current_n_sites != n_sites) {
+			printf("Number of CG sites changed in frame %d; stopping.\n", frame_source->current_frame_n);
+			break;
 		}
 		
-		//extract force information
-		if (no_forces == 0) {
-			for(j = 0; j < DIMENSION; j++) {
-				frame_config->f[i][j] = atof( lammps_data->elements[j + lammps_data->f_pos].c_str() );
+		int64_t timestep = frame_source->current_timestep;
+		double time = frame_source->time;
+		memcpy(&record[0], &timestep, sizeof(int64_t));
+		memcpy(&record[sizeof(int64_t)], &time, sizeof(double));
+		for (int i = 0; i < DIMENSION; i++) {
+			double box_length = frame_source->simulation_box_limits[i][i];
+			memcpy(&record[2 * sizeof(int64_t) + i * sizeof(double)], &box_length, sizeof(double));
+		}
+		if (precision == sizeof(double)) {
+			memcpy(&record[layout.x_offset], &frame_config->x[0][0], n_components * sizeof(double));
+			memcpy(&record[layout.f_offset], &frame_config->f[0][0], n_components * sizeof(double));
+		} else {
+			float* x = (float*)(&record[layout.x_offset]);
+			float* f = (float*)(&record[layout.f_offset]);
+			const double* frame_x = &frame_config->x[0][0];
+			const double* frame_f = &frame_config->f[0][0];
+			for (int k = 0; k < n_components; k++) {
+				x[k] = (float)(frame_x[k]);
+				f[k] = (float)(frame_f[k]);
 			}
 		}
-		
-		//extract type information
-		if(dynamic_types == 1) { //check if dynamic_type is set
-			frame_config->cg_site_types[i] = atoi( lammps_data->elements[lammps_data->type_pos].c_str() );
+		if (header.contents & kBinaryTypes) {
+			int32_t* types = (int32_t*)(&record[layout.types_offset]);
+			for (int i = 0; i < n_sites; i++) types[i] = frame_config->cg_site_types[i];
 		}
-		if(dynamic_state_sampling == 1) { // check if dynamic_state_sampling is set
-			lammps_data->cg_site_state_probabilities[i] = atof( lammps_data->elements[lammps_data->state_pos].c_str() );
+		if (header.contents & kBinaryStateProbabilities) {
+			memcpy(&record[layout.state_probabilities_offset], current_state_probabilities(frame_source), n_sites * sizeof(double));
 		}
+		uint64_t checksum = binary_trajectory_checksum(&record[0], layout.checksum_offset);
+		memcpy(&record[layout.checksum_offset], &checksum, sizeof(uint64_t));
+		
+		if (fwrite(&record[0], 1, layout.frame_size, binary_file) != layout.frame_size) write_ok = 0;
+		else header.n_frames++;
 	}
-	return return_value;
+	
+	header.checksum = binary_trajectory_checksum((const char*)(&header), offsetof(BinaryTrajectoryHeader, checksum));
+	if (write_ok == 1) {
+		if (fseek(binary_file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(BinaryTrajectoryHeader), 1, binary_file) != 1) write_ok = 0;
+	}
+	if (fclose(binary_file) != 0) write_ok = 0;
+	if (write_ok == 0) {
+		printf("Problem writing binary trajectory %s\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	printf("Wrote %d frames to binary trajectory %s.\n", header.n_frames, filename);
 }
 
 void FrameSource::sampleTypesFromProbs()
 {
 	double rand;
         std::uniform_real_distribution<double> uniform_dist(0.0, 1.0);
+	const double* state_probabilities = current_state_probabilities(this);
 	// Determine each site's type/state by comparing the probability against a random number
 	for(int i = 0; i < frame_config->current_n_sites; i++) {
 		// Generate random number [0,1] using Mersenne Twister.
 		rand = uniform_dist(mt_rand_gen);
 		// Make state assignment based on comparison.
-		if (rand > lammps_data->cg_site_state_probabilities[i]) frame_config->cg_site_types[i] = 2;
+		if (rand > state_probabilities[i]) frame_config->cg_site_types[i] = 2;
 		else frame_config->cg_site_types[i] = 1;
 	}
 }
@@ -889,15 +1947,80 @@ void setup_3B_cell_stencil(const std::vector<int>& cell_number, std::vector<int>
 int recursive_template_loop(const std::vector<int>& cell_number, const std::vector<int> &cell_indices, std::vector<int> &shift_indices, std::vector<int> &stencil, const std::vector<int> &hash_offset, int stencil_counter, const int current_dimension, add_stencil_element action_todo);
 int add_pair_stencil_element(const std::vector<int>& cell_number,  const std::vector<int> &cell_indices, std::vector<int> &shift_indices, std::vector<int> &stencil, const std::vector<int> &hash_offset, int stencil_counter);
 int add_3B_stencil_element(const std::vector<int>& cell_number, const std::vector<int> &cell_indices, std::vector<int> &shift_indices, std::vector<int> &stencil, const std::vector<int> &hash_offset, int stencil_counter);
+int fitting_cell_number(const double cutoff, const real simulation_box_half_length);
+int count_decomposed_dimensions(const std::vector<int>& cell_number);
+
+// Number of cells used along a dimension: as many as fit the cutoff,
+// or a single cell if there is not room for the three cells of a stencil.
+
+int fitting_cell_number(const double cutoff, const real simulation_box_half_length)
+{
+	int n_cells = (int)(2.0 * simulation_box_half_length / cutoff);
+	if (n_cells < 3) n_cells = 1;
+	return n_cells;
+}
+
+// Number of dimensions that are split into more than one cell.
+
+int count_decomposed_dimensions(const std::vector<int>& cell_number)
+{
+	int n_decomposed = 0;
+	for (int i = 0; i < DIMENSION; i++) {
+		if (cell_number[i] > 1) n_decomposed++;
+	}
+	return n_decomposed;
+}
 
 // Initializer for cell lists, using derived class's stencil set up routine.
 
 void BaseCellList::init(const double cutoff, const FrameSource* const fr)
 {
+    list_cutoff = cutoff;
+    populated = false;
     setUpCellListCells(cutoff, fr->frame_config->simulation_box_half_lengths, fr->frame_config->current_n_sites);
     setUpCellListStencil();
 }
 
+// Adapt the cell lists to a new box for the next frame.
+// Binning divides each position by the cell size, so the grid is fixed in scaled coordinates
+// and the cells simply stretch with the box. The grid and its stencil are only rebuilt when the
+// number of cells that fit the box changes in some dimension; box fluctuations within a cell
+// count therefore never reallocate anything.
+
+void BaseCellList::updateBox(const FrameSource* const fr)
+{
+	const real* simulation_box_half_lengths = fr->frame_config->simulation_box_half_lengths;
+	int current_n_sites = fr->frame_config->current_n_sites;
+	int regrid = 0;
+	
+	for (int i = 0; i < DIMENSION; i++) {
+		if (fitting_cell_number(list_cutoff, simulation_box_half_lengths[i]) != cell_number[i]) {
+			regrid = 1;
+			break;
+		}
+	}
+	
+	if (regrid == 1) {
+		setUpCellListCells(list_cutoff, simulation_box_half_lengths, current_n_sites);
+		setUpCellListStencil();
+		return;
+	}
+	
+	for (int i = 0; i < DIMENSION; i++) {
+		if (list_cutoff > simulation_box_half_lengths[i]) {
+	        printf("Cutoff is larger than half of the simulation box size!\n");
+    	    exit(EXIT_FAILURE);
+    	}
+		cell_size[i] = 2.0 * simulation_box_half_lengths[i] / (double)(cell_number[i]);
+	}
+	if ((int)(cell_sites.size()) != current_n_sites) {
+	    cell_sites.resize(current_n_sites);
+	    particle_cell.resize(current_n_sites);
+	    sorted_x.resize(current_n_sites);
+	    sorted_types.resize(current_n_sites);
+	}
+}
+
 // Set up the lists and the spatial decomposition.
 
 void BaseCellList::setUpCellListCells(const double cutoff, const real*  simulation_box_half_lengths, const int current_n_sites)
@@ -912,32 +2035,16 @@ void BaseCellList::setUpCellListCells(const double cutoff, const real*  simulati
 	
 	cell_number = std::vector<int>(DIMENSION);
 	cell_size = std::vector<double>(DIMENSION);
-	int too_small = 0;
 	
-	// Determine the number of cells in the box first by calculateng the number of cells needed to span each dimension.
-    for (int i = 0; i < DIMENSION; i++) {
-    	cell_number[i] = (int)(2.0 * simulation_box_half_lengths[i] / cutoff);
-    }
-
-    // Check that there are enough cells to make a cell list worthwhile.
+	// Determine the number of cells in the box first by calculating the number of cells needed to span each dimension.
+	// A dimension that is too short to hold the three cells of a stencil is left as a single cell spanning the box
+	// so that the other dimensions can still be decomposed (e.g. a thin slab or bilayer).
     for (int i = 0; i < DIMENSION; i++) {
-    	// NOTE: I am not sure that throwing away the cell list entirely is the smartest thing to do.
-    	// It would be possible to shrink the cell list dimension by the number of dimensions that are too small.
-    	
-    	// This is a special case where the number of cells is smaller than the stencil in at least one dimension.
-    	if (cell_number[i] < 3) {
-    		std::fill(cell_number.begin(), cell_number.end(), 3);
-    		std::fill(cell_size.begin(), cell_size.end(), -1.0);
-    		too_small = 1;
-    		break;
-    	}
+    	cell_number[i] = fitting_cell_number(cutoff, simulation_box_half_lengths[i]);
+        cell_size[i] = 2.0 * simulation_box_half_lengths[i] / (double)(cell_number[i]);
     }
-    // Otherwise, continue with cell list setup.
-    if (too_small == 0) {
-    	for (int i = 0; i < DIMENSION; i++) {
-	        cell_size[i] = 2.0 * simulation_box_half_lengths[i] / (double)(cell_number[i]);
-	    }
-	}
+    int n_decomposed = count_decomposed_dimensions(cell_number);
+    partially_decomposed = (n_decomposed > 0 && n_decomposed < DIMENSION);
 	
 	// Allocate arrays based on the total number of cells needed to cover the entire simulation box.
     size = 1;
@@ -945,13 +2052,17 @@ void BaseCellList::setUpCellListCells(const double cutoff, const real*  simulati
     	size *= cell_number[i];
     }
     
-    head = std::vector<int>(size);
-    list = std::vector<int>(current_n_sites);
+    cell_start = std::vector<int>(size + 1);
+    cell_fill = std::vector<int>(size);
+    cell_sites = std::vector<int>(current_n_sites);
+    particle_cell = std::vector<int>(current_n_sites);
+    sorted_x = std::vector<std::array<double, DIMENSION> >(current_n_sites);
+    sorted_types = std::vector<int>(current_n_sites);
 }
 
 // Populate the cell lists.
 
-void BaseCellList::populateList(const int n_particles, std::array<double, DIMENSION>* const &particle_positions)
+void BaseCellList::populateList(const int n_particles, std::array<double, DIMENSION>* const &particle_positions, const int* const site_types)
 {
     assert(n_particles > 0);
     int icell; // The index for the cell that a particle is in;
@@ -969,39 +2080,39 @@ void BaseCellList::populateList(const int n_particles, std::array<double, DIMENS
 		cell_inv[i] = 1.0 / cell_size[i];
 	}
 	
-	// If we are actually using cell_lists.
-	// // At the moment this is checked by only looking at the first dimension,
-	// // but if cell list use is NOT all-or-none then this check would be insufficient.
-    if (cell_size[0] > 0.0) {
-		// Assign the particles to cells and build the neighbor list for each cell (backwards).
-        // Initialize the cell heads.
-		for (int i = 0; i < size; i++) {
-            head[i] = -1;
-        }
-        for (int i = 0; i < n_particles; i++) {
-			// Determine each particles cell. 
-			// This "hash" for each cell refers to the cell's index since that data is stored in a flat array (x + y * x_offset + z * x_offset * y_offsets + ...).
-            icell = 0;
-            for (int j = 0; j < DIMENSION; j++) {
-            	icell += (int)( particle_positions[i][j] * cell_inv[j] ) * hash_offset[j];
-            }
-			// Make this particle the head of its cell's list.
-			// This particle now "points" to the index that was previously the head of this cell's list (-1 if it is the first particle).
-            list[i] = head[icell];
-            head[icell] = i;
-        }
-    } else {
-		// In this special case, it does not make sense to use actual cells.
-		// So, this is simply a list of all particles with each particle connected to the particles adjacent to it (by index) in the list.
-        for (int i = 1; i < size; i++) {
-            head[i] = -1;
-        }
-        head[0] = 0;
-        for (int i = 0; i < n_particles - 1; i++) {
-            list[i] = i + 1;
+	// Count the particles in each cell.
+	for (int i = 0; i < size; i++) {
+		cell_fill[i] = 0;
+	}
+    for (int i = 0; i < n_particles; i++) {
+		// Determine each particles cell. 
+		// This "hash" for each cell refers to the cell's index since that data is stored in a flat array (x + y * x_offset + z * x_offset * y_offsets + ...).
+		// Dimensions left as a single cell do not contribute.
+        icell = 0;
+        for (int j = 0; j < DIMENSION; j++) {
+        	if (cell_number[j] > 1) icell += (int)( particle_positions[i][j] * cell_inv[j] ) * hash_offset[j];
         }
-        list[n_particles - 1] = -1;
+        particle_cell[i] = icell;
+        cell_fill[icell]++;
     }
+    
+    // Convert the counts to the starting offset of each cell.
+    cell_start[0] = 0;
+    for (int i = 0; i < size; i++) {
+    	cell_start[i + 1] = cell_start[i] + cell_fill[i];
+    	cell_fill[i] = cell_start[i];
+    }
+    
+    // Place the particles in their cells. Decomposed boxes list each cell's particles by decreasing index 
+    // and a box that is a single cell by increasing index, as the original linked lists did.
+    for (int n = 0; n < n_particles; n++) {
+    	int i = (size > 1) ? (n_particles - 1 - n) : n;
+    	int slot = cell_fill[particle_cell[i]]++;
+    	cell_sites[slot] = i;
+    	sorted_x[slot] = particle_positions[i];
+    	sorted_types[slot] = site_types[i];
+    }
+    populated = true;
 }
 
 // Set up a pair list stencil.
@@ -1019,9 +2130,9 @@ void PairCellList::setUpCellListStencil()
 
 	// Determine how many neighboring cells each cell has, 
 	// but only half need to be looked at using Newton's third law.
-	int neighbor_cells = (int)( pow( 3.0, (double)(DIMENSION) ) ) - 1;
+	int neighbor_cells = (int)( pow( 3.0, (double)(count_decomposed_dimensions(cell_number)) ) ) - 1;
 	// Get the total number of cells.
-	int number_cells = head.size();
+	int number_cells = size;
 	// The stencil vector is a flat vector that includes
 	// the neighboring cells that need to be looked at for all cells.
 	stencil_size = neighbor_cells / 2;
@@ -1049,9 +2160,9 @@ void ThreeBCellList::setUpCellListStencil()
 
 	// Determine how many neighboring cells each cell has.
 	// For three_body_interactions all neighboring cells need to be looked at.
-	int neighbor_cells = (int)( pow( 3.0, (double)(DIMENSION) ) ) - 1;
+	int neighbor_cells = (int)( pow( 3.0, (double)(count_decomposed_dimensions(cell_number)) ) ) - 1;
 	// Get the total number of cells.
-	int number_cells = head.size();
+	int number_cells = size;
 	// The stencil vector is a flat vector that includes
 	// the neighboring cells that need to be looked at for all cells.
 	stencil_size = neighbor_cells;
@@ -1129,6 +2240,10 @@ int recursive_template_loop(const std::vector<int> &cell_number, const std::vect
 int add_pair_stencil_element(const std::vector<int> &cell_number, const std::vector<int> &cell_indices, std::vector<int> &shift_indices, std::vector<int> &stencil, const std::vector<int> &hash_offset, int stencil_counter)
 {
 	// Check that this set of offsets is acceptable.
+	// Dimensions that are a single cell can only be shifted by 0.
+	for (int i = 0; i < DIMENSION; i++) {
+		if (cell_number[i] == 1 && shift_indices[i] != 0) return stencil_counter;
+	}
 	// The first non-zero offset must be positive.
 	int non_zero = 0;
 	for (int i = 0; i < DIMENSION; i++) {
@@ -1151,7 +2266,7 @@ int add_pair_stencil_element(const std::vector<int> &cell_number, const std::vec
 	}
 	
 	// Now, determine this cell's beginning index in the stencil vector.
-	int neighbor_cells = (int)( pow( 3.0, (double)(DIMENSION) ) ) - 1;
+	int neighbor_cells = (int)( pow( 3.0, (double)(count_decomposed_dimensions(cell_number)) ) ) - 1;
 	int cell_stencil = cell_index * neighbor_cells / 2;
 	
 	// Determine the shifted cell's hash index.
@@ -1169,6 +2284,10 @@ int add_pair_stencil_element(const std::vector<int> &cell_number, const std::vec
 int add_3B_stencil_element(const std::vector<int> &cell_number, const std::vector<int> &cell_indices, std::vector<int> &shift_indices, std::vector<int> &stencil, const std::vector<int> &hash_offset, int stencil_counter)
 {
 	// Check that this set of offsets is acceptable.
+	// Dimensions that are a single cell can only be shifted by 0.
+	for (int i = 0; i < DIMENSION; i++) {
+		if (cell_number[i] == 1 && shift_indices[i] != 0) return stencil_counter;
+	}
 	int non_zero = 0;
 	for (int i = 0; i < DIMENSION; i++) {
 		if (shift_indices[i] != 0) {
@@ -1186,7 +2305,7 @@ int add_3B_stencil_element(const std::vector<int> &cell_number, const std::vecto
 	}
 	
 	// Now, determine this cell's beginning index in the stencil vector.
-	int neighbor_cells = (int)( pow( 3.0, (double)(DIMENSION) ) ) - 1;
+	int neighbor_cells = (int)( pow( 3.0, (double)(count_decomposed_dimensions(cell_number)) ) ) - 1;
 	int cell_stencil = cell_index * neighbor_cells;
 	
 	// Determine the shifted cell's hash index.
@@ -30,10 +30,12 @@
 struct ControlInputs;
 struct LammpsData;
 struct XRDData;
+struct BinaryTrajectoryData;
+struct FramePrefetcher;
 
 typedef real matrix[3][3];
 
-enum TrajectoryType {kGromacsTRR = 0, kGromacsXTC = 1, kLAMMPSDump = 2};
+enum TrajectoryType {kGromacsTRR = 0, kGromacsXTC = 1, kLAMMPSDump = 2, kBinaryTrajectory = 3};
 
 typedef void (*dimension_neighbor_action)(const std::vector<int> &cell_number, std::vector<int> &indices, std::vector<int> &stencil, const std::vector<int> &hash_offset);
 typedef int (*add_stencil_element)(const std::vector<int> &cell_number, const std::vector<int> &cell_indices, std::vector<int> &shift_indices, std::vector<int> &stencil, const std::vector<int> &hash_offset, int stencil_counter);
@@ -89,14 +91,18 @@ struct FrameSource {
 	uint_fast32_t random_num_seed;			// Random number seed only used if dynamic_state_sampling or bootstrapping_flag is 1
     int starting_frame;                     // Trajectory frame number to start from
     int n_frames;                           // Total number of frames to read for this force matching
+    int prefetch_frames;                    // Number of frames read ahead by a background thread (0 to read frames in turn)
+    int frame_index_flag;                   // 1 to seek to starting_frame using a frame index kept next to the trajectory; 0 otherwise
     char trajectory_filename[1000];         // Trajectory file name (positions for .xtc, forces and positions for .trr)
     std::mt19937 mt_rand_gen;    			// A Mersenne Twister random number generator for dynamic state sampling.
 	int position_dimension;					// The number of elements in each particle's position vector.
 	
     // Type-dependent source data and functions
-    TrajectoryType trajectory_type;         // 0 to use .trr format trajectories; 1 to use .xtc format trajectories; 2 to use LAMMPS trajectories
+    TrajectoryType trajectory_type;         // 0 to use .trr format trajectories; 1 to use .xtc format trajectories; 2 to use LAMMPS trajectories; 3 to use binary trajectories
 	XRDData* gromacs_data;
 	LammpsData* lammps_data;
+	BinaryTrajectoryData* binary_data;
+	FramePrefetcher* prefetcher;            // Background reader of the following frames, if frames are prefetched
 
     // Type-dependent function to read the first frame of a given source
     // Performs initial sanity checks to make sure the frame is consistent 
@@ -137,6 +143,11 @@ struct FrameSource {
 void parse_command_line_arguments(const int num_arg, char** arg, FrameSource* const frame_source);
 // Copy trajectory-reading specifications from ControlInputs to FRAME_DATA.
 void copy_control_inputs_to_frd(struct ControlInputs* const control_input, FrameSource* const frame_source);
+// Read the frames after the first one in a background thread if prefetch_frames is set.
+void enable_frame_prefetching(FrameSource* const frame_source);
+// Write the n_frames frames from the current one on to a binary trajectory (.cgb) holding
+// positions and forces with the given number of bytes (4 or 8) per component.
+void write_binary_trajectory(FrameSource* const frame_source, const char* filename, const int precision);
 
 //-------------------------------------------------------------
 // Auxiliary-trajectory reading functions.
@@ -170,30 +181,37 @@ double calculate_volume(const matrix simulation_box_lengths);
 
 class BaseCellList {
 
-	// This list is traversed for a given cell by looking up the head for a given cell (the index of head).
-	// The value gives the index of the first particle in that cells list.
-	// The next particle index is determined by looking up the value at the index of the previous particle's index in the "list".
-	// This is repeated until the value is -1.
+	// Particles are binned by a counting sort so that the particles of each cell are contiguous.
+	// The particles in cell c are cell_sites[cell_start[c]] to cell_sites[cell_start[c + 1] - 1].
+	// Positions and types are copied in the same order so that neighbor traversal reads contiguous memory;
+	// the entries of cell_sites map them back to the original site indices used for matrix rows.
 
 public:
     void init(const double cutoff, const FrameSource* const fr);
-    void populateList(const int n_particles, std::array<double, DIMENSION>* const &particle_positions);
+    void updateBox(const FrameSource* const fr);
+    void populateList(const int n_particles, std::array<double, DIMENSION>* const &particle_positions, const int* const site_types);
     inline int get_stencil_size() const { return stencil_size; };
     inline double get_cell_size(int i) const {return cell_size[i]; };
     int size;					// The total number of cells to cover the simulation box.
-    std::vector<int> list;		// "Linked list" for neighbor list. 
-								// The value at each particle's index is the next particle index in that cell's list. 
-								// If it is the last particle in the list, its value is -1.
-    std::vector<int> head;		// List of the first particle in each cell for all cells.
+    std::vector<int> cell_start;	// Offset of each cell's first particle in cell_sites (size + 1 entries).
+    std::vector<int> cell_sites;	// Original site index of each particle, ordered by cell.
+    std::vector<std::array<double, DIMENSION> > sorted_x;	// Particle positions in cell_sites order.
+    std::vector<int> sorted_types;	// Particle types in cell_sites order.
     std::vector<int> stencil;	// List of neighboring cells to look through during force computation.
     std::vector<int> hash_offset;
+    bool populated;				// Whether the lists hold the current frame's particles.
+    bool partially_decomposed;	// Whether some, but not all, dimensions are split into cells.
 	
 protected:
+	// The cutoff that each cell must span.
+	double list_cutoff;
     // The number of cells in each dimension.
     std::vector<int> cell_number;
 	// The size (in each dimension) that a given cell spans.
     std::vector<double> cell_size;
 	int stencil_size;			// The number of neighboring cells surrounding a given cell that need to be searched through during force computation.
+	std::vector<int> particle_cell;	// Cell index of each particle (temporary for the counting sort).
+	std::vector<int> cell_fill;		// Next free slot of each cell (temporary for the counting sort).
 
     void setUpCellListCells(const double cutoff, const real* simulation_box_half_lengths, const int current_n_sites);
     virtual void setUpCellListStencil() = 0;